@@ -3,12 +3,16 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <time.h>
 #include "lib/tdns/tdns-c.h"
 
 /* A few macros that might be useful */
 /* Feel free to add macros you want */
 #define DNS_PORT 53
 #define BUFFER_SIZE 2048 
+/* How long answering queries takes, written once in a while (in seconds) like local-dns.c does */
+#define LATENCY_DUMP "cs-dns-latency.txt"
+#define DUMP_INTERVAL 60
 
 
 
@@ -49,6 +53,7 @@ int main() {
     /* 5. Receive a message continuously and parse it using TDNSParseMsg() */
    struct TDNSParseResult *parsed = malloc(sizeof(struct TDNSParseResult));
     struct TDNSFindResult *ret = malloc(sizeof(struct TDNSFindResult));
+    time_t last_dump = time(NULL);
     while(1) {
         uint64_t size = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr*)&client_addr, &client_len);
         if (size == -1) {
@@ -56,19 +61,31 @@ int main() {
             close(sockfd);
             exit(EXIT_FAILURE);
         }
+        /* Queries are timed from here until their response is sent */
+        TDNSTimingStart(ctx);
         uint8_t res = TDNSParseMsg(buffer, size, parsed);
         if (res == 0) {
+            TDNSTimingMark(ctx, TDNS_STAGE_PARSE);
             /* 6. If it is a query for A, AAAA, NS DNS record */
             /* find the corresponding record using TDNSFind() and send the response back */
             if (TDNSFind(ctx, parsed, ret) == 1) {
                 // found a record
+                TDNSTimingMark(ctx, TDNS_STAGE_RENDER);
                 sendto(sockfd, ret->serialized, ret->len, 0, (struct sockaddr*)&client_addr, client_len);
             } else {
                 // TDNSFind failed
+                TDNSTimingMark(ctx, TDNS_STAGE_RENDER);
                 sendto(sockfd, ret->serialized, ret->len, 0, (struct sockaddr*)&client_addr, client_len);
             }
+            TDNSTimingMark(ctx, TDNS_STAGE_SEND);
+            TDNSTimingDone(ctx, parsed->qtype);
         }
         /* Otherwise, just ignore it. */
+        /* The timings only change when a query comes in, so checking after each one is enough */
+        if (time(NULL) - last_dump >= DUMP_INTERVAL) {
+            TDNSDumpTimings(ctx, LATENCY_DUMP);
+            last_dump = time(NULL);
+        }
     }
     close(sockfd);
     return 0;
@@ -0,0 +1,354 @@
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "dns-storage.hh"
+#include "dnsmessages.hh"
+#include "record-types.hh"
+#include "histogram.hh"
+#include "opcount.hh"
+#include "nlohmann/json.hpp"
+
+/*!
+   @file
+   @brief Microbenchmarks for the core data structures, run with 'make bench'
+
+   Every benchmark reports nanoseconds, heap allocations and syscalls per
+   operation, the latter two counted by opcount.o.
+   The results go to stdout as JSON, so runs can be stored and compared, and
+   to stderr as a table, to read along.
+*/
+
+using namespace std;
+
+bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddress& remote, DNSMessageWriter& response, StageTimer& st);
+
+//! Keeps the compiler from optimizing away a result nobody looks at
+template<typename T>
+static void keep(T&& val)
+{
+  asm volatile("" : : "g"(&val) : "memory");
+}
+
+struct Result
+{
+  std::string name;
+  uint64_t ops{0};
+  double nsec{0};
+  uint64_t allocs{0};
+  uint64_t syscalls{0};
+};
+
+class Bench
+{
+public:
+  Bench(double mintime, std::string filter) : d_mintime(mintime), d_filter(std::move(filter)) {}
+
+  bool wanted(const std::string& name) const
+  {
+    return d_filter.empty() || name.find(d_filter) != std::string::npos;
+  }
+
+  /*! Runs op(n) for growing n until it took d_mintime. op should do n operations.
+      prep(n) is called before op(n), and is not counted */
+  void run(const std::string& name, std::function<void(uint64_t)> op, std::function<void(uint64_t)> prep = nullptr)
+  {
+    if(!wanted(name))
+      return;
+    Result r;
+    r.name = name;
+    for(uint64_t n = 1; r.nsec < d_mintime * 1e9; n = std::min<uint64_t>(n * 2, 1 << 20)) {
+      if(prep)
+        prep(n);
+      OpCounts before = opCounts();
+      auto start = std::chrono::steady_clock::now();
+      op(n);
+      auto end = std::chrono::steady_clock::now();
+      OpCounts used = opCounts() - before;
+      r.allocs += used.allocs;
+      r.syscalls += used.syscalls;
+      r.nsec += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+      r.ops += n;
+    }
+    add(r);
+  }
+
+  //! For things that can only be done once, like building a tree
+  void once(const std::string& name, uint64_t ops, std::function<void()> op)
+  {
+    if(!wanted(name))
+      return;
+    Result r;
+    r.name = name;
+    r.ops = ops;
+    OpCounts before = opCounts();
+    auto start = std::chrono::steady_clock::now();
+    op();
+    auto end = std::chrono::steady_clock::now();
+    OpCounts used = opCounts() - before;
+    r.allocs = used.allocs;
+    r.syscalls = used.syscalls;
+    r.nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    add(r);
+  }
+
+  nlohmann::json toJSON() const
+  {
+    nlohmann::json ret = nlohmann::json::array();
+    for(const auto& r : d_results) {
+      nlohmann::json b;
+      b["name"] = r.name;
+      b["ops"] = r.ops;
+      b["ns_per_op"] = r.nsec / r.ops;
+      b["allocs_per_op"] = (double)r.allocs / r.ops;
+      b["syscalls_per_op"] = (double)r.syscalls / r.ops;
+      ret.push_back(b);
+    }
+    return ret;
+  }
+
+private:
+  void add(const Result& r)
+  {
+    char line[200];
+    snprintf(line, sizeof(line), "%-45s %12.1f ns/op %10.2f allocs/op %8.2f syscalls/op %12llu ops", r.name.c_str(), r.nsec / r.ops,
+             (double)r.allocs / r.ops, (double)r.syscalls / r.ops, (unsigned long long)r.ops);
+    cerr << line << endl;
+    d_results.push_back(r);
+  }
+
+  double d_mintime;
+  std::string d_filter;
+  std::vector<Result> d_results;
+};
+
+static void benchNames(Bench& b)
+{
+  b.run("makeDNSName", [](uint64_t n) {
+      for(uint64_t i = 0; i < n; ++i)
+        keep(makeDNSName("www.tdns.powerdns.org"));
+    });
+
+  DNSName a = makeDNSName("www.tdns.powerdns.org"), c = makeDNSName("www.tdns.powerdns.com");
+  DNSName zone = makeDNSName("powerdns.org");
+  b.run("DNSName copy", [&a](uint64_t n) {
+      for(uint64_t i = 0; i < n; ++i) {
+        DNSName copy(a);
+        keep(copy);
+      }
+    });
+  b.run("DNSName operator<", [&a, &c](uint64_t n) {
+      for(uint64_t i = 0; i < n; ++i)
+        keep(a < c);
+    });
+  b.run("DNSName makeRelative (with a copy)", [&a, &zone](uint64_t n) {
+      for(uint64_t i = 0; i < n; ++i) {
+        DNSName copy(a);
+        keep(copy.makeRelative(zone));
+      }
+    });
+  b.run("DNSName isPartOf", [&a, &zone](uint64_t n) {
+      for(uint64_t i = 0; i < n; ++i)
+        keep(a.isPartOf(zone));
+    });
+
+  DNSLabel l1("Server-Number-1"), l2("server-number-2");
+  b.run("DNSLabel operator< (case insensitive)", [&l1, &l2](uint64_t n) {
+      for(uint64_t i = 0; i < n; ++i)
+        keep(l1 < l2);
+    });
+  b.run("DNSLabel operator==", [&l1, &l2](uint64_t n) {
+      for(uint64_t i = 0; i < n; ++i)
+        keep(l1 == l2);
+    });
+}
+
+//! Names like h123.d45.example.com, with up to 1000 names under every d
+static DNSName syntheticName(uint64_t i)
+{
+  return DNSName({DNSLabel("h" + std::to_string(i)), DNSLabel("d" + std::to_string(i / 1000)), DNSLabel("example"), DNSLabel("com")});
+}
+
+static void benchTree(Bench& b, uint64_t maxnames)
+{
+  std::mt19937_64 rng(1);
+  for(uint64_t size = 1000; size <= maxnames; size *= 10) {
+    std::string suffix = " (" + std::to_string(size) + " names)";
+    if(!b.wanted("DNSNode::add" + suffix) && !b.wanted("DNSNode::find" + suffix))
+      continue;
+    std::vector<DNSName> names;
+    names.reserve(size);
+    for(uint64_t i = 0; i < size; ++i)
+      names.push_back(syntheticName(i));
+    std::shuffle(names.begin(), names.end(), rng);
+
+    DNSNode tree;
+    b.once("DNSNode::add" + suffix, size, [&tree, &names]() {
+        for(const auto& n : names)
+          keep(tree.add(n));
+      });
+
+    // find() eats the name it is given, so every lookup needs its own copy
+    std::vector<DNSName> lookups;
+    std::uniform_int_distribution<uint64_t> pick(0, size - 1);
+    b.run("DNSNode::find" + suffix, [&tree, &lookups](uint64_t n) {
+        DNSName last;
+        for(uint64_t i = 0; i < n; ++i)
+          keep(tree.find(lookups[i], last));
+      }, [&lookups, &names, &rng, &pick](uint64_t n) {
+        lookups.clear();
+        for(uint64_t i = 0; i < n; ++i)
+          lookups.push_back(names[pick(rng)]);
+      });
+  }
+}
+
+static std::string makeResponse()
+{
+  DNSName qname = makeDNSName("www.tdns.powerdns.org");
+  DNSMessageWriter dmw(qname, DNSType::A);
+  dmw.dh.qr = 1;
+  dmw.putRR(DNSSection::Answer, qname, 3600, CNAMEGen::make(makeDNSName("server1.tdns.powerdns.org")));
+  for(int n = 1; n <= 4; ++n)
+    dmw.putRR(DNSSection::Answer, makeDNSName("server1.tdns.powerdns.org"), 3600, AGen::make("192.0.2." + std::to_string(n)));
+  dmw.putRR(DNSSection::Authority, makeDNSName("tdns.powerdns.org"), 3600, NSGen::make(makeDNSName("ns1.tdns.powerdns.org")));
+  dmw.putRR(DNSSection::Additional, makeDNSName("ns1.tdns.powerdns.org"), 3600, AGen::make("192.0.2.53"));
+  return dmw.serialize();
+}
+
+static void benchMessages(Bench& b)
+{
+  std::string response = makeResponse();
+  b.run("DNSMessageReader construction", [&response](uint64_t n) {
+      for(uint64_t i = 0; i < n; ++i) {
+        DNSMessageReader dmr(response);
+        keep(dmr);
+      }
+    });
+  b.run("DNSMessageReader getRR (7 records)", [&response](uint64_t n) {
+      for(uint64_t i = 0; i < n; ++i) {
+        DNSMessageReader dmr(response);
+        DNSSection section;
+        DNSName name;
+        DNSType type;
+        uint32_t ttl;
+        std::unique_ptr<RRGen> content;
+        while(dmr.getRR(section, name, type, ttl, content))
+          keep(content);
+      }
+    });
+
+  DNSName qname = makeDNSName("www.tdns.powerdns.org"), target = makeDNSName("server1.tdns.powerdns.org");
+  DNSName zone = makeDNSName("tdns.powerdns.org"), ns = makeDNSName("ns1.tdns.powerdns.org");
+  std::unique_ptr<RRGen> cname = CNAMEGen::make(target), nsrr = NSGen::make(ns), a = AGen::make("192.0.2.1");
+  b.run("DNSMessageWriter putRR (7 records, compressed)", [&](uint64_t n) {
+      for(uint64_t i = 0; i < n; ++i) {
+        DNSMessageWriter dmw(qname, DNSType::A);
+        dmw.putRR(DNSSection::Answer, qname, 3600, cname);
+        for(int r = 0; r < 4; ++r)
+          dmw.putRR(DNSSection::Answer, target, 3600, a);
+        dmw.putRR(DNSSection::Authority, zone, 3600, nsrr);
+        dmw.putRR(DNSSection::Additional, ns, 3600, a);
+        keep(dmw.serialize());
+      }
+    });
+}
+
+//! A zone like the one contents.cc serves, without needing the network
+static void loadBenchZone(DNSNode& zones)
+{
+  auto zone = zones.add({"tdns", "powerdns", "org"});
+  auto newzone = std::make_unique<DNSNode>();
+  newzone->addRRs(SOAGen::make({"ns1", "tdns", "powerdns", "org"}, {"admin", "powerdns", "org"}, 1),
+                  NSGen::make({"ns1", "tdns", "powerdns", "org"}),
+                  MXGen::make(25, {"server1", "tdns", "powerdns", "org"}));
+  newzone->add({"ns1"})->addRRs(AGen::make("192.0.2.53"));
+  newzone->add({"server1"})->addRRs(AGen::make("213.244.168.210"), AAAAGen::make("::1"));
+  newzone->add({"www"})->rrsets[DNSType::CNAME].add(CNAMEGen::make({"server1", "tdns", "powerdns", "org"}));
+  newzone->add({"*", "nl"})->rrsets[DNSType::A].add(AGen::make("5.6.7.8"));
+  newzone->add({"fra"})->addRRs(NSGen::make({"ns1", "fra", "powerdns", "org"}));
+  zone->zone = std::move(newzone);
+}
+
+static void benchProcessQuestion(Bench& b)
+{
+  DNSNode zones;
+  loadBenchZone(zones);
+  ComboAddress remote("192.0.2.100", 5300);
+  PipelineTimings timings(0);
+
+  struct Query
+  {
+    const char* what;
+    const char* name;
+    DNSType type;
+  };
+  for(const auto& q : std::vector<Query>{
+      {"answer", "server1.tdns.powerdns.org", DNSType::A},
+      {"CNAME", "www.tdns.powerdns.org", DNSType::A},
+      {"wildcard", "host.nl.tdns.powerdns.org", DNSType::A},
+      {"MX with additional", "tdns.powerdns.org", DNSType::MX},
+      {"delegation", "www.fra.tdns.powerdns.org", DNSType::A},
+      {"NXDOMAIN", "nosuch.tdns.powerdns.org", DNSType::A}}) {
+    DNSMessageWriter dmw(makeDNSName(q.name), q.type);
+    dmw.dh.rd = 1;
+    std::string query = dmw.serialize();
+    b.run(std::string("processQuestion ") + q.what, [&](uint64_t n) {
+        for(uint64_t i = 0; i < n; ++i) {
+          DNSMessageReader dm(query);
+          DNSName qname;
+          DNSType qtype;
+          dm.getQuestion(qname, qtype);
+          DNSMessageWriter response(qname, qtype, dm.d_qclass);
+          StageTimer st(timings);
+          processQuestion(zones, dm, remote, response, st);
+          keep(response.serialize());
+        }
+      });
+  }
+}
+
+int main(int argc, char** argv)
+try
+{
+  uint64_t maxnames = 1000000;
+  double mintime = 0.2;
+  std::string filter;
+  for(int n = 1; n < argc; ++n) {
+    std::string arg(argv[n]);
+    if(arg == "--max-names" && n + 1 < argc)
+      maxnames = atoll(argv[++n]);
+    else if(arg == "--min-time" && n + 1 < argc)
+      mintime = atof(argv[++n]);
+    else if(arg == "--filter" && n + 1 < argc)
+      filter = argv[++n];
+    else {
+      cerr<<"Syntax: benchrunner [--max-names N] [--min-time seconds] [--filter substring]"<<endl;
+      cerr<<"Runs microbenchmarks, prints a table on stderr and JSON on stdout."<<endl;
+      cerr<<"Trees go from 1000 names to --max-names (default 1000000, 10000000 needs a few GB)."<<endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  Bench b(mintime, filter);
+  benchNames(b);
+  benchTree(b, maxnames);
+  benchMessages(b);
+  benchProcessQuestion(b);
+
+  nlohmann::json out;
+  out["time"] = (uint64_t)time(nullptr);
+  out["compiler"] = __VERSION__;
+  out["max_names"] = maxnames;
+  out["benchmarks"] = b.toJSON();
+  cout << out.dump(2) << endl;
+}
+catch(std::exception& e)
+{
+  cerr<<"Fatal error: "<<e.what()<<endl;
+  return EXIT_FAILURE;
+}
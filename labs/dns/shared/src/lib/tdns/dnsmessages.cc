@@ -25,7 +25,13 @@ DNSMessageReader::DNSMessageReader(const char* in, uint16_t size)
       d_ednsVersion = getUInt8();
       auto flags=getUInt8();
       d_doBit = flags & 0x80;
-      getUInt8(); getUInt16(); // ignore rest
+      getUInt8();
+      auto rdlen = getUInt16();
+      for(auto end = payloadpos + rdlen; payloadpos + 4 <= end; ) { // options, RFC 6891 6.1.2
+        auto code = (EDNSOption) getUInt16();
+        auto len = getUInt16();
+        d_ednsOptions.push_back({code, getBlob(len)});
+      }
       d_haveEDNS = true;
     }
     payloadpos=nowpos;
@@ -72,6 +78,17 @@ bool DNSMessageReader::getEDNS(uint16_t* bufsize, bool* doBit) const
   return true;
 }
 
+bool DNSMessageReader::getEDNSOption(EDNSOption code, std::string& data) const
+{
+  for(const auto& o : d_ednsOptions) {
+    if(o.first == code) {
+      data = o.second;
+      return true;
+    }
+  }
+  return false;
+}
+
 void DNSMessageReader::skipRRs(int num)
 {
   for(int n = 0; n < num; ++n) {
@@ -213,7 +230,13 @@ void DNSMessageWriter::putEDNS(uint16_t bufsize, RCode ercode, bool doBit)
   try {
     xfrUInt8(0); xfrUInt16((uint16_t)DNSType::OPT); // 'root' name, our type
     xfrUInt16(bufsize); xfrUInt8(((int)ercode)>>4); xfrUInt8(0); xfrUInt8(doBit ? 0x80 : 0); xfrUInt8(0);
-    xfrUInt16(0);
+    auto rdlenpos = xfrUInt16(0);
+    for(const auto& o : d_ednsOptions) {
+      xfrUInt16((uint16_t)o.first);
+      xfrUInt16(o.second.size());
+      xfrBlob(o.second);
+    }
+    xfrUInt16At(rdlenpos, payloadpos - rdlenpos - 2);
   }
   catch(...) {  // went beyond message size, roll it all back
     payloadpos = cursize;
@@ -262,6 +285,11 @@ string DNSMessageWriter::serialize()
   }
 }
 
+void DNSMessageWriter::addEDNSOption(EDNSOption code, const std::string& data)
+{
+  d_ednsOptions.push_back({code, data});
+}
+
 void DNSMessageWriter::setEDNS(uint16_t newsize, bool doBit, RCode ercode)
 {
   if(newsize > sizeof(dnsheader))
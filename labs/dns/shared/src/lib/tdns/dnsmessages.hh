@@ -9,6 +9,12 @@
   @brief Defines DNSMessageReader and DNSMessageWriter
 */
 
+//! EDNS option codes, from the IANA registry
+enum class EDNSOption : uint16_t
+{
+  Cookie = 10, TCPKeepalive = 11, Padding = 12
+};
+
 //! A class that parses a DNS Message 
 class DNSMessageReader
 {
@@ -30,6 +36,8 @@ public:
   void getQuestion(DNSName& name, DNSType& type) const;
   //! Returns true if there was an EDNS record, plus copies details
   bool getEDNS(uint16_t* newsize, bool* doBit) const;
+  //! Returns true if the EDNS record had this option, plus copies its content
+  bool getEDNSOption(EDNSOption code, std::string& data) const;
 
   //! Puts the next RR in content, unless at 'end of message', in which case it returns false
   bool getRR(DNSSection& section, DNSName& name, DNSType& type, uint32_t& ttl, std::unique_ptr<RRGen>& content);
@@ -107,6 +115,7 @@ public:
   uint16_t d_bufsize;
   bool d_doBit{false};
   bool d_haveEDNS{false};
+  std::vector<std::pair<EDNSOption, std::string>> d_ednsOptions;
 }; 
 
 //! A DNS Message writer
@@ -132,6 +141,8 @@ public:
   void clearRRs();
   void putRR(DNSSection section, const DNSName& name, uint32_t ttl, const std::unique_ptr<RRGen>& rr, DNSClass dclass = DNSClass::IN);
   void setEDNS(uint16_t bufsize, bool doBit, RCode ercode = (RCode)0);
+  //! Adds an option to the EDNS record, which needs setEDNS() too
+  void addEDNSOption(EDNSOption code, const std::string& data);
   std::string serialize();
 
   void xfrUInt8(uint8_t val)
@@ -190,5 +201,6 @@ private:
   std::unique_ptr<DNSNode> d_comptree;
   void putEDNS(uint16_t bufsize, RCode ercode, bool doBit);
   bool d_serialized{false};  // needed to make serialize() idempotent
+  std::vector<std::pair<EDNSOption, std::string>> d_ednsOptions;
 };
 
@@ -0,0 +1,465 @@
+#include "engine.hh"
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include "sclasses.hh"
+#include "timerwheel.hh"
+using namespace std;
+
+/*!
+   @file
+   @brief Implements the coroutine engine
+*/
+
+namespace {
+//! Everything that can be in the epoll set of a worker, except the wakeup pipe
+struct Pollable
+{
+  bool iswatch;
+};
+
+//! A socket that is watched by the worker loop
+struct Watch : Pollable
+{
+  int fd;
+  std::function<void()> cb;
+};
+}
+
+//! A task that has been started, with its own stack
+struct Engine::Coroutine : Pollable
+{
+  ucontext_t ctx;
+  char* stack{nullptr}; //!< starts with a guard page
+  Engine::Task task;
+  int waitfd{-1};
+  int result{0};        //!< of the wait, 1 is ready, 0 is timeout
+  TimerWheel::TimerID timer{0};
+  bool suspended{false}; //!< in suspend(), can be woken up
+  bool done{false};
+};
+
+//! A thread that runs coroutines, each with its own epoll set, timers and queue
+class Engine::Worker
+{
+public:
+  explicit Worker(Engine& engine);
+  ~Worker();
+  //! Only moves from task if it was accepted
+  bool push(Task& task);
+  //! Called from a coroutine running on this worker, with fd -1 we wait for a wakeup
+  int wait(int fd, bool read, double* timeout);
+  void wakeup(Coroutine* c);
+  void spawn(Task&& task);
+  void watch(int fd, std::function<void()>&& cb);
+  void unwatch(int fd);
+  uint64_t addTimer(uint64_t deadline, std::function<void()>&& cb) { return d_wheel.add(deadline, std::move(cb)); }
+  void cancelTimer(uint64_t id) { d_wheel.cancel(id); }
+  size_t queued();
+
+  static thread_local Worker* t_current; //!< the worker of this thread, if any
+  Coroutine* d_running{nullptr};         //!< the coroutine that runs now, if any
+  std::atomic<uint64_t> d_active{0}, d_finished{0};
+
+private:
+  void loop();
+  void start(Task&& task);
+  void resume(Coroutine* c);
+  void wake();
+  static void trampoline();
+  char* getStack();
+  void putStack(char* stack);
+
+  Engine& d_engine;
+  std::mutex d_lock;        //!< protects d_queue
+  std::deque<Task> d_queue;
+  int d_wakepipe[2];
+  int d_epfd;
+  TimerWheel d_wheel;
+  ucontext_t d_loopctx;
+  std::vector<Coroutine*> d_expired;
+  std::vector<Coroutine*> d_woken;
+  std::vector<Task> d_spawned; //!< started by the loop, we might be running in a coroutine
+  std::map<int, std::unique_ptr<Watch>> d_watches;
+  std::vector<std::unique_ptr<Watch>> d_unwatched; //!< freed after this round of events
+  std::vector<char*> d_stacks; //!< free ones, ready for reuse
+  size_t d_pagesize;
+  std::atomic<bool> d_quit{false};
+  std::thread d_thread;     //!< last, everything else has to be ready when it starts
+};
+
+thread_local Engine::Worker* Engine::Worker::t_current;
+
+Engine::Worker::Worker(Engine& engine) : d_engine(engine), d_pagesize(sysconf(_SC_PAGESIZE))
+{
+  if(pipe2(d_wakepipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    throw std::runtime_error("Creating wakeup pipe for worker: "+string(strerror(errno)));
+  d_epfd = epoll_create1(EPOLL_CLOEXEC);
+  if(d_epfd < 0)
+    throw std::runtime_error("Creating epoll set for worker: "+string(strerror(errno)));
+  epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr; // is how we recognize the wakeup pipe
+  epoll_ctl(d_epfd, EPOLL_CTL_ADD, d_wakepipe[0], &ev);
+  d_thread = std::thread([this]() { loop(); });
+}
+
+Engine::Worker::~Worker()
+{
+  d_quit = true;
+  wake();
+  d_thread.join();
+  for(auto s : d_stacks)
+    munmap(s, d_engine.d_stacksize + d_pagesize);
+  close(d_epfd);
+  close(d_wakepipe[0]);
+  close(d_wakepipe[1]);
+}
+
+void Engine::Worker::wake()
+{
+  char c = 0;
+  if(write(d_wakepipe[1], &c, 1) < 0 && errno != EAGAIN) // if the pipe is full, a wakeup is pending anyhow
+    cerr << "Unable to wake up worker: " << strerror(errno) << endl;
+}
+
+bool Engine::Worker::push(Task& task)
+{
+  bool wasempty;
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    if(d_queue.size() >= d_engine.d_maxqueued)
+      return false;
+    wasempty = d_queue.empty();
+    d_queue.push_back(std::move(task));
+  }
+  if(wasempty)
+    wake();
+  return true;
+}
+
+size_t Engine::Worker::queued()
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  return d_queue.size();
+}
+
+char* Engine::Worker::getStack()
+{
+  if(!d_stacks.empty()) {
+    char* ret = d_stacks.back();
+    d_stacks.pop_back();
+    return ret;
+  }
+  // memory only gets used once it is touched, so big stacks are cheap
+  void* ret = mmap(nullptr, d_engine.d_stacksize + d_pagesize, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if(ret == MAP_FAILED)
+    throw std::runtime_error("Allocating stack for task: "+string(strerror(errno)));
+  mprotect(ret, d_pagesize, PROT_NONE); // a stack overflow crashes, instead of corrupting the heap
+  return (char*)ret;
+}
+
+void Engine::Worker::putStack(char* stack)
+{
+  if(d_stacks.size() < 64)
+    d_stacks.push_back(stack);
+  else
+    munmap(stack, d_engine.d_stacksize + d_pagesize);
+}
+
+void Engine::Worker::trampoline()
+{
+  Coroutine* c = t_current->d_running;
+  try {
+    c->task();
+  }
+  catch(std::exception& e) {
+    cerr << "Task died: " << e.what() << endl;
+  }
+  catch(...) {
+    cerr << "Task died with an unknown exception" << endl;
+  }
+  c->task = nullptr; // whatever it captured is destroyed while we are still on its stack
+  c->done = true;
+  // returning resumes uc_link, which is the worker loop
+}
+
+void Engine::Worker::start(Task&& task)
+{
+  auto c = new Coroutine;
+  c->iswatch = false;
+  c->task = std::move(task);
+  c->stack = getStack();
+  getcontext(&c->ctx);
+  c->ctx.uc_stack.ss_sp = c->stack + d_pagesize;
+  c->ctx.uc_stack.ss_size = d_engine.d_stacksize;
+  c->ctx.uc_link = &d_loopctx;
+  makecontext(&c->ctx, trampoline, 0);
+  ++d_active;
+  resume(c);
+}
+
+//! Runs c until it waits or is done
+void Engine::Worker::resume(Coroutine* c)
+{
+  d_running = c;
+  swapcontext(&d_loopctx, &c->ctx);
+  d_running = nullptr;
+  if(c->done) {
+    putStack(c->stack);
+    delete c;
+    --d_active;
+    ++d_finished;
+  }
+}
+
+int Engine::Worker::wait(int fd, bool read, double* timeout)
+{
+  Coroutine* c = d_running;
+  if(fd >= 0) {
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = read ? EPOLLIN : EPOLLOUT;
+    ev.data.ptr = c;
+    if(epoll_ctl(d_epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+      throw std::runtime_error("Waiting for socket: "+string(strerror(errno)));
+  }
+  else
+    c->suspended = true;
+  c->waitfd = fd;
+  c->timer = 0;
+  if(timeout)
+    c->timer = d_wheel.add(msecNow() + *timeout * 1000, [this, c]() { d_expired.push_back(c); });
+
+  swapcontext(&c->ctx, &d_loopctx); // back to the loop, which resumes us when something happened
+  c->suspended = false;
+  return c->result;
+}
+
+void Engine::Worker::wakeup(Coroutine* c)
+{
+  if(!c->suspended) // already woken up, or it timed out
+    return;
+  c->suspended = false;
+  d_wheel.cancel(c->timer);
+  c->result = 1;
+  d_woken.push_back(c); // the loop resumes it, we might be running in another coroutine
+}
+
+void Engine::Worker::spawn(Task&& task)
+{
+  d_spawned.push_back(std::move(task));
+}
+
+void Engine::Worker::watch(int fd, std::function<void()>&& cb)
+{
+  auto w = std::make_unique<Watch>();
+  w->iswatch = true;
+  w->fd = fd;
+  w->cb = std::move(cb);
+  epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = w.get();
+  if(epoll_ctl(d_epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    throw std::runtime_error("Watching socket: "+string(strerror(errno)));
+  d_watches[fd] = std::move(w);
+}
+
+void Engine::Worker::unwatch(int fd)
+{
+  auto iter = d_watches.find(fd);
+  if(iter == d_watches.end())
+    return;
+  epoll_ctl(d_epfd, EPOLL_CTL_DEL, fd, nullptr);
+  d_unwatched.push_back(std::move(iter->second)); // events for it may still be pending in this round
+  d_watches.erase(iter);
+}
+
+void Engine::Worker::loop()
+{
+  t_current = this;
+  epoll_event events[128];
+  for(;;) {
+    for(;;) {
+      Task task;
+      {
+        std::lock_guard<std::mutex> l(d_lock);
+        if(d_active >= d_engine.d_maxtasks || d_queue.empty()) {
+          if(d_quit && !d_active && d_queue.empty())
+            return;
+          break;
+        }
+        task = std::move(d_queue.front());
+        d_queue.pop_front();
+      }
+      start(std::move(task));
+    }
+
+    int64_t timeout = d_wheel.nextTimeout();
+    int n = epoll_wait(d_epfd, events, sizeof(events)/sizeof(events[0]), timeout > INT32_MAX ? INT32_MAX : timeout);
+    if(n < 0 && errno != EINTR)
+      cerr << "Worker waiting for events: " << strerror(errno) << endl;
+
+    for(int i = 0; i < n; ++i) {
+      auto p = (Pollable*)events[i].data.ptr;
+      if(!p) {
+        char buf[64];
+        while(read(d_wakepipe[0], buf, sizeof(buf)) > 0)
+          ;
+        continue;
+      }
+      if(p->iswatch) {
+        auto w = (Watch*)p;
+        auto iter = d_watches.find(w->fd);
+        if(iter != d_watches.end() && iter->second.get() == w) // not unwatched in this round
+          w->cb();
+        continue;
+      }
+      auto c = (Coroutine*)p;
+      epoll_ctl(d_epfd, EPOLL_CTL_DEL, c->waitfd, nullptr);
+      d_wheel.cancel(c->timer);
+      c->result = 1;
+      resume(c);
+    }
+    d_unwatched.clear();
+
+    d_expired.clear();
+    d_wheel.advance();
+    auto expired = std::move(d_expired); // resumed coroutines may add timers
+    for(auto c : expired) {
+      if(c->waitfd >= 0)
+        epoll_ctl(d_epfd, EPOLL_CTL_DEL, c->waitfd, nullptr);
+      c->suspended = false;
+      c->result = 0;
+      resume(c);
+    }
+
+    while(!d_woken.empty() || !d_spawned.empty()) {
+      auto spawned = std::move(d_spawned);
+      d_spawned.clear();
+      for(auto& t : spawned)
+        start(std::move(t));
+      auto woken = std::move(d_woken);
+      d_woken.clear();
+      for(auto c : woken)
+        resume(c);
+    }
+  }
+}
+
+Engine::Engine(unsigned int workers, unsigned int maxtasks, unsigned int maxqueued, size_t stacksize) :
+  d_maxtasks(maxtasks), d_maxqueued(maxqueued), d_stacksize(stacksize)
+{
+  if(!workers)
+    workers = 1;
+  for(unsigned int n = 0; n < workers; ++n)
+    d_workers.emplace_back(std::make_unique<Worker>(*this));
+}
+
+Engine::~Engine() = default;
+
+bool Engine::submit(Task task)
+{
+  unsigned int first = d_next++;
+  for(unsigned int n = 0; n < d_workers.size(); ++n) {
+    if(d_workers[(first + n) % d_workers.size()]->push(task)) {
+      ++d_submitted;
+      return true;
+    }
+  }
+  ++d_rejected;
+  return false;
+}
+
+bool Engine::inTask()
+{
+  return Worker::t_current && Worker::t_current->d_running;
+}
+
+int Engine::waitForRead(int fd, double* timeout)
+{
+  if(inTask())
+    return Worker::t_current->wait(fd, true, timeout);
+  return waitForData(fd, timeout);
+}
+
+int Engine::waitForWrite(int fd, double* timeout)
+{
+  if(inTask())
+    return Worker::t_current->wait(fd, false, timeout);
+  return waitForRWData(fd, false, timeout);
+}
+
+Engine::TaskHandle Engine::currentTask()
+{
+  return inTask() ? Worker::t_current->d_running : nullptr;
+}
+
+int Engine::suspend(double* timeout)
+{
+  if(!inTask())
+    throw std::logic_error("Engine::suspend() called outside of a task");
+  return Worker::t_current->wait(-1, true, timeout);
+}
+
+void Engine::wakeup(TaskHandle task)
+{
+  Worker::t_current->wakeup(task);
+}
+
+void Engine::spawn(Task task)
+{
+  if(!inTask())
+    throw std::logic_error("Engine::spawn() called outside of a task");
+  Worker::t_current->spawn(std::move(task));
+}
+
+void Engine::watch(int fd, std::function<void()> cb)
+{
+  if(!inTask())
+    throw std::logic_error("Engine::watch() called outside of a task");
+  Worker::t_current->watch(fd, std::move(cb));
+}
+
+void Engine::unwatch(int fd)
+{
+  if(Worker::t_current)
+    Worker::t_current->unwatch(fd);
+}
+
+uint64_t Engine::addTimer(uint64_t deadline, std::function<void()> cb)
+{
+  if(!Worker::t_current)
+    throw std::logic_error("Engine::addTimer() called outside of a worker");
+  return Worker::t_current->addTimer(deadline, std::move(cb));
+}
+
+void Engine::cancelTimer(uint64_t id)
+{
+  if(Worker::t_current)
+    Worker::t_current->cancelTimer(id);
+}
+
+Engine::Stats Engine::getStats()
+{
+  Stats ret;
+  ret.submitted = d_submitted;
+  ret.rejected = d_rejected;
+  for(auto& w : d_workers) {
+    ret.running += w->d_active;
+    ret.finished += w->d_finished;
+    ret.queued += w->queued();
+  }
+  return ret;
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+/*!
+   @file
+   @brief Defines Engine, which runs many resolutions on a few threads
+*/
+
+/*! \brief Runs tasks as cooperative coroutines on a fixed set of worker threads
+
+   Resolving a name mostly means waiting for nameservers. Giving every query its
+   own OS thread works, but not for tens of thousands of queries at the same time.
+
+   Instead, every task gets its own small stack, and runs on one of a few worker
+   threads. When a task needs to wait for a socket, it calls waitForRead() or
+   waitForWrite(). This registers the socket with the epoll set of the worker,
+   arms a timer for the timeout, and switches back to the worker loop, which then
+   runs other tasks. Once the socket is ready or the timer fires, the task
+   continues where it left off. So code that runs in a task can be written as if
+   it blocks, like it always was.
+
+   Outside of a task, waitForRead() and waitForWrite() just block. This means the
+   same code works in the engine and in a simple command line tool.
+
+   Concurrency is bounded: every worker runs at most d_maxtasks tasks at the same
+   time, and queues at most d_maxqueued more. If all queues are full, submit()
+   returns false, and the caller should shed the load.
+
+   Sockets that are shared by many tasks can be watched by the worker loop
+   instead, with watch(). The callback reads what arrived, finds out which task
+   it is for, and wakes that task up if it was suspended.
+
+   A task can start helpers with spawn(). These run on the same worker thread,
+   so they can share state with the task that started them without locking, and
+   wake it up when they have something for it.
+
+   Tasks must not block the worker thread in any other way, only one task can
+   wait for a given socket at a time, and exceptions escaping a task are logged
+   and dropped. The destructor waits until all tasks are done. */
+class Engine
+{
+public:
+  typedef std::function<void()> Task;
+
+  Engine(unsigned int workers, unsigned int maxtasks=4096, unsigned int maxqueued=1024, size_t stacksize=256*1024);
+  ~Engine();
+  Engine(const Engine&) = delete;
+  Engine& operator=(const Engine&) = delete;
+
+  //! Hands task to a worker, returns false if we are at capacity
+  bool submit(Task task);
+
+  //! Waits until fd can be read from, or timeout seconds passed. Returns 1 if readable, 0 on timeout
+  static int waitForRead(int fd, double* timeout);
+  //! Same, but waits until we can write to fd, for example when a TCP connection was set up
+  static int waitForWrite(int fd, double* timeout);
+  //! Are we running in a task?
+  static bool inTask();
+
+  struct Coroutine;
+  typedef Coroutine* TaskHandle;
+  //! The task we are running in, nullptr if we are not in one
+  static TaskHandle currentTask();
+  //! Suspends the current task until wakeup() is called for it, or timeout seconds passed. Returns 1 if woken up, 0 on timeout
+  static int suspend(double* timeout);
+  //! Makes a suspended task continue. Only call this from the worker thread that task runs on
+  static void wakeup(TaskHandle task);
+  //! Starts task on the worker we run on, right after the current task waits. Only in a task, and not subject to d_maxtasks
+  static void spawn(Task task);
+  //! Calls cb from the worker loop whenever fd is readable, until unwatch(). Only in a task, the fd stays with that worker
+  static void watch(int fd, std::function<void()> cb);
+  static void unwatch(int fd);
+  /*! Calls cb from the worker loop once deadline (msec, on the msecNow() clock) passed. Only in a task
+      or a callback from the worker loop, cb runs on that worker. Returns an ID for cancelTimer(), never 0 */
+  static uint64_t addTimer(uint64_t deadline, std::function<void()> cb);
+  //! Harmless if the timer fired already
+  static void cancelTimer(uint64_t id);
+
+  struct Stats
+  {
+    uint64_t submitted{0};
+    uint64_t rejected{0};  //!< submit() returned false
+    uint64_t finished{0};
+    uint64_t running{0};   //!< started, not yet finished
+    uint64_t queued{0};    //!< not yet started
+  };
+  Stats getStats();
+
+  const unsigned int d_maxtasks;
+  const unsigned int d_maxqueued;
+  const size_t d_stacksize;
+
+private:
+  class Worker;
+  std::vector<std::unique_ptr<Worker>> d_workers;
+  std::atomic<unsigned int> d_next{0};
+  std::atomic<uint64_t> d_submitted{0}, d_rejected{0};
+};
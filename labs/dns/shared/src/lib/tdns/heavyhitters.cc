@@ -0,0 +1,196 @@
+#include "heavyhitters.hh"
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <sstream>
+using namespace std;
+
+/*!
+   @file
+   @brief Implements heavy hitter tracking with count-min sketches
+*/
+
+namespace {
+const uint64_t c_fnvbasis = 14695981039346656037ULL, c_fnvprime = 1099511628211ULL;
+
+void fnv(uint64_t& hash, const void* data, size_t len)
+{
+  for(size_t n = 0; n < len; ++n) {
+    hash ^= ((const uint8_t*)data)[n];
+    hash *= c_fnvprime;
+  }
+}
+
+//! FNV is fine for telling keys apart, this spreads its bits over the rows of the sketch
+uint64_t finish(uint64_t hash)
+{
+  hash ^= hash >> 31;
+  hash *= 0x7fb5d329728ea185ULL;
+  hash ^= hash >> 27;
+  hash *= 0x81dadef4bc2dd44dULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+void fnvLower(uint64_t& hash, const std::string& s)
+{
+  for(char c : s) {
+    hash ^= (c >= 'A' && c <= 'Z') ? c + 0x20 : c;
+    hash *= c_fnvprime;
+  }
+}
+
+uint64_t hashAddress(const ComboAddress& ca)
+{
+  uint64_t hash = c_fnvbasis;
+  if(ca.sin4.sin_family == AF_INET6)
+    fnv(hash, &ca.sin6.sin6_addr.s6_addr, 16);
+  else
+    fnv(hash, &ca.sin4.sin_addr.s_addr, 4);
+  return finish(hash);
+}
+}
+
+template<typename F>
+void HeavyHitters::Sketch::add(uint64_t hash, F makeKey)
+{
+  uint32_t est = UINT32_MAX;
+  for(unsigned int row = 0; row < c_depth; ++row) {
+    auto& c = counts[row][(hash >> (16 * row)) % c_width];
+    if(c != UINT32_MAX)
+      ++c;
+    est = std::min(est, c);
+  }
+  if(++added % c_halflife == 0)
+    halve();
+
+  unsigned int lowest = 0;
+  for(unsigned int n = 0; n < used; ++n) {
+    if(tracked[n].hash == hash) {
+      tracked[n].count = est;
+      return;
+    }
+    if(tracked[n].count < tracked[lowest].count)
+      lowest = n;
+  }
+  if(used < c_tracked)
+    lowest = used++;
+  else if(est <= tracked[lowest].count)
+    return;
+  tracked[lowest].hash = hash;
+  tracked[lowest].count = est;
+  tracked[lowest].key = makeKey();
+}
+
+void HeavyHitters::Sketch::halve()
+{
+  for(auto& row : counts)
+    for(auto& c : row)
+      c /= 2;
+  for(unsigned int n = 0; n < used; ++n)
+    tracked[n].count /= 2;
+}
+
+HeavyHitters::~HeavyHitters()
+{
+  for(auto& s : d_slots)
+    delete s.load();
+}
+
+//! Like Metrics, threads get consecutive slots. The lock is only contended when more threads than slots share one, or by top()
+HeavyHitters::Slot& HeavyHitters::mySlot()
+{
+  static std::atomic<unsigned int> threads{0};
+  thread_local unsigned int idx = threads++ % c_slots;
+  auto& slot = d_slots[idx];
+  auto s = slot.load(std::memory_order_acquire);
+  if(!s) {
+    auto fresh = new Slot();
+    if(slot.compare_exchange_strong(s, fresh, std::memory_order_acq_rel))
+      s = fresh;
+    else
+      delete fresh;
+  }
+  return *s;
+}
+
+void HeavyHitters::query(const DNSName& qname, const ComboAddress& client)
+{
+  auto& s = mySlot();
+  std::lock_guard<std::mutex> l(s.lock);
+
+  // hash from the root down, so every step is the hash of a zone above qname
+  uint64_t hash = c_fnvbasis;
+  auto labels = qname.d_name.size();
+  for(auto iter = qname.d_name.rbegin(); iter != qname.d_name.rend(); ++iter) {
+    uint8_t len = iter->size();
+    fnv(hash, &len, 1);
+    fnvLower(hash, iter->d_s);
+    if(iter + 1 == qname.d_name.rend())
+      break;
+    auto skip = qname.d_name.rend() - iter - 1;
+    s.sketches[(int)Kind::Zone].add(finish(hash), [&qname, skip, labels]() {
+        DNSName zone;
+        zone.d_name.assign(qname.d_name.begin() + skip, qname.d_name.begin() + labels);
+        return zone.toString();
+      });
+  }
+  s.sketches[(int)Kind::QName].add(finish(hash), [&qname]() { return qname.toString(); });
+  s.sketches[(int)Kind::Client].add(hashAddress(client), [&client]() { return client.toString(); });
+}
+
+void HeavyHitters::nxdomain(const ComboAddress& client)
+{
+  auto& s = mySlot();
+  std::lock_guard<std::mutex> l(s.lock);
+  s.sketches[(int)Kind::Nxdomain].add(hashAddress(client), [&client]() { return client.toString(); });
+}
+
+std::vector<HeavyHitters::Entry> HeavyHitters::top(Kind kind, unsigned int k) const
+{
+  std::vector<uint64_t> counts(c_depth * c_width);
+  std::map<uint64_t, std::string> keys;
+  for(const auto& slot : d_slots) {
+    auto s = slot.load(std::memory_order_acquire);
+    if(!s)
+      continue;
+    std::lock_guard<std::mutex> l(s->lock);
+    const auto& sk = s->sketches[(int)kind];
+    for(unsigned int row = 0; row < c_depth; ++row)
+      for(unsigned int n = 0; n < c_width; ++n)
+        counts[row * c_width + n] += sk.counts[row][n];
+    for(unsigned int n = 0; n < sk.used; ++n)
+      keys.emplace(sk.tracked[n].hash, sk.tracked[n].key);
+  }
+
+  std::vector<Entry> ret;
+  for(const auto& key : keys) {
+    uint64_t est = UINT64_MAX;
+    for(unsigned int row = 0; row < c_depth; ++row)
+      est = std::min(est, counts[row * c_width + (key.first >> (16 * row)) % c_width]);
+    if(est)
+      ret.push_back({key.second, est});
+  }
+  std::sort(ret.begin(), ret.end(), [](const Entry& a, const Entry& b) {
+      return a.count > b.count || (a.count == b.count && a.key < b.key);
+    });
+  if(ret.size() > k)
+    ret.resize(k);
+  return ret;
+}
+
+std::string HeavyHitters::report(unsigned int k) const
+{
+  static const char* names[] = {"qname", "zone", "client", "nxdomain-client"};
+  ostringstream ret;
+  char line[300];
+  for(unsigned int kind = 0; kind < c_kinds; ++kind) {
+    ret << "Top " << k << " " << names[kind] << "s\n";
+    for(const auto& e : top((Kind)kind, k)) {
+      snprintf(line, sizeof(line), "%12llu  %s\n", (unsigned long long)e.count, e.key.c_str());
+      ret << line;
+    }
+    ret << "\n";
+  }
+  return ret.str();
+}
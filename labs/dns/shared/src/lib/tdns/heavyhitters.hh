@@ -0,0 +1,93 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "comboaddress.hh"
+#include "dns-storage.hh"
+
+/*!
+   @file
+   @brief Defines HeavyHitters, which finds the names and clients that most queries are about or come from
+*/
+
+/*! \brief Keeps track of the most frequent qnames, zones, clients and NXDOMAIN sources, in fixed memory
+
+   Every thread counts in its own slot. A slot has, for each Kind, a count-min
+   sketch that estimates how often any key was seen, and the c_tracked keys
+   with the highest estimates. When a key comes in that is not tracked, and its
+   estimate is above the lowest tracked one, it takes that place. This is like
+   Space-Saving, with the sketch providing the counts.
+
+   Recording a query costs a few hashes and scans of c_tracked hashes, no
+   matter how many different names or clients there are. A key is only turned
+   into a string when it starts being tracked.
+
+   The counts are halved every c_halflife keys, so what was popular a while
+   ago makes way for what is popular now.
+
+   top() adds up the sketches of all slots, and estimates every key any slot
+   tracks from that. Estimates are never too low, and too high by at most
+   e/c_width of all keys counted, with high probability.
+
+   This class can be shared between threads. */
+class HeavyHitters
+{
+public:
+  enum class Kind : uint8_t { QName, Zone, Client, Nxdomain };
+  static const unsigned int c_kinds = 4;
+  static const unsigned int c_width = 1024;  //!< counters per row of a sketch
+  static const unsigned int c_depth = 4;     //!< rows of a sketch
+  static const unsigned int c_tracked = 64;  //!< keys tracked per slot and Kind
+  static const uint64_t c_halflife = 1 << 20;
+
+  HeavyHitters() = default;
+  ~HeavyHitters();
+  HeavyHitters(const HeavyHitters&) = delete;
+  HeavyHitters& operator=(const HeavyHitters&) = delete;
+
+  /*! Counts qname as a QName, every domain above it except the root as a Zone, and
+      client as a Client. A query for www.example.com counts for zones example.com and com */
+  void query(const DNSName& qname, const ComboAddress& client);
+  //! Counts client as a source of NXDOMAIN answers
+  void nxdomain(const ComboAddress& client);
+
+  struct Entry
+  {
+    std::string key;
+    uint64_t count;  //!< estimated, recent queries count more
+  };
+  //! The k most frequent keys of kind, most frequent first
+  std::vector<Entry> top(Kind kind, unsigned int k=10) const;
+  //! A table of the top k of every Kind
+  std::string report(unsigned int k=10) const;
+
+private:
+  struct Tracked
+  {
+    uint64_t hash;
+    uint32_t count;
+    std::string key;
+  };
+  struct Sketch
+  {
+    uint32_t counts[c_depth][c_width]{};
+    Tracked tracked[c_tracked];
+    unsigned int used{0};
+    uint64_t added{0};
+
+    template<typename F>
+    void add(uint64_t hash, F makeKey);
+    void halve();
+  };
+  struct Slot
+  {
+    std::mutex lock;
+    Sketch sketches[c_kinds];
+  };
+  Slot& mySlot();
+
+  static const unsigned int c_slots = 64;
+  std::atomic<Slot*> d_slots[c_slots]{};
+};
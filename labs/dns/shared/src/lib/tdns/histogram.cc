@@ -0,0 +1,145 @@
+#include "histogram.hh"
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+using namespace std;
+
+/*!
+   @file
+   @brief Implements latency histograms and the timings of the query stages
+*/
+
+unsigned int LatencyHistogram::bucket(uint64_t nsec)
+{
+  if(nsec < (1U << c_subbits))
+    return nsec;
+  unsigned int exp = 63 - __builtin_clzll(nsec);
+  if(exp > c_maxbits)
+    return c_buckets - 1;
+  unsigned int shift = exp - c_subbits;
+  return (1 << c_subbits) + shift * (1 << c_subbits) + ((nsec >> shift) - (1 << c_subbits));
+}
+
+uint64_t LatencyHistogram::lowest(unsigned int idx)
+{
+  if(idx < (1U << c_subbits))
+    return idx;
+  unsigned int shift = (idx >> c_subbits) - 1;
+  return ((uint64_t)(1 << c_subbits) + (idx & ((1 << c_subbits) - 1))) << shift;
+}
+
+uint64_t LatencyHistogram::highest(unsigned int idx)
+{
+  if(idx < (1U << c_subbits))
+    return idx;
+  unsigned int shift = (idx >> c_subbits) - 1;
+  return lowest(idx) + (1ULL << shift) - 1;
+}
+
+void LatencyHistogram::snapshot(Snapshot& snap) const
+{
+  for(unsigned int n = 0; n < c_buckets; ++n)
+    snap.counts[n] += d_counts[n].load(std::memory_order_relaxed);
+  snap.max = std::max(snap.max, d_max.load(std::memory_order_relaxed));
+}
+
+uint64_t LatencyHistogram::Snapshot::count() const
+{
+  uint64_t ret = 0;
+  for(auto c : counts)
+    ret += c;
+  return ret;
+}
+
+uint64_t LatencyHistogram::Snapshot::percentile(double p) const
+{
+  uint64_t total = count();
+  if(!total)
+    return 0;
+  uint64_t want = std::max<uint64_t>(1, p * total + 0.5), seen = 0;
+  for(unsigned int n = 0; n < counts.size(); ++n) {
+    seen += counts[n];
+    if(seen >= want)
+      return std::min(highest(n), max);
+  }
+  return max;
+}
+
+void LatencyHistogram::Snapshot::add(const Snapshot& rhs)
+{
+  for(unsigned int n = 0; n < counts.size(); ++n)
+    counts[n] += rhs.counts[n];
+  max = std::max(max, rhs.max);
+}
+
+PipelineTimings::PipelineTimings(unsigned int every) : d_every(every)
+{
+  if(const char* sample = getenv("TDNS_SAMPLE"))
+    d_every = atoi(sample);
+}
+
+PipelineTimings::~PipelineTimings()
+{
+  for(auto& stage : d_hists)
+    for(auto& h : stage)
+      delete h.load();
+}
+
+void PipelineTimings::record(Stage stage, DNSType qtype, uint64_t nsec)
+{
+  auto& slot = d_hists[(int)stage][std::min((unsigned int)qtype, c_qtypes - 1)];
+  auto h = slot.load(std::memory_order_acquire);
+  if(!h) {
+    auto fresh = new LatencyHistogram();
+    if(slot.compare_exchange_strong(h, fresh, std::memory_order_acq_rel))
+      h = fresh;
+    else
+      delete fresh; // another thread was first, h is now what it made
+  }
+  h->record(nsec);
+}
+
+LatencyHistogram::Snapshot PipelineTimings::get(Stage stage, DNSType qtype) const
+{
+  LatencyHistogram::Snapshot ret;
+  for(unsigned int n = 0; n < c_qtypes; ++n) {
+    if(qtype != (DNSType)0 && n != std::min((unsigned int)qtype, c_qtypes - 1))
+      continue;
+    if(auto h = d_hists[(int)stage][n].load(std::memory_order_acquire))
+      h->snapshot(ret);
+  }
+  return ret;
+}
+
+std::string PipelineTimings::dump() const
+{
+  static const char* stages[] = {"parse", "queue", "lookup", "resolve", "render", "send", "total"};
+  ostringstream ret;
+  char line[160];
+  snprintf(line, sizeof(line), "%-8s %-8s %10s %10s %10s %10s %10s %10s\n", "stage", "qtype", "count", "p50 usec", "p90", "p99", "p99.9", "max");
+  ret << line;
+  auto print = [&](const char* stage, const std::string& qtype, const LatencyHistogram::Snapshot& snap) {
+    snprintf(line, sizeof(line), "%-8s %-8s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", stage, qtype.c_str(), (unsigned long long)snap.count(),
+             snap.percentile(0.5) / 1000.0, snap.percentile(0.9) / 1000.0, snap.percentile(0.99) / 1000.0,
+             snap.percentile(0.999) / 1000.0, snap.max / 1000.0);
+    ret << line;
+  };
+  for(unsigned int s = 0; s < c_stages; ++s) {
+    auto all = get((Stage)s);
+    if(!all.count())
+      continue;
+    print(stages[s], "all", all);
+    for(unsigned int n = 0; n < c_qtypes; ++n) {
+      auto h = d_hists[s][n].load(std::memory_order_acquire);
+      if(!h)
+        continue;
+      LatencyHistogram::Snapshot snap;
+      h->snapshot(snap);
+      std::string name = n == c_qtypes - 1 ? "other" : toString((DNSType)n);
+      if(name == "?")
+        name = "TYPE" + std::to_string(n);
+      print(stages[s], name, snap);
+    }
+  }
+  return ret.str();
+}
@@ -0,0 +1,159 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "record-types.hh"
+#include "timerwheel.hh"
+
+/*!
+   @file
+   @brief Defines latency histograms, and timing of the stages a query goes through
+*/
+
+/*! \brief Counts durations in log-linear buckets, like an HDR histogram
+
+   Durations below 16 nanoseconds each get their own bucket. Above that, every
+   power of two is split into 16 buckets of equal width, so a bucket is never
+   more than 1/16th (6.25%) wider than the values in it. This covers up to
+   2^40 nanoseconds, about 18 minutes, in 608 buckets. Anything longer ends up
+   in the last bucket.
+
+   Recording is a relaxed increment, so this class can be shared between
+   threads without locking. */
+class LatencyHistogram
+{
+public:
+  static const unsigned int c_subbits = 4;
+  static const unsigned int c_maxbits = 40;
+  static const unsigned int c_buckets = (1 << c_subbits) * (c_maxbits - c_subbits + 2);
+
+  void record(uint64_t nsec)
+  {
+    d_counts[bucket(nsec)].fetch_add(1, std::memory_order_relaxed);
+    uint64_t max = d_max.load(std::memory_order_relaxed);
+    while(nsec > max && !d_max.compare_exchange_weak(max, nsec, std::memory_order_relaxed))
+      ;
+  }
+
+  //! The counts at one moment, which can be added up and asked for percentiles
+  struct Snapshot
+  {
+    std::vector<uint64_t> counts = std::vector<uint64_t>(c_buckets);
+    uint64_t max{0};
+
+    uint64_t count() const;
+    //! The value below which p (0 to 1) of the durations are, as the highest value of its bucket
+    uint64_t percentile(double p) const;
+    void add(const Snapshot& rhs);
+  };
+  //! Adds what was recorded so far to snap
+  void snapshot(Snapshot& snap) const;
+
+  static unsigned int bucket(uint64_t nsec);
+  //! The lowest value that ends up in bucket idx
+  static uint64_t lowest(unsigned int idx);
+  //! The highest value that ends up in bucket idx
+  static uint64_t highest(unsigned int idx);
+
+private:
+  std::atomic<uint64_t> d_counts[c_buckets]{};
+  std::atomic<uint64_t> d_max{0};
+};
+
+//! What handling a query consists of. Not every server has every stage
+enum class Stage : uint8_t { Parse, Queue, Lookup, Resolve, Render, Send, Total };
+
+/*! \brief Latency histograms for every stage, for every qtype
+
+   Only 1 in d_every queries is timed, decided per thread, so the cost for all
+   others is an increment and a compare. Histograms are created the first time
+   a stage and qtype combination is recorded.
+
+   This class can be shared between threads. */
+class PipelineTimings
+{
+public:
+  explicit PipelineTimings(unsigned int every=64);
+  ~PipelineTimings();
+  PipelineTimings(const PipelineTimings&) = delete;
+  PipelineTimings& operator=(const PipelineTimings&) = delete;
+
+  //! True if this query should be timed
+  bool sample()
+  {
+    unsigned int every = d_every.load(std::memory_order_relaxed);
+    if(!every)
+      return false;
+    thread_local unsigned int count = 0;
+    return ++count % every == 0;
+  }
+
+  void record(Stage stage, DNSType qtype, uint64_t nsec);
+
+  //! What was recorded for stage, for one qtype, or for all of them if qtype is 0
+  LatencyHistogram::Snapshot get(Stage stage, DNSType qtype=(DNSType)0) const;
+
+  /*! A table with a line for each stage, and for each qtype in that stage, with the
+      count and the 50th, 90th, 99th and 99.9th percentile and maximum in microseconds */
+  std::string dump() const;
+
+  //! Time 1 in this many queries, 0 for none. From TDNS_SAMPLE if set
+  std::atomic<unsigned int> d_every;
+
+private:
+  static const unsigned int c_stages = (unsigned int)Stage::Total + 1;
+  static const unsigned int c_qtypes = 257; //!< 256 is everything above 255
+  std::atomic<LatencyHistogram*> d_hists[c_stages][c_qtypes]{};
+};
+
+/*! \brief Times one query as it goes through the stages
+
+   Call mark() when a stage is done, the time since the previous mark (or since
+   the start) is added to that stage. A stage can be marked more than once, for
+   example when looking up and rendering alternate, like when following a CNAME.
+   done() records the stages that were marked, and the total.
+
+   If the query was not sampled, all of this does nothing. A StageTimer can be
+   copied to another thread, as long as only one thread uses it at a time. */
+class StageTimer
+{
+public:
+  explicit StageTimer(PipelineTimings& pt) : d_pt(&pt), d_sampled(pt.sample())
+  {
+    if(d_sampled)
+      d_start = d_last = nsecNow();
+  }
+
+  void mark(Stage stage)
+  {
+    if(!d_sampled)
+      return;
+    uint64_t now = nsecNow();
+    d_nsec[(int)stage] += now - d_last;
+    d_used |= 1 << (int)stage;
+    d_last = now;
+  }
+
+  void done(DNSType qtype)
+  {
+    if(!d_sampled)
+      return;
+    for(unsigned int n = 0; n < (unsigned int)Stage::Total; ++n) {
+      if(d_used & (1 << n))
+        d_pt->record((Stage)n, qtype, d_nsec[n]);
+    }
+    d_pt->record(Stage::Total, qtype, d_last - d_start);
+    d_sampled = false;
+  }
+
+  bool sampled() const { return d_sampled; }
+
+private:
+  PipelineTimings* d_pt;
+  bool d_sampled;
+  uint8_t d_used{0};
+  uint64_t d_start{0};
+  uint64_t d_last{0};
+  uint64_t d_nsec[(int)Stage::Total]{};
+};
@@ -0,0 +1,91 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+/*!
+   @file
+   @brief Defines InflightTable, for answering identical queries with a single resolution
+*/
+
+/*! \brief Keeps track of resolutions that are in progress, and who else is waiting for them
+
+   When a popular record expires, many clients ask for it at the same time. Only the
+   first of these needs to be resolved. join() tells the caller if it is first. If it
+   is not, the caller is stored as a waiter and can go do something else. Once the
+   first resolution is done, finish() hands out the waiters, so they can be sent the
+   same answer.
+
+   Nobody blocks on anything here, a waiter is just a record of who to answer and how.
+   This class does its own locking and can be shared between threads. */
+template<typename Key, typename Waiter>
+class InflightTable
+{
+public:
+  //! Returns true if nobody was resolving key yet, and the caller should do it. Otherwise w is stored as a waiter
+  bool join(const Key& key, Waiter&& w)
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    auto iter = d_inflight.find(key);
+    if(iter == d_inflight.end()) {
+      d_inflight[key];
+      ++d_resolutions;
+      return true;
+    }
+    iter->second.push_back(std::move(w));
+    ++d_waiters;
+    if(iter->second.size() > d_maxwaiters)
+      d_maxwaiters = iter->second.size();
+    return false;
+  }
+
+  //! The resolution of key is done, returns everyone that was waiting for it
+  std::vector<Waiter> finish(const Key& key)
+  {
+    std::vector<Waiter> ret;
+    std::lock_guard<std::mutex> l(d_lock);
+    auto iter = d_inflight.find(key);
+    if(iter != d_inflight.end()) {
+      ret = std::move(iter->second);
+      d_inflight.erase(iter);
+    }
+    return ret;
+  }
+
+  //! Number of resolutions in progress
+  size_t size()
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    return d_inflight.size();
+  }
+
+  //! Statistics, all queries that came in are either a resolution or a waiter
+  struct Stats
+  {
+    uint64_t resolutions{0};
+    uint64_t waiters{0};
+    uint64_t maxwaiters{0}; //!< the most waiters a single resolution ever had
+
+    //! fraction of queries that did not need a resolution of their own
+    double ratio() const
+    {
+      return resolutions + waiters ? (double)waiters / (resolutions + waiters) : 0;
+    }
+  };
+
+  Stats getStats()
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    Stats ret;
+    ret.resolutions = d_resolutions;
+    ret.waiters = d_waiters;
+    ret.maxwaiters = d_maxwaiters;
+    return ret;
+  }
+
+private:
+  std::map<Key, std::vector<Waiter>> d_inflight;
+  std::mutex d_lock;
+  uint64_t d_resolutions{0}, d_waiters{0}, d_maxwaiters{0};
+};
@@ -0,0 +1,143 @@
+#include "infra.hh"
+#include <cmath>
+#include "snapshot.hh"
+using namespace std;
+
+/*!
+   @file
+   @brief Implements the nameserver infrastructure table
+*/
+
+//! Finds or creates the entry for server, and applies the decay of its timeout count
+InfraTable::Stats& InfraTable::getLocked(const ComboAddress& server, uint64_t now)
+{
+  auto iter = d_servers.find(server);
+  if(iter == d_servers.end()) {
+    if(d_servers.size() >= d_maxentries)
+      purgeLocked(now);
+    iter = d_servers.insert({server, Stats()}).first;
+    iter->second.lastupdate = now;
+  }
+  auto& s = iter->second;
+  if(now > s.lastupdate) {
+    s.timeouts *= exp2(-(double)(now - s.lastupdate) / d_halflife);
+    s.lastupdate = now;
+  }
+  return s;
+}
+
+uint64_t InfraTable::scoreLocked(const Stats& s) const
+{
+  uint64_t ret = s.measured ? s.srtt + 4 * s.rttvar : 0;
+  return ret + s.timeouts * d_timeoutpenalty;
+}
+
+// RFC 6298, section 2
+void InfraTable::reportRTT(const ComboAddress& server, uint32_t usec, uint64_t now)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  auto& s = getLocked(server, now);
+  if(!s.measured) {
+    s.srtt = usec;
+    s.rttvar = usec / 2.0;
+    s.measured = true;
+  }
+  else {
+    s.rttvar = 0.75 * s.rttvar + 0.25 * fabs(s.srtt - usec);
+    s.srtt = 0.875 * s.srtt + 0.125 * usec;
+  }
+  // it answered, so it is alive. Earlier timeouts were probably lost packets
+  s.timeouts /= 2;
+}
+
+void InfraTable::reportTimeout(const ComboAddress& server, uint64_t now)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  getLocked(server, now).timeouts += 1;
+}
+
+uint64_t InfraTable::score(const ComboAddress& server, uint64_t now)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  auto iter = d_servers.find(server);
+  if(iter == d_servers.end())
+    return 0;
+  return scoreLocked(getLocked(server, now));
+}
+
+bool InfraTable::isThrottled(const ComboAddress& server, uint64_t now)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  auto iter = d_servers.find(server);
+  if(iter == d_servers.end())
+    return false;
+  return getLocked(server, now).timeouts > d_throttle;
+}
+
+bool InfraTable::getStats(const ComboAddress& server, Stats& stats, uint64_t now)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  auto iter = d_servers.find(server);
+  if(iter == d_servers.end())
+    return false;
+  stats = getLocked(server, now);
+  return true;
+}
+
+void InfraTable::purgeLocked(uint64_t now)
+{
+  for(auto iter = d_servers.begin(); iter != d_servers.end(); ) {
+    if(now > iter->second.lastupdate + d_maxage)
+      iter = d_servers.erase(iter);
+    else
+      ++iter;
+  }
+}
+
+void InfraTable::purge(uint64_t now)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  purgeLocked(now);
+}
+
+size_t InfraTable::size()
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  return d_servers.size();
+}
+
+// msecNow() starts over after a reboot, so we store how long ago every server was last updated
+void InfraTable::save(SnapshotWriter& sw, uint64_t now)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  sw.putUInt32(d_servers.size());
+  for(const auto& s : d_servers) {
+    sw.putAddress(s.first);
+    sw.putDouble(s.second.srtt);
+    sw.putDouble(s.second.rttvar);
+    sw.putDouble(s.second.timeouts);
+    sw.putUInt64(now > s.second.lastupdate ? now - s.second.lastupdate : 0);
+    sw.putUInt8(s.second.measured);
+  }
+}
+
+size_t InfraTable::load(SnapshotReader& sr, uint64_t now)
+{
+  time_t wallnow = time(nullptr);
+  uint64_t downtime = sr.d_written && wallnow > sr.d_written ? (wallnow - sr.d_written) * 1000 : 0;
+  std::lock_guard<std::mutex> l(d_lock);
+  size_t ret = 0;
+  for(uint32_t count = sr.getUInt32(); count; --count) {
+    ComboAddress server = sr.getAddress();
+    Stats s;
+    s.srtt = sr.getDouble();
+    s.rttvar = sr.getDouble();
+    s.timeouts = sr.getDouble();
+    uint64_t age = sr.getUInt64() + downtime;
+    s.measured = sr.getUInt8();
+    s.lastupdate = now > age ? now - age : 0;
+    if(age <= d_maxage && d_servers.size() < d_maxentries && d_servers.insert({server, s}).second)
+      ++ret;
+  }
+  return ret;
+}
@@ -0,0 +1,107 @@
+#pragma once
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <random>
+#include <vector>
+#include "comboaddress.hh"
+#include "timerwheel.hh"
+
+class SnapshotWriter;
+class SnapshotReader;
+
+/*!
+   @file
+   @brief Defines InfraTable, which remembers how fast and how reliable nameservers are
+*/
+
+/*! \brief Per-nameserver round trip times and timeouts, used to pick which server to ask
+
+   For every nameserver address we keep a smoothed round trip time and its
+   variance, updated like TCP does it (RFC 6298). Timeouts are counted too,
+   and that count halves every d_halflife milliseconds, so a server that was
+   down for a while gets a new chance later on.
+
+   sort() puts the servers we expect to answer fastest first. Servers we know
+   nothing about yet come before everything else, so each of them gets tried
+   once. And every now and then (d_explore) a random other server is moved to
+   the front, otherwise a server that was slow once would never be measured again.
+
+   Addresses are compared including the port number.
+   This class does its own locking and can be shared between threads. */
+class InfraTable
+{
+public:
+  //! Feed this the round trip time of a query that was answered without being retransmitted
+  void reportRTT(const ComboAddress& server, uint32_t usec, uint64_t now=msecNow());
+  //! A query to this server got no response at all
+  void reportTimeout(const ComboAddress& server, uint64_t now=msecNow());
+
+  //! What we expect a query to this server to cost in microseconds. 0 if we know nothing about it
+  uint64_t score(const ComboAddress& server, uint64_t now=msecNow());
+  //! True if this server timed out so often recently that we should not bother it
+  bool isThrottled(const ComboAddress& server, uint64_t now=msecNow());
+
+  //! What we know about a server, for tests and statistics
+  struct Stats
+  {
+    double srtt{0};      //!< smoothed round trip time, usec
+    double rttvar{0};    //!< round trip time variance, usec
+    double timeouts{0};  //!< decays over time, see d_halflife
+    uint64_t lastupdate{0};
+    bool measured{false}; //!< if false, srtt and rttvar are meaningless
+  };
+  bool getStats(const ComboAddress& server, Stats& stats, uint64_t now=msecNow());
+
+  //! Orders servers best first, getaddr turns an element of servers into a ComboAddress
+  template<typename T, typename F>
+  void sort(std::vector<T>& servers, F getaddr, uint64_t now=msecNow())
+  {
+    if(servers.empty())
+      return;
+    thread_local std::mt19937 gen{std::random_device{}()};
+    // randomize first, so servers with equal scores share the load
+    std::shuffle(servers.begin(), servers.end(), gen);
+
+    std::vector<std::pair<uint64_t, T>> scored;
+    scored.reserve(servers.size());
+    for(auto& s : servers)
+      scored.push_back({score(getaddr(s), now), std::move(s)});
+    std::stable_sort(scored.begin(), scored.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+      });
+    servers.clear();
+    for(auto& s : scored)
+      servers.push_back(std::move(s.second));
+
+    if(servers.size() > 1 && std::uniform_real_distribution<>(0, 1)(gen) < d_explore) {
+      auto pick = std::uniform_int_distribution<size_t>(1, servers.size() - 1)(gen);
+      std::rotate(servers.begin(), servers.begin() + pick, servers.begin() + pick + 1);
+    }
+  }
+
+  //! Removes servers we have not used in d_maxage milliseconds
+  void purge(uint64_t now=msecNow());
+  size_t size();
+
+  //! Adds all servers to a snapshot
+  void save(SnapshotWriter& sw, uint64_t now=msecNow());
+  /*! Reads what save() wrote. The time since the snapshot was written counts as time the servers
+      were not used, so timeouts decay over it and servers that are now too old are skipped.
+      Returns how many servers were loaded */
+  size_t load(SnapshotReader& sr, uint64_t now=msecNow());
+
+  double d_explore{0.05};            //!< fraction of sort() calls that put a random server first
+  uint64_t d_halflife{60000};        //!< timeouts are forgotten with this half-life, msec
+  uint32_t d_timeoutpenalty{1000000}; //!< what a (recent) timeout adds to the score, usec
+  double d_throttle{3.0};            //!< with more (decayed) timeouts than this, a server is skipped
+  uint64_t d_maxage{3600000};        //!< msec
+  size_t d_maxentries{100000};
+
+private:
+  Stats& getLocked(const ComboAddress& server, uint64_t now);
+  uint64_t scoreLocked(const Stats& s) const;
+  void purgeLocked(uint64_t now);
+  std::map<ComboAddress, Stats> d_servers;
+  std::mutex d_lock;
+};
@@ -0,0 +1,302 @@
+#include "labsim.hh"
+#include <algorithm>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "dns-storage.hh"
+#include "log.hh"
+#include "timerwheel.hh"
+#include "../../local-dns-handler.h"
+using namespace std;
+
+/*!
+   @file
+   @brief Implements the simulated DNS lab
+*/
+
+const char* const c_labRoot = "127.1.0.1";
+const char* const c_labResolver = "127.20.0.10";
+
+struct LabNetwork::Server
+{
+  std::string name;
+  ComboAddress address;
+  LinkProfile link;
+  struct TDNSServerContext* ctx{nullptr};
+  int fd{-1};
+  uint64_t inbusy{0}, outbusy{0};  //!< nsec until which the link is sending earlier packets
+  std::atomic<uint64_t> queries{0}, dropped{0}, answered{0};
+};
+
+//! The state local-dns.c keeps in main()
+struct LabNetwork::Resolver
+{
+  ComboAddress address;
+  struct TDNSParseResult parsed;
+  struct TDNSFindResult ret;
+  struct LocalDNS server;                        //!< for LocalDNSHandle(), points to parsed and ret
+  std::atomic<uint64_t> queries{0}, answered{0}; //!< of server, for getStats()
+};
+
+namespace {
+//! TDNSParseMsg() and TDNSFind() allocate what they fill in, this frees it again
+struct ParseResult : TDNSParseResult
+{
+  ParseResult()
+  {
+    memset((TDNSParseResult*)this, 0, sizeof(TDNSParseResult));
+  }
+  ~ParseResult()
+  {
+    TDNSFreeParseResult(this);
+  }
+};
+}
+
+LabNetwork::LabNetwork(uint16_t port, uint64_t seed) : d_port(port), d_random(seed)
+{
+}
+
+LabNetwork::~LabNetwork()
+{
+  stop();
+  for(auto& s : d_servers)
+    close(s->fd);
+  if(d_resolver)
+    close(d_resolver->server.sockfd);
+  // the TDNS C API has no way to free a context
+}
+
+std::string LabNetwork::labAddress(const std::string& ip)
+{
+  struct in_addr addr;
+  if(inet_pton(AF_INET, ip.c_str(), &addr) != 1)
+    throw std::runtime_error("Not an IPv4 address: "+ip);
+  auto p = (const uint8_t*)&addr.s_addr;
+  return "127."+to_string(p[0])+"."+to_string(p[2])+"."+to_string(p[3]);
+}
+
+int LabNetwork::makeSocket(const ComboAddress& local)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd < 0)
+    throw std::runtime_error("Creating socket for lab: "+string(strerror(errno)));
+  if(::bind(fd, (struct sockaddr*)&local, local.getSocklen()) < 0) {
+    close(fd);
+    throw std::runtime_error("Binding lab socket to "+local.toStringWithPort()+": "+string(strerror(errno)));
+  }
+  return fd;
+}
+
+void LabNetwork::addServer(const std::string& name, const std::string& ip, std::function<void(struct TDNSServerContext*)> build, const LinkProfile& link)
+{
+  auto s = std::make_unique<Server>();
+  s->name = name;
+  s->address = ComboAddress(ip, d_port);
+  s->link = link;
+  s->fd = makeSocket(s->address);
+  s->ctx = TDNSInit();
+  build(s->ctx);
+  d_servers.push_back(std::move(s));
+}
+
+void LabNetwork::addResolver(const std::string& ip, std::function<void(struct TDNSServerContext*)> build)
+{
+  d_resolver = std::make_unique<Resolver>();
+  auto& r = *d_resolver;
+  r.address = ComboAddress(ip, d_port);
+  memset(&r.parsed, 0, sizeof(r.parsed));
+  r.server = {makeSocket(r.address), d_port, TDNSInit(), TDNSInit(), &r.parsed, &r.ret, 0, 0};
+  build(r.server.ctx);
+}
+
+void LabNetwork::start()
+{
+  d_stop = false;
+  d_thread = std::thread([this]() { loop(); });
+}
+
+void LabNetwork::stop()
+{
+  d_stop = true;
+  if(d_thread.joinable())
+    d_thread.join();
+}
+
+std::vector<LabNetwork::ServerStats> LabNetwork::getStats() const
+{
+  std::vector<ServerStats> ret;
+  for(const auto& s : d_servers) {
+    ServerStats st;
+    st.name = s->name;
+    st.address = s->address;
+    st.queries = s->queries;
+    st.dropped = s->dropped;
+    st.answered = s->answered;
+    ret.push_back(st);
+  }
+  if(d_resolver) {
+    ServerStats st;
+    st.name = "local-dns";
+    st.address = d_resolver->address;
+    st.queries = d_resolver->queries;
+    st.answered = d_resolver->answered;
+    ret.push_back(st);
+  }
+  return ret;
+}
+
+uint64_t LabNetwork::traverse(Server& s, uint64_t& busy, size_t size, uint64_t now)
+{
+  if(s.link.loss > 0 && std::uniform_real_distribution<double>(0, 1)(d_random) < s.link.loss)
+    return 0;
+  uint64_t sent = std::max(now, busy);
+  if(s.link.bandwidth)
+    sent += size * 8 * 1000000000ULL / s.link.bandwidth;
+  busy = sent;
+  double delay = s.link.latency;
+  if(s.link.jitter > 0)
+    delay += std::uniform_real_distribution<double>(0, s.link.jitter)(d_random);
+  return sent + delay * 1000000;
+}
+
+//! Like the loop in ut-dns.c and cs-dns.c, but what we send goes over the link
+void LabNetwork::serve(Server& s, const std::string& packet, const ComboAddress& from, uint64_t now)
+{
+  s.queries++;
+  uint64_t arrived = traverse(s, s.inbusy, packet.size(), now);
+  if(!arrived) {
+    s.dropped++;
+    return;
+  }
+  ParseResult parsed;
+  struct TDNSFindResult ret;
+  ret.len = 0;
+  try {
+    if(TDNSParseMsg(packet.c_str(), packet.size(), &parsed) != TDNS_QUERY)
+      return;
+    TDNSFind(s.ctx, &parsed, &ret);
+  }
+  catch(std::exception& e) {
+    TLOG(Warning, "Lab server ", s.name, " could not answer a query from ", from.toStringWithPort(), ": ", e.what());
+    return;
+  }
+  if(ret.len <= 0)  // for a name in none of our zones, TDNSFind() has no answer at all
+    return;
+  uint64_t delivered = traverse(s, s.outbusy, ret.len, arrived);
+  if(!delivered) {
+    s.dropped++;
+    return;
+  }
+  s.answered++;
+  d_scheduled.push({delivered, s.fd, from, std::string(ret.serialized, ret.len)});
+}
+
+//! What the loop in local-dns.c does with a message, with the port of the lab instead of 53
+void LabNetwork::resolve(const std::string& query, const ComboAddress& from)
+{
+  auto& r = *d_resolver;
+  std::string packet(query);
+  packet.resize(std::max(packet.size(), (size_t)MAX_RESPONSE)); // answers get our NS information added
+  struct sockaddr_in client_addr = from.sin4;
+  LocalDNSHandle(&r.server, &packet[0], query.size(), &client_addr);
+  r.queries = r.server.queries;
+  r.answered = r.server.answered;
+}
+
+void LabNetwork::loop()
+{
+  vector<pollfd> pfds;
+  for(const auto& s : d_servers)
+    pfds.push_back({s->fd, POLLIN, 0});
+  if(d_resolver)
+    pfds.push_back({d_resolver->server.sockfd, POLLIN, 0});
+
+  std::string buffer(65535, 0);
+  while(!d_stop) {
+    uint64_t now = nsecNow();
+    while(!d_scheduled.empty() && d_scheduled.top().when <= now) {
+      const auto& sc = d_scheduled.top();
+      sendto(sc.fd, sc.packet.c_str(), sc.packet.size(), 0, (struct sockaddr*)&sc.to, sc.to.getSocklen());
+      d_scheduled.pop();
+    }
+
+    uint64_t wait = 10000000;
+    if(!d_scheduled.empty())
+      wait = std::min(wait, d_scheduled.top().when - now);
+    if(d_resolver) {
+      int msec = TDNSNextTimeout(d_resolver->server.per_query_ctx);
+      if(msec >= 0)
+        wait = std::min(wait, (uint64_t)msec * 1000000);
+    }
+    struct timespec ts{(time_t)(wait / 1000000000), (long)(wait % 1000000000)};
+    int ready = ppoll(&pfds[0], pfds.size(), &ts, nullptr);
+    if(d_resolver)
+      TDNSProcessTimeouts(d_resolver->server.per_query_ctx, d_resolver->server.sockfd);
+    if(ready <= 0)
+      continue;
+
+    now = nsecNow();
+    for(unsigned int n = 0; n < pfds.size(); ++n) {
+      if(!pfds[n].revents)
+        continue;
+      for(;;) {
+        ComboAddress from;
+        socklen_t fromlen = sizeof(from);
+        ssize_t len = recvfrom(pfds[n].fd, &buffer[0], buffer.size(), 0, (struct sockaddr*)&from, &fromlen);
+        if(len < 0)
+          break;
+        std::string packet(buffer, 0, len);
+        try {
+          if(n < d_servers.size())
+            serve(*d_servers[n], packet, from, now);
+          else
+            resolve(packet, from);
+        }
+        catch(std::exception& e) {
+          TLOG(Warning, "Lab could not handle a packet from ", from.toStringWithPort(), ": ", e.what());
+        }
+      }
+    }
+  }
+}
+
+void buildLab(LabNetwork& net, const LinkProfile& link, const std::map<std::string, LinkProfile>& links, bool withResolver)
+{
+  auto linkOf = [&](const std::string& name) {
+    auto iter = links.find(name);
+    return iter == links.end() ? link : iter->second;
+  };
+  const string ut = LabNetwork::labAddress("40.0.0.20");
+  const string cs = LabNetwork::labAddress("50.0.0.30");
+  // in the lab, local_dns has the edu zone. Here a server of its own has it too, for tres
+  const string edu = LabNetwork::labAddress("30.0.0.10");
+
+  net.addServer("root", c_labRoot, [edu](struct TDNSServerContext* ctx) {
+      TDNSCreateZone(ctx, ".");
+      TDNSAddRecord(ctx, ".", "edu", NULL, "ns.edu");
+      TDNSAddRecord(ctx, "edu..", "ns", edu.c_str(), NULL);
+    }, linkOf("root"));
+  // what local-dns.c has itself
+  auto eduZone = [ut](struct TDNSServerContext* ctx) {
+    TDNSCreateZone(ctx, "edu");
+    TDNSAddRecord(ctx, "edu", "utexas", NULL, "ns.utexas.edu");
+    TDNSAddRecord(ctx, "utexas.edu", "ns", ut.c_str(), NULL);
+  };
+  net.addServer("edu", edu, eduZone, linkOf("edu"));
+  net.addServer("utexas.edu", ut, [cs](struct TDNSServerContext* ctx) {  // as in ut-dns.c
+      TDNSCreateZone(ctx, "utexas.edu");
+      TDNSAddRecord(ctx, "utexas.edu", "www", "40.0.0.10", NULL);
+      TDNSAddRecord(ctx, "utexas.edu", "cs", NULL, "ns.cs.utexas.edu");
+      TDNSAddRecord(ctx, "cs.utexas.edu", "ns", cs.c_str(), NULL);
+    }, linkOf("utexas.edu"));
+  net.addServer("cs.utexas.edu", cs, [](struct TDNSServerContext* ctx) {  // as in cs-dns.c
+      TDNSCreateZone(ctx, "cs.utexas.edu");
+      TDNSAddRecord(ctx, "cs.utexas.edu", "", "50.0.0.10", NULL);
+      TDNSAddRecord(ctx, "cs.utexas.edu", "aquila", "50.0.0.20", NULL);
+    }, linkOf("cs.utexas.edu"));
+  if(withResolver)
+    net.addResolver(c_labResolver, eduZone);
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "comboaddress.hh"
+#include "tdns-c.h"
+
+/*!
+   @file
+   @brief Defines LabNetwork, which simulates the servers of the DNS lab in one process, for repeatable benchmarks
+*/
+
+/*! \brief How a simulated link between a server and everyone else behaves
+
+   Every packet is delayed by latency plus a random part of jitter, and by the
+   time it takes to send it at bandwidth, after the packets before it. It is
+   lost with probability loss. All of this applies in both directions. */
+struct LinkProfile
+{
+  double latency{0};      //!< msec, one way
+  double jitter{0};       //!< msec, the most that is randomly added to latency
+  double loss{0};         //!< 0 to 1, per packet
+  uint64_t bandwidth{0};  //!< bits per second, 0 for no limit
+};
+
+/*! \brief The servers of the Kathara DNS lab, on loopback addresses, run from a single thread
+
+   Authoritative servers are built with the TDNS C API, like ut-dns.c and
+   cs-dns.c build theirs, and answer every query like they do. The iterative
+   server of local-dns.c can run here too: messages for it go to
+   LocalDNSHandle() from local-dns-handler.c, which local-dns.c calls as well.
+
+   Every server listens on a loopback address of its own, on the same port,
+   because referrals only carry addresses. labAddress() turns a lab address
+   into one that works here: 40.0.0.20 becomes 127.40.0.20. Linux routes all
+   of 127.0.0.0/8 to the loopback interface, other systems may need aliases.
+
+   The link of every authoritative server can be given latency, loss and
+   bandwidth. Lost packets and jitter come from a random generator with a
+   fixed seed, so a run with the same queries drops the same packets.
+
+   The servers are not thread safe, but getStats() can be called from
+   anywhere. */
+class LabNetwork
+{
+public:
+  explicit LabNetwork(uint16_t port, uint64_t seed=1);
+  ~LabNetwork();
+  LabNetwork(const LabNetwork&) = delete;
+  LabNetwork& operator=(const LabNetwork&) = delete;
+
+  //! 40.0.0.20 becomes 127.40.0.20
+  static std::string labAddress(const std::string& ip);
+
+  /*! Adds an authoritative server called name, listening on ip and our port. build creates its
+      zones with TDNSCreateZone() and TDNSAddRecord(). Call before start() */
+  void addServer(const std::string& name, const std::string& ip, std::function<void(struct TDNSServerContext*)> build, const LinkProfile& link=LinkProfile());
+
+  /*! Adds the iterative server of local-dns.c, listening on ip and our port, and asking other
+      servers on our port too. build creates the zones it has itself. Call before start() */
+  void addResolver(const std::string& ip, std::function<void(struct TDNSServerContext*)> build);
+
+  //! Starts answering, from a thread of our own
+  void start();
+  //! Stops that thread, the destructor does this too
+  void stop();
+
+  struct ServerStats
+  {
+    std::string name;
+    ComboAddress address;
+    uint64_t queries{0};   //!< received, including those the link lost
+    uint64_t dropped{0};   //!< queries and responses the link lost
+    uint64_t answered{0};  //!< responses that made it through the link
+  };
+  //! Of all servers, the resolver last
+  std::vector<ServerStats> getStats() const;
+
+private:
+  struct Server;
+  struct Resolver;
+  struct Scheduled
+  {
+    uint64_t when;  //!< nsec
+    int fd;
+    ComboAddress to;
+    std::string packet;
+    bool operator>(const Scheduled& rhs) const { return when > rhs.when; }
+  };
+
+  void loop();
+  void serve(Server& s, const std::string& packet, const ComboAddress& from, uint64_t now);
+  void resolve(const std::string& packet, const ComboAddress& from);
+  //! When a packet of size bytes that enters the link at now comes out at the other end, or 0 if it gets lost
+  uint64_t traverse(Server& s, uint64_t& busy, size_t size, uint64_t now);
+  int makeSocket(const ComboAddress& local);
+
+  uint16_t d_port;
+  std::mt19937_64 d_random;
+  std::vector<std::unique_ptr<Server>> d_servers;
+  std::unique_ptr<Resolver> d_resolver;
+  std::priority_queue<Scheduled, std::vector<Scheduled>, std::greater<Scheduled>> d_scheduled;
+  std::thread d_thread;
+  std::atomic<bool> d_stop{false};
+};
+
+/*! Adds the servers of the lab to net: root, an edu server with the zone local-dns.c has, and
+    utexas.edu and cs.utexas.edu from ut-dns.c and cs-dns.c. The root only exists here, for
+    resolvers like tres that start at the top. Servers get the link in links under their name,
+    or link. withResolver adds local-dns.c too, on the lab address of local_dns */
+void buildLab(LabNetwork& net, const LinkProfile& link, const std::map<std::string, LinkProfile>& links, bool withResolver);
+
+//! Where buildLab() puts the root server and the resolver
+extern const char* const c_labRoot;
+extern const char* const c_labResolver;
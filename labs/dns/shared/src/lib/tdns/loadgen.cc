@@ -0,0 +1,390 @@
+#include "loadgen.hh"
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "dnsmessages.hh"
+#include "timerwheel.hh"
+using namespace std;
+
+/*!
+   @file
+   @brief Implements the load generator, with a thread per share of the load
+*/
+
+std::vector<LoadQuery> readQueryList(std::istream& in)
+{
+  std::vector<LoadQuery> ret;
+  string line;
+  unsigned int lineno = 0;
+  while(getline(in, line)) {
+    ++lineno;
+    istringstream ls(line);
+    string name, type;
+    if(!(ls >> name) || name[0] == '#')
+      continue;
+    if(!(ls >> type))
+      throw std::runtime_error("No type on line "+to_string(lineno)+" of query list: "+line);
+    try {
+      ret.push_back({makeDNSName(name), makeDNSType(type.c_str())});
+    }
+    catch(std::exception& e) {
+      throw std::runtime_error("Line "+to_string(lineno)+" of query list: "+e.what());
+    }
+  }
+  return ret;
+}
+
+void LoadReport::add(const LoadReport& rhs)
+{
+  elapsed = std::max(elapsed, rhs.elapsed);
+  sent += rhs.sent;
+  answered += rhs.answered;
+  lost += rhs.lost;
+  unexpected += rhs.unexpected;
+  for(unsigned int n = 0; n < 16; ++n)
+    rcodes[n] += rhs.rcodes[n];
+  latency.add(rhs.latency);
+}
+
+std::string LoadReport::toString() const
+{
+  ostringstream ret;
+  char line[200];
+  auto pct = [this](uint64_t n) { return sent ? 100.0 * n / sent : 0.0; };
+  snprintf(line, sizeof(line), "Sent %llu queries in %.2f s, %.0f qps\n", (unsigned long long)sent, elapsed, elapsed > 0 ? sent / elapsed : 0.0);
+  ret << line;
+  snprintf(line, sizeof(line), "Answered %llu (%.2f%%), %.0f qps\n", (unsigned long long)answered, pct(answered), elapsed > 0 ? answered / elapsed : 0.0);
+  ret << line;
+  snprintf(line, sizeof(line), "Lost %llu (%.2f%%), %llu unexpected responses\n", (unsigned long long)lost, pct(lost), (unsigned long long)unexpected);
+  ret << line;
+  ret << "RCodes:";
+  for(unsigned int n = 0; n < 16; ++n) {
+    if(!rcodes[n])
+      continue;
+    string name = ::toString((RCode)n);
+    if(name == "?")
+      name = "RCODE" + to_string(n);
+    snprintf(line, sizeof(line), " %s %llu (%.2f%%)", name.c_str(), (unsigned long long)rcodes[n], answered ? 100.0 * rcodes[n] / answered : 0.0);
+    ret << line;
+  }
+  ret << "\n";
+  if(latency.count()) {
+    snprintf(line, sizeof(line), "Latency usec: p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+             latency.percentile(0.5) / 1000.0, latency.percentile(0.9) / 1000.0,
+             latency.percentile(0.99) / 1000.0, latency.percentile(0.999) / 1000.0, latency.max / 1000.0);
+    ret << line;
+  }
+  return ret.str();
+}
+
+namespace {
+const unsigned int c_batch = 64;
+const unsigned int c_maxpacket = 4096;
+const unsigned int c_randomlen = 12;  //!< characters in the first label of a random name
+
+struct LoadSocket
+{
+  int fd{-1};
+  uint16_t nextid{0};
+  std::vector<uint64_t> sent = std::vector<uint64_t>(65536);  //!< nsec an ID went out at, 0 if free
+  std::deque<std::pair<uint16_t, uint64_t>> order;             //!< in order of sending, to find what timed out
+
+  ~LoadSocket()
+  {
+    if(fd >= 0)
+      close(fd);
+  }
+};
+
+//! One thread's share of the load, which has its own sockets, packets and counts
+class LoadWorker
+{
+public:
+  LoadWorker(const LoadOptions& opts, const std::vector<std::string>& packets, unsigned int idx);
+  void run(uint64_t start);
+  LoadReport d_report;
+
+private:
+  void fillPacket(std::string& packet);
+  bool sendBatch(LoadSocket& s, unsigned int count, uint64_t now);
+  void readSocket(LoadSocket& s);
+  void expire(LoadSocket& s, uint64_t now, bool all);
+
+  const LoadOptions& d_opts;
+  const std::vector<std::string>& d_packets;
+  std::vector<std::unique_ptr<LoadSocket>> d_socks;
+  std::vector<std::string> d_out, d_in;
+  LatencyHistogram d_latency;
+  std::mt19937 d_gen{std::random_device{}()};
+  uint64_t d_pos;
+  double d_qps;
+  unsigned int d_inflight;
+  uint64_t d_outstanding{0};
+};
+
+LoadWorker::LoadWorker(const LoadOptions& opts, const std::vector<std::string>& packets, unsigned int idx) :
+  d_opts(opts), d_packets(packets), d_out(c_batch), d_in(c_batch, std::string(c_maxpacket, 0)), d_pos(idx)
+{
+  // spread the rate and the limit, the first threads get what does not divide evenly
+  d_qps = opts.qps / opts.threads;
+  d_inflight = opts.inflight / opts.threads + (idx < opts.inflight % opts.threads);
+
+  for(unsigned int n = 0; n < opts.sockets; ++n) {
+    auto s = std::make_unique<LoadSocket>();
+    s->fd = socket(opts.server.sin4.sin_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(s->fd < 0)
+      throw std::runtime_error("Creating UDP socket for load: "+string(strerror(errno)));
+    if(connect(s->fd, (struct sockaddr*)&opts.server, opts.server.getSocklen()) < 0)
+      throw std::runtime_error("Connecting UDP socket to "+opts.server.toStringWithPort()+": "+string(strerror(errno)));
+    int bufsize = 1 << 22;  // a best effort, so bursts of responses don't get dropped by our kernel
+    setsockopt(s->fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    s->nextid = d_gen();
+    d_socks.push_back(std::move(s));
+  }
+}
+
+//! The next query from the list, or a fresh random name, with ID 0
+void LoadWorker::fillPacket(std::string& packet)
+{
+  packet = d_packets[d_pos % d_packets.size()];
+  d_pos += d_opts.threads;
+  if(!d_opts.queries.empty())
+    return;
+  static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+  uint64_t r = d_gen() | (uint64_t)d_gen() << 32;
+  // the first label starts right after the header and its length byte
+  for(unsigned int n = 0; n < c_randomlen; ++n, r /= 36)
+    packet[sizeof(dnsheader) + 1 + n] = chars[r % 36];
+}
+
+//! Sends up to count queries on s. False if the socket could take no more
+bool LoadWorker::sendBatch(LoadSocket& s, unsigned int count, uint64_t now)
+{
+  uint16_t ids[c_batch];
+  unsigned int filled = 0;
+  for(; filled < count && filled < c_batch; ++filled) {
+    unsigned int tries;
+    for(tries = 0; tries < 16 && s.sent[s.nextid]; ++tries)
+      ++s.nextid;
+    if(tries == 16)  // this socket has nearly all its IDs out
+      break;
+    ids[filled] = s.nextid++;
+    fillPacket(d_out[filled]);
+    d_out[filled][0] = ids[filled] >> 8;
+    d_out[filled][1] = ids[filled] & 0xff;
+  }
+  if(!filled)
+    return false;
+
+  int done;
+#ifdef __linux__
+  struct mmsghdr msgs[c_batch];
+  struct iovec iovs[c_batch];
+  memset(msgs, 0, sizeof(msgs));
+  for(unsigned int n = 0; n < filled; ++n) {
+    iovs[n].iov_base = &d_out[n][0];
+    iovs[n].iov_len = d_out[n].size();
+    msgs[n].msg_hdr.msg_iov = &iovs[n];
+    msgs[n].msg_hdr.msg_iovlen = 1;
+  }
+  done = sendmmsg(s.fd, msgs, filled, 0);
+#else
+  for(done = 0; done < (int)filled; ++done)
+    if(send(s.fd, d_out[done].c_str(), d_out[done].size(), 0) < 0)
+      break;
+  if(!done)
+    done = -1;
+#endif
+  if(done <= 0)  // full, or the server is unreachable. Either way, try again later
+    return false;
+
+  for(int n = 0; n < done; ++n) {
+    s.sent[ids[n]] = now;
+    s.order.push_back({ids[n], now});
+  }
+  d_outstanding += done;
+  d_report.sent += done;
+  // IDs we did not use are still free
+  s.nextid -= filled - done;
+  return done == (int)filled;
+}
+
+void LoadWorker::readSocket(LoadSocket& s)
+{
+  for(;;) {
+    int got;
+#ifdef __linux__
+    struct mmsghdr msgs[c_batch];
+    struct iovec iovs[c_batch];
+    memset(msgs, 0, sizeof(msgs));
+    for(unsigned int n = 0; n < c_batch; ++n) {
+      iovs[n].iov_base = &d_in[n][0];
+      iovs[n].iov_len = c_maxpacket;
+      msgs[n].msg_hdr.msg_iov = &iovs[n];
+      msgs[n].msg_hdr.msg_iovlen = 1;
+    }
+    got = recvmmsg(s.fd, msgs, c_batch, 0, nullptr);
+#else
+    size_t lens[1];
+    ssize_t len = recv(s.fd, &d_in[0][0], c_maxpacket, 0);
+    got = len < 0 ? -1 : 1;
+    lens[0] = len;
+#endif
+    if(got <= 0)
+      return;
+
+    uint64_t now = nsecNow();
+    for(int n = 0; n < got; ++n) {
+#ifdef __linux__
+      size_t len = msgs[n].msg_len;
+#else
+      size_t len = lens[n];
+#endif
+      const auto* p = (const uint8_t*)d_in[n].c_str();
+      uint16_t id = p[0] << 8 | p[1];
+      if(len < sizeof(dnsheader) || !(p[2] & 0x80) || !s.sent[id]) {
+        d_report.unexpected++;
+        continue;
+      }
+      d_latency.record(now - s.sent[id]);
+      s.sent[id] = 0;
+      --d_outstanding;
+      d_report.answered++;
+      d_report.rcodes[p[3] & 0x0f]++;
+    }
+    if(got < (int)c_batch)
+      return;
+  }
+}
+
+//! Counts queries as lost that were sent before the timeout, or all that are left
+void LoadWorker::expire(LoadSocket& s, uint64_t now, bool all)
+{
+  uint64_t timeout = d_opts.timeout * 1000000000.0;
+  while(!s.order.empty()) {
+    auto& front = s.order.front();
+    if(s.sent[front.first] == front.second) {
+      if(!all && now - front.second < timeout)
+        break;
+      s.sent[front.first] = 0;
+      --d_outstanding;
+      d_report.lost++;
+    }
+    s.order.pop_front();
+  }
+}
+
+void LoadWorker::run(uint64_t start)
+{
+  uint64_t stop = start + d_opts.duration * 1000000000.0;
+  uint64_t drained = stop + d_opts.timeout * 1000000000.0;
+  vector<pollfd> pfds;
+  for(const auto& s : d_socks)
+    pfds.push_back({s->fd, POLLIN, 0});
+
+  unsigned int turn = 0;
+  uint64_t now = nsecNow();
+  bool sending = true;
+  for(;;) {
+    if(sending && now >= stop) {
+      sending = false;
+      d_report.elapsed = (now - start) / 1000000000.0;
+    }
+    if(!sending && (!d_outstanding || now >= drained))
+      break;
+
+    // how many queries should go out now
+    uint64_t due = 0;
+    if(sending) {
+      if(d_qps > 0) {
+        uint64_t target = (now - start) / 1000000000.0 * d_qps + 1;
+        due = target > d_report.sent ? target - d_report.sent : 0;
+      }
+      else
+        due = d_inflight > d_outstanding ? d_inflight - d_outstanding : 0;
+    }
+    // spread over the sockets, a batch at a time, until they can take no more
+    for(unsigned int tries = 0; due && tries < d_socks.size(); ) {
+      auto& s = *d_socks[turn++ % d_socks.size()];
+      uint64_t before = d_report.sent;
+      if(sendBatch(s, std::min<uint64_t>(due, c_batch), now))
+        tries = 0;
+      else
+        ++tries;
+      due -= d_report.sent - before;
+    }
+
+    // wait for responses, or until the next query is due
+    uint64_t wait = 10000000;
+    if(sending && d_qps > 0) {
+      uint64_t next = start + (d_report.sent / d_qps) * 1000000000.0;
+      wait = next > now ? next - now : 0;
+    }
+    if(due)  // sockets are full, give them a moment
+      wait = std::max<uint64_t>(wait, 100000);
+    wait = std::min(wait, (sending ? stop : drained) - std::min(now, sending ? stop : drained));
+    struct timespec ts{(time_t)(wait / 1000000000), (long)(wait % 1000000000)};
+    if(ppoll(&pfds[0], pfds.size(), &ts, nullptr) > 0) {
+      for(unsigned int n = 0; n < pfds.size(); ++n)
+        if(pfds[n].revents)
+          readSocket(*d_socks[n]);
+    }
+    now = nsecNow();
+    for(auto& s : d_socks)
+      expire(*s, now, false);
+  }
+  for(auto& s : d_socks)
+    expire(*s, now, true);
+  d_latency.snapshot(d_report.latency);
+}
+}
+
+LoadReport runLoad(const LoadOptions& opts)
+{
+  if(!opts.threads || !opts.sockets || opts.duration <= 0 || opts.timeout <= 0)
+    throw std::runtime_error("Load needs at least a thread and a socket, and a positive duration and timeout");
+  if(opts.qps <= 0 && opts.inflight < opts.threads)
+    throw std::runtime_error("Closed loop load needs at least one query in flight per thread");
+
+  // packets are made once, only the ID (and for random names, the first label) changes
+  std::vector<std::string> packets;
+  auto make = [&opts](const DNSName& name, DNSType type) {
+    DNSMessageWriter dmw(name, type);
+    dmw.dh.rd = true;
+    if(opts.bufsize)
+      dmw.setEDNS(opts.bufsize, false);
+    return dmw.serialize();
+  };
+  if(opts.queries.empty()) {
+    DNSName name = opts.randomzone;
+    name.push_front(DNSLabel(std::string(c_randomlen, 'a')));
+    packets.push_back(make(name, opts.randomtype));
+  }
+  else {
+    for(const auto& q : opts.queries)
+      packets.push_back(make(q.name, q.type));
+  }
+
+  std::vector<std::unique_ptr<LoadWorker>> workers;
+  for(unsigned int n = 0; n < opts.threads; ++n)
+    workers.push_back(std::make_unique<LoadWorker>(opts, packets, n));
+
+  uint64_t start = nsecNow();
+  std::vector<std::thread> threads;
+  for(auto& w : workers)
+    threads.emplace_back([&w, start]() { w->run(start); });
+  for(auto& t : threads)
+    t.join();
+
+  LoadReport ret;
+  for(const auto& w : workers)
+    ret.add(w->d_report);
+  return ret;
+}
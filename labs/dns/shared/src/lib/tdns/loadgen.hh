@@ -0,0 +1,67 @@
+#pragma once
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <vector>
+#include "comboaddress.hh"
+#include "dns-storage.hh"
+#include "histogram.hh"
+
+/*!
+   @file
+   @brief Defines the load generator of tdig, which sends many queries and measures what comes back, like dnsperf
+*/
+
+//! A question to send, from a query list
+struct LoadQuery
+{
+  DNSName name;
+  DNSType type;
+};
+
+/*! Reads a query list in the format of dnsperf: a name and a type per line. Empty lines
+    and lines starting with # are skipped. Throws on a line it can't parse */
+std::vector<LoadQuery> readQueryList(std::istream& in);
+
+/*! \brief What to send, where, and how fast
+
+   With qps set, queries go out at that rate no matter how many are
+   unanswered (open loop). Otherwise, a new query goes out as soon as one is
+   answered or lost, and at most inflight are unanswered at any time
+   (closed loop). Both are spread evenly over the threads. */
+struct LoadOptions
+{
+  ComboAddress server;
+  std::vector<LoadQuery> queries;  //!< sent in turn, if empty random names below randomzone are sent
+  DNSName randomzone;
+  DNSType randomtype{DNSType::A};
+  double qps{0};                   //!< 0 for closed loop
+  unsigned int inflight{100};
+  double duration{10};             //!< seconds of sending
+  double timeout{1};               //!< seconds after which a query counts as lost
+  unsigned int threads{1};
+  unsigned int sockets{4};         //!< per thread, each has its own source port and 65536 IDs
+  uint16_t bufsize{4000};          //!< EDNS buffer size, 0 to send no EDNS
+};
+
+struct LoadReport
+{
+  double elapsed{0};               //!< seconds of sending
+  uint64_t sent{0};
+  uint64_t answered{0};
+  uint64_t lost{0};                //!< not answered within the timeout
+  uint64_t unexpected{0};          //!< responses with an ID we had no query out for, or late
+  uint64_t rcodes[16]{};
+  LatencyHistogram::Snapshot latency;
+
+  void add(const LoadReport& rhs);
+  //! Achieved qps, loss, rcodes and latency percentiles, for people
+  std::string toString() const;
+};
+
+/*! Sends queries to opts.server for opts.duration seconds, then waits up to opts.timeout
+    for the last answers. Responses are matched to queries by socket and ID.
+
+    Every thread has its own sockets, and sends and receives up to 64 packets
+    per system call with sendmmsg() and recvmmsg() on Linux. */
+LoadReport runLoad(const LoadOptions& opts);
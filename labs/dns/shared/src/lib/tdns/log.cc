@@ -0,0 +1,262 @@
+#include "log.hh"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "timerwheel.hh"
+using namespace std;
+
+/*!
+   @file
+   @brief Implements asynchronous logging, with a ring buffer per thread and a writer thread
+*/
+
+static bool parseLogLevel(const std::string& level, uint8_t& ret)
+{
+  static const char* names[] = {"debug", "info", "warning", "error", "none"};
+  for(uint8_t n = 0; n < sizeof(names) / sizeof(names[0]); ++n) {
+    if(level == names[n]) {
+      ret = n;
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint8_t initialLogLevel()
+{
+  uint8_t ret = (uint8_t)LogLevel::Warning;
+  if(const char* level = getenv("TDNS_LOG")) {
+    if(!parseLogLevel(level, ret))
+      cerr<<"Unknown log level '"<<level<<"' in TDNS_LOG, using 'warning'"<<endl;
+  }
+  return ret;
+}
+
+std::atomic<uint8_t> g_loglevel{initialLogLevel()};
+
+bool setLogLevel(const std::string& level)
+{
+  uint8_t l;
+  if(!parseLogLevel(level, l))
+    return false;
+  g_loglevel = l;
+  return true;
+}
+
+namespace {
+
+/* Written by one thread, read by the writer thread. head and tail only ever go up,
+   and are on different cache lines so the two sides don't slow each other down */
+struct LogRing
+{
+  struct Line
+  {
+    uint64_t usec;
+    LogLevel level;
+    std::unique_ptr<LogArgsBase> args;
+  };
+  static const uint64_t size = 1024;
+  Line lines[size];
+
+  std::atomic<uint64_t> head{0};  //!< next line the thread writes
+  char pad1[64];
+  std::atomic<uint64_t> tail{0};  //!< next line the writer reads
+  char pad2[64];
+  std::atomic<uint64_t> dropped{0};
+  std::atomic<bool> done{false};  //!< the thread exited, no more lines will come
+};
+
+/* Takes the lines from all rings, puts them back in the order they were logged in, and
+   writes them out. Taking the lock is only needed to find the rings and the streams,
+   and for flushLog() */
+class LogWriter
+{
+public:
+  static LogWriter& instance()
+  {
+    static LogWriter lw;
+    return lw;
+  }
+
+  ~LogWriter()
+  {
+    {
+      std::lock_guard<std::mutex> l(d_lock);
+      d_stop = true;
+    }
+    d_cv.notify_all();
+    if(d_thread.joinable())
+      d_thread.join();
+  }
+
+  std::shared_ptr<LogRing> addRing()
+  {
+    auto ring = std::make_shared<LogRing>();
+    std::lock_guard<std::mutex> l(d_lock);
+    if(!d_thread.joinable())
+      d_thread = std::thread(&LogWriter::run, this);
+    d_rings.push_back(ring);
+    return ring;
+  }
+
+  void flush()
+  {
+    std::unique_lock<std::mutex> l(d_lock);
+    if(!d_thread.joinable())
+      return;
+    // the pass that is running now may have missed our lines, the one after it won't
+    uint64_t until = d_passes + 2;
+    d_flushwanted = true;
+    d_cv.notify_all();
+    d_cv.wait(l, [this, until]() { return d_passes >= until || d_stop; });
+  }
+
+  void setStreams(std::ostream& out, std::ostream& err)
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    d_out = &out;
+    d_err = &err;
+  }
+
+  LogStats getStats()
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    LogStats ret;
+    ret.lines = d_lines;
+    ret.dropped = d_dropped;
+    for(const auto& r : d_rings) {
+      ret.dropped += r->dropped;
+      if(!r->done)
+        ret.threads++;
+    }
+    return ret;
+  }
+
+private:
+  void run();
+
+  std::mutex d_lock;
+  std::condition_variable d_cv;
+  std::vector<std::shared_ptr<LogRing>> d_rings;
+  std::thread d_thread;
+  std::ostream* d_out{&std::cout};
+  std::ostream* d_err{&std::cerr};
+  uint64_t d_passes{0};
+  uint64_t d_lines{0};
+  uint64_t d_dropped{0};  //!< of rings that are gone
+  bool d_flushwanted{false};
+  bool d_stop{false};
+};
+
+void LogWriter::run()
+{
+  std::vector<LogRing::Line> batch;
+  uint64_t reported = 0;
+  std::unique_lock<std::mutex> l(d_lock);
+  for(;;) {
+    auto rings = d_rings;
+    bool stop = d_stop;
+    auto out = d_out, err = d_err;
+    l.unlock();
+
+    std::vector<bool> done;
+    uint64_t dropped = 0;
+    for(auto& r : rings) {
+      // if the thread was done before we looked, we are about to see all it logged
+      done.push_back(r->done.load(std::memory_order_acquire));
+      uint64_t head = r->head.load(std::memory_order_acquire);
+      for(uint64_t n = r->tail.load(std::memory_order_relaxed); n != head; ++n)
+        batch.push_back(std::move(r->lines[n % LogRing::size]));
+      r->tail.store(head, std::memory_order_release);
+      dropped += r->dropped;
+    }
+    std::stable_sort(batch.begin(), batch.end(), [](const LogRing::Line& a, const LogRing::Line& b) {
+        return a.usec < b.usec;
+      });
+    bool wrote = !batch.empty();
+    for(const auto& line : batch) {
+      auto& os = line.level >= LogLevel::Warning ? *err : *out;
+      line.args->format(os);
+      os << '\n';
+    }
+    size_t lines = batch.size();
+    batch.clear();
+
+    l.lock();
+    dropped += d_dropped;
+    if(dropped > reported) {
+      *err << "Dropped "<<dropped - reported<<" log lines, the log writer could not keep up"<<'\n';
+      reported = dropped;
+      wrote = true;
+    }
+    if(wrote) {
+      out->flush();
+      err->flush();
+    }
+    d_lines += lines;
+    for(size_t n = rings.size(); n-- > 0; ) {
+      if(done[n]) {
+        d_dropped += rings[n]->dropped;
+        d_rings.erase(std::find(d_rings.begin(), d_rings.end(), rings[n]));
+      }
+    }
+    d_passes++;
+    d_cv.notify_all();
+    if(stop)
+      break;
+    if(!wrote && !d_flushwanted)
+      d_cv.wait_for(l, std::chrono::milliseconds(10), [this]() { return d_stop || d_flushwanted; });
+    d_flushwanted = false;
+  }
+}
+
+//! Lets the writer know when the thread is gone, so it can forget the ring once it is empty
+struct RingHolder
+{
+  ~RingHolder()
+  {
+    if(ring)
+      ring->done.store(true, std::memory_order_release);
+  }
+  std::shared_ptr<LogRing> ring;
+};
+
+thread_local RingHolder t_ring;
+}
+
+void pushLogLine(LogLevel level, std::unique_ptr<LogArgsBase>&& args)
+{
+  if(!t_ring.ring)
+    t_ring.ring = LogWriter::instance().addRing();
+  LogRing& r = *t_ring.ring;
+  uint64_t head = r.head.load(std::memory_order_relaxed);
+  if(head - r.tail.load(std::memory_order_acquire) == LogRing::size) {
+    r.dropped.store(r.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return;
+  }
+  auto& line = r.lines[head % LogRing::size];
+  line.usec = usecNow();
+  line.level = level;
+  line.args = std::move(args);
+  r.head.store(head + 1, std::memory_order_release);
+}
+
+void flushLog()
+{
+  LogWriter::instance().flush();
+}
+
+void setLogStreams(std::ostream& out, std::ostream& err)
+{
+  LogWriter::instance().setStreams(out, err);
+}
+
+LogStats getLogStats()
+{
+  return LogWriter::instance().getStats();
+}
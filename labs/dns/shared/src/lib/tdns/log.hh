@@ -0,0 +1,111 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+/*!
+   @file
+   @brief Defines asynchronous, leveled logging, which keeps iostreams off the query path
+*/
+
+/*! \brief How important a log line is
+
+   Debug is for traces of how a query was handled, Info for a line or two per
+   query, Warning and Error for things an operator should look at. Warning and
+   Error go to stderr, the rest to stdout. */
+enum class LogLevel : uint8_t { Debug, Info, Warning, Error, None };
+
+/*! Lines below this level are not even compiled in. Build with -DTDNS_LOG_MIN=1 to
+    drop all Debug lines */
+#ifndef TDNS_LOG_MIN
+#define TDNS_LOG_MIN 0
+#endif
+
+/*! Lines below this level are skipped at runtime. Starts at Warning, or what the
+    TDNS_LOG environment variable says (debug, info, warning, error or none) */
+extern std::atomic<uint8_t> g_loglevel;
+
+//! Sets g_loglevel by name, returns false if there is no such level
+bool setLogLevel(const std::string& level);
+
+//! If this is false, nothing needs to be formatted, copied or locked for a line of this level
+inline bool logEnabled(LogLevel level)
+{
+  return (int)level >= TDNS_LOG_MIN && (uint8_t)level >= g_loglevel.load(std::memory_order_relaxed);
+}
+
+/*! \brief Logs the arguments, printed after each other like with operator<<
+
+   The arguments are only evaluated if the level is enabled, so at the default
+   level, a Debug line costs a single relaxed load. Example:
+
+   TLOG(Info, "Received a query from ", remote.toStringWithPort(), " for ", qname);
+
+   There is no endl, every call is one line. */
+#define TLOG(level, ...) do { if(logEnabled(LogLevel::level)) logLine(LogLevel::level, __VA_ARGS__); } while(0)
+
+//! A line that has not been formatted yet
+struct LogArgsBase
+{
+  virtual ~LogArgsBase() = default;
+  virtual void format(std::ostream& os) const = 0;
+};
+
+/*! What a line keeps of an argument. It is formatted later, on another thread, so
+    everything is copied. The exceptions are string literals, which live forever,
+    and C strings, which may not (think of e.what()), so they become a std::string. */
+template<typename T> struct LogStored { using type = std::decay_t<T>; };
+template<> struct LogStored<const char*> { using type = std::string; };
+template<> struct LogStored<char*> { using type = std::string; };
+template<std::size_t N> struct LogStored<const char[N]> { using type = const char*; };
+template<std::size_t N> struct LogStored<char[N]> { using type = std::string; };
+
+template<typename... T>
+struct LogArgs : LogArgsBase
+{
+  template<typename... A>
+  explicit LogArgs(A&&... args) : d_args(std::forward<A>(args)...) {}
+
+  void format(std::ostream& os) const override
+  {
+    formatAll(os, std::index_sequence_for<T...>());
+  }
+
+  template<std::size_t... I>
+  void formatAll(std::ostream& os, std::index_sequence<I...>) const
+  {
+    (void)std::initializer_list<int>{(os << std::get<I>(d_args), 0)...};
+  }
+
+  std::tuple<T...> d_args;
+};
+
+/*! Hands the line to the ring buffer of this thread, which takes no lock. If the ring
+    is full because the writer thread can't keep up, the line is dropped and counted */
+void pushLogLine(LogLevel level, std::unique_ptr<LogArgsBase>&& args);
+
+//! Use TLOG() instead, which skips the arguments if level is not enabled
+template<typename... Args>
+void logLine(LogLevel level, Args&&... args)
+{
+  pushLogLine(level, std::make_unique<LogArgs<typename LogStored<std::remove_reference_t<Args>>::type...>>(std::forward<Args>(args)...));
+}
+
+//! Waits until the writer thread has written everything that was logged before this call
+void flushLog();
+
+//! Where the writer thread writes to, std::cout and std::cerr by default. Mostly for testing
+void setLogStreams(std::ostream& out, std::ostream& err);
+
+struct LogStats
+{
+  uint64_t lines{0};    //!< written
+  uint64_t dropped{0};  //!< because a ring was full
+  uint64_t threads{0};  //!< that have a ring now
+};
+LogStats getLogStats();
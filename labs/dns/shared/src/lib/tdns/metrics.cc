@@ -0,0 +1,185 @@
+#include "metrics.hh"
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include "sclasses.hh"
+#include "log.hh"
+using namespace std;
+
+/*!
+   @file
+   @brief Implements the query metrics and their HTTP endpoint
+*/
+
+//! Threads get consecutive slots, so up to c_slots threads never share one
+Metrics::Slot& Metrics::mySlot()
+{
+  static std::atomic<unsigned int> threads{0};
+  thread_local unsigned int slot = threads++ % c_slots;
+  return d_slots[slot];
+}
+
+void Metrics::query(Transport transport, DNSType qtype, bool edns, bool dnssecok)
+{
+  auto& s = mySlot();
+  s.queries[(int)transport].fetch_add(1, std::memory_order_relaxed);
+  s.qtypes[std::min((unsigned int)qtype, 256U)].fetch_add(1, std::memory_order_relaxed);
+  if(edns)
+    s.edns.fetch_add(1, std::memory_order_relaxed);
+  if(dnssecok)
+    s.dnssecok.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::response(RCode rcode, bool truncated)
+{
+  auto& s = mySlot();
+  s.rcodes[(unsigned int)rcode & 0xf].fetch_add(1, std::memory_order_relaxed);
+  if(truncated)
+    s.truncated.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::addGauge(const std::string& name, const std::string& help, std::function<double()> get)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  d_gauges.push_back({name, help, get});
+}
+
+void Metrics::addPage(const std::string& path, std::function<std::string()> get)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  d_pages[path] = get;
+}
+
+Metrics::Totals Metrics::getTotals() const
+{
+  Totals ret;
+  auto add = [](uint64_t* to, const std::atomic<uint64_t>* from, size_t n) {
+    for(size_t i = 0; i < n; ++i)
+      to[i] += from[i].load(std::memory_order_relaxed);
+  };
+  for(const auto& s : d_slots) {
+    add(ret.queries, s.queries, 2);
+    add(ret.qtypes, s.qtypes, 257);
+    add(ret.rcodes, s.rcodes, 16);
+    add(&ret.truncated, &s.truncated, 1);
+    add(&ret.dropped, &s.dropped, 1);
+    add(&ret.edns, &s.edns, 1);
+    add(&ret.dnssecok, &s.dnssecok, 1);
+    add(&ret.cachehits, &s.cachehits, 1);
+    add(&ret.cachemisses, &s.cachemisses, 1);
+  }
+  for(auto r : ret.rcodes)
+    ret.responses += r;
+  return ret;
+}
+
+//! The name of a type or rcode if it has one, otherwise its number like in RFC 3597
+template<typename T>
+static std::string label(T val, const char* unknown)
+{
+  std::string ret = toString(val);
+  if(ret == "?")
+    ret = unknown + std::to_string((unsigned int)val);
+  return ret;
+}
+
+std::string Metrics::prometheus() const
+{
+  auto t = getTotals();
+  ostringstream ret;
+  ret << std::setprecision(15);
+  auto head = [&](const char* name, const char* type, const char* help) {
+    ret << "# HELP " << d_prefix << "_" << name << " " << help << "\n";
+    ret << "# TYPE " << d_prefix << "_" << name << " " << type << "\n";
+  };
+  auto counter = [&](const char* name, const char* help, uint64_t val) {
+    head(name, "counter", help);
+    ret << d_prefix << "_" << name << " " << val << "\n";
+  };
+
+  head("queries_total", "counter", "Queries received, by transport");
+  ret << d_prefix << "_queries_total{transport=\"udp\"} " << t.queries[(int)Transport::UDP] << "\n";
+  ret << d_prefix << "_queries_total{transport=\"tcp\"} " << t.queries[(int)Transport::TCP] << "\n";
+
+  head("queries_by_type_total", "counter", "Queries received, by query type");
+  for(unsigned int n = 0; n < 257; ++n) {
+    if(t.qtypes[n])
+      ret << d_prefix << "_queries_by_type_total{qtype=\"" << (n < 256 ? label((DNSType)n, "TYPE") : "other") << "\"} " << t.qtypes[n] << "\n";
+  }
+
+  head("responses_total", "counter", "Responses sent, by rcode");
+  for(unsigned int n = 0; n < 16; ++n) {
+    if(t.rcodes[n])
+      ret << d_prefix << "_responses_total{rcode=\"" << label((RCode)n, "RCODE") << "\"} " << t.rcodes[n] << "\n";
+  }
+
+  counter("truncated_total", "Responses sent with the TC bit", t.truncated);
+  counter("dropped_total", "Queries that did not get a response", t.dropped);
+  counter("edns_queries_total", "Queries with an EDNS OPT record", t.edns);
+  counter("dnssec_ok_queries_total", "Queries with the EDNS DO bit", t.dnssecok);
+  counter("cache_hits_total", "Queries answered without asking a nameserver", t.cachehits);
+  counter("cache_misses_total", "Queries that needed nameservers to be asked", t.cachemisses);
+
+  std::lock_guard<std::mutex> l(d_lock);
+  for(const auto& g : d_gauges) {
+    head(g.name.c_str(), "gauge", g.help.c_str());
+    ret << d_prefix << "_" << g.name << " " << g.get() << "\n";
+  }
+  return ret.str();
+}
+
+/* Just enough HTTP/1.0 for Prometheus and curl: one request per connection, we read
+   the request line and headers, and close after the response */
+ComboAddress Metrics::serve(const ComboAddress& local)
+{
+  auto listener = std::make_shared<Socket>(local.sin4.sin_family, SOCK_STREAM);
+  SSetsockopt(*listener, SOL_SOCKET, SO_REUSEADDR, 1);
+  SBind(*listener, local);
+  SListen(*listener, 10);
+  ComboAddress ret(local);
+  SGetsockname(*listener, ret);
+
+  std::thread([this, listener, local]() {
+      for(;;) {
+        ComboAddress remote(local);
+        try {
+          Socket sock(SAccept(*listener, remote));
+          SocketCommunicator sc(sock);
+          sc.setTimeout(2);
+          string request, line;
+          if(!sc.getLine(request))
+            continue;
+          while(sc.getLine(line) && line != "\r\n" && line != "\n")
+            ;
+          istringstream iss(request);
+          string method, path;
+          iss >> method >> path;
+          string status = "200 OK", type = "text/plain; version=0.0.4", body;
+          std::function<std::string()> page;
+          {
+            std::lock_guard<std::mutex> l(d_lock);
+            auto iter = d_pages.find(path);
+            if(iter != d_pages.end())
+              page = iter->second;
+          }
+          if(method != "GET")
+            status = "405 Method Not Allowed";
+          else if(path == "/metrics" || path == "/")
+            body = prometheus();
+          else if(page) {
+            body = page();
+            type = "text/plain";
+          }
+          else
+            status = "404 Not Found";
+          sc.writen("HTTP/1.0 " + status + "\r\nContent-Type: " + type + "\r\nContent-Length: " +
+                    std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body);
+        }
+        catch(std::exception& e) {
+          TLOG(Warning, "Unable to serve metrics to ", remote.toStringWithPort(), ": ", e.what());
+        }
+      }
+    }).detach();
+  return ret;
+}
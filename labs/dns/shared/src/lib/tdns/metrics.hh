@@ -0,0 +1,112 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "comboaddress.hh"
+#include "record-types.hh"
+
+/*!
+   @file
+   @brief Defines Metrics, counters for what a server does, and the endpoint to read them from
+*/
+
+/*! \brief Counts queries and answers, without making the threads that do so wait for each other
+
+   Every thread counts in its own slot, which is padded so no two slots share a
+   cache line. The counters are only added up when they are read, by
+   getTotals() or prometheus(). There are a fixed number of slots. If there
+   are more threads than that, some share a slot, which is still correct
+   because the counters are atomic, just a bit slower.
+
+   Things that are counted somewhere else already, like the hit ratio of a
+   cache, can be added as a gauge with addGauge().
+
+   serve() makes the numbers available over HTTP in the Prometheus text
+   format, so any Prometheus or a plain curl can collect them.
+
+   This class can be shared between threads. */
+class Metrics
+{
+public:
+  //! prefix goes in front of every metric name, like 'tres' for tres_queries_total
+  explicit Metrics(std::string prefix) : d_prefix(std::move(prefix)) {}
+
+  enum class Transport : uint8_t { UDP, TCP };
+
+  //! A query came in. edns is true if it had an OPT record, dnssecok if that had the DO bit
+  void query(Transport transport, DNSType qtype, bool edns, bool dnssecok);
+  //! An answer went out
+  void response(RCode rcode, bool truncated);
+  //! A query was not answered, because it was broken or we were too busy
+  void drop() { bump(&Slot::dropped); }
+  //! The answer came from the cache, or we had to ask nameservers for it
+  void cache(bool hit) { bump(hit ? &Slot::cachehits : &Slot::cachemisses); }
+
+  //! Adds a number that is kept elsewhere, get is called from whichever thread reads the metrics
+  void addGauge(const std::string& name, const std::string& help, std::function<double()> get);
+  //! Makes serve() answer requests for path, like "/latency", with what get returns as plain text
+  void addPage(const std::string& path, std::function<std::string()> get);
+
+  struct Totals
+  {
+    uint64_t queries[2]{};   //!< by Transport
+    uint64_t qtypes[257]{};  //!< by qtype, 256 is everything above 255
+    uint64_t rcodes[16]{};
+    uint64_t responses{0};
+    uint64_t truncated{0};
+    uint64_t dropped{0};
+    uint64_t edns{0};
+    uint64_t dnssecok{0};
+    uint64_t cachehits{0};
+    uint64_t cachemisses{0};
+  };
+  Totals getTotals() const;
+
+  //! All metrics in the Prometheus text exposition format
+  std::string prometheus() const;
+
+  /*! Starts a thread that answers HTTP requests for /metrics on local with prometheus(),
+      and for the paths added with addPage().
+      Returns the address it listens on, which has the actual port if local had port 0.
+      Throws if it can't listen there */
+  ComboAddress serve(const ComboAddress& local);
+
+private:
+  static const unsigned int c_slots = 64;
+  struct Slot
+  {
+    char pad1[64];
+    std::atomic<uint64_t> queries[2];
+    std::atomic<uint64_t> qtypes[257];
+    std::atomic<uint64_t> rcodes[16];
+    std::atomic<uint64_t> truncated;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> edns;
+    std::atomic<uint64_t> dnssecok;
+    std::atomic<uint64_t> cachehits;
+    std::atomic<uint64_t> cachemisses;
+    char pad2[64];
+  };
+  Slot& mySlot();
+  void bump(std::atomic<uint64_t> Slot::*counter)
+  {
+    (mySlot().*counter).fetch_add(1, std::memory_order_relaxed);
+  }
+
+  struct Gauge
+  {
+    std::string name;
+    std::string help;
+    std::function<double()> get;
+  };
+
+  std::string d_prefix;
+  Slot d_slots[c_slots]{};
+  mutable std::mutex d_lock;  //!< for d_gauges and d_pages only
+  std::vector<Gauge> d_gauges;
+  std::map<std::string, std::function<std::string()>> d_pages;
+};
@@ -0,0 +1,125 @@
+#include "negcache.hh"
+#include "snapshot.hh"
+using namespace std;
+
+/*!
+   @file
+   @brief Implements the NXDOMAIN/NODATA cache
+*/
+
+void NegativeCache::add(const DNSName& name, DNSType type, Entry&& entry, time_t now)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  if(d_entries.size() >= d_maxentries) {
+    purgeLocked(now);
+    if(d_entries.size() >= d_maxentries) // still full, don't make it worse
+      return;
+  }
+  d_entries[{name, type}] = std::move(entry);
+}
+
+void NegativeCache::addNxdomain(const DNSName& name, const DNSName& zone, const SOAGen& soa, uint32_t soattl, time_t now)
+{
+  uint32_t ttl = min(getTTL(soattl, soa), d_maxttl);
+  add(name, DNSType::ANY, Entry{Kind::Nxdomain, name, zone, std::make_shared<SOAGen>(soa), now + ttl}, now);
+}
+
+void NegativeCache::addNodata(const DNSName& name, DNSType type, const DNSName& zone, const SOAGen& soa, uint32_t soattl, time_t now)
+{
+  uint32_t ttl = min(getTTL(soattl, soa), d_maxttl);
+  add(name, type, Entry{Kind::Nodata, name, zone, std::make_shared<SOAGen>(soa), now + ttl}, now);
+}
+
+/* First we check if we know about this exact name and type. If not, we walk up
+   the tree to see if this name or any of its parents is known not to exist. 
+   Expired entries are ignored here, and cleaned up by purge() */
+bool NegativeCache::get(const DNSName& name, DNSType type, Entry& entry, time_t now)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  auto valid = [this, now](decltype(d_entries)::const_iterator i, Kind kind) {
+    return i != d_entries.end() && i->second.kind == kind && i->second.expire > now;
+  };
+
+  auto iter = d_entries.find({name, type});
+  if(!valid(iter, Kind::Nodata)) {
+    DNSName parent(name);
+    for(;;) {
+      iter = d_entries.find({parent, DNSType::ANY});
+      if(valid(iter, Kind::Nxdomain) || parent.empty())
+        break;
+      parent.pop_front();
+    }
+    if(!valid(iter, Kind::Nxdomain)) {
+      ++d_misses;
+      return false;
+    }
+  }
+  ++d_hits;
+  entry = iter->second;
+  return true;
+}
+
+void NegativeCache::purgeLocked(time_t now)
+{
+  for(auto iter = d_entries.begin(); iter != d_entries.end(); ) {
+    if(iter->second.expire <= now)
+      iter = d_entries.erase(iter);
+    else
+      ++iter;
+  }
+}
+
+void NegativeCache::purge(time_t now)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  purgeLocked(now);
+}
+
+size_t NegativeCache::size()
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  return d_entries.size();
+}
+
+void NegativeCache::save(SnapshotWriter& sw, time_t now)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  purgeLocked(now);
+  sw.putUInt32(d_entries.size());
+  for(const auto& e : d_entries) {
+    sw.putName(e.first.first);
+    sw.putUInt16((uint16_t)e.first.second);
+    sw.putUInt8((uint8_t)e.second.kind);
+    sw.putName(e.second.name);
+    sw.putName(e.second.zone);
+    sw.putUInt64(e.second.expire);
+    const auto& soa = *e.second.soa;
+    sw.putName(soa.d_mname);
+    sw.putName(soa.d_rname);
+    for(uint32_t val : {soa.d_serial, soa.d_refresh, soa.d_retry, soa.d_expire, soa.d_minimum})
+      sw.putUInt32(val);
+  }
+}
+
+size_t NegativeCache::load(SnapshotReader& sr, time_t now)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  size_t ret = 0;
+  for(uint32_t count = sr.getUInt32(); count; --count) {
+    DNSName name = sr.getName();
+    DNSType type = (DNSType)sr.getUInt16();
+    Entry e;
+    e.kind = (Kind)sr.getUInt8();
+    e.name = sr.getName();
+    e.zone = sr.getName();
+    e.expire = sr.getUInt64();
+    DNSName mname = sr.getName(), rname = sr.getName();
+    uint32_t vals[5];
+    for(auto& val : vals)
+      val = sr.getUInt32();
+    e.soa = std::make_shared<SOAGen>(mname, rname, vals[0], vals[1], vals[2], vals[3], vals[4]);
+    if(e.expire > now && d_entries.size() < d_maxentries && d_entries.insert({{name, type}, e}).second)
+      ++ret;
+  }
+  return ret;
+}
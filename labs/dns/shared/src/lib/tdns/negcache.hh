@@ -0,0 +1,79 @@
+#pragma once
+#include <ctime>
+#include <map>
+#include <mutex>
+#include "dns-storage.hh"
+#include "record-types.hh"
+
+class SnapshotWriter;
+class SnapshotReader;
+
+/*!
+   @file
+   @brief Defines NegativeCache, which remembers NXDOMAIN and NODATA answers
+*/
+
+/*! \brief Remembers that a name, or a type at a name, does not exist
+
+   Negative answers are cached for as long as RFC 2308 allows, which is the
+   lower of the TTL of the SOA record in the authority section and its
+   'minimum' field.
+
+   Following RFC 8020, an NXDOMAIN for a name also means that nothing below
+   that name exists. So once 'nosuch.example.com' is known not to exist, a query
+   for 'www.nosuch.example.com' is answered from this cache as well. This is what
+   stops random subdomain floods from all ending up at the authoritative servers.
+
+   This class does its own locking and can be shared between threads. */
+class NegativeCache
+{
+public:
+  enum class Kind { Nxdomain, Nodata };
+
+  //! What we know about a name that does not exist
+  struct Entry
+  {
+    Kind kind{Kind::Nxdomain};
+    DNSName name;    //!< the name that was denied, can be a parent of what was asked
+    DNSName zone;    //!< owner of the SOA record
+    std::shared_ptr<SOAGen> soa; //!< the SOA record itself, to put in the authority section
+    time_t expire{0};
+
+    //! How many seconds this entry is still valid
+    uint32_t ttl(time_t now) const { return expire > now ? expire - now : 0; }
+  };
+
+  //! Remember that name does not exist at all
+  void addNxdomain(const DNSName& name, const DNSName& zone, const SOAGen& soa, uint32_t soattl, time_t now=time(nullptr));
+  //! Remember that name exists, but has no records of type
+  void addNodata(const DNSName& name, DNSType type, const DNSName& zone, const SOAGen& soa, uint32_t soattl, time_t now=time(nullptr));
+
+  //! Returns true if name|type is known not to exist, also for names below an NXDOMAIN
+  bool get(const DNSName& name, DNSType type, Entry& entry, time_t now=time(nullptr));
+
+  //! Removes all expired entries
+  void purge(time_t now=time(nullptr));
+  size_t size();
+
+  //! Adds all entries that have not expired to a snapshot
+  void save(SnapshotWriter& sw, time_t now=time(nullptr));
+  //! Reads what save() wrote, skipping what has expired since. Returns how many entries were loaded
+  size_t load(SnapshotReader& sr, time_t now=time(nullptr));
+
+  //! RFC 2308 section 5: the negative TTL is the lower of the SOA TTL and its minimum field
+  static uint32_t getTTL(uint32_t soattl, const SOAGen& soa)
+  {
+    return std::min(soattl, soa.d_minimum);
+  }
+
+  uint32_t d_maxttl{10800};      //!< RFC 2308 recommends not caching negative answers longer than 3 hours
+  size_t d_maxentries{100000};   //!< beyond this, we stop adding entries that are not expired
+  uint64_t d_hits{0}, d_misses{0};
+
+private:
+  void add(const DNSName& name, DNSType type, Entry&& entry, time_t now);
+  void purgeLocked(time_t now);
+  // NXDOMAINs are stored with type ANY, since they deny all types
+  std::map<std::pair<DNSName, DNSType>, Entry> d_entries;
+  std::mutex d_lock;
+};
@@ -0,0 +1,98 @@
+#undef _FORTIFY_SOURCE  // that turns read() into an inline function, which we can't replace
+#include "opcount.hh"
+#include <cstdlib>
+#include <dlfcn.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+/*!
+   @file
+   @brief Implements counting heap allocations and syscalls, by replacing the functions of the C library
+*/
+
+//! Plain data, so access needs no initialization, not even from within malloc
+static thread_local OpCounts t_counts;
+
+OpCounts opCounts()
+{
+  return t_counts;
+}
+
+#if defined(__GLIBC__) && defined(__linux__)
+
+bool opCountsSupported()
+{
+  return true;
+}
+
+/* glibc lets programs replace malloc, and calls the replacement from within the
+   C library and libstdc++ too. Its own versions remain available under these names */
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t nmemb, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+
+void* malloc(size_t size)
+{
+  ++t_counts.allocs;
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+  ++t_counts.allocs;
+  return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+  ++t_counts.allocs;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr)
+{
+  if(ptr)
+    ++t_counts.frees;
+  __libc_free(ptr);
+}
+
+/* Counts, then calls the function of the C library by the same name. dlsym() is only
+   called the first time, and does not use the functions replaced here */
+#define COUNTED(ret, name, params, args)                                  \
+  ret name params                                                         \
+  {                                                                       \
+    ++t_counts.syscalls;                                                  \
+    static auto real = (ret (*) params)dlsym(RTLD_NEXT, #name);           \
+    return real args;                                                     \
+  }
+
+COUNTED(ssize_t, read, (int fd, void* buf, size_t count), (fd, buf, count))
+COUNTED(ssize_t, write, (int fd, const void* buf, size_t count), (fd, buf, count))
+COUNTED(ssize_t, recv, (int fd, void* buf, size_t len, int flags), (fd, buf, len, flags))
+COUNTED(ssize_t, send, (int fd, const void* buf, size_t len, int flags), (fd, buf, len, flags))
+COUNTED(ssize_t, recvfrom, (int fd, void* buf, size_t len, int flags, struct sockaddr* from, socklen_t* fromlen), (fd, buf, len, flags, from, fromlen))
+COUNTED(ssize_t, sendto, (int fd, const void* buf, size_t len, int flags, const struct sockaddr* to, socklen_t tolen), (fd, buf, len, flags, to, tolen))
+COUNTED(ssize_t, recvmsg, (int fd, struct msghdr* msg, int flags), (fd, msg, flags))
+COUNTED(ssize_t, sendmsg, (int fd, const struct msghdr* msg, int flags), (fd, msg, flags))
+COUNTED(int, recvmmsg, (int fd, struct mmsghdr* msgs, unsigned int vlen, int flags, struct timespec* timeout), (fd, msgs, vlen, flags, timeout))
+COUNTED(int, sendmmsg, (int fd, struct mmsghdr* msgs, unsigned int vlen, int flags), (fd, msgs, vlen, flags))
+COUNTED(int, poll, (struct pollfd* fds, nfds_t nfds, int timeout), (fds, nfds, timeout))
+COUNTED(int, ppoll, (struct pollfd* fds, nfds_t nfds, const struct timespec* timeout, const sigset_t* sigmask), (fds, nfds, timeout, sigmask))
+COUNTED(int, epoll_wait, (int epfd, struct epoll_event* events, int maxevents, int timeout), (epfd, events, maxevents, timeout))
+}
+
+#else
+
+bool opCountsSupported()
+{
+  return false;
+}
+
+#endif
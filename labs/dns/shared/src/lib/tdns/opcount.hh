@@ -0,0 +1,48 @@
+#pragma once
+#include <cstdint>
+
+/*!
+   @file
+   @brief Defines counting heap allocations and syscalls, to keep budgets for them in tests and benchmarks
+*/
+
+/*! \brief Heap allocations and socket syscalls done by the current thread
+
+   Linking opcount.o into a program replaces malloc(), calloc(), realloc() and
+   free(), and with that new and delete, by versions that count before they call
+   those of the C library. The same goes for the syscalls a DNS server does per
+   query: read(), write(), send(), recv() and their *to, *from, *msg and *mmsg
+   versions, poll(), ppoll() and epoll_wait(). Programs that don't link it are
+   not affected, so this is only in testrunner and benchrunner.
+
+   The counts are per thread, so work done by other threads at the same time
+   does not show up. Measure by taking opCounts() before and after:
+
+   \code
+   OpCounts before = opCounts();
+   answerQuery();
+   OpCounts used = opCounts() - before;
+   \endcode
+
+   Replacing malloc needs glibc, and counting syscalls needs Linux. Elsewhere,
+   opCountsSupported() is false and the counts stay 0. */
+struct OpCounts
+{
+  uint64_t allocs{0};    //!< malloc, calloc and realloc calls, including those of new
+  uint64_t frees{0};     //!< free calls with a pointer that was not null
+  uint64_t syscalls{0};  //!< of the calls listed above
+
+  OpCounts operator-(const OpCounts& rhs) const
+  {
+    OpCounts ret;
+    ret.allocs = allocs - rhs.allocs;
+    ret.frees = frees - rhs.frees;
+    ret.syscalls = syscalls - rhs.syscalls;
+    return ret;
+  }
+};
+
+//! What the current thread did since it started
+OpCounts opCounts();
+//! Are allocations and syscalls counted on this platform?
+bool opCountsSupported();
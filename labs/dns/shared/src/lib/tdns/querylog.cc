@@ -0,0 +1,506 @@
+#include "querylog.hh"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "log.hh"
+#include "timerwheel.hh"
+using namespace std;
+
+/*!
+   @file
+   @brief Implements the query log, with a ring buffer per thread and a writer thread
+*/
+
+void QueryLogRecord::setQName(const DNSName& name)
+{
+  qnamelen = 0;
+  for(const auto& l : name) {
+    if(qnamelen + 1 + l.size() + 1 > sizeof(qname))
+      break; // can't happen for a name that came out of a packet
+    qname[qnamelen++] = l.size();
+    memcpy(qname + qnamelen, l.d_s.c_str(), l.size());
+    qnamelen += l.size();
+  }
+  qname[qnamelen++] = 0;
+}
+
+DNSName QueryLogRecord::getQName() const
+{
+  DNSName ret;
+  for(unsigned int pos = 0; pos < qnamelen && qname[pos]; pos += 1 + qname[pos]) {
+    if(pos + 1 + qname[pos] > qnamelen)
+      throw std::runtime_error("Query log record has a broken qname");
+    ret.push_back(std::string((const char*)qname + pos + 1, qname[pos]));
+  }
+  return ret;
+}
+
+static const char c_magic[] = "TQL1";
+
+std::string queryLogHeader()
+{
+  return std::string(c_magic, 4);
+}
+
+namespace {
+void putBE(std::string& out, uint64_t val, int bytes)
+{
+  while(bytes--)
+    out.append(1, (char)(val >> (8 * bytes)));
+}
+
+uint64_t getBE(const std::string& in, unsigned int& pos, int bytes)
+{
+  if(pos + bytes > in.size())
+    throw std::runtime_error("Query log record is too short");
+  uint64_t ret = 0;
+  while(bytes--)
+    ret = (ret << 8) | (uint8_t)in[pos++];
+  return ret;
+}
+}
+
+/* All in network byte order:
+   length (2), usec (8), latency (4), family (1, 4 or 6), address (4 or 16), port (2),
+   qtype (2), rcode (1), flags (1), size (2), qname length (1), qname.
+   The length covers everything after itself */
+std::string serializeQueryLogRecord(const QueryLogRecord& r)
+{
+  std::string ret;
+  ret.reserve(48 + r.qnamelen);
+  putBE(ret, 0, 2);
+  putBE(ret, r.usec, 8);
+  putBE(ret, r.latency, 4);
+  if(r.client.sin4.sin_family == AF_INET6) {
+    putBE(ret, 6, 1);
+    ret.append((const char*)&r.client.sin6.sin6_addr.s6_addr, 16);
+  }
+  else {
+    putBE(ret, 4, 1);
+    ret.append((const char*)&r.client.sin4.sin_addr.s_addr, 4);
+  }
+  putBE(ret, ntohs(r.client.sin4.sin_port), 2);
+  putBE(ret, r.qtype, 2);
+  putBE(ret, r.rcode, 1);
+  putBE(ret, r.flags, 1);
+  putBE(ret, r.size, 2);
+  putBE(ret, r.qnamelen, 1);
+  ret.append((const char*)r.qname, r.qnamelen);
+  ret[0] = (ret.size() - 2) >> 8;
+  ret[1] = (ret.size() - 2) & 0xff;
+  return ret;
+}
+
+QueryLogReader::QueryLogReader(std::istream& in) : d_in(in)
+{
+  char magic[4];
+  if(!d_in.read(magic, 4) || memcmp(magic, c_magic, 4))
+    throw std::runtime_error("Not a query log");
+}
+
+bool QueryLogReader::get(QueryLogRecord& r)
+{
+  unsigned char len[2];
+  if(!d_in.read((char*)len, 2))
+    return false;
+  std::string in(len[0] * 256 + len[1], '\0');
+  if(!d_in.read(&in[0], in.size()))
+    throw std::runtime_error("Query log ends in the middle of a record");
+
+  unsigned int pos = 0;
+  r.usec = getBE(in, pos, 8);
+  r.latency = getBE(in, pos, 4);
+  auto family = getBE(in, pos, 1);
+  if(family == 6) {
+    r.client = ComboAddress("::");
+    if(pos + 16 > in.size())
+      throw std::runtime_error("Query log record is too short");
+    memcpy(&r.client.sin6.sin6_addr.s6_addr, &in[pos], 16);
+    pos += 16;
+  }
+  else if(family == 4) {
+    r.client = ComboAddress("0.0.0.0");
+    if(pos + 4 > in.size())
+      throw std::runtime_error("Query log record is too short");
+    memcpy(&r.client.sin4.sin_addr.s_addr, &in[pos], 4);
+    pos += 4;
+  }
+  else
+    throw std::runtime_error("Query log record has unknown address family "+std::to_string(family));
+  r.client.sin4.sin_port = htons(getBE(in, pos, 2));
+  r.qtype = getBE(in, pos, 2);
+  r.rcode = getBE(in, pos, 1);
+  r.flags = getBE(in, pos, 1);
+  r.size = getBE(in, pos, 2);
+  r.qnamelen = getBE(in, pos, 1);
+  if(pos + r.qnamelen > in.size())
+    throw std::runtime_error("Query log record is too short");
+  memcpy(r.qname, &in[pos], r.qnamelen);
+  // anything after this was added by a later version
+  return true;
+}
+
+namespace {
+
+//! Written by one thread, read by the writer thread, like the rings of the log
+struct QueryRing
+{
+  static const uint64_t size = 1024;
+  QueryLogRecord records[size];
+
+  std::atomic<uint64_t> head{0};  //!< next record the thread writes
+  char pad1[64];
+  std::atomic<uint64_t> tail{0};  //!< next record the writer reads
+  char pad2[64];
+  std::atomic<uint64_t> dropped{0};
+  std::atomic<bool> done{false};
+};
+
+/* Where the records go. A file is rotated when it gets too big, a socket is
+   connected again when it went away, but not more than once a second */
+class QueryLogSink
+{
+public:
+  QueryLogSink(const std::string& target, uint64_t maxbytes, unsigned int keep)
+    : d_maxbytes(maxbytes), d_keep(keep)
+  {
+    if(target.compare(0, 5, "unix:") == 0)
+      d_socket = target.substr(5);
+    else {
+      d_fname = target;
+      openFile();
+    }
+  }
+
+  ~QueryLogSink()
+  {
+    if(d_fd >= 0)
+      close(d_fd);
+  }
+
+  //! Files are rotated between records, for a socket they are collected until flush()
+  void add(const std::string& record)
+  {
+    if(d_fname.empty()) {
+      d_pending += record;
+      return;
+    }
+    if(d_written && d_written + record.size() > d_maxbytes)
+      rotate();
+    d_out.write(record.c_str(), record.size());
+    d_written += record.size();
+  }
+
+  //! Returns false if what was added since the last flush() could not be written, and was dropped
+  bool flush()
+  {
+    if(!d_fname.empty()) {
+      d_out.flush();
+      bool ret = (bool)d_out;
+      d_out.clear();
+      return ret;
+    }
+
+    std::string data;
+    data.swap(d_pending);
+    if(d_fd < 0 && !connectSocket())
+      return false;
+    return send(data);
+  }
+
+  uint64_t d_files{0};
+
+private:
+  void openFile()
+  {
+    d_out.close();
+    d_out.clear();
+    d_out.open(d_fname, std::ios::binary | std::ios::trunc);
+    if(!d_out)
+      throw std::runtime_error("Unable to open query log "+d_fname+": "+strerror(errno));
+    auto header = queryLogHeader();
+    d_out.write(header.c_str(), header.size());
+    d_written = header.size();
+    d_files++;
+  }
+
+  void rotate()
+  {
+    for(unsigned int n = d_keep; n > 1; --n)
+      rename((d_fname + "." + std::to_string(n - 1)).c_str(), (d_fname + "." + std::to_string(n)).c_str());
+    d_out.close();
+    if(d_keep)
+      rename(d_fname.c_str(), (d_fname + ".1").c_str());
+    try {
+      openFile();
+    }
+    catch(std::exception& e) {
+      TLOG(Error, e.what());
+    }
+  }
+
+  bool connectSocket()
+  {
+    uint64_t now = msecNow();
+    if(d_lastattempt && now - d_lastattempt < 1000)
+      return false;
+    d_lastattempt = now;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(d_socket.size() >= sizeof(addr.sun_path)) {
+      TLOG(Error, "Query log socket name ", d_socket, " is too long");
+      return false;
+    }
+    strcpy(addr.sun_path, d_socket.c_str());
+    d_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(d_fd < 0 || connect(d_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      TLOG(Warning, "Unable to connect to query log socket ", d_socket, ": ", strerror(errno));
+      if(d_fd >= 0)
+        close(d_fd);
+      d_fd = -1;
+      return false;
+    }
+    TLOG(Info, "Writing query log to socket ", d_socket);
+    d_files++;
+    return send(queryLogHeader());
+  }
+
+  bool send(const std::string& data)
+  {
+    for(size_t pos = 0; pos < data.size(); ) {
+      auto ret = ::send(d_fd, data.c_str() + pos, data.size() - pos, MSG_NOSIGNAL);
+      if(ret < 0) {
+        if(errno == EINTR)
+          continue;
+        TLOG(Warning, "Unable to write to query log socket ", d_socket, ": ", strerror(errno));
+        close(d_fd);
+        d_fd = -1;
+        return false;
+      }
+      pos += ret;
+    }
+    return true;
+  }
+
+  std::string d_fname;
+  std::ofstream d_out;
+  uint64_t d_written{0};
+  uint64_t d_maxbytes;
+  unsigned int d_keep;
+
+  std::string d_socket;
+  std::string d_pending;
+  int d_fd{-1};
+  uint64_t d_lastattempt{0};
+};
+
+class QueryLogWriter
+{
+public:
+  static QueryLogWriter& instance()
+  {
+    static QueryLogWriter qlw;
+    return qlw;
+  }
+
+  ~QueryLogWriter()
+  {
+    stop();
+  }
+
+  void start(const std::string& target, uint64_t maxbytes, unsigned int keep)
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    if(d_sink)
+      throw std::runtime_error("Query log was already started");
+    d_sink = std::make_unique<QueryLogSink>(target, maxbytes, keep);
+    d_thread = std::thread(&QueryLogWriter::run, this);
+    d_enabled.store(true, std::memory_order_release);
+  }
+
+  void stop()
+  {
+    std::unique_lock<std::mutex> l(d_lock);
+    if(!d_thread.joinable())
+      return;
+    d_enabled.store(false, std::memory_order_release);
+    d_stop = true;
+    d_cv.notify_all();
+    l.unlock();
+    d_thread.join(); // its last pass writes what is still in the rings
+    l.lock();
+    d_stats.files += d_sink->d_files;
+    d_sink.reset();
+    d_stop = false;
+  }
+
+  std::shared_ptr<QueryRing> addRing()
+  {
+    auto ring = std::make_shared<QueryRing>();
+    std::lock_guard<std::mutex> l(d_lock);
+    d_rings.push_back(ring);
+    return ring;
+  }
+
+  void flush()
+  {
+    std::unique_lock<std::mutex> l(d_lock);
+    if(!d_thread.joinable())
+      return;
+    uint64_t until = d_passes + 2;
+    d_flushwanted = true;
+    d_cv.notify_all();
+    d_cv.wait(l, [this, until]() { return d_passes >= until || d_stop; });
+  }
+
+  QueryLogStats getStats()
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    QueryLogStats ret = d_stats;
+    for(const auto& r : d_rings)
+      ret.dropped += r->dropped;
+    if(d_sink)
+      ret.files += d_sink->d_files;
+    return ret;
+  }
+
+  std::atomic<bool> d_enabled{false};
+
+private:
+  void run();
+
+  std::mutex d_lock;
+  std::condition_variable d_cv;
+  std::vector<std::shared_ptr<QueryRing>> d_rings;
+  std::unique_ptr<QueryLogSink> d_sink;  //!< only used by the writer thread once it runs
+  std::thread d_thread;
+  QueryLogStats d_stats;  //!< dropped is of rings that are gone, and by the sink, files of sinks that are gone
+  uint64_t d_passes{0};
+  bool d_flushwanted{false};
+  bool d_stop{false};
+};
+
+void QueryLogWriter::run()
+{
+  std::unique_lock<std::mutex> l(d_lock);
+  for(;;) {
+    auto rings = d_rings;
+    bool stop = d_stop;
+    l.unlock();
+
+    std::vector<bool> done;
+    uint64_t records = 0;
+    for(auto& r : rings) {
+      done.push_back(r->done.load(std::memory_order_acquire));
+      uint64_t head = r->head.load(std::memory_order_acquire);
+      for(uint64_t n = r->tail.load(std::memory_order_relaxed); n != head; ++n)
+        d_sink->add(serializeQueryLogRecord(r->records[n % QueryRing::size]));
+      records += head - r->tail.load(std::memory_order_relaxed);
+      r->tail.store(head, std::memory_order_release);
+    }
+    bool wrote = records > 0;
+    bool ok = !wrote || d_sink->flush();
+
+    l.lock();
+    if(ok)
+      d_stats.records += records;
+    else
+      d_stats.dropped += records;
+    for(size_t n = rings.size(); n-- > 0; ) {
+      if(done[n]) {
+        d_stats.dropped += rings[n]->dropped;
+        d_rings.erase(std::find(d_rings.begin(), d_rings.end(), rings[n]));
+      }
+    }
+    d_passes++;
+    d_cv.notify_all();
+    if(stop)
+      break;
+    if(!wrote && !d_flushwanted)
+      d_cv.wait_for(l, std::chrono::milliseconds(10), [this]() { return d_stop || d_flushwanted; });
+    d_flushwanted = false;
+  }
+}
+
+struct QueryRingHolder
+{
+  ~QueryRingHolder()
+  {
+    if(ring)
+      ring->done.store(true, std::memory_order_release);
+  }
+  std::shared_ptr<QueryRing> ring;
+};
+
+thread_local QueryRingHolder t_queryring;
+}
+
+void startQueryLog(const std::string& target, uint64_t maxbytes, unsigned int keep)
+{
+  QueryLogWriter::instance().start(target, maxbytes, keep);
+}
+
+bool queryLogEnabled()
+{
+  return QueryLogWriter::instance().d_enabled.load(std::memory_order_relaxed);
+}
+
+void logQuery(const QueryLogRecord& record)
+{
+  if(!queryLogEnabled())
+    return;
+  if(!t_queryring.ring)
+    t_queryring.ring = QueryLogWriter::instance().addRing();
+  QueryRing& r = *t_queryring.ring;
+  uint64_t head = r.head.load(std::memory_order_relaxed);
+  if(head - r.tail.load(std::memory_order_acquire) == QueryRing::size) {
+    r.dropped.store(r.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return;
+  }
+  r.records[head % QueryRing::size] = record;
+  r.head.store(head + 1, std::memory_order_release);
+}
+
+void logQuery(const ComboAddress& client, const DNSName& qname, DNSType qtype, uint64_t received, RCode rcode, uint8_t flags, uint16_t size)
+{
+  if(!queryLogEnabled())
+    return;
+  QueryLogRecord r;
+  r.usec = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  r.latency = std::min<uint64_t>(usecNow() - received, UINT32_MAX);
+  r.client = client;
+  r.qtype = (uint16_t)qtype;
+  r.rcode = (uint8_t)rcode;
+  r.flags = flags;
+  r.size = size;
+  r.setQName(qname);
+  logQuery(r);
+}
+
+void flushQueryLog()
+{
+  QueryLogWriter::instance().flush();
+}
+
+void stopQueryLog()
+{
+  QueryLogWriter::instance().stop();
+}
+
+QueryLogStats getQueryLogStats()
+{
+  return QueryLogWriter::instance().getStats();
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <cstdint>
+#include <istream>
+#include <string>
+#include "comboaddress.hh"
+#include "dns-storage.hh"
+#include "record-types.hh"
+
+/*!
+   @file
+   @brief Defines the query log, a compact binary record of every query and its answer, like dnstap
+*/
+
+/*! \brief One query and what we answered
+
+   This is what goes through the ring buffers, so it has a fixed size and
+   holds no pointers. The qname is in wire format, without compression. */
+struct QueryLogRecord
+{
+  enum Flags : uint8_t { TCP = 1, Truncated = 2, Dropped = 4 };
+
+  uint64_t usec;      //!< when the answer went out, wall clock microseconds since 1970
+  uint32_t latency;   //!< microseconds from receiving the query to sending the answer
+  ComboAddress client;
+  uint16_t qtype;
+  uint8_t rcode;
+  uint8_t flags;
+  uint16_t size;      //!< of the response, 0 if none was sent
+  uint8_t qnamelen;
+  uint8_t qname[255];
+
+  void setQName(const DNSName& name);
+  DNSName getQName() const;
+};
+
+/*! \brief Starts writing the query log to target, from a background thread
+
+   target is either a file name, or unix:/path for a Unix stream socket that
+   something else listens on. A file is rotated when it grows beyond maxbytes:
+   it becomes target.1, which becomes target.2, up to target.keep. If a socket
+   goes away, records are dropped until it can be connected again.
+
+   Throws if the file can't be opened, or if the query log runs already. */
+void startQueryLog(const std::string& target, uint64_t maxbytes=64*1024*1024, unsigned int keep=4);
+
+//! False until startQueryLog() was called, so servers can skip filling in a record
+bool queryLogEnabled();
+
+/*! Hands the record to the ring buffer of this thread. This takes no lock and never
+    waits: if the ring is full because the writer can't keep up, the record is dropped */
+void logQuery(const QueryLogRecord& record);
+
+/*! Fills in a record and logs it, if the query log is enabled. received is when the query
+    came in, on the usecNow() clock. The answer is taken to be sent just now */
+void logQuery(const ComboAddress& client, const DNSName& qname, DNSType qtype, uint64_t received, RCode rcode, uint8_t flags, uint16_t size);
+
+//! Waits until the writer thread has written everything that was logged before this call
+void flushQueryLog();
+
+/*! Writes what was logged so far, closes the file or socket and stops the writer thread.
+    After this, queryLogEnabled() is false again, and startQueryLog() may be called again */
+void stopQueryLog();
+
+struct QueryLogStats
+{
+  uint64_t records{0};  //!< written
+  uint64_t dropped{0};  //!< because a ring was full, or the socket was gone
+  uint64_t files{0};    //!< started, so 1 plus the number of rotations
+};
+QueryLogStats getQueryLogStats();
+
+/*! \brief Reads what the query log wrote, from a file or from what came in on the socket
+
+   The stream starts with a header, and every record is prefixed with its length,
+   so records that a later version added fields to can still be read. */
+class QueryLogReader
+{
+public:
+  //! Throws if the stream does not start with a query log header
+  explicit QueryLogReader(std::istream& in);
+  //! False at the end of the stream, throws if a record is broken
+  bool get(QueryLogRecord& record);
+
+private:
+  std::istream& d_in;
+};
+
+//! The header and a record in the format of the query log, for QueryLogReader
+std::string queryLogHeader();
+std::string serializeQueryLogRecord(const QueryLogRecord& record);
@@ -0,0 +1,338 @@
+#include "reccache.hh"
+#include <string.h>
+#include "dnsmessages.hh"
+#include "snapshot.hh"
+using namespace std;
+
+/*!
+   @file
+   @brief Implements the sharded record cache
+*/
+
+/* Writes rr into a message without compression, and takes its rdata out again.
+   In the message, the question for the root takes 5 bytes, and the record header
+   of the root name, type, class, TTL and length takes 11 more. */
+static std::string toWire(const std::unique_ptr<RRGen>& rr)
+{
+  DNSMessageWriter dmw(DNSName(), rr->getType(), DNSClass::IN, 4096);
+  dmw.d_nocompress = true;
+  dmw.putRR(DNSSection::Answer, DNSName(), 0, rr);
+  return std::string(dmw.payload.begin() + 16, dmw.payload.begin() + dmw.payloadpos);
+}
+
+//! And this goes the other way, by making a message with just this record in it
+static std::unique_ptr<RRGen> fromWire(DNSType type, const std::string& rdata)
+{
+  dnsheader dh;
+  memset(&dh, 0, sizeof(dh));
+  dh.ancount = htons(1);
+  std::string msg((const char*)&dh, sizeof(dh));
+  uint16_t t = htons((uint16_t)type), c = htons((uint16_t)DNSClass::IN), len = htons(rdata.size());
+  uint32_t ttl = 0;
+  msg.append(1, '\0');
+  msg.append((const char*)&t, 2);
+  msg.append((const char*)&c, 2);
+  msg.append((const char*)&ttl, 4);
+  msg.append((const char*)&len, 2);
+  msg.append(rdata);
+
+  DNSMessageReader dmr(msg);
+  DNSSection section;
+  DNSName name;
+  uint32_t rttl;
+  std::unique_ptr<RRGen> ret;
+  dmr.getRR(section, name, type, rttl, ret);
+  return ret;
+}
+
+RecordCache::RecordCache(unsigned int shards)
+{
+  for(unsigned int n = 0; n < std::max(shards, 1U); ++n) {
+    d_shards.emplace_back(std::make_unique<Shard>());
+    d_shards.back()->hand = d_shards.back()->queue.end();
+  }
+}
+
+// names compare case insensitively, so they have to hash that way too
+RecordCache::Shard& RecordCache::getShard(const DNSName& name)
+{
+  uint32_t hash = 2166136261; // FNV-1a
+  for(const auto& l : name) {
+    for(auto c : l.d_s)
+      hash = (hash ^ (uint8_t)tolower(c)) * 16777619;
+    hash = (hash ^ '.') * 16777619;
+  }
+  return *d_shards[hash % d_shards.size()];
+}
+
+/* What an RRset costs us, with the containers of libstdc++. A map node has four
+   pointers of bookkeeping, and a list node two. A deque, which holds the labels of
+   a DNSName, allocates a map of 8 pointers and blocks of 512 bytes. Strings of up
+   to 15 characters are stored in the string object itself */
+size_t RecordCache::getBytes(const Key& key, const Entry& e)
+{
+  auto heap = [](const std::string& str) { return str.capacity() > 15 ? str.capacity() + 1 : 0; };
+  size_t ret = 4 * sizeof(void*) + sizeof(std::pair<const Key, Entry>);
+  size_t labels = 0;
+  for(const auto& l : key.first) {
+    ret += heap(l.d_s);
+    ++labels;
+  }
+  ret += 8 * sizeof(void*) + 512 * (labels / (512 / sizeof(DNSLabel)) + 1);
+  ret += 2 * sizeof(void*) + sizeof(Node);
+  ret += e.rdata.capacity() * sizeof(std::string);
+  for(const auto& rd : e.rdata)
+    ret += heap(rd);
+  return ret;
+}
+
+void RecordCache::remove(Shard& shard, std::map<Key, Entry>::iterator iter)
+{
+  if(shard.hand == iter->second.node)
+    ++shard.hand;
+  shard.queue.erase(iter->second.node);
+  shard.stats.bytes -= iter->second.bytes;
+  shard.entries.erase(iter);
+}
+
+// SIEVE: the hand passes over what was looked up, and evicts the first RRset that was not
+void RecordCache::evict(Shard& shard, size_t needed)
+{
+  while(!shard.queue.empty() && shard.stats.bytes + needed > shardBudget()) {
+    if(shard.hand == shard.queue.end())
+      shard.hand = shard.queue.begin();
+    if(shard.hand->visited) {
+      shard.hand->visited = false;
+      ++shard.hand;
+      continue;
+    }
+    remove(shard, shard.entries.find(*shard.hand->key));
+    shard.stats.evictions++;
+  }
+}
+
+void RecordCache::add(const DNSName& name, DNSType type, const std::vector<std::unique_ptr<RRGen>>& rrs, uint32_t ttl, Rank rank, time_t now)
+{
+  if(rrs.empty())
+    return;
+  Key key{name, type};
+  Entry e;
+  try {
+    for(const auto& rr : rrs)
+      e.rdata.push_back(toWire(rr));
+  }
+  catch(std::exception& ex) { // too big for us
+    return;
+  }
+  e.ttl = std::min(ttl, d_maxttl);
+  e.expire = now + e.ttl;
+  e.rank = rank;
+  store(std::move(key), std::move(e), now);
+}
+
+//! Puts e in the cache, unless it does not fit or we have something better. Returns true if it was added
+bool RecordCache::store(Key&& key, Entry&& e, time_t now)
+{
+  e.bytes = getBytes(key, e);
+  if(e.bytes > shardBudget())
+    return false;
+
+  auto& shard = getShard(key.first);
+  std::lock_guard<std::mutex> l(shard.lock);
+  auto iter = shard.entries.find(key);
+  if(iter != shard.entries.end()) {
+    if(iter->second.expire > now && iter->second.rank > e.rank) // we know better
+      return false;
+    e.prefetched = iter->second.prefetching;
+    remove(shard, iter);
+  }
+  evict(shard, e.bytes);
+  shard.stats.bytes += e.bytes;
+  iter = shard.entries.emplace(std::move(key), std::move(e)).first;
+  iter->second.node = shard.queue.insert(shard.queue.end(), Node{&iter->first});
+  return true;
+}
+
+bool RecordCache::find(const DNSName& name, DNSType type, RRset& rrset, Rank minrank, time_t now, bool count, bool stale)
+{
+  auto& shard = getShard(name);
+  std::lock_guard<std::mutex> l(shard.lock);
+  auto iter = shard.entries.find({name, type});
+  time_t until = iter == shard.entries.end() ? 0 : iter->second.expire + (stale ? d_staleseconds : 0);
+  if(iter == shard.entries.end() || until <= now || iter->second.rank < minrank) {
+    if(count)
+      shard.stats.misses++;
+    return false;
+  }
+  rrset.rrs.clear();
+  for(const auto& rd : iter->second.rdata)
+    rrset.rrs.push_back(fromWire(type, rd));
+  rrset.expire = iter->second.expire;
+  rrset.rank = iter->second.rank;
+  rrset.prefetch = false;
+  iter->second.node->visited = true;
+  if(stale) {
+    if(iter->second.expire <= now)
+      shard.stats.stale++;
+  }
+  else if(count) {
+    auto& e = iter->second;
+    shard.stats.hits++;
+    e.hits++;
+    if(e.prefetched) {
+      shard.stats.prefetchhits++;
+      e.prefetched = false;
+    }
+    if(!e.prefetching && e.hits >= d_prefetchhits && e.expire - now <= d_prefetchfraction * e.ttl) {
+      shard.stats.prefetches++;
+      e.prefetching = rrset.prefetch = true;
+    }
+  }
+  return true;
+}
+
+bool RecordCache::get(const DNSName& name, DNSType type, RRset& rrset, Rank minrank, time_t now)
+{
+  return find(name, type, rrset, minrank, now, true);
+}
+
+bool RecordCache::getStale(const DNSName& name, DNSType type, RRset& rrset, Rank minrank, time_t now)
+{
+  return find(name, type, rrset, minrank, now, false, true);
+}
+
+/* From name up to the root, we look for NS records. Once we find them, we
+   need at least one address for one of those nameservers to be of use */
+bool RecordCache::getDelegation(const DNSName& name, DNSName& zone, std::multimap<DNSName, ComboAddress>& servers, time_t now)
+{
+  DNSName parent(name);
+  for(;;) {
+    RRset nsset;
+    if(find(parent, DNSType::NS, nsset, Rank::Glue, now, false)) {
+      servers.clear();
+      for(const auto& rr : nsset.rrs) {
+        auto ns = dynamic_cast<NSGen*>(rr.get());
+        if(!ns)
+          continue;
+        for(const DNSType& qtype : {DNSType::A, DNSType::AAAA}) {
+          RRset addrs;
+          if(!find(ns->d_name, qtype, addrs, Rank::Glue, now, false))
+            continue;
+          for(const auto& a : addrs.rrs) {
+            ComboAddress ca;
+            if(auto ptr = dynamic_cast<AGen*>(a.get()))
+              ca = ptr->getIP();
+            else if(auto ptr = dynamic_cast<AAAAGen*>(a.get()))
+              ca = ptr->getIP();
+            else
+              continue;
+            ca.sin4.sin_port = htons(53);
+            servers.insert({ns->d_name, ca});
+          }
+        }
+      }
+      if(!servers.empty()) {
+        zone = parent;
+        return true;
+      }
+    }
+    if(parent.empty())
+      return false;
+    parent.pop_front();
+  }
+}
+
+void RecordCache::purge(time_t now)
+{
+  for(auto& shard : d_shards) {
+    std::lock_guard<std::mutex> l(shard->lock);
+    for(auto iter = shard->entries.begin(); iter != shard->entries.end(); ) {
+      auto next = std::next(iter);
+      if(iter->second.expire + d_staleseconds <= now)
+        remove(*shard, iter);
+      iter = next;
+    }
+  }
+}
+
+size_t RecordCache::size()
+{
+  size_t ret = 0;
+  for(auto& shard : d_shards) {
+    std::lock_guard<std::mutex> l(shard->lock);
+    ret += shard->entries.size();
+  }
+  return ret;
+}
+
+RecordCache::Stats RecordCache::getStats(std::vector<Stats>* pershard)
+{
+  Stats ret;
+  if(pershard)
+    pershard->clear();
+  for(auto& shard : d_shards) {
+    std::lock_guard<std::mutex> l(shard->lock);
+    Stats st = shard->stats;
+    st.entries = shard->entries.size();
+    ret.entries += st.entries;
+    ret.bytes += st.bytes;
+    ret.hits += st.hits;
+    ret.misses += st.misses;
+    ret.evictions += st.evictions;
+    ret.prefetches += st.prefetches;
+    ret.prefetchhits += st.prefetchhits;
+    ret.stale += st.stale;
+    if(pershard)
+      pershard->push_back(st);
+  }
+  return ret;
+}
+
+/* Every shard writes the number of RRsets it has, and then the RRsets in the order of
+   its queue. Loading them in that order gives the same queue, so SIEVE evicts the
+   same RRsets it would have evicted before the restart */
+void RecordCache::save(SnapshotWriter& sw, time_t now)
+{
+  sw.putUInt32(d_shards.size());
+  for(auto& shard : d_shards) {
+    std::lock_guard<std::mutex> l(shard->lock);
+    uint32_t count = 0;
+    for(const auto& n : shard->queue)
+      if(shard->entries.find(*n.key)->second.expire > now)
+        ++count;
+    sw.putUInt32(count);
+    for(const auto& n : shard->queue) {
+      const auto& e = shard->entries.find(*n.key)->second;
+      if(e.expire <= now)
+        continue;
+      sw.putName(n.key->first);
+      sw.putUInt16((uint16_t)n.key->second);
+      sw.putUInt8((uint8_t)e.rank);
+      sw.putUInt64(e.expire);
+      sw.putUInt16(e.rdata.size());
+      for(const auto& rd : e.rdata)
+        sw.putString(rd);
+    }
+  }
+}
+
+size_t RecordCache::load(SnapshotReader& sr, time_t now)
+{
+  size_t ret = 0;
+  for(uint32_t shards = sr.getUInt32(); shards; --shards) {
+    for(uint32_t count = sr.getUInt32(); count; --count) {
+      Key key;
+      Entry e;
+      key.first = sr.getName();
+      key.second = (DNSType)sr.getUInt16();
+      e.rank = (Rank)sr.getUInt8();
+      e.expire = sr.getUInt64();
+      e.ttl = e.expire > now ? e.expire - now : 0;
+      for(uint16_t n = sr.getUInt16(); n; --n)
+        e.rdata.push_back(sr.getString());
+      if(e.expire > now && store(std::move(key), std::move(e), now))
+        ++ret;
+    }
+  }
+  return ret;
+}
@@ -0,0 +1,171 @@
+#pragma once
+#include <ctime>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "comboaddress.hh"
+#include "dns-storage.hh"
+#include "record-types.hh"
+
+class SnapshotWriter;
+class SnapshotReader;
+
+/*!
+   @file
+   @brief Defines RecordCache, which remembers the records resolvers learned
+*/
+
+/*! \brief Remembers RRsets, so resolving does not have to start at the root every time
+
+   Everything that comes in is stored, as long as it is within the authority
+   of the server that sent it: answers, CNAMEs, NS records of delegations, and
+   the glue that came with them. Records are stored per RRset, in wire format,
+   with an absolute expiry time.
+
+   Not all records are equally believable. An authoritative answer is worth more
+   than the NS records of a referral, which are worth more than glue. These ranks
+   follow RFC 2181 section 5.4.1. A new RRset only replaces one that has not
+   expired yet if it ranks at least as high, and get() can be told to ignore
+   anything below a certain rank.
+
+   getDelegation() finds the deepest zone cut we know servers for, so a resolver
+   can start there instead of at the root.
+
+   The cache is split into shards by a hash of the name, each with its own lock,
+   so threads looking up different names rarely wait for each other.
+
+   Memory use is bounded by d_maxbytes, which every shard gets an equal part of.
+   Each RRset is accounted for with everything it takes: the name, the rdata,
+   and the bookkeeping of the containers that hold them. When a shard is over
+   its budget, RRsets are evicted using SIEVE (Zhang et al, NSDI 2024). This is
+   a FIFO queue where a hand moves from old to new. RRsets that were looked up
+   since the hand last passed get another round, the others are evicted. So a
+   flood of names that are asked once moves through the cache without pushing
+   out the ones that are asked all the time.
+
+   Popular RRsets are refreshed before they expire. When get() finds an RRset
+   in the last d_prefetchfraction of its TTL, that has been looked up at least
+   d_prefetchhits times since it was stored, it sets RRset::prefetch. The caller
+   is then expected to resolve it again in the background, so the next clients
+   don't have to wait for that. Only one get() per RRset sees this.
+
+   RRsets are not thrown away when they expire, but kept for d_staleseconds
+   longer. When resolving fails, or takes too long, getStale() returns them,
+   since an answer that is a little old beats no answer at all (RFC 8767).
+
+   This class can be shared between threads. */
+class RecordCache
+{
+public:
+  //! How much we believe an RRset, higher is better
+  enum class Rank : uint8_t
+  {
+    Glue = 1,           //!< additional section
+    Referral = 2,       //!< authority section of a non-authoritative response
+    NonAuthAnswer = 3,
+    AuthAuthority = 4,
+    AuthAnswer = 5
+  };
+
+  //! An RRset as it comes out of the cache
+  struct RRset
+  {
+    std::vector<std::unique_ptr<RRGen>> rrs;
+    time_t expire{0};
+    Rank rank{Rank::Glue};
+    bool prefetch{false}; //!< please refresh this RRset, it is popular and about to expire
+
+    //! How many seconds this RRset is still valid
+    uint32_t ttl(time_t now) const { return expire > now ? expire - now : 0; }
+  };
+
+  explicit RecordCache(unsigned int shards=64);
+
+  //! Stores rrs as the RRset for name|type, unless we have one that ranks higher and has not expired
+  void add(const DNSName& name, DNSType type, const std::vector<std::unique_ptr<RRGen>>& rrs, uint32_t ttl, Rank rank, time_t now=time(nullptr));
+  //! Returns true if we have records for name|type of at least minrank, which have not expired
+  bool get(const DNSName& name, DNSType type, RRset& rrset, Rank minrank=Rank::Glue, time_t now=time(nullptr));
+  //! Like get(), but also returns RRsets that expired less than d_staleseconds ago. Their ttl() is 0
+  bool getStale(const DNSName& name, DNSType type, RRset& rrset, Rank minrank=Rank::Glue, time_t now=time(nullptr));
+  /*! Finds the deepest zone at or above name that we have NS records for, and addresses of at least one
+      of those nameservers. servers is keyed on nameserver name, ports are 53 */
+  bool getDelegation(const DNSName& name, DNSName& zone, std::multimap<DNSName, ComboAddress>& servers, time_t now=time(nullptr));
+
+  //! Removes all RRsets that expired more than d_staleseconds ago
+  void purge(time_t now=time(nullptr));
+  size_t size();
+
+  //! Adds all RRsets that have not expired to a snapshot, oldest first
+  void save(SnapshotWriter& sw, time_t now=time(nullptr));
+  //! Reads what save() wrote, skipping what has expired since. Returns how many RRsets were loaded
+  size_t load(SnapshotReader& sr, time_t now=time(nullptr));
+
+  struct Stats
+  {
+    uint64_t entries{0};
+    uint64_t bytes{0};
+    uint64_t hits{0};       //!< of get() only, getDelegation() is not counted
+    uint64_t misses{0};
+    uint64_t evictions{0};  //!< to stay within the memory budget, expired RRsets are not counted
+    uint64_t prefetches{0}; //!< RRsets get() asked to be refreshed
+    uint64_t prefetchhits{0}; //!< refreshed RRsets that were looked up again
+    uint64_t stale{0};      //!< RRsets getStale() returned after they expired
+
+    double hitRatio() const
+    {
+      return hits + misses ? (double)hits / (hits + misses) : 0;
+    }
+    //! How many prefetches were of use
+    double prefetchHitRatio() const
+    {
+      return prefetches ? (double)prefetchhits / prefetches : 0;
+    }
+  };
+  //! The totals, and if pershard is set, the numbers of every shard, to see if the load is spread well
+  Stats getStats(std::vector<Stats>* pershard=nullptr);
+
+  uint32_t d_maxttl{86400};          //!< we don't believe TTLs over a day
+  size_t d_maxbytes{128*1024*1024};  //!< over all shards
+  double d_prefetchfraction{0.1};    //!< of the original TTL
+  uint32_t d_prefetchhits{3};
+  uint32_t d_staleseconds{86400};    //!< how long expired RRsets are kept for getStale()
+
+private:
+  typedef std::pair<DNSName, DNSType> Key;
+  struct Node
+  {
+    const Key* key;      //!< points into Shard::entries
+    bool visited{false}; //!< looked up since the hand passed
+  };
+  struct Entry
+  {
+    std::vector<std::string> rdata; //!< wire format, names not compressed
+    time_t expire;
+    uint32_t ttl;                  //!< what it was when stored, for prefetching
+    Rank rank;
+    std::list<Node>::iterator node;
+    size_t bytes;
+    uint32_t hits{0};
+    bool prefetching{false};       //!< get() asked for a refresh
+    bool prefetched{false};        //!< this is that refresh, and nobody looked it up yet
+  };
+  struct Shard
+  {
+    std::map<Key, Entry> entries;
+    std::list<Node> queue;            //!< oldest first
+    std::list<Node>::iterator hand;   //!< the next candidate for eviction, or queue.end()
+    Stats stats;
+    std::mutex lock;
+  };
+  Shard& getShard(const DNSName& name);
+  bool find(const DNSName& name, DNSType type, RRset& rrset, Rank minrank, time_t now, bool count, bool stale=false);
+  bool store(Key&& key, Entry&& e, time_t now);
+  void evict(Shard& shard, size_t needed);
+  void remove(Shard& shard, std::map<Key, Entry>::iterator iter);
+  static size_t getBytes(const Key& key, const Entry& e);
+
+  std::vector<std::unique_ptr<Shard>> d_shards;
+  size_t shardBudget() const { return d_maxbytes / d_shards.size(); }
+};
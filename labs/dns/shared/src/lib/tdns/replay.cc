@@ -0,0 +1,468 @@
+#include "replay.hh"
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <sstream>
+#include <tuple>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "dnsmessages.hh"
+#include "timerwheel.hh"
+using namespace std;
+
+/*!
+   @file
+   @brief Implements the pcap reader and the replay of captured queries
+*/
+
+namespace {
+uint16_t get16(const std::string& s, size_t pos)
+{
+  return (uint8_t)s[pos] << 8 | (uint8_t)s[pos + 1];
+}
+
+uint32_t get32(const char* p, bool swap)
+{
+  uint32_t ret;
+  memcpy(&ret, p, 4);
+  return swap ? __builtin_bswap32(ret) : ret;
+}
+
+const uint32_t c_pcapmagic = 0xa1b2c3d4, c_pcapnsecmagic = 0xa1b23c4d;
+const uint32_t c_maxframe = 262144;  //!< the largest snaplen tcpdump uses
+
+enum LinkType : uint32_t { Null = 0, Ethernet = 1, Raw = 101, LinuxSLL = 113, LinuxSLL2 = 276 };
+}
+
+PcapReader::PcapReader(std::istream& in) : d_in(in)
+{
+  char header[24];
+  if(!d_in.read(header, sizeof(header)))
+    throw std::runtime_error("Capture is too short for a pcap header");
+  uint32_t magic = get32(header, false);
+  if(magic == c_pcapmagic || magic == c_pcapnsecmagic)
+    d_swap = false;
+  else if(__builtin_bswap32(magic) == c_pcapmagic || __builtin_bswap32(magic) == c_pcapnsecmagic)
+    d_swap = true;
+  else
+    throw std::runtime_error("Not a pcap capture (pcapng is not supported, convert it with editcap -F pcap)");
+  d_nsec = get32(header, d_swap) == c_pcapnsecmagic;
+  d_linktype = get32(header + 20, d_swap);
+  if(d_linktype != Null && d_linktype != Ethernet && d_linktype != Raw && d_linktype != LinuxSLL && d_linktype != LinuxSLL2)
+    throw std::runtime_error("Unsupported link layer type "+to_string(d_linktype)+" in capture");
+}
+
+bool PcapReader::get(PcapPacket& packet)
+{
+  char header[16];
+  std::string frame;
+  for(;;) {
+    if(!d_in.read(header, sizeof(header))) {
+      if(d_in.gcount())
+        throw std::runtime_error("Capture ends in a packet header");
+      return false;
+    }
+    uint32_t len = get32(header + 8, d_swap);
+    if(len > c_maxframe)
+      throw std::runtime_error("Packet of "+to_string(len)+" bytes in capture, it is probably broken");
+    frame.resize(len);
+    if(len && !d_in.read(&frame[0], len))
+      throw std::runtime_error("Capture ends in the middle of a packet");
+    uint64_t frac = get32(header + 4, d_swap);
+    packet.usec = get32(header, d_swap) * 1000000ULL + (d_nsec ? frac / 1000 : frac);
+    if(parse(frame, packet))
+      return true;
+  }
+}
+
+//! Finds the UDP payload in frame. False if there is none
+bool PcapReader::parse(const std::string& frame, PcapPacket& packet) const
+{
+  size_t pos = 0;
+  uint16_t ethertype = 0;  // 0 if the link layer doesn't say, then the IP version does
+  switch(d_linktype) {
+  case Null:
+    pos = 4;
+    break;
+  case Ethernet:
+    pos = 14;
+    if(frame.size() < pos)
+      return false;
+    ethertype = get16(frame, 12);
+    while((ethertype == 0x8100 || ethertype == 0x88a8) && frame.size() >= pos + 4) {  // VLAN tags
+      ethertype = get16(frame, pos + 2);
+      pos += 4;
+    }
+    break;
+  case LinuxSLL:
+    pos = 16;
+    if(frame.size() < pos)
+      return false;
+    ethertype = get16(frame, 14);
+    break;
+  case LinuxSLL2:
+    pos = 20;
+    if(frame.size() < pos)
+      return false;
+    ethertype = get16(frame, 0);
+    break;
+  }
+  if(frame.size() < pos + 1)
+    return false;
+  int version = (uint8_t)frame[pos] >> 4;
+  if((ethertype && ethertype != 0x0800 && ethertype != 0x86dd) || (version != 4 && version != 6))
+    return false;
+
+  size_t end;
+  if(version == 4) {
+    if(frame.size() < pos + 20 || frame[pos + 9] != 17 || (get16(frame, pos + 6) & 0x3fff))  // UDP, not a fragment
+      return false;
+    packet.source = packet.destination = ComboAddress();
+    memcpy(&packet.source.sin4.sin_addr.s_addr, &frame[pos + 12], 4);
+    memcpy(&packet.destination.sin4.sin_addr.s_addr, &frame[pos + 16], 4);
+    end = pos + get16(frame, pos + 2);
+    pos += ((uint8_t)frame[pos] & 0x0f) * 4;
+  }
+  else {
+    if(frame.size() < pos + 40 || frame[pos + 6] != 17)
+      return false;
+    packet.source = packet.destination = ComboAddress("::");
+    memcpy(&packet.source.sin6.sin6_addr.s6_addr, &frame[pos + 8], 16);
+    memcpy(&packet.destination.sin6.sin6_addr.s6_addr, &frame[pos + 24], 16);
+    end = pos + 40 + get16(frame, pos + 4);
+    pos += 40;
+  }
+  // Ethernet pads short frames, and the snaplen may have cut them off
+  end = std::min(end, frame.size());
+  if(end < pos + 8)
+    return false;
+  packet.source.sin4.sin_port = htons(get16(frame, pos));
+  packet.destination.sin4.sin_port = htons(get16(frame, pos + 2));
+  end = std::min(end, pos + get16(frame, pos + 4));
+  if(end < pos + 8)
+    return false;
+  packet.payload = frame.substr(pos + 8, end - pos - 8);
+  return true;
+}
+
+std::vector<CapturedQuery> readCapturedQueries(std::istream& in)
+{
+  PcapReader pr(in);
+  PcapPacket p;
+  std::vector<CapturedQuery> ret;
+  // the queries that have not seen their response yet
+  std::map<std::tuple<ComboAddress, uint16_t, DNSName, DNSType>, size_t> waiting;
+  while(pr.get(p)) {
+    if(ntohs(p.source.sin4.sin_port) != 53 && ntohs(p.destination.sin4.sin_port) != 53)
+      continue;
+    DNSName qname;
+    DNSType qtype;
+    uint16_t id;
+    bool qr;
+    try {
+      DNSMessageReader dmr(p.payload);
+      dmr.getQuestion(qname, qtype);
+      id = dmr.dh.id;
+      qr = dmr.dh.qr;
+    }
+    catch(std::exception& e) {
+      continue;
+    }
+    if(!qr) {
+      waiting[std::make_tuple(p.source, id, qname, qtype)] = ret.size();
+      ret.push_back({p.usec, p.source, p.payload, std::string()});
+    }
+    else {
+      auto iter = waiting.find(std::make_tuple(p.destination, id, qname, qtype));
+      if(iter != waiting.end()) {
+        ret[iter->second].response = p.payload;
+        waiting.erase(iter);
+      }
+    }
+  }
+  return ret;
+}
+
+namespace {
+//! The rcode, and the answer section without TTLs, sorted
+std::pair<RCode, std::vector<std::string>> summarize(const std::string& response)
+{
+  DNSMessageReader dmr(response);
+  std::pair<RCode, std::vector<std::string>> ret;
+  ret.first = (RCode)dmr.dh.rcode;
+  DNSSection section;
+  DNSName name;
+  DNSType type;
+  uint32_t ttl;
+  std::unique_ptr<RRGen> rr;
+  while(dmr.getRR(section, name, type, ttl, rr)) {
+    if(section == DNSSection::Answer)
+      ret.second.push_back(name.toString() + " " + toString(type) + " " + rr->toString());
+  }
+  std::sort(ret.second.begin(), ret.second.end());
+  return ret;
+}
+}
+
+std::string compareResponses(const std::string& captured, const std::string& received)
+{
+  std::pair<RCode, std::vector<std::string>> want, got;
+  try {
+    want = summarize(captured);
+  }
+  catch(std::exception& e) {
+    return string("captured response does not parse: ")+e.what();
+  }
+  try {
+    got = summarize(received);
+  }
+  catch(std::exception& e) {
+    return string("response does not parse: ")+e.what();
+  }
+  if(got.first != want.first)
+    return string("rcode ")+toString(got.first)+" instead of "+toString(want.first);
+  if(got.second == want.second)
+    return "";
+  ostringstream ret;
+  ret << got.second.size() << " answers instead of " << want.second.size();
+  std::vector<std::string> missing;
+  std::set_difference(want.second.begin(), want.second.end(), got.second.begin(), got.second.end(), std::back_inserter(missing));
+  if(!missing.empty())
+    ret << ", missing " << missing.front();
+  else {
+    std::vector<std::string> extra;
+    std::set_difference(got.second.begin(), got.second.end(), want.second.begin(), want.second.end(), std::back_inserter(extra));
+    if(!extra.empty())
+      ret << ", extra " << extra.front();
+  }
+  return ret.str();
+}
+
+std::string ReplayReport::toString() const
+{
+  ostringstream ret;
+  char line[200];
+  auto pct = [](uint64_t n, uint64_t of) { return of ? 100.0 * n / of : 0.0; };
+  snprintf(line, sizeof(line), "Replayed %llu queries in %.2f s, %.0f qps\n", (unsigned long long)sent, elapsed, elapsed > 0 ? sent / elapsed : 0.0);
+  ret << line;
+  snprintf(line, sizeof(line), "Answered %llu (%.2f%%), lost %llu (%.2f%%), %llu unexpected responses\n",
+           (unsigned long long)answered, pct(answered, sent), (unsigned long long)lost, pct(lost, sent), (unsigned long long)unexpected);
+  ret << line;
+  snprintf(line, sizeof(line), "Compared %llu answers with the capture, %llu (%.2f%%) differ\n",
+           (unsigned long long)compared, (unsigned long long)mismatched, pct(mismatched, compared));
+  ret << line;
+  if(latency.count()) {
+    snprintf(line, sizeof(line), "Latency usec: p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+             latency.percentile(0.5) / 1000.0, latency.percentile(0.9) / 1000.0,
+             latency.percentile(0.99) / 1000.0, latency.percentile(0.999) / 1000.0, latency.max / 1000.0);
+    ret << line;
+  }
+  if(!examples.empty()) {
+    ret << "Differences, the first " << examples.size() << ":\n";
+    for(const auto& e : examples)
+      ret << "  " << e << "\n";
+  }
+  return ret.str();
+}
+
+namespace {
+const unsigned int c_examples = 10;
+
+struct ReplaySocket
+{
+  int fd{-1};
+  std::vector<int64_t> byid = std::vector<int64_t>(65536, -1);  //!< index of the query out with an ID
+  std::deque<size_t> order;                                     //!< in order of sending, to find what timed out
+
+  ~ReplaySocket()
+  {
+    if(fd >= 0)
+      close(fd);
+  }
+};
+
+struct ReplayState
+{
+  DNSName qname;
+  DNSType qtype;
+  unsigned int sock;
+  uint16_t id;
+  uint64_t sent{0};  //!< nsec
+  bool done{false};
+};
+}
+
+ReplayReport replay(const std::vector<CapturedQuery>& queries, const ReplayOptions& opts)
+{
+  if(!opts.sockets || opts.speed < 0 || opts.timeout <= 0 || (opts.speed == 0 && !opts.inflight))
+    throw std::runtime_error("Replay needs at least a socket, a positive timeout and speed, or something in flight");
+
+  ReplayReport report;
+  std::vector<std::unique_ptr<ReplaySocket>> socks;
+  std::vector<pollfd> pfds;
+  for(unsigned int n = 0; n < opts.sockets; ++n) {
+    auto s = std::make_unique<ReplaySocket>();
+    s->fd = socket(opts.server.sin4.sin_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(s->fd < 0)
+      throw std::runtime_error("Creating UDP socket for replay: "+string(strerror(errno)));
+    if(connect(s->fd, (struct sockaddr*)&opts.server, opts.server.getSocklen()) < 0)
+      throw std::runtime_error("Connecting UDP socket to "+opts.server.toStringWithPort()+": "+string(strerror(errno)));
+    pfds.push_back({s->fd, POLLIN, 0});
+    socks.push_back(std::move(s));
+  }
+
+  // every captured client address gets a socket, in turn
+  std::vector<ReplayState> states(queries.size());
+  std::map<ComboAddress, unsigned int> clients;
+  for(size_t n = 0; n < queries.size(); ++n) {
+    DNSMessageReader dmr(queries[n].query);
+    dmr.getQuestion(states[n].qname, states[n].qtype);
+    ComboAddress client = queries[n].client;
+    client.sin4.sin_port = 0;
+    auto iter = clients.emplace(client, clients.size() % opts.sockets).first;
+    states[n].sock = iter->second;
+  }
+
+  LatencyHistogram histogram;
+  uint64_t outstanding = 0, last = 0;
+  auto finish = [&](size_t idx, uint64_t latency, const std::string* response) {
+    auto& st = states[idx];
+    st.done = true;
+    socks[st.sock]->byid[st.id] = -1;
+    --outstanding;
+    std::string result = "-";
+    if(response) {
+      report.answered++;
+      histogram.record(latency);
+      if(!queries[idx].response.empty()) {
+        report.compared++;
+        result = compareResponses(queries[idx].response, *response);
+        if(result.empty())
+          result = "same";
+        else {
+          report.mismatched++;
+          if(report.examples.size() < c_examples)
+            report.examples.push_back(st.qname.toString()+" "+toString(st.qtype)+": "+result);
+          result = "differs: " + result;
+        }
+      }
+    }
+    else
+      report.lost++;
+    if(opts.details) {
+      char line[100];
+      snprintf(line, sizeof(line), "%.6f ", (queries[idx].usec - queries[0].usec) / 1000000.0);
+      *opts.details << line << queries[idx].client.toString() << " " << st.qname << " " << st.qtype << " ";
+      if(response) {
+        snprintf(line, sizeof(line), "%.1f ", latency / 1000.0);
+        *opts.details << line << (RCode)((uint8_t)(*response)[3] & 0x0f);
+      }
+      else
+        *opts.details << "lost -";
+      *opts.details << " " << result << "\n";
+    }
+  };
+
+  std::string buffer(65535, 0);
+  auto readSocket = [&](unsigned int sock) {
+    auto& s = *socks[sock];
+    for(;;) {
+      ssize_t len = recv(s.fd, &buffer[0], buffer.size(), 0);
+      if(len < 0)
+        return;
+      uint64_t now = nsecNow();
+      std::string response(buffer, 0, len);
+      int64_t idx = len < (ssize_t)sizeof(dnsheader) ? -1 : s.byid[get16(response, 0)];
+      DNSName qname;
+      DNSType qtype;
+      try {
+        if(idx >= 0)
+          DNSMessageReader(response).getQuestion(qname, qtype);
+      }
+      catch(std::exception& e) {
+        idx = -1;
+      }
+      if(idx < 0 || qname != states[idx].qname || qtype != states[idx].qtype) {
+        report.unexpected++;
+        continue;
+      }
+      finish(idx, now - states[idx].sent, &response);
+      last = now;
+    }
+  };
+
+  uint64_t timeout = opts.timeout * 1000000000.0;
+  uint64_t start = nsecNow(), now = start;
+  last = start;
+  // nsec, when queries[idx] is sent at opts.speed. A capture can be out of order, what is earlier than the first is due right away
+  auto dueAt = [&](size_t idx) -> uint64_t {
+    uint64_t offset = queries[idx].usec > queries[0].usec ? queries[idx].usec - queries[0].usec : 0;
+    return start + offset * 1000.0 / opts.speed;
+  };
+  size_t next = 0;
+  while(next < queries.size() || outstanding) {
+    // send what is due
+    while(next < queries.size()) {
+      if(opts.speed > 0) {
+        if(dueAt(next) > now)
+          break;
+      }
+      else if(outstanding >= opts.inflight)
+        break;
+      auto& st = states[next];
+      auto& s = *socks[st.sock];
+      std::string packet = queries[next].query;
+      st.id = get16(packet, 0);
+      for(unsigned int tries = 0; s.byid[st.id] >= 0; ++tries) {
+        if(tries == 65536)
+          throw std::runtime_error("All IDs are in use on a replay socket, use more sockets");
+        ++st.id;
+      }
+      packet[0] = st.id >> 8;
+      packet[1] = st.id & 0xff;
+      if(send(s.fd, packet.c_str(), packet.size(), 0) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+        break;  // try again after a moment. Other errors mean the query is lost, we'll notice later
+      st.sent = now;
+      s.byid[st.id] = next;
+      s.order.push_back(next);
+      ++outstanding;
+      report.sent++;
+      ++next;
+      last = now;
+    }
+
+    // wait for responses, or until the next query is due
+    uint64_t wait = 10000000;
+    if(next < queries.size()) {
+      if(opts.speed > 0) {
+        uint64_t due = dueAt(next);
+        wait = due > now ? std::min(wait, due - now) : 100000;
+      }
+      else if(outstanding < opts.inflight)  // the socket buffer was full
+        wait = 100000;
+    }
+    struct timespec ts{(time_t)(wait / 1000000000), (long)(wait % 1000000000)};
+    if(ppoll(&pfds[0], pfds.size(), &ts, nullptr) > 0) {
+      for(unsigned int n = 0; n < pfds.size(); ++n)
+        if(pfds[n].revents)
+          readSocket(n);
+    }
+    now = nsecNow();
+    for(auto& s : socks) {
+      while(!s->order.empty()) {
+        auto idx = s->order.front();
+        if(!states[idx].done) {
+          if(now - states[idx].sent < timeout)
+            break;
+          finish(idx, 0, nullptr);
+        }
+        s->order.pop_front();
+      }
+    }
+  }
+  report.elapsed = (last - start) / 1000000000.0;
+  histogram.snapshot(report.latency);
+  return report;
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "comboaddress.hh"
+#include "histogram.hh"
+
+/*!
+   @file
+   @brief Defines reading DNS queries from pcap captures, and replaying them against a server
+*/
+
+//! A UDP packet from a capture
+struct PcapPacket
+{
+  uint64_t usec;       //!< capture time, microseconds since 1970
+  ComboAddress source, destination;
+  std::string payload;
+};
+
+/*! \brief Reads UDP packets over IPv4 and IPv6 from a classic pcap file, the format of tcpdump -w
+
+   Both byte orders, and microsecond and nanosecond timestamps are
+   supported. The link layer can be Ethernet (with VLAN tags), BSD loopback,
+   raw IP, or Linux cooked captures (tcpdump -i any). Fragments, IPv6
+   extension headers and everything that isn't UDP are skipped. The newer
+   pcapng format is not supported, tcpdump writes classic pcap by default. */
+class PcapReader
+{
+public:
+  //! Throws if the stream doesn't start with a pcap header, or uses a link layer we don't know
+  explicit PcapReader(std::istream& in);
+  //! False at the end of the capture, throws if it is cut off in the middle of a packet
+  bool get(PcapPacket& packet);
+
+private:
+  bool parse(const std::string& frame, PcapPacket& packet) const;
+
+  std::istream& d_in;
+  uint32_t d_linktype;
+  bool d_swap;
+  bool d_nsec;
+};
+
+//! A query from a capture, and the response it got, if that was captured too
+struct CapturedQuery
+{
+  uint64_t usec;
+  ComboAddress client;
+  std::string query;
+  std::string response;  //!< empty if none was captured
+};
+
+/*! Reads the DNS queries in a capture, in the order they were captured. A response is
+    matched to the query from the address it was sent to, with the same ID and question.
+    Packets to or from port 53 that do not parse as DNS are skipped */
+std::vector<CapturedQuery> readCapturedQueries(std::istream& in);
+
+/*! Compares the rcode and answer section of two responses, ignoring TTLs and the order of
+    records. Returns an empty string if they are the same, or how they differ */
+std::string compareResponses(const std::string& captured, const std::string& received);
+
+struct ReplayOptions
+{
+  ComboAddress server;
+  double speed{1};             //!< 2 replays twice as fast as captured, 0 as fast as possible
+  unsigned int inflight{1000}; //!< most unanswered queries, when replaying as fast as possible
+  unsigned int sockets{1};     //!< captured clients are spread over this many source ports
+  double timeout{2};           //!< seconds after which a query counts as lost
+  std::ostream* details{nullptr};  //!< if set, gets a line per query with its latency and result
+};
+
+struct ReplayReport
+{
+  double elapsed{0};       //!< seconds until the last query went out, or the last answer came in
+  uint64_t sent{0};
+  uint64_t answered{0};
+  uint64_t lost{0};
+  uint64_t unexpected{0};  //!< responses with an ID or question we had no query out for
+  uint64_t compared{0};    //!< answers for which a response was captured too
+  uint64_t mismatched{0};  //!< of those, with a different rcode or answer section
+  std::vector<std::string> examples;  //!< of mismatches, the first few
+  LatencyHistogram::Snapshot latency;
+
+  std::string toString() const;
+};
+
+/*! Sends the queries to opts.server, with the timing they were captured with, scaled by
+    opts.speed. All queries of a captured client go out from the same socket. A query keeps
+    its ID, unless that is already in use on its socket */
+ReplayReport replay(const std::vector<CapturedQuery>& queries, const ReplayOptions& opts);
@@ -0,0 +1,317 @@
+#include "rootmirror.hh"
+#include <fstream>
+#include <sstream>
+#include "dnsmessages.hh"
+#include "sclasses.hh"
+using namespace std;
+
+/*!
+   @file
+   @brief Implements the local root zone mirror
+*/
+
+void RootMirror::setSource(const std::string& source)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  try {
+    d_server = ComboAddress(source, 53);
+    d_axfr = true;
+  }
+  catch(std::exception& e) {
+    d_file = source;
+    d_axfr = false;
+  }
+}
+
+//! Sends a query over TCP, with the length in front
+static void writeTCPQuery(int sock, DNSMessageWriter& dmw)
+{
+  string packet = dmw.serialize();
+  SWriten(sock, string{(char)(packet.size() / 256), (char)(packet.size() % 256)} + packet);
+}
+
+//! Reads a length and then a message from a TCP connection, throws if that takes over timeout seconds
+static string readTCPMessage(int sock, double timeout)
+{
+  auto readn = [sock, timeout](size_t len) {
+    string ret;
+    while(ret.size() < len) {
+      double left = timeout;
+      if(waitForData(sock, &left) != 1)
+        throw std::runtime_error("Timeout reading from nameserver");
+      string part = SRead(sock, len - ret.size());
+      if(part.empty())
+        throw std::runtime_error("Nameserver closed the connection");
+      ret += part;
+    }
+    return ret;
+  };
+  string len = readn(2);
+  return readn((uint8_t)len[0] * 256 + (uint8_t)len[1]);
+}
+
+/* We only need the SOA, delegations and addresses. Other records, like the DNSSEC
+   ones, are skipped. So are NS records below a delegation, which are not in the root
+   zone anyway */
+void RootMirror::addRecord(Zone& zone, std::map<DNSName, std::vector<ComboAddress>>& addrs, const DNSName& name, uint32_t ttl, std::unique_ptr<RRGen>&& rr)
+{
+  switch(rr->getType()) {
+  case DNSType::SOA:
+    if(name.empty()) {
+      zone.soa = std::make_unique<SOAGen>(*dynamic_cast<SOAGen*>(rr.get()));
+      zone.soattl = ttl;
+    }
+    break;
+  case DNSType::NS: {
+    auto& ref = zone.delegations[name];
+    ref.zone = name;
+    ref.ttl = ttl;
+    ref.nsses.push_back(dynamic_cast<NSGen*>(rr.get())->d_name);
+    break;
+  }
+  case DNSType::A:
+    addrs[name].push_back(dynamic_cast<AGen*>(rr.get())->getIP());
+    break;
+  case DNSType::AAAA:
+    addrs[name].push_back(dynamic_cast<AAAAGen*>(rr.get())->getIP());
+    break;
+  default:
+    break;
+  }
+}
+
+//! Once all records are in, the nameservers get their addresses
+void RootMirror::finish(Zone& zone, const std::map<DNSName, std::vector<ComboAddress>>& addrs)
+{
+  if(!zone.soa)
+    throw std::runtime_error("Root zone has no SOA record");
+  if(!zone.delegations.count(DNSName()))
+    throw std::runtime_error("Root zone has no NS records");
+  for(auto& d : zone.delegations) {
+    for(const auto& ns : d.second.nsses) {
+      auto iter = addrs.find(ns);
+      if(iter == addrs.end())
+        continue;
+      for(auto ca : iter->second) {
+        ca.sin4.sin_port = htons(53);
+        d.second.servers.insert({ns, ca});
+      }
+    }
+  }
+}
+
+uint32_t RootMirror::querySerial(const ComboAddress& server)
+{
+  Socket sock(server.sin4.sin_family, SOCK_STREAM);
+  SConnectWithTimeout(sock, server, d_timeout);
+  DNSMessageWriter dmw(DNSName(), DNSType::SOA);
+  writeTCPQuery(sock, dmw);
+  DNSMessageReader dmr(readTCPMessage(sock, d_timeout));
+  DNSSection rrsection;
+  DNSName rrname;
+  DNSType rrtype;
+  uint32_t ttl;
+  std::unique_ptr<RRGen> rr;
+  while(dmr.getRR(rrsection, rrname, rrtype, ttl, rr)) {
+    if(rrsection == DNSSection::Answer && rrtype == DNSType::SOA && rrname.empty())
+      return dynamic_cast<SOAGen*>(rr.get())->d_serial;
+  }
+  throw std::runtime_error("No SOA record in response from "+server.toStringWithPort());
+}
+
+//! Like retrieveZone() in tauth, an AXFR ends with the SOA record it started with
+std::unique_ptr<RootMirror::Zone> RootMirror::transfer(const ComboAddress& server)
+{
+  Socket sock(server.sin4.sin_family, SOCK_STREAM);
+  SConnectWithTimeout(sock, server, d_timeout);
+  DNSMessageWriter dmw(DNSName(), DNSType::AXFR);
+  writeTCPQuery(sock, dmw);
+
+  auto ret = std::make_unique<Zone>();
+  std::map<DNSName, std::vector<ComboAddress>> addrs;
+  int soacount = 0;
+  for(;;) {
+    DNSMessageReader dmr(readTCPMessage(sock, d_timeout));
+    if(dmr.dh.rcode != (int)RCode::Noerror)
+      throw std::runtime_error("AXFR of the root zone from "+server.toStringWithPort()+" failed with "+toString((RCode)dmr.dh.rcode));
+    DNSSection rrsection;
+    DNSName rrname;
+    DNSType rrtype;
+    uint32_t ttl;
+    std::unique_ptr<RRGen> rr;
+    while(dmr.getRR(rrsection, rrname, rrtype, ttl, rr)) {
+      if(rrtype == DNSType::SOA && ++soacount == 2) {
+        finish(*ret, addrs);
+        return ret;
+      }
+      addRecord(*ret, addrs, rrname, ttl, std::move(rr));
+    }
+  }
+}
+
+/* Every line is 'name ttl class type content', all names end on a dot. This is
+   how the root zone is published, we don't do $ORIGIN, $TTL or parentheses */
+std::unique_ptr<RootMirror::Zone> RootMirror::read(const std::string& fname)
+{
+  ifstream ifs(fname);
+  if(!ifs)
+    throw std::runtime_error("Unable to open root zone file '"+fname+"'");
+  auto ret = std::make_unique<Zone>();
+  std::map<DNSName, std::vector<ComboAddress>> addrs;
+  string line;
+  unsigned int linenum = 0;
+  while(getline(ifs, line)) {
+    ++linenum;
+    auto pos = line.find(';');
+    if(pos != string::npos)
+      line.resize(pos);
+    istringstream iss(line);
+    string name, cls, type, content;
+    uint32_t ttl;
+    if(!(iss >> name))
+      continue;
+    if(!(iss >> ttl >> cls >> type))
+      throw std::runtime_error("Unable to parse line "+to_string(linenum)+" of '"+fname+"'");
+    getline(iss >> std::ws, content);
+
+    std::unique_ptr<RRGen> rr;
+    try {
+      if(type == "SOA")
+        rr = std::make_unique<SOAGen>(DNSStringReader(content));
+      else if(type == "NS")
+        rr = NSGen::make(makeDNSName(content));
+      else if(type == "A")
+        rr = AGen::make(content);
+      else if(type == "AAAA")
+        rr = AAAAGen::make(content);
+      else
+        continue;
+    }
+    catch(std::exception& e) {
+      throw std::runtime_error("Unable to parse line "+to_string(linenum)+" of '"+fname+"': "+e.what());
+    }
+    addRecord(*ret, addrs, makeDNSName(name), ttl, std::move(rr));
+  }
+  finish(*ret, addrs);
+  return ret;
+}
+
+bool RootMirror::refresh(time_t now)
+{
+  bool axfr;
+  ComboAddress server;
+  string file;
+  std::shared_ptr<const Zone> old;
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    axfr = d_axfr;
+    server = d_server;
+    file = d_file;
+    old = d_zone;
+  }
+
+  std::unique_ptr<Zone> zone;
+  try {
+    if(axfr) {
+      if(old && querySerial(server) == old->soa->d_serial) {
+        std::lock_guard<std::mutex> l(d_lock);
+        auto fresh = std::make_shared<Zone>();
+        fresh->soa = std::make_unique<SOAGen>(*old->soa);
+        fresh->soattl = old->soattl;
+        fresh->delegations = old->delegations;
+        fresh->loaded = now;
+        d_zone = fresh;
+        d_nextrefresh = now + old->soa->d_refresh;
+        d_stats.checks++;
+        return true;
+      }
+      zone = transfer(server);
+    }
+    else
+      zone = read(file);
+  }
+  catch(std::exception& e) {
+    cerr<<"Unable to refresh the root zone: "<<e.what()<<endl;
+    std::lock_guard<std::mutex> l(d_lock);
+    d_nextrefresh = now + (old ? old->soa->d_retry : 60);
+    d_stats.failures++;
+    return false;
+  }
+  zone->loaded = now;
+  std::lock_guard<std::mutex> l(d_lock);
+  d_nextrefresh = now + zone->soa->d_refresh;
+  d_stats.refreshes++;
+  d_zone = std::move(zone);
+  return true;
+}
+
+void RootMirror::maintain(time_t now)
+{
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    if(now < d_nextrefresh || (!d_axfr && d_file.empty()))
+      return;
+  }
+  refresh(now);
+}
+
+//! The zone, if we have one and it has not expired
+std::shared_ptr<const RootMirror::Zone> RootMirror::getZone(time_t now)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  if(!d_zone || now >= d_zone->loaded + (time_t)d_zone->soa->d_expire)
+    return nullptr;
+  return d_zone;
+}
+
+RootMirror::Result RootMirror::lookup(const DNSName& name, Referral& ref, time_t now)
+{
+  auto zone = getZone(now);
+  if(!zone || name.empty())
+    return Result::Unavailable;
+  // the deepest delegation, in the root zone that is the TLD
+  DNSName parent(name);
+  while(!parent.empty()) {
+    auto iter = zone->delegations.find(parent);
+    if(iter != zone->delegations.end()) {
+      ref = iter->second;
+      std::lock_guard<std::mutex> l(d_lock);
+      d_stats.referrals++;
+      return Result::Referral;
+    }
+    parent.pop_front();
+  }
+  std::lock_guard<std::mutex> l(d_lock);
+  d_stats.nxdomains++;
+  return Result::Nxdomain;
+}
+
+bool RootMirror::getSOA(std::unique_ptr<SOAGen>& soa, uint32_t& ttl, time_t now)
+{
+  auto zone = getZone(now);
+  if(!zone)
+    return false;
+  soa = std::make_unique<SOAGen>(*zone->soa);
+  ttl = zone->soattl;
+  return true;
+}
+
+bool RootMirror::getRootServers(std::multimap<DNSName, ComboAddress>& servers, time_t now)
+{
+  auto zone = getZone(now);
+  if(!zone)
+    return false;
+  servers = zone->delegations.find(DNSName())->second.servers;
+  return !servers.empty();
+}
+
+RootMirror::Stats RootMirror::getStats()
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  Stats ret = d_stats;
+  if(d_zone) {
+    ret.serial = d_zone->soa->d_serial;
+    ret.delegations = d_zone->delegations.size() - 1;
+  }
+  return ret;
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "comboaddress.hh"
+#include "dns-storage.hh"
+#include "record-types.hh"
+
+/*!
+   @file
+   @brief Defines RootMirror, a local copy of the root zone
+*/
+
+/*! \brief Keeps a copy of the root zone, so a resolver never has to ask the root servers (RFC 8806)
+
+   Almost every lookup that does not start from the cache starts with a query to
+   a root server, which only says which servers to ask for the TLD. The root
+   zone is small, public and changes slowly, so we can just as well have all of
+   it locally, and make those referrals ourselves.
+
+   The zone comes from an AXFR of a server that allows that (several root
+   servers do, see RFC 8806 appendix A), or from a file in master format like
+   https://www.internic.net/domain/root.zone. Only what is needed for referrals
+   is kept: the SOA, the NS records and the addresses of the nameservers.
+
+   The SOA timers are followed like a secondary server would. After 'refresh'
+   seconds maintain() checks the serial, and transfers the zone again if it
+   changed. If that fails, it tries again after 'retry' seconds. Once the zone
+   is older than 'expire', lookup() stops using it, and the resolver goes back
+   to asking the root servers.
+
+   This class can be shared between threads. */
+class RootMirror
+{
+public:
+  /*! If source is an IP address, with an optional port, the zone is transferred from there.
+      Otherwise it is the name of a file to read it from */
+  void setSource(const std::string& source);
+  //! Loads the zone from the source now. Returns false and keeps what we had if that did not work
+  bool refresh(time_t now=time(nullptr));
+  //! Calls refresh() if the SOA timers say so. Call this every few seconds
+  void maintain(time_t now=time(nullptr));
+
+  //! What the root says about a name below it
+  struct Referral
+  {
+    DNSName zone;    //!< the child zone, usually a TLD
+    std::vector<DNSName> nsses;                    //!< all its nameservers
+    std::multimap<DNSName, ComboAddress> servers;  //!< the addresses of those we have glue for, port 53
+    uint32_t ttl{0};
+  };
+  enum class Result { Unavailable, Referral, Nxdomain };
+  //! For name, returns Referral and fills out ref, or Nxdomain. Unavailable if we have no (valid) zone, or name is the root
+  Result lookup(const DNSName& name, Referral& ref, time_t now=time(nullptr));
+  //! The SOA of the zone, for negative answers. Returns false if Unavailable
+  bool getSOA(std::unique_ptr<SOAGen>& soa, uint32_t& ttl, time_t now=time(nullptr));
+  //! The root servers and their addresses, to prime a resolver with. Returns false if Unavailable
+  bool getRootServers(std::multimap<DNSName, ComboAddress>& servers, time_t now=time(nullptr));
+
+  struct Stats
+  {
+    uint32_t serial{0};
+    size_t delegations{0};
+    uint64_t refreshes{0};  //!< zone loaded
+    uint64_t checks{0};     //!< serial checked, no new zone needed
+    uint64_t failures{0};
+    uint64_t referrals{0};
+    uint64_t nxdomains{0};
+  };
+  Stats getStats();
+
+  double d_timeout{10}; //!< seconds, for every read during a transfer
+
+private:
+  struct Zone
+  {
+    std::unique_ptr<SOAGen> soa;
+    uint32_t soattl{0};
+    std::map<DNSName, Referral> delegations;  //!< including the root itself
+    time_t loaded{0};
+  };
+  std::shared_ptr<const Zone> getZone(time_t now);
+  std::unique_ptr<Zone> transfer(const ComboAddress& server);
+  std::unique_ptr<Zone> read(const std::string& fname);
+  uint32_t querySerial(const ComboAddress& server);
+  static void addRecord(Zone& zone, std::map<DNSName, std::vector<ComboAddress>>& addrs, const DNSName& name, uint32_t ttl, std::unique_ptr<RRGen>&& rr);
+  static void finish(Zone& zone, const std::map<DNSName, std::vector<ComboAddress>>& addrs);
+
+  std::string d_file;
+  ComboAddress d_server;
+  bool d_axfr{false};
+  std::shared_ptr<const Zone> d_zone;
+  time_t d_nextrefresh{0};
+  Stats d_stats;
+  std::mutex d_lock;
+};
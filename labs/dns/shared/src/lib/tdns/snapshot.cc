@@ -0,0 +1,179 @@
+#include "snapshot.hh"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+using namespace std;
+
+/*!
+   @file
+   @brief Implements writing and reading snapshot files
+*/
+
+// the file starts with this, then a version number and the time it was written
+static const char g_magic[] = "TDNSSNAP";
+static const uint16_t g_version = 1;
+
+void SnapshotWriter::putNumber(uint64_t val, unsigned int bytes)
+{
+  for(unsigned int n = bytes; n > 0; --n)
+    d_s.append(1, (char)(val >> (8 * (n - 1))));
+}
+
+void SnapshotWriter::putDouble(double val)
+{
+  uint64_t bits;
+  memcpy(&bits, &val, sizeof(bits));
+  putUInt64(bits);
+}
+
+void SnapshotWriter::putString(const std::string& str)
+{
+  if(str.size() > 65535)
+    throw std::out_of_range("string too long for snapshot");
+  putUInt16(str.size());
+  d_s.append(str);
+}
+
+void SnapshotWriter::putName(const DNSName& name)
+{
+  for(const auto& l : name) {
+    putUInt8(l.d_s.size());
+    d_s.append(l.d_s);
+  }
+  putUInt8(0);
+}
+
+// the port is in network byte order already
+void SnapshotWriter::putAddress(const ComboAddress& ca)
+{
+  if(ca.sin4.sin_family == AF_INET) {
+    putUInt8(4);
+    d_s.append((const char*)&ca.sin4.sin_addr, 4);
+  }
+  else {
+    putUInt8(6);
+    d_s.append((const char*)&ca.sin6.sin6_addr, 16);
+  }
+  d_s.append((const char*)&ca.sin4.sin_port, 2);
+}
+
+uint64_t SnapshotReader::getNumber(unsigned int bytes)
+{
+  if(d_s.size() - d_pos < bytes)
+    throw std::out_of_range("snapshot truncated");
+  uint64_t ret = 0;
+  for(unsigned int n = 0; n < bytes; ++n)
+    ret = (ret << 8) | (uint8_t)d_s[d_pos++];
+  return ret;
+}
+
+double SnapshotReader::getDouble()
+{
+  uint64_t bits = getUInt64();
+  double ret;
+  memcpy(&ret, &bits, sizeof(ret));
+  return ret;
+}
+
+std::string SnapshotReader::getString()
+{
+  size_t len = getUInt16();
+  if(d_s.size() - d_pos < len)
+    throw std::out_of_range("snapshot truncated");
+  d_pos += len;
+  return d_s.substr(d_pos - len, len);
+}
+
+DNSName SnapshotReader::getName()
+{
+  DNSName ret;
+  while(size_t len = getUInt8()) {
+    if(d_s.size() - d_pos < len)
+      throw std::out_of_range("snapshot truncated");
+    ret.push_back(DNSLabel(d_s.substr(d_pos, len)));
+    d_pos += len;
+  }
+  return ret;
+}
+
+ComboAddress SnapshotReader::getAddress()
+{
+  ComboAddress ret("0.0.0.0"); // all zero, also the parts of an IPv6 address we don't store
+  auto raw = [this](void* dest, size_t len) {
+    if(d_s.size() - d_pos < len)
+      throw std::out_of_range("snapshot truncated");
+    memcpy(dest, &d_s[d_pos], len);
+    d_pos += len;
+  };
+  uint8_t version = getUInt8();
+  if(version == 4) {
+    ret.sin4.sin_family = AF_INET;
+    raw(&ret.sin4.sin_addr, 4);
+  }
+  else if(version == 6) {
+    ret.sin6.sin6_family = AF_INET6;
+    raw(&ret.sin6.sin6_addr, 16);
+  }
+  else
+    throw std::out_of_range("unknown address family in snapshot");
+  raw(&ret.sin4.sin_port, 2);
+  return ret;
+}
+
+void writeSnapshot(const std::string& fname, const SnapshotWriter& sw)
+{
+  SnapshotWriter header;
+  for(const char* p = g_magic; *p; ++p)
+    header.putUInt8(*p);
+  header.putUInt16(g_version);
+  header.putUInt64(time(nullptr));
+
+  string tmp = fname + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+    throw std::runtime_error("Creating snapshot '"+tmp+"': "+string(strerror(errno)));
+  for(const string* part : {&header.str(), &sw.str()}) {
+    for(size_t pos = 0; pos < part->size(); ) {
+      ssize_t res = write(fd, part->c_str() + pos, part->size() - pos);
+      if(res < 0) {
+        int err = errno;
+        close(fd);
+        unlink(tmp.c_str());
+        throw std::runtime_error("Writing snapshot '"+tmp+"': "+string(strerror(err)));
+      }
+      pos += res;
+    }
+  }
+  // without this, a crash can leave us with a renamed file that has nothing in it
+  if(fsync(fd) < 0 || close(fd) < 0) {
+    int err = errno;
+    unlink(tmp.c_str());
+    throw std::runtime_error("Writing snapshot '"+tmp+"': "+string(strerror(err)));
+  }
+  if(rename(tmp.c_str(), fname.c_str()) < 0) {
+    int err = errno;
+    unlink(tmp.c_str());
+    throw std::runtime_error("Renaming snapshot to '"+fname+"': "+string(strerror(err)));
+  }
+}
+
+bool readSnapshot(const std::string& fname, std::unique_ptr<SnapshotReader>& sr)
+{
+  ifstream ifs(fname, std::ios::binary);
+  if(!ifs)
+    return false;
+  ostringstream data;
+  data << ifs.rdbuf();
+  sr = std::make_unique<SnapshotReader>(data.str());
+  string magic;
+  for(size_t n = 0; n < strlen(g_magic); ++n)
+    magic.append(1, (char)sr->getUInt8());
+  if(magic != g_magic)
+    throw std::runtime_error("'"+fname+"' is not a snapshot");
+  if(sr->getUInt16() != g_version)
+    throw std::runtime_error("Snapshot '"+fname+"' has an unsupported version");
+  sr->d_written = sr->getUInt64();
+  return true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <ctime>
+#include <memory>
+#include <string>
+#include "comboaddress.hh"
+#include "dns-storage.hh"
+
+/*!
+   @file
+   @brief Defines snapshot files, which let caches survive a restart
+*/
+
+/*! \brief Builds the contents of a snapshot
+
+   Numbers are stored in network byte order, names as a length byte for each
+   label followed by an empty label, like in a DNS message without compression.
+   What goes in is up to the caches, see their save() and load() methods. */
+class SnapshotWriter
+{
+public:
+  void putUInt8(uint8_t val) { d_s.append(1, (char)val); }
+  void putUInt16(uint16_t val) { putNumber(val, 2); }
+  void putUInt32(uint32_t val) { putNumber(val, 4); }
+  void putUInt64(uint64_t val) { putNumber(val, 8); }
+  void putDouble(double val);
+  //! Up to 64k
+  void putString(const std::string& str);
+  void putName(const DNSName& name);
+  void putAddress(const ComboAddress& ca);
+
+  const std::string& str() const { return d_s; }
+
+private:
+  void putNumber(uint64_t val, unsigned int bytes);
+  std::string d_s;
+};
+
+//! Reads what SnapshotWriter wrote, and throws std::out_of_range if there is less than that
+class SnapshotReader
+{
+public:
+  explicit SnapshotReader(std::string data) : d_s(std::move(data)) {}
+
+  uint8_t getUInt8() { return getNumber(1); }
+  uint16_t getUInt16() { return getNumber(2); }
+  uint32_t getUInt32() { return getNumber(4); }
+  uint64_t getUInt64() { return getNumber(8); }
+  double getDouble();
+  std::string getString();
+  DNSName getName();
+  ComboAddress getAddress();
+
+  bool done() const { return d_pos == d_s.size(); }
+
+  time_t d_written{0}; //!< when the snapshot was written, set by readSnapshot()
+
+private:
+  uint64_t getNumber(unsigned int bytes);
+  std::string d_s;
+  size_t d_pos{0};
+};
+
+/*! Writes a snapshot to fname. It goes to a temporary file first, which is flushed to disk
+    and then renamed to fname, so a crash halfway leaves the previous snapshot in place.
+    Throws on errors */
+void writeSnapshot(const std::string& fname, const SnapshotWriter& sw);
+/*! Returns false if fname does not exist. Throws if it is not a snapshot, or one of an
+    older format */
+bool readSnapshot(const std::string& fname, std::unique_ptr<SnapshotReader>& sr);
@@ -16,9 +16,30 @@
 #include "record-types.hh"
 #include "dns-storage.hh"
 #include "tdnssec.hh"
+#include "log.hh"
+#include "metrics.hh"
+#include "histogram.hh"
+#include "querylog.hh"
+#include "heavyhitters.hh"
 
 using namespace std;
 
+//! What the server did, see TDNS_METRICS
+Metrics g_metrics("tauth");
+//! How long the stages of answering take, served on /latency next to the metrics
+PipelineTimings g_timings;
+//! Which names and clients most queries are about, served on /heavyhitters
+HeavyHitters g_hitters;
+
+//! Counts a query that came in over transport
+static void countQuery(Metrics::Transport transport, const DNSMessageReader& dm, DNSType qtype)
+{
+  uint16_t bufsize;
+  bool doBit = false;
+  bool edns = dm.getEDNS(&bufsize, &doBit);
+  g_metrics.query(transport, qtype, edns, doBit);
+}
+
 /*! \mainpage Welcome to tdns
     \section Introduction
     tdns is a simple authoritative nameserver that is fully faithful to the 
@@ -70,10 +91,10 @@ void reportQuery(DNSName qname, DNSClass qclass, DNSType qtype, const ComboAddre
 
    This function implements "the algorithm" from RFC 1034 and is key to 
    unstanding DNS */
-bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddress& remote, DNSMessageWriter& response)
+bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddress& remote, DNSMessageWriter& response, StageTimer& st)
 {
   if(dm.dh.qr) {
-    cerr<<"Dropping non-query from "<<remote.toStringWithPort()<<endl;
+    TLOG(Warning, "Dropping non-query from ", remote.toStringWithPort());
     return false; // should not send ANY kind of response, loop potential
   }
 
@@ -82,9 +103,10 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
   dm.getQuestion(qname, qtype);
 
   DNSName origname=qname; // we need this for error reporting, we munch the original name
-  cout<<"Received a query from "<<remote.toStringWithPort()<<" for "<<qname<<" "<<dm.d_qclass<<" "<<qtype<<endl;
+  TLOG(Info, "Received a query from ", remote.toStringWithPort(), " for ", qname, " ", dm.d_qclass, " ", qtype);
 
   reportQuery(qname, dm.d_qclass, qtype, remote);
+  g_hitters.query(qname, remote);
   
   try {
     response.dh.id = dm.dh.id; response.dh.rd = dm.dh.rd;
@@ -94,9 +116,9 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
     uint16_t newsize; bool doBit{false};
 
     if(dm.getEDNS(&newsize, &doBit)) {
-      cout<<"\tHave EDNS, buffer size = "<<newsize<<", DO bit = "<<doBit<<endl;
+      TLOG(Debug, "\tHave EDNS, buffer size = ", newsize, ", DO bit = ", doBit);
       if(dm.d_ednsVersion != 0) {
-        cout<<"\tBad EDNS version: "<<(int)dm.d_ednsVersion<<endl;
+        TLOG(Debug, "\tBad EDNS version: ", (int)dm.d_ednsVersion);
         response.setEDNS(newsize, doBit, RCode::Badvers);
         return true;
       }
@@ -104,13 +126,13 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
     }
     
     if(qtype == DNSType::AXFR || qtype == DNSType::IXFR)  {
-      cout<<"\tQuery was for AXFR or IXFR over UDP, can't do that"<<endl;
+      TLOG(Debug, "\tQuery was for AXFR or IXFR over UDP, can't do that");
       response.dh.rcode = (int)RCode::Servfail;
       return true;
     }
 
     if(dm.dh.opcode != 0) {
-      cout<<"\tQuery had non-zero opcode "<<dm.dh.opcode<<", sending NOTIMP"<<endl;
+      TLOG(Debug, "\tQuery had non-zero opcode ", (int)dm.dh.opcode, ", sending NOTIMP");
       response.dh.rcode = (int)RCode::Notimp;
       return true;
     }
@@ -131,20 +153,21 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
       return true;
     }
     
+    st.mark(Stage::Parse);
     // find the best zone for this query
     DNSName zonename;
     auto fnd = zones.find(qname, zonename); 
     if(!fnd || !fnd->zone) {  // check if we found an actual zone
-      cout<<"\tNo zone matched ("<< (void*)fnd<<")" <<endl;
+      TLOG(Debug, "\tNo zone matched (", (void*)fnd, ")");
       if(fnd)
-        cout<<"\tLast match was "<<fnd->getName()<<", zone = "<<(void*)fnd->zone.get()<<endl;
+        TLOG(Debug, "\tLast match was ", fnd->getName(), ", zone = ", (void*)fnd->zone.get());
 
       for(;;) {
         qname.push_back(fnd->d_name);
         fnd = fnd->d_parent;
         if(!fnd) break;
 
-        cout<<"\tTrying parent node"<<endl;
+        TLOG(Debug, "\tTrying parent node");
         if(fnd->zone) {
           zonename = fnd->getName();
           break;
@@ -158,7 +181,7 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
     }
 
     // qname is now relative to the zonename
-    cout<<"\tFound best zone: "<<zonename<<", qname now "<<qname<<endl;
+    TLOG(Debug, "\tFound best zone: ", zonename, ", qname now ", qname);
     response.dh.aa = 1; 
     
     auto bestzone = fnd->zone.get(); // this loads a pointer to the zone contents
@@ -176,9 +199,10 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
        want any wildcard processing there */
     
     auto node = bestzone->find(searchname, lastnode, true, &passedZonecut, &passedWcard);
+    st.mark(Stage::Lookup);
     if(passedZonecut) {
       response.dh.aa = false;
-      cout<<"\tThis is a delegation, zonecutname: '"<<passedZonecut->getName()<<"'"<<endl;
+      TLOG(Debug, "\tThis is a delegation, zonecutname: '", passedZonecut->getName(), "'");
       vector<DNSName> toresolve;
 
       auto iter = passedZonecut->rrsets.find(DNSType::NS);  // is there an NS record here? should be!
@@ -199,7 +223,7 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
       addAdditional(bestzone, zonename, toresolve, response);
     }
     else if(!searchname.empty()) { // we had parts of the qname that did not match
-      cout<<"\tThis is an NXDOMAIN situation, unmatched parts: "<<searchname<<", lastnode: "<<lastnode<<endl;
+      TLOG(Debug, "\tThis is an NXDOMAIN situation, unmatched parts: ", searchname, ", lastnode: ", lastnode);
 
       const auto& rrset = bestzone->rrsets[DNSType::SOA]; // fetch the SOA record to indicate NXDOMAIN ttl
       auto ttl = min(rrset.ttl, dynamic_cast<SOAGen*>(rrset.contents[0].get())->d_minimum); // 2308 3
@@ -209,18 +233,20 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
       if(mustDoDNSSEC) { // should do DNSSEC
         addNXDOMAINDNSSEC(response, rrset, qname, node, passedZonecut, zonename);
       }
-      if(!CNAMELoopCount) // RFC 1034, 4.3.2, step 3.c
+      if(!CNAMELoopCount) { // RFC 1034, 4.3.2, step 3.c
         response.dh.rcode = (int)RCode::Nxdomain;
+        g_hitters.nxdomain(remote);
+      }
     }
     else {
-      cout<<"\tFound node in zone '"<<zonename<<"' for lhs '"<<qname<<"', searchname now '"<<searchname<<"', lastnode '"<<lastnode<<"', passedZonecut="<<passedZonecut<<endl;
+      TLOG(Debug, "\tFound node in zone '", zonename, "' for lhs '", qname, "', searchname now '", searchname, "', lastnode '", lastnode, "', passedZonecut=", passedZonecut);
       
       decltype(node->rrsets)::const_iterator iter;
 
       vector<DNSName> additional;
       // first we always check for a CNAME, which should be the only RRType at a node if present
       if(iter = node->rrsets.find(DNSType::CNAME), iter != node->rrsets.end()) {
-        cout<<"\tCNAME"<<endl;
+        TLOG(Debug, "\tCNAME");
         const auto& rrset = iter->second;
         response.putRR(DNSSection::Answer, lastnode+zonename, rrset.ttl, rrset.contents[0]);
         if(mustDoDNSSEC) {
@@ -231,17 +257,18 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
 
         // we'll only follow in-zone CNAMEs, which is not quite per-RFC, but a good idea
         if(target.makeRelative(zonename)) {
-          cout<<"\tFound CNAME, chasing to "<<target<<endl;
+          TLOG(Debug, "\tFound CNAME, chasing to ", target);
           searchname = target; 
           if(qtype != DNSType::CNAME && CNAMELoopCount++ < 10) {  // do not loop if they *wanted* the CNAME
             lastnode.clear();
+            st.mark(Stage::Render);
             goto loopCNAME;
           }
         }
       }  // we have a node, and it might even have RRSets we want
       else if(iter = node->rrsets.find(qtype), iter != node->rrsets.end() || (!node->rrsets.empty() && qtype==DNSType::ANY)) {
         if(passedWcard)
-          cout<<"\tWe had a wildcard synthesised match. Name of wildcard: "<<passedWcard->getName()<<endl;
+          TLOG(Debug, "\tWe had a wildcard synthesised match. Name of wildcard: ", passedWcard->getName());
         auto range = make_pair(iter, iter);
         
         if(qtype == DNSType::ANY) // if ANY, loop over all types
@@ -251,7 +278,7 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
         for(auto i2 = range.first; i2 != range.second; ++i2) {
           const auto& rrset = i2->second;
           for(const auto& rr : rrset.contents) {
-            cout<<"\tAdding a " << i2->first <<" RR\n";
+            TLOG(Debug, "\tAdding a ", i2->first, " RR");
             response.putRR(DNSSection::Answer, lastnode+zonename, rrset.ttl, rr);
             if(i2->first == DNSType::MX)
               additional.push_back(dynamic_cast<MXGen*>(rr.get())->d_name);
@@ -261,7 +288,7 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
         }
       }
       else {
-        cout<<"\tNode exists, qtype doesn't, NOERROR situation, inserting SOA"<<endl;
+        TLOG(Debug, "\tNode exists, qtype doesn't, NOERROR situation, inserting SOA");
         const auto& rrset = bestzone->rrsets[DNSType::SOA];
         auto ttl = min(rrset.ttl, dynamic_cast<SOAGen*>(rrset.contents[0].get())->d_minimum); // 2308 3
 
@@ -271,20 +298,59 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
       }
       addAdditional(bestzone, zonename, additional, response);
     }
+    st.mark(Stage::Render);
     return true;
   }
   catch(std::out_of_range& e) { // exceeded packet size
-    cout<<"\tQuery for '"<<origname<<"'|"<<qtype<<" got truncated"<<endl;
+    TLOG(Debug, "\tQuery for '", origname, "'|", qtype, " got truncated");
     response.clearRRs(); 
     response.dh.aa = 0;   response.dh.tc = 1; 
     return true;
   }
   catch(std::exception& e) {
-    cout<<"\tError processing query: "<<e.what()<<endl;
+    TLOG(Warning, "\tError processing query: ", e.what());
     return false;
   }
 }
 
+/* Receives one UDP question on sock, and sends the answer. qname and qtype are passed in so
+   their memory is reused from question to question. Returns false if nothing was sent */
+bool answerUDPQuestion(int sock, const ComboAddress& local, const DNSNode* zones, DNSName& qname, DNSType& qtype)
+{
+  ComboAddress remote(local);
+  try {
+    string message = SRecvfrom(sock, 512, remote);
+    uint64_t received = usecNow();
+    StageTimer st(g_timings);
+    DNSMessageReader dm(message);
+    dm.getQuestion(qname, qtype);
+    countQuery(Metrics::Transport::UDP, dm, qtype);
+    
+    DNSMessageWriter response(qname, qtype, dm.d_qclass);
+    
+    if(processQuestion(*zones, dm, remote, response, st)) {
+      if(response.dh.rcode)
+        TLOG(Debug, "\tSending response with rcode ", (RCode)response.dh.rcode);
+      
+      string packet = response.serialize();
+      st.mark(Stage::Render);
+      SSendto(sock, packet, remote);
+      st.mark(Stage::Send);
+      st.done(qtype);
+      g_metrics.response((RCode)response.dh.rcode, response.dh.tc);
+      logQuery(remote, qname, qtype, received, (RCode)response.dh.rcode, response.dh.tc ? QueryLogRecord::Truncated : 0, packet.size());
+      return true;
+    }
+    g_metrics.drop();
+    logQuery(remote, qname, qtype, received, RCode::Noerror, QueryLogRecord::Dropped, 0);
+  }
+  catch(std::exception& e) {
+    TLOG(Warning, "Query from ", remote.toStringWithPort(), " caused an error: ", e.what());
+    g_metrics.drop();
+  }
+  return false;
+}
+
 /* this is where all UDP questions come in. Note that 'zones' is const, 
    which protects us from accidentally changing anything */
 void udpThread(ComboAddress local, Socket* sock, const DNSNode* zones)
@@ -292,26 +358,8 @@ void udpThread(ComboAddress local, Socket* sock, const DNSNode* zones)
   DNSName qname;
   DNSType qtype;
 
-  for(;;) {
-    ComboAddress remote(local);
-    try {
-      string message = SRecvfrom(*sock, 512, remote);
-      DNSMessageReader dm(message);
-      dm.getQuestion(qname, qtype);
-      
-      DNSMessageWriter response(qname, qtype, dm.d_qclass);
-      
-      if(processQuestion(*zones, dm, remote, response)) {
-        if(response.dh.rcode)
-          cout<<"\tSending response with rcode "<<(RCode)response.dh.rcode <<endl;
-        
-        SSendto(*sock, response.serialize(), remote);
-      }
-    }
-    catch(std::exception& e) {
-      cerr<<"Query from "<<remote.toStringWithPort()<<" caused an error: "<<e.what()<<endl;
-    }
-  }
+  for(;;)
+    answerUDPQuestion(*sock, local, zones, qname, qtype);
 }
 
 /** \brief Looks up additional records
@@ -350,7 +398,7 @@ try
   }  
 }
 catch(std::out_of_range& e) { // exceeded packet size
-  cout<<"\tAdditional records would have overflowed the packet, stopped adding them, not truncating yet\n";
+  TLOG(Debug, "\tAdditional records would have overflowed the packet, stopped adding them, not truncating yet");
 }
 
 
@@ -361,13 +409,14 @@ catch(std::out_of_range& e) { // exceeded packet size
    Note that it is highly recommended to send the envelope (with length)
    as a single call. This saves packets and works around implementation bugs
    over at resolvers */
-static void writeTCPMessage(int sock, DNSMessageWriter& response)
+static size_t writeTCPMessage(int sock, DNSMessageWriter& response)
 {
   string ser="00"+response.serialize();
   uint16_t len = htons(ser.length()-2);
   ser[0] = *((char*)&len);
   ser[1] = *(((char*)&len) + 1);
   SWriten(sock, ser); 
+  return ser.size() - 2;
 }
 
 /*! helper to read a 16 bit length in network order. Returns 0 on EOF */
@@ -390,7 +439,7 @@ try
 {
   signal(SIGPIPE, SIG_IGN);
   Socket sock(s); // this will close for us
-  cout<<"TCP Connection from "<<remote.toStringWithPort()<<endl;
+  TLOG(Info, "TCP Connection from ", remote.toStringWithPort());
 
   // multiple questions can come in over a single TCP/IP connection
   for(;;) {
@@ -398,31 +447,37 @@ try
     if(!len) // likely EOF
       return;
     if(len > 512) {
-      cerr<<"Remote "<<remote.toStringWithPort()<<" sent question that was too big"<<endl;
+      TLOG(Warning, "Remote ", remote.toStringWithPort(), " sent question that was too big");
+      g_metrics.drop();
       return;
     }
     
     if(len < sizeof(dnsheader)) {
-      cerr<<"Dropping query from "<<remote.toStringWithPort()<<", too short"<<endl;
+      TLOG(Warning, "Dropping query from ", remote.toStringWithPort(), ", too short");
+      g_metrics.drop();
       return;
     }
 
     std::string message = SRead(sock, len);
+    uint64_t received = usecNow();
+    StageTimer st(g_timings);
     DNSMessageReader dm(message);
 
     DNSName name;
     DNSType type;
     dm.getQuestion(name, type);
+    countQuery(Metrics::Transport::TCP, dm, type);
 
     DNSMessageWriter response(name, type, DNSClass::IN, 16384);
 
     if(type == DNSType::AXFR || type == DNSType::IXFR) {
       if(dm.dh.opcode || dm.dh.qr) {
-        cerr<<"Dropping non-query AXFR from "<<remote.toStringWithPort()<<endl; // too weird
+        TLOG(Warning, "Dropping non-query AXFR from ", remote.toStringWithPort()); // too weird
+        g_metrics.drop();
         return;
       }
 
-      cout<<"AXFR requested for "<<name<<endl;
+      TLOG(Info, "AXFR requested for ", name);
 
       response.dh.id = dm.dh.id;
       response.dh.ad = response.dh.ra = response.dh.aa = 0;
@@ -432,12 +487,13 @@ try
       // as in processQuestion, find the best zone
       auto fnd = zones->find(name, zone);
       if(!fnd || !fnd->zone || !name.empty() || !fnd->zone->rrsets.count(DNSType::SOA)) {
-        cout<<"   This was not a zone, or zone had no SOA"<<endl;
+        TLOG(Info, "   This was not a zone, or zone had no SOA");
         response.dh.rcode = (int)RCode::Refused;
         writeTCPMessage(sock, response);
+        g_metrics.response(RCode::Refused, false);
         continue;
       }
-      cout<<"Answering from zone "<<zone<<endl;
+      TLOG(Info, "Answering from zone ", zone);
       auto node = fnd->zone.get();
 
       // send SOA, which is how an AXFR must start
@@ -477,19 +533,27 @@ try
       response.putRR(DNSSection::Answer, zone, node->rrsets[DNSType::SOA].ttl, node->rrsets[DNSType::SOA].contents[0]);
 
       writeTCPMessage(sock, response);
+      g_metrics.response((RCode)response.dh.rcode, false);
       return;
     }
     else {
-      if(processQuestion(*zones, dm, remote, response)) {
-        writeTCPMessage(sock, response);
+      if(processQuestion(*zones, dm, remote, response, st)) {
+        size_t size = writeTCPMessage(sock, response);
+        st.mark(Stage::Send);
+        st.done(type);
+        g_metrics.response((RCode)response.dh.rcode, response.dh.tc);
+        logQuery(remote, name, type, received, (RCode)response.dh.rcode, QueryLogRecord::TCP | (response.dh.tc ? QueryLogRecord::Truncated : 0), size);
       }
-      else
+      else {
+        g_metrics.drop();
+        logQuery(remote, name, type, received, RCode::Noerror, QueryLogRecord::TCP | QueryLogRecord::Dropped, 0);
         return;
+      }
     }
   }
 }
 catch(std::exception &e) {
-  cerr<<"TCP client thread spawned for "<<remote.toStringWithPort()<<" exiting: "<<e.what()<<endl;
+  TLOG(Warning, "TCP client thread spawned for ", remote.toStringWithPort(), " exiting: ", e.what());
 }
    
 //! connects to an authoritative server, retrieves a zone, returns it as a smart pointer
@@ -578,6 +642,15 @@ try
     thread tcpLoop(tcploop, tcplistener, local);
     tcpLoop.detach();
   }
+  if(const char* querylog = getenv("TDNS_QUERYLOG")) {
+    startQueryLog(querylog);
+    cout<<"Writing query log to "<<querylog<<endl;
+  }
+  if(const char* metrics = getenv("TDNS_METRICS")) {
+    g_metrics.addPage("/latency", []() { return g_timings.dump(); });
+    g_metrics.addPage("/heavyhitters", []() { return g_hitters.report(); });
+    cout<<"Serving metrics on http://"<<g_metrics.serve(ComboAddress(metrics, 9153)).toStringWithPort()<<"/metrics, /latency and /heavyhitters"<<endl;
+  }
   cout<<"Server is live"<<endl;
   pause();
 }
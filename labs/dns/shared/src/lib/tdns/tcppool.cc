@@ -0,0 +1,324 @@
+#include "tcppool.hh"
+#include <algorithm>
+#include <random>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include "dnsmessages.hh"
+#include "sclasses.hh"
+#include "timerwheel.hh"
+using namespace std;
+
+/*!
+   @file
+   @brief Implements the pool of persistent TCP connections for outgoing queries
+*/
+
+struct TCPPool::Connection
+{
+  int fd;                 //!< -1 once closed
+  ComboAddress server;
+  std::string buffer;     //!< read already, but not a complete message yet
+  std::map<uint16_t, Pending*> pending; //!< by ID
+  uint64_t lastused;      //!< msec
+  uint64_t idletimeout;   //!< msec
+};
+
+struct TCPPool::Pending
+{
+  DNSName qname;
+  DNSType qtype;
+  Engine::TaskHandle task{nullptr};
+  std::string response;
+  bool done{false};
+};
+
+static std::mt19937& getRandom()
+{
+  thread_local std::mt19937 gen{std::random_device{}()};
+  return gen;
+}
+
+TCPPool& TCPPool::get()
+{
+  thread_local TCPPool pool;
+  return pool;
+}
+
+TCPPool::TCPPool() : d_inengine(Engine::inTask())
+{
+}
+
+TCPPool::~TCPPool()
+{
+  if(d_inengine)
+    Engine::cancelTimer(d_reaptimer);
+  for(auto& c : d_conns) {
+    if(d_inengine)
+      Engine::unwatch(c.second->fd);
+    ::close(c.second->fd);
+  }
+}
+
+std::shared_ptr<TCPPool::Connection> TCPPool::pick(const ComboAddress& server)
+{
+  reap();
+  std::shared_ptr<Connection> ret;
+  for(auto& c : d_conns) {
+    if(c.second->server == server && c.second->pending.size() < d_maxpipeline && (!ret || c.second->pending.size() < ret->pending.size()))
+      ret = c.second;
+  }
+  return ret;
+}
+
+void TCPPool::reap()
+{
+  uint64_t now = msecNow(), next = 0;
+  for(auto iter = d_conns.begin(); iter != d_conns.end(); ) {
+    auto c = (iter++)->second; // close() erases it from d_conns
+    if(!c->pending.empty()) // detach() gets us here again once it is idle
+      continue;
+    uint64_t expires = c->lastused + c->idletimeout;
+    if(now >= expires)
+      close(c.get());
+    else if(!next || expires < next)
+      next = expires;
+  }
+  // a timer that fires early finds nothing to do, and sets itself again
+  if(d_inengine && next && (!d_reaptimer || next < d_reapat)) {
+    Engine::cancelTimer(d_reaptimer);
+    d_reapat = next;
+    d_reaptimer = Engine::addTimer(next, [this]() { d_reaptimer = 0; reap(); });
+  }
+}
+
+std::shared_ptr<TCPPool::Connection> TCPPool::connect(const ComboAddress& server, double* timeout)
+{
+  int fd = socket(server.sin4.sin_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd < 0)
+    throw std::runtime_error("Creating TCP socket for pool: "+string(strerror(errno)));
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // pipelined queries should not wait for each other
+
+  if(::connect(fd, (struct sockaddr*)&server, server.getSocklen()) < 0) {
+    if(errno != EINPROGRESS) {
+      int err = errno;
+      ::close(fd);
+      throw std::runtime_error("Connecting to "+server.toStringWithPort()+": "+string(strerror(err)));
+    }
+    uint64_t start = msecNow();
+    if(Engine::waitForWrite(fd, timeout) <= 0) {
+      ::close(fd);
+      throw std::runtime_error("Timeout connecting to "+server.toStringWithPort());
+    }
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 || err) {
+      ::close(fd);
+      throw std::runtime_error("Connecting to "+server.toStringWithPort()+": "+string(strerror(err)));
+    }
+    if(timeout)
+      *timeout = std::max(0.0, *timeout - (msecNow() - start) / 1000.0);
+  }
+
+  auto c = std::make_shared<Connection>();
+  c->fd = fd;
+  c->server = server;
+  c->lastused = msecNow();
+  c->idletimeout = d_idletimeout;
+  auto ptr = c.get();
+  if(d_inengine)
+    Engine::watch(fd, [this, ptr]() { readConnection(ptr); });
+  d_conns.insert({server, c});
+  d_stats.connects++;
+  return c;
+}
+
+void TCPPool::close(Connection* c)
+{
+  if(c->fd < 0)
+    return;
+  if(d_inengine)
+    Engine::unwatch(c->fd);
+  ::close(c->fd);
+  c->fd = -1;
+  d_stats.closed++;
+  for(auto& p : c->pending) // so they find out it broke
+    if(p.second->task)
+      Engine::wakeup(p.second->task);
+
+  auto range = d_conns.equal_range(c->server);
+  for(auto iter = range.first; iter != range.second; ++iter) {
+    if(iter->second.get() == c) {
+      d_conns.erase(iter); // if no query holds on to c, it is gone now
+      break;
+    }
+  }
+}
+
+bool TCPPool::send(Connection* c, const std::string& packet)
+{
+  // length and message in one go, so they leave in one segment
+  std::string msg;
+  msg.reserve(packet.size() + 2);
+  msg.append(1, (char)(packet.size() / 256));
+  msg.append(1, (char)(packet.size() % 256));
+  msg.append(packet);
+  // a partial write would garble the stream for all queries on it, so that counts as broken too
+  if(::send(c->fd, msg.c_str(), msg.size(), MSG_NOSIGNAL) != (ssize_t)msg.size())
+    return false;
+  c->lastused = msecNow();
+  return true;
+}
+
+void TCPPool::readConnection(Connection* c)
+{
+  char buf[4096];
+  bool eof = false;
+  for(;;) {
+    int res = read(c->fd, buf, sizeof(buf));
+    if(res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if(res <= 0) {
+      eof = true;
+      break;
+    }
+    c->buffer.append(buf, res);
+  }
+
+  // the responses can come back in any order
+  while(c->buffer.size() >= 2) {
+    size_t len = (uint8_t)c->buffer[0] * 256 + (uint8_t)c->buffer[1];
+    if(c->buffer.size() < len + 2)
+      break;
+    std::string msg = c->buffer.substr(2, len);
+    c->buffer.erase(0, len + 2);
+    d_stats.received++;
+    try {
+      DNSMessageReader dmr(msg);
+      DNSName qname;
+      DNSType qtype;
+      dmr.getQuestion(qname, qtype);
+      auto iter = c->pending.find(dmr.dh.id);
+      if(!dmr.dh.qr || iter == c->pending.end() || iter->second->done || !(iter->second->qname == qname) || iter->second->qtype != qtype) {
+        d_stats.unexpected++;
+        continue;
+      }
+      std::string keepalive;
+      if(dmr.getEDNSOption(EDNSOption::TCPKeepalive, keepalive) && keepalive.size() == 2) // in units of 100 msec
+        c->idletimeout = ((uint8_t)keepalive[0] * 256 + (uint8_t)keepalive[1]) * 100;
+      c->lastused = msecNow();
+      auto p = iter->second;
+      p->response = std::move(msg);
+      p->done = true;
+      if(p->task)
+        Engine::wakeup(p->task);
+    }
+    catch(std::exception& e) { // could not even parse it
+      d_stats.unexpected++;
+    }
+  }
+  if(eof)
+    close(c); // c might be gone after this
+}
+
+TCPPool::Stats TCPPool::getStats() const
+{
+  Stats ret = d_stats;
+  ret.connections = d_conns.size();
+  return ret;
+}
+
+TCPPool::Query::Query(TCPPool& pool, const ComboAddress& server, std::string packet, const DNSName& qname, DNSType qtype, double* timeout) :
+  d_pool(pool), d_server(server), d_packet(std::move(packet)), d_pending(std::make_unique<Pending>())
+{
+  if(d_packet.size() < 12)
+    throw std::runtime_error("Query packet is too short");
+  memcpy(&d_id, &d_packet.at(0), 2);
+  d_pending->qname = qname;
+  d_pending->qtype = qtype;
+  d_pending->task = Engine::currentTask();
+  attach(false, timeout);
+}
+
+TCPPool::Query::~Query()
+{
+  detach();
+}
+
+void TCPPool::Query::attach(bool fresh, double* timeout)
+{
+  if(!fresh)
+    d_conn = d_pool.pick(d_server);
+  d_reused = (bool)d_conn;
+  if(d_reused)
+    d_pool.d_stats.reused++;
+  else
+    d_conn = d_pool.connect(d_server, timeout);
+
+  while(d_conn->pending.count(d_id)) { // someone else on this connection has our ID
+    d_id = getRandom()();
+    memcpy(&d_packet.at(0), &d_id, 2);
+  }
+  if(!d_conn->pending.empty())
+    d_pool.d_stats.pipelined++;
+  d_conn->pending[d_id] = d_pending.get();
+  if(!d_pool.send(d_conn.get(), d_packet))
+    d_pool.close(d_conn.get()); // wait() will notice
+}
+
+void TCPPool::Query::detach()
+{
+  if(!d_conn)
+    return;
+  d_conn->pending.erase(d_id);
+  d_conn->lastused = msecNow();
+  d_conn.reset();
+  d_pool.reap(); // if the server asked us not to keep it open, it goes right away
+}
+
+const std::string& TCPPool::Query::response() const
+{
+  return d_pending->response;
+}
+
+int TCPPool::Query::wait(double* timeout)
+{
+  uint64_t deadline = timeout ? msecNow() + *timeout * 1000 : 0;
+  for(;;) {
+    if(d_pending->done)
+      return 1;
+    double left = 0;
+    if(timeout) {
+      uint64_t now = msecNow();
+      if(now >= deadline)
+        return 0;
+      left = (deadline - now) / 1000.0;
+    }
+
+    if(d_conn->fd < 0) { // it broke
+      if(!d_reused || d_retried) // a new connection that breaks is not going to get better
+        return -1;
+      d_retried = true;       // but the server may have closed an idle one just before we used it
+      detach();
+      try {
+        attach(true, timeout ? &left : nullptr);
+      }
+      catch(std::exception& e) {
+        return -1;
+      }
+      continue;
+    }
+
+    if(d_pool.d_inengine) {
+      Engine::suspend(timeout ? &left : nullptr);
+      continue;
+    }
+    // nobody else is reading our connection, so we do it ourselves
+    int res = waitForData(d_conn->fd, timeout ? &left : nullptr);
+    if(res < 0)
+      return -1;
+    if(res > 0)
+      d_pool.readConnection(d_conn.get());
+  }
+}
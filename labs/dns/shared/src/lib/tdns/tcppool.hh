@@ -0,0 +1,110 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <string>
+#include "comboaddress.hh"
+#include "dns-storage.hh"
+#include "engine.hh"
+
+/*!
+   @file
+   @brief Defines TCPPool, persistent TCP connections to nameservers shared by all outgoing queries of a thread
+*/
+
+/*! \brief Keeps TCP connections to nameservers open, and sends many queries over each of them
+
+   Setting up a TCP connection costs a round trip before the query can even be
+   sent. Once a nameserver truncates one answer it will likely truncate more, so
+   connections are kept open after use, and the next query to that server goes
+   out over the same one (RFC 7766, section 6.2.1).
+
+   Queries are pipelined: a query does not wait for the one before it. Responses
+   may come back in any order, and are matched to their query by ID and question.
+   At most d_maxpipeline queries are outstanding on a connection, beyond that a
+   new one is opened.
+
+   Connections that had nothing to do for d_idletimeout milliseconds are closed,
+   within an Engine by a timer of the worker loop, outside of it once the pool is
+   used again.
+   We send the edns-tcp-keepalive option (RFC 7828) in our queries, and if the
+   server returns it, its idle timeout replaces ours. If it says 0, we close the
+   connection as soon as nothing is outstanding on it anymore.
+
+   A server may close an idle connection at any time. If a query on a reused
+   connection finds that out, it is sent again once, over a new connection.
+
+   Within an Engine task, the connections are watched by the worker loop, which
+   wakes up the task a response is for. Outside of the engine, Query::wait()
+   reads the connection itself.
+
+   There is one pool per thread, get() returns it. It does no locking. */
+class TCPPool
+{
+  struct Connection;
+  struct Pending;
+public:
+  //! The pool of this thread
+  static TCPPool& get();
+  ~TCPPool();
+
+  //! A query that is waiting for its response. Sends the packet on construction, connecting if needed
+  class Query
+  {
+  public:
+    //! Throws if no connection could be set up within timeout seconds, which is reduced by the time that took
+    Query(TCPPool& pool, const ComboAddress& server, std::string packet, const DNSName& qname, DNSType qtype, double* timeout);
+    ~Query();
+    Query(const Query&) = delete;
+    Query& operator=(const Query&) = delete;
+
+    //! Returns 1 once the response arrived, 0 if it did not within timeout seconds, -1 if the connection broke
+    int wait(double* timeout);
+    //! The ID the query went out with, which differs from that in packet if that was in use already
+    uint16_t id() const { return d_id; }
+    const std::string& response() const;
+
+  private:
+    void attach(bool fresh, double* timeout);
+    void detach();
+
+    TCPPool& d_pool;
+    ComboAddress d_server;
+    std::string d_packet;
+    uint16_t d_id;
+    std::shared_ptr<Connection> d_conn;
+    std::unique_ptr<Pending> d_pending;
+    bool d_reused{false};
+    bool d_retried{false};
+  };
+
+  struct Stats
+  {
+    uint64_t connects{0};
+    uint64_t reused{0};      //!< queries sent over a connection that was already open
+    uint64_t pipelined{0};   //!< queries sent while another one was still outstanding on the connection
+    uint64_t received{0};
+    uint64_t unexpected{0};  //!< responses for nobody
+    uint64_t closed{0};      //!< because they were idle, or broke
+    uint64_t connections{0}; //!< open right now
+  };
+  Stats getStats() const;
+
+  unsigned int d_maxpipeline{100};
+  uint64_t d_idletimeout{10000}; //!< msec, unless the server told us otherwise
+
+private:
+  TCPPool();
+  std::shared_ptr<Connection> pick(const ComboAddress& server);
+  //! Closes connections that were idle for too long, and sets a timer for the next one in the engine
+  void reap();
+  std::shared_ptr<Connection> connect(const ComboAddress& server, double* timeout);
+  void close(Connection* c);
+  void readConnection(Connection* c);
+  bool send(Connection* c, const std::string& packet);
+
+  std::multimap<ComboAddress, std::shared_ptr<Connection>> d_conns;
+  Stats d_stats;
+  bool d_inengine;
+  uint64_t d_reaptimer{0}; //!< for reap(), 0 if not set
+  uint64_t d_reapat{0};    //!< msec, when it fires
+};
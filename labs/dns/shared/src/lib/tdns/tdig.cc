@@ -4,24 +4,105 @@
 #include <stdexcept>
 #include "sclasses.hh"
 #include <thread>
+#include <fstream>
 #include <signal.h>
 #include "record-types.hh"
+#include "loadgen.hh"
 
 /*! 
    @file
-   @brief Tiny 'dig'-like utility to create DNS queries & print responses
+   @brief Tiny 'dig'-like utility to create DNS queries & print responses, or to send lots of them
 */
 
 using namespace std;
 
+static void usage()
+{
+  cerr<<"Syntax: tdig name type ip[:port]"<<endl;
+  cerr<<"        tdig --load ip[:port] [options]"<<endl;
+  cerr<<endl;
+  cerr<<"With --load, sends queries for a while and reports qps, loss, rcodes and latency:"<<endl;
+  cerr<<"  --queries file    name and type per line, sent in turn"<<endl;
+  cerr<<"  --random zone     random names below zone instead, like 7kq2x0a9bmzt.zone"<<endl;
+  cerr<<"  --type type       of the random names, default A"<<endl;
+  cerr<<"  --qps n           send at this rate, no matter how many are unanswered"<<endl;
+  cerr<<"  --inflight n      or, keep this many unanswered, default 100"<<endl;
+  cerr<<"  --duration secs   default 10"<<endl;
+  cerr<<"  --timeout secs    after which a query counts as lost, default 1"<<endl;
+  cerr<<"  --threads n       default 1"<<endl;
+  cerr<<"  --sockets n       per thread, default 4"<<endl;
+  cerr<<"  --bufsize n       EDNS buffer size, 0 for no EDNS, default 4000"<<endl;
+}
+
+static int load(int argc, char** argv)
+{
+  LoadOptions opts;
+  opts.server = ComboAddress(argv[2], 53);
+  bool haveZone = false;
+  for(int n = 3; n < argc; n += 2) {
+    string opt(argv[n]);
+    if(n + 1 == argc)
+      throw std::runtime_error("Option "+opt+" needs a value");
+    string val(argv[n + 1]);
+    if(opt == "--queries") {
+      ifstream in(val);
+      if(!in)
+        throw std::runtime_error("Unable to open query list "+val);
+      opts.queries = readQueryList(in);
+      if(opts.queries.empty())
+        throw std::runtime_error("No queries in "+val);
+    }
+    else if(opt == "--random") {
+      opts.randomzone = makeDNSName(val);
+      haveZone = true;
+    }
+    else if(opt == "--type")
+      opts.randomtype = makeDNSType(val.c_str());
+    else if(opt == "--qps")
+      opts.qps = atof(val.c_str());
+    else if(opt == "--inflight")
+      opts.inflight = atoi(val.c_str());
+    else if(opt == "--duration")
+      opts.duration = atof(val.c_str());
+    else if(opt == "--timeout")
+      opts.timeout = atof(val.c_str());
+    else if(opt == "--threads")
+      opts.threads = atoi(val.c_str());
+    else if(opt == "--sockets")
+      opts.sockets = atoi(val.c_str());
+    else if(opt == "--bufsize")
+      opts.bufsize = atoi(val.c_str());
+    else {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+  if(opts.queries.empty() == !haveZone) {
+    cerr<<"Pass either --queries or --random"<<endl;
+    return EXIT_FAILURE;
+  }
+
+  cout<<"Sending to "<<opts.server.toStringWithPort()<<" for "<<opts.duration<<" s, ";
+  if(opts.qps > 0)
+    cout<<opts.qps<<" qps";
+  else
+    cout<<opts.inflight<<" in flight";
+  cout<<", "<<opts.threads<<" threads with "<<opts.sockets<<" sockets each"<<endl;
+  cout<<runLoad(opts).toString();
+  return EXIT_SUCCESS;
+}
+
 int main(int argc, char** argv)
 try
 {
+  signal(SIGPIPE, SIG_IGN);
+  if(argc >= 3 && string(argv[1]) == "--load")
+    return load(argc, argv);
+
   if(argc != 4) {
-    cerr<<"Syntax: tdig name type ip[:port]"<<endl;
+    usage();
     return(EXIT_FAILURE);
   }
-  signal(SIGPIPE, SIG_IGN);
   
   DNSName dn = makeDNSName(argv[1]);
   DNSType dt = makeDNSType(argv[2]);
@@ -3,7 +3,16 @@
 #include "swrappers.hh"
 #include "sclasses.hh"
 #include "dns-storage.hh"
+#include "negcache.hh"
+#include "timerwheel.hh"
+#include "infra.hh"
+#include "inflight.hh"
+#include "snapshot.hh"
+#include "log.hh"
+#include "histogram.hh"
 #include <memory>
+#include <set>
+#include <algorithm>
 #include <fstream>
 #include "tdns-c.h"
 
@@ -71,10 +80,21 @@ try
   }  
 }
 catch(std::out_of_range& e) { // exceeded packet size
-  cout<<"\tAdditional records would have overflowed the packet, stopped adding them, not truncating yet\n";
+  TLOG(Debug, "\tAdditional records would have overflowed the packet, stopped adding them, not truncating yet");
 }
 
 
+//! Puts the SOA of a zone in the authority section, which makes negative answers cacheable (RFC 2308)
+void putNegativeSOA(const DNSNode* zone, const DNSName& zonename, DNSMessageWriter& dmw)
+{
+  auto iter = zone->rrsets.find(DNSType::SOA);
+  if(iter == zone->rrsets.end() || iter->second.contents.empty())
+    return;
+  const auto& rrset = iter->second;
+  auto ttl = min(rrset.ttl, dynamic_cast<SOAGen*>(rrset.contents[0].get())->d_minimum); // 2308 3
+  dmw.putRR(DNSSection::Authority, zonename, ttl, rrset.contents[0]);
+}
+
 void print_str_hex (string str)
 {
   for(char& c : str) {
@@ -106,8 +126,38 @@ struct TDNSServerContext
   map<uint16_t, struct sockaddr_in> qid_to_addr;
   map<uint16_t, const char *> qid_to_nsIP;
   map<uint16_t, const char *> qid_to_nsDomain;
+  NegativeCache negcache;
+
+  //! An upstream query we have not heard back about yet
+  struct OutstandingQuery
+  {
+    string query;
+    struct sockaddr_in upstream;
+    unsigned int retransmits{0};
+    TimerWheel::TimerID timer{0};
+    uint64_t sent{0}; //!< usec, for measuring the round trip time
+  };
+  map<uint16_t, OutstandingQuery> qid_to_outstanding;
+  TimerWheel timers;
+  vector<uint16_t> expired_qids; //!< filled by the timers, processed by TDNSProcessTimeouts
+  unsigned int retransmit_msec{500}; //!< doubled for every retransmit
+  unsigned int max_retransmits{3};
+  InfraTable infra; //!< round trip times of the nameservers we sent queries to
+
+  //! A client asking for something we were already resolving for another client
+  struct Waiter
+  {
+    struct sockaddr_in client;
+    uint16_t qid;
+  };
+  InflightTable<pair<DNSName, DNSType>, Waiter> inflight;
+  map<uint16_t, pair<DNSName, DNSType>> qid_to_inflight; //!< the queries others are waiting for
+
+  PipelineTimings timings;
+  StageTimer timer{timings}; //!< the query being handled, from TDNSTimingStart() to TDNSTimingDone()
 };
 
+
 struct TDNSServerContext *TDNSInit(void)
 {
   auto ret = std::make_unique<TDNSServerContext>(); 
@@ -122,11 +172,13 @@ void TDNSCreateZone (struct TDNSServerContext *ctx, const char *zoneurl)
 
   auto zone = ctx->zones.add(zonename);
   auto newzone = std::make_unique<DNSNode>();
+  // the SOA minimum sets how long resolvers may cache our NXDOMAINs, keep it short for the lab
+  newzone->addRRs(SOAGen::make(DNSName({"ns"})+zonename, DNSName({"hostmaster"})+zonename, 1, 10800, 3600, 604800, 300));
   //zonename.push_front(DNSLabel("ns"));
   //newzone->addRRs(NSGen::make(zonename));
   zone->zone = std::move(newzone);
   ctx->url_to_zone[zoneurl_str] = zone;
-  cout << "Created zone named: " << zoneurl_str << endl;
+  TLOG(Info, "Created zone named: ", zoneurl_str);
 }
 
 void TDNSAddRecord(struct TDNSServerContext *ctx, const char *zoneurl, const char *subdomain, const char *IPv4, const char* NS)
@@ -136,9 +188,9 @@ void TDNSAddRecord(struct TDNSServerContext *ctx, const char *zoneurl, const cha
   dn = makeDNSName(subdomain);
   auto fnd = ctx->url_to_zone[zoneurl_str];
   if(!fnd) {
-    cout << "No such zone" << zoneurl_str << endl;
+    TLOG(Error, "No such zone", zoneurl_str);
   }
-  cout << "Add subdomain " << dn << "to zone " << zoneurl_str <<endl;
+  TLOG(Info, "Add subdomain ", dn, "to zone ", zoneurl_str);
 
   auto added = fnd->zone->add(dn);
   if (NS) {
@@ -150,12 +202,12 @@ void TDNSAddRecord(struct TDNSServerContext *ctx, const char *zoneurl, const cha
     added->zone = std::move(newzone);
     auto newzone_name = subdomain_str+"."+zoneurl_str;
     ctx->url_to_zone[newzone_name] = added;    
-    cout << "Its NS is " << ns << endl; 
-    cout << "Created zone named " << newzone_name << endl;
+    TLOG(Info, "Its NS is ", ns); 
+    TLOG(Info, "Created zone named ", newzone_name);
   }
   if (IPv4) {
     added->addRRs(AGen::make(IPv4), AAAAGen::make("::1"));
-    cout << "Its IP is " << IPv4 << endl;
+    TLOG(Info, "Its IP is ", IPv4);
   } 
 }
 void TDNSAddPTREntry (struct TDNSServerContext *ctx, const char *zone, const char *IP, const char *domain)
@@ -168,9 +220,9 @@ void TDNSAddPTREntry (struct TDNSServerContext *ctx, const char *zone, const cha
 
   auto fnd = ctx->url_to_zone[zone_str];
   if(!fnd) {
-    cout << "No such zone" << zone_str << endl;
+    TLOG(Error, "No such zone", zone_str);
   }
-  cout << "Add IP " << reverse_ip_dn << "to " << domain_dn << " mapping" << endl;
+  TLOG(Info, "Add IP ", reverse_ip_dn, "to ", domain_dn, " mapping");
   auto added = fnd->zone->add(reverse_ip_dn);
   added->addRRs(PTRGen::make(domain_dn));
 }
@@ -191,7 +243,7 @@ uint8_t TDNSParseMsg (const char *message, uint64_t size, struct TDNSParseResult
   response->nsDomain = NULL;
 
   if (dmr.dh.qr == TDNS_QUERY) {
-    cout << "Received a query" << endl;
+    TLOG(Debug, "Received a query");
     /* This is the response used in the future */
     response->dh = std::make_unique<dnsheader>().release();
     response->qname = strdup(dn.toString().c_str());
@@ -207,7 +259,7 @@ uint8_t TDNSParseMsg (const char *message, uint64_t size, struct TDNSParseResult
     return TDNS_QUERY;
   }
   else if (dmr.dh.qr == TDNS_RESPONSE) {
-    cout << "Received a response" << endl;
+    TLOG(Debug, "Received a response");
     response->dh = std::make_unique<dnsheader>().release();
     response->qname = strdup(dn.toString().c_str());
     response->qtype = (uint16_t) dt;
@@ -232,23 +284,33 @@ uint8_t TDNSParseMsg (const char *message, uint64_t size, struct TDNSParseResult
       while(dmr.getRR(rrsection, dn, dt, rrttl, rr)) {
         if(rrsection == DNSSection::Additional && dt == DNSType::A){
           auto agen =dynamic_cast<AGen*>(rr.get());
-          cout << "Got nsIP: " << agen->toString() << endl;
+          TLOG(Debug, "Got nsIP: ", agen->toString());
           response->nsIP = strdup(agen->toString().c_str());
         }
         if (rrsection == DNSSection::Authority && dt == DNSType::NS){
           auto nsgen = dynamic_cast<NSGen*>(rr.get());
-          cout << "Got NS: " << nsgen->toString() << endl;
+          TLOG(Debug, "Got NS: ", nsgen->toString());
           response->nsDomain = strdup(nsgen->toString().c_str());
         }
       }
     }
     return TDNS_RESPONSE;
   } else {
-    cout << "Unknown message type" << endl;
+    TLOG(Warning, "Unknown message type");
     return 2;
   }
 }
 
+void TDNSFreeParseResult (struct TDNSParseResult *parsed)
+{
+  delete parsed->dh;
+  free((char*)parsed->qname);
+  free((char*)parsed->nsIP);
+  free((char*)parsed->nsDomain);
+  parsed->dh = NULL;
+  parsed->qname = parsed->nsIP = parsed->nsDomain = NULL;
+}
+
 uint8_t TDNSFind (struct TDNSServerContext* context, struct TDNSParseResult *response, struct TDNSFindResult *ret)
 {
   DNSName last, dn;
@@ -257,28 +319,30 @@ uint8_t TDNSFind (struct TDNSServerContext* context, struct TDNSParseResult *res
 
   dn = makeDNSName(qname);
   if (strcmp(qname, dn.toString().c_str()) != 0) {
-    printf("The converted domain name doesn't match to the original one.\n");
+    TLOG(Debug, "The converted domain name doesn't match to the original one.");
     dn.pop_back();
   }
   ret->delegate_ip = NULL;
   response->nsIP = NULL;
   response->nsDomain = NULL;
 
-  cout << "Looking for " << dn << endl;
+  TLOG(Debug, "Looking for ", dn);
   
   auto fnd = context->zones.find(dn, last);
   if(!fnd) {
-    cout << "No such domain " << dn << endl;
+    TLOG(Debug, "No such domain ", dn);
     return false;
   }
-  cout << "Found domain: " << last << endl;
+  DNSName zonename = last;
+  TLOG(Debug, "Found domain: ", last);
   //zonename = last;
-  cout << "Looking for " << dn << endl;
+  TLOG(Debug, "Looking for ", dn);
 
   if (fnd->zone) {
     auto node = fnd->zone->find(dn, last, false);
-    cout << "Not matched: " << dn.toString() <<  endl;
-    cout << "Matched: " << last <<  endl;
+    context->timer.mark(Stage::Lookup);
+    TLOG(Debug, "Not matched: ", dn);
+    TLOG(Debug, "Matched: ", last);
 
     DNSName r_qname = makeDNSName(response->qname);
     if (strcmp(qname, r_qname.toString().c_str()) != 0) {
@@ -286,7 +350,7 @@ uint8_t TDNSFind (struct TDNSServerContext* context, struct TDNSParseResult *res
       r_qname.pop_back();
     } 
     //r_qname.pop_back();
-    cout << "Response query name: " << r_qname << endl;
+    TLOG(Debug, "Response query name: ", r_qname);
     DNSType r_qtype = (DNSType) response->qtype;
     DNSClass r_qclass = (DNSClass) response->qclass;
     
@@ -310,8 +374,8 @@ uint8_t TDNSFind (struct TDNSServerContext* context, struct TDNSParseResult *res
     if (node->zone && (empty.compare(dn.toString())!=0)) {
       /* check if the IP is available locally */
       auto cache_node = node->zone->find(dn, last, false);
-      cout << "Not matched: " << dn.toString() <<  endl;
-      cout << "Matched: " << last <<  endl;
+      TLOG(Debug, "Not matched: ", dn);
+      TLOG(Debug, "Matched: ", last);
       if (empty.compare(dn.toString())==0) {
         /* TODO: send A record */
         auto iter = cache_node->rrsets.find(r_qtype);
@@ -321,8 +385,8 @@ uint8_t TDNSFind (struct TDNSServerContext* context, struct TDNSParseResult *res
         for(auto i2 = range.first; i2 != range.second; ++i2) {
           const auto& rrset = i2->second;
           for(const auto& rr : rrset.contents) {
-            cout<<"Found Request Record Type: " << i2->first << endl;
-            cout<<"Value: " << rr->toString() << endl;
+            TLOG(Debug, "Found Request Record Type: ", i2->first);
+            TLOG(Debug, "Value: ", rr->toString());
             dmw.dh.aa=1;
             dmw.dh.rcode=0;
 
@@ -336,14 +400,15 @@ uint8_t TDNSFind (struct TDNSServerContext* context, struct TDNSParseResult *res
         }
         dmw.dh.aa=1;
         dmw.dh.rcode=(uint32_t) RCode::Nxdomain;
+        putNegativeSOA(fnd->zone.get(), zonename, dmw);
         auto serialized = dmw.serialize();
         memcpy (ret->serialized, serialized.c_str(), serialized.length());
         ret->len = serialized.length();
         return false;
       }
 
-      cout << "Handle delegation." << endl;
-      cout << "Zone name: " << last << endl;
+      TLOG(Debug, "Handle delegation.");
+      TLOG(Debug, "Zone name: ", last);
       auto it = node->zone->rrsets.find(DNSType::NS);
       if (it != node->zone->rrsets.end()) {
         dmw.dh.ra = 1;
@@ -361,7 +426,7 @@ uint8_t TDNSFind (struct TDNSServerContext* context, struct TDNSParseResult *res
           auto pos = full_ns_name.find(last.toString());
           
           DNSName ns_subdomain = makeDNSName(full_ns_name.substr(0, pos));
-          cout << "Resolve sub domain for NS: " << ns_subdomain << endl;
+          TLOG(Debug, "Resolve sub domain for NS: ", ns_subdomain);
 
           auto ns_node = node->zone->find(ns_subdomain, last, false);
           
@@ -372,8 +437,8 @@ uint8_t TDNSFind (struct TDNSServerContext* context, struct TDNSParseResult *res
           for(auto i2 = range.first; i2 != range.second; ++i2) {
             const auto& rrset = i2->second;
             for(const auto& rr : rrset.contents) {
-              cout<<"Found Request Record Type: " << i2->first << endl;
-              cout<<"Value: " << rr->toString() << endl;      
+              TLOG(Debug, "Found Request Record Type: ", i2->first);
+              TLOG(Debug, "Value: ", rr->toString());      
               response->nsIP = strdup(rr->toString().c_str());
               dmw.putRR(DNSSection::Additional, n, 3600, rr);
             }
@@ -386,6 +451,7 @@ uint8_t TDNSFind (struct TDNSServerContext* context, struct TDNSParseResult *res
       }
       dmw.dh.aa = 1;
       dmw.dh.rcode = (uint32_t) RCode::Nxdomain;
+      putNegativeSOA(fnd->zone.get(), zonename, dmw);
       auto serialized = dmw.serialize();
       memcpy (ret->serialized, serialized.c_str(), serialized.length());
       ret->len = serialized.length();
@@ -415,7 +481,7 @@ uint8_t TDNSFind (struct TDNSServerContext* context, struct TDNSParseResult *res
               auto pos = full_ns_name.find(last.toString());
               
               DNSName ns_subdomain = makeDNSName(full_ns_name.substr(0, pos));
-              cout << "Resolve sub domain for NS: " << ns_subdomain << endl;
+              TLOG(Debug, "Resolve sub domain for NS: ", ns_subdomain);
 
               auto ns_node = node->zone->find(ns_subdomain, last, false);
               
@@ -426,8 +492,8 @@ uint8_t TDNSFind (struct TDNSServerContext* context, struct TDNSParseResult *res
               for(auto i2 = range.first; i2 != range.second; ++i2) {
                 const auto& rrset = i2->second;
                 for(const auto& rr : rrset.contents) {
-                  cout<<"Found Request Record Type: " << i2->first << endl;
-                  cout<<"Value: " << rr->toString() << endl;      
+                  TLOG(Debug, "Found Request Record Type: ", i2->first);
+                  TLOG(Debug, "Value: ", rr->toString());      
                   response->nsIP = strdup(rr->toString().c_str());
                   dmw.putRR(DNSSection::Additional, n, 3600, rr);
                 }
@@ -439,7 +505,7 @@ uint8_t TDNSFind (struct TDNSServerContext* context, struct TDNSParseResult *res
             return true;
           }
         }
-        cout << "Corresponding RR not found" << endl;
+        TLOG(Debug, "Corresponding RR not found");
       }
       else {
         auto range = make_pair(iter, iter);
@@ -448,8 +514,8 @@ uint8_t TDNSFind (struct TDNSServerContext* context, struct TDNSParseResult *res
         for(auto i2 = range.first; i2 != range.second; ++i2) {
           const auto& rrset = i2->second;
           for(const auto& rr : rrset.contents) {
-            cout<<"Found Request Record Type: " << i2->first << endl;
-            cout<<"Value: " << rr->toString() << endl;
+            TLOG(Debug, "Found Request Record Type: ", i2->first);
+            TLOG(Debug, "Value: ", rr->toString());
             dmw.dh.aa=1;
             dmw.dh.rcode=0;
 
@@ -470,11 +536,12 @@ uint8_t TDNSFind (struct TDNSServerContext* context, struct TDNSParseResult *res
             return true;
           }
         }
-        cout << "Corresponding RR not found" << endl;
+        TLOG(Debug, "Corresponding RR not found");
       }
     }
     dmw.dh.aa=1;
     dmw.dh.rcode= (uint32_t) RCode::Nxdomain;
+    putNegativeSOA(fnd->zone.get(), zonename, dmw);
     auto serialized = dmw.serialize();
     memcpy (ret->serialized, serialized.c_str(), serialized.length());
     ret->len = serialized.length();
@@ -515,7 +582,7 @@ uint64_t TDNSPutNStoMessage (char *message, uint64_t size, TDNSParseResult *resp
   DNSType r_qtype = (DNSType) response->qtype;
   DNSClass r_qclass = (DNSClass) response->qclass;
   
-  cout << "Response query name: " << r_qname << endl;
+  TLOG(Debug, "Response query name: ", r_qname);
 
   DNSMessageWriter dmw(r_qname, r_qtype, r_qclass);
   dmw.dh.id = response->dh->id;
@@ -544,6 +611,293 @@ uint64_t TDNSPutNStoMessage (char *message, uint64_t size, TDNSParseResult *resp
   return serialized.length();
 }
 
+uint8_t TDNSCacheNegative (struct TDNSServerContext *context, const char *message, uint64_t size)
+try
+{
+  std::string msg(message, size);
+  DNSMessageReader dmr(msg);
+  DNSName qname, rrdn;
+  DNSType qtype, rrdt;
+  dmr.getQuestion(qname, qtype);
+
+  // answers are not negative, and without a SOA we may not cache (RFC 2308, section 5)
+  if(!dmr.dh.qr || dmr.dh.ancount || !dmr.dh.nscount)
+    return 0;
+  if((RCode)dmr.dh.rcode != RCode::Nxdomain && (RCode)dmr.dh.rcode != RCode::Noerror)
+    return 0;
+
+  DNSSection rrsection;
+  uint32_t rrttl;
+  std::unique_ptr<RRGen> rr;
+  while(dmr.getRR(rrsection, rrdn, rrdt, rrttl, rr)) {
+    if(rrsection != DNSSection::Authority || rrdt != DNSType::SOA || !qname.isPartOf(rrdn))
+      continue;
+    auto soa = dynamic_cast<SOAGen*>(rr.get());
+    if((RCode)dmr.dh.rcode == RCode::Nxdomain) {
+      TLOG(Info, "Caching NXDOMAIN for ", qname, ", SOA ", rrdn);
+      context->negcache.addNxdomain(qname, rrdn, *soa, rrttl);
+    }
+    else {
+      TLOG(Info, "Caching NODATA for ", qname, "|", qtype, ", SOA ", rrdn);
+      context->negcache.addNodata(qname, qtype, rrdn, *soa, rrttl);
+    }
+    return 1;
+  }
+  return 0;
+}
+catch(std::exception& e) { // a malformed response, C callers can't catch this
+  TLOG(Info, "Not caching a response we could not parse: ", e.what());
+  return 0;
+}
+
+uint8_t TDNSFindNegative (struct TDNSServerContext *context, struct TDNSParseResult *parsed, struct TDNSFindResult *result)
+{
+  DNSName qname = makeDNSName(parsed->qname);
+  DNSType qtype = (DNSType) parsed->qtype;
+  NegativeCache::Entry ne;
+
+  if(!context->negcache.get(qname, qtype, ne))
+    return 0;
+  TLOG(Info, "Negative cache hit for ", qname, "|", qtype, ", denied by ", ne.name);
+
+  DNSMessageWriter dmw(qname, qtype, (DNSClass) parsed->qclass);
+  dmw.dh.id = parsed->dh->id;
+  dmw.dh.rd = parsed->dh->rd;
+  dmw.dh.ra = 1;
+  dmw.dh.qr = TDNS_RESPONSE;
+  dmw.dh.opcode = parsed->dh->opcode;
+  if(ne.kind == NegativeCache::Kind::Nxdomain)
+    dmw.dh.rcode = (uint32_t) RCode::Nxdomain;
+
+  std::unique_ptr<RRGen> soa = std::make_unique<SOAGen>(*ne.soa);
+  dmw.putRR(DNSSection::Authority, ne.zone, ne.ttl(time(nullptr)), soa);
+
+  auto serialized = dmw.serialize();
+  memcpy (result->serialized, serialized.c_str(), serialized.length());
+  result->len = serialized.length();
+  return 1;
+}
+
+void TDNSTrackQuery (struct TDNSServerContext *context, uint16_t qid, const char *query, uint64_t size, struct sockaddr_in *upstream)
+{
+  auto& oq = context->qid_to_outstanding[qid];
+  context->timers.cancel(oq.timer); // a referral replaces the query we had outstanding
+  oq.query.assign(query, size);
+  oq.upstream = *upstream;
+  oq.retransmits = 0;
+  oq.sent = usecNow();
+  oq.timer = context->timers.add(msecNow() + context->retransmit_msec, [context, qid]() {
+      context->expired_qids.push_back(qid);
+    });
+}
+
+uint8_t TDNSQueryAnswered (struct TDNSServerContext *context, uint16_t qid)
+{
+  auto iter = context->qid_to_outstanding.find(qid);
+  if(iter == context->qid_to_outstanding.end())
+    return 0;
+  auto& oq = iter->second;
+  context->timers.cancel(oq.timer);
+  if(!oq.retransmits) // if we retransmitted, we can't tell which query this answers
+    context->infra.reportRTT(ComboAddress(oq.upstream), usecNow() - oq.sent);
+  context->qid_to_outstanding.erase(iter);
+  return 1;
+}
+
+int TDNSNextTimeout (struct TDNSServerContext *context)
+{
+  return context->timers.nextTimeout();
+}
+
+void TDNSProcessTimeouts (struct TDNSServerContext *context, int sockfd)
+{
+  context->expired_qids.clear();
+  context->timers.advance();
+
+  for(auto qid : context->expired_qids) {
+    auto iter = context->qid_to_outstanding.find(qid);
+    if(iter == context->qid_to_outstanding.end())
+      continue;
+    auto& oq = iter->second;
+    context->infra.reportTimeout(ComboAddress(oq.upstream));
+    if(oq.retransmits < context->max_retransmits) {
+      ++oq.retransmits;
+      TLOG(Info, "No response for query ", qid, ", retransmit ", oq.retransmits);
+      sendto(sockfd, oq.query.c_str(), oq.query.size(), 0, (struct sockaddr*)&oq.upstream, sizeof(oq.upstream));
+      oq.timer = context->timers.add(msecNow() + (context->retransmit_msec << oq.retransmits), [context, qid]() {
+          context->expired_qids.push_back(qid);
+        });
+      continue;
+    }
+
+    // we give up, tell the client and forget everything about this query
+    DNSMessageReader dmr(oq.query);
+    DNSName qname;
+    DNSType qtype;
+    dmr.getQuestion(qname, qtype);
+    TLOG(Warning, "Giving up on query ", qid, " for ", qname, "|", qtype, ", sending SERVFAIL");
+
+    DNSMessageWriter dmw(qname, qtype, dmr.d_qclass);
+    dmw.dh.id = qid;
+    dmw.dh.rd = dmr.dh.rd;
+    dmw.dh.ra = 1;
+    dmw.dh.qr = TDNS_RESPONSE;
+    dmw.dh.rcode = (uint32_t) RCode::Servfail;
+    auto serialized = dmw.serialize();
+    auto client = context->qid_to_addr.find(qid);
+    if(client != context->qid_to_addr.end()) {
+      sendto(sockfd, serialized.c_str(), serialized.length(), 0, (struct sockaddr*)&client->second, sizeof(client->second));
+    }
+    TDNSAnswerWaiters(context, sockfd, qid, serialized.c_str(), serialized.length());
+    context->qid_to_outstanding.erase(iter);
+    delAddrQID(context, qid);
+    delNSQID(context, qid);
+  }
+}
+
+uint8_t TDNSPickNS (struct TDNSServerContext *context, const char *message, uint64_t size, struct TDNSParseResult *parsed)
+try
+{
+  std::string msg(message, size);
+  DNSMessageReader dmr(msg);
+
+  DNSSection rrsection;
+  DNSName dn;
+  DNSType dt;
+  uint32_t rrttl;
+  std::unique_ptr<RRGen> rr;
+  set<DNSName> nsnames;
+  vector<pair<DNSName, ComboAddress>> servers; // glue
+  while(dmr.getRR(rrsection, dn, dt, rrttl, rr)) {
+    if(rrsection == DNSSection::Authority && dt == DNSType::NS)
+      nsnames.insert(dynamic_cast<NSGen*>(rr.get())->d_name);
+    else if(rrsection == DNSSection::Additional && dt == DNSType::A) {
+      ComboAddress addr(rr->toString(), 53);
+      servers.push_back({dn, addr});
+    }
+  }
+  // only glue for the nameservers we were referred to counts
+  servers.erase(remove_if(servers.begin(), servers.end(), [&nsnames](const pair<DNSName, ComboAddress>& sp) {
+        return !nsnames.count(sp.first);
+      }), servers.end());
+  if(servers.empty())
+    return 0;
+
+  context->infra.sort(servers, [](const pair<DNSName, ComboAddress>& sp) { return sp.second; });
+  auto best = servers.begin();
+  while(best != servers.end() && context->infra.isThrottled(best->second))
+    ++best;
+  if(best == servers.end()) // all of them are timing out, try one anyhow
+    best = servers.begin();
+
+  free((char*)parsed->nsIP);
+  free((char*)parsed->nsDomain);
+  parsed->nsIP = strdup(best->second.toString().c_str());
+  parsed->nsDomain = strdup(best->first.toString().c_str());
+  TLOG(Info, "Picked nameserver ", parsed->nsDomain, " on ", parsed->nsIP, " out of ", servers.size());
+  return 1;
+}
+catch(std::exception& e) { // a malformed response, C callers can't catch this
+  TLOG(Info, "Not picking a nameserver from a response we could not parse: ", e.what());
+  return 0;
+}
+
+uint8_t TDNSCoalesceQuery (struct TDNSServerContext *context, struct TDNSParseResult *parsed, struct sockaddr_in *client)
+{
+  auto key = make_pair(makeDNSName(parsed->qname), (DNSType)parsed->qtype);
+  if(context->inflight.join(key, TDNSServerContext::Waiter{*client, parsed->dh->id})) {
+    context->qid_to_inflight[parsed->dh->id] = key;
+    return 0;
+  }
+  TLOG(Info, "Already resolving ", key.first, "|", key.second, ", query ", parsed->dh->id, " will get that answer");
+  return 1;
+}
+
+int TDNSAnswerWaiters (struct TDNSServerContext *context, int sockfd, uint16_t qid, const char *message, uint64_t size)
+{
+  auto iter = context->qid_to_inflight.find(qid);
+  if(iter == context->qid_to_inflight.end())
+    return 0;
+  auto waiters = context->inflight.finish(iter->second);
+  context->qid_to_inflight.erase(iter);
+
+  string msg(message, size);
+  for(const auto& w : waiters) {
+    memcpy(&msg.at(0), &w.qid, sizeof(w.qid)); // the ID is the first field of the header
+    sendto(sockfd, msg.c_str(), msg.size(), 0, (struct sockaddr*)&w.client, sizeof(w.client));
+  }
+  return waiters.size();
+}
+
+void TDNSTimingStart (struct TDNSServerContext *context)
+{
+  context->timer = StageTimer(context->timings);
+}
+
+void TDNSTimingMark (struct TDNSServerContext *context, enum TDNSStage stage)
+{
+  static const Stage stages[] = {Stage::Parse, Stage::Lookup, Stage::Render, Stage::Send};
+  if((unsigned int)stage < sizeof(stages) / sizeof(stages[0]))
+    context->timer.mark(stages[stage]);
+}
+
+void TDNSTimingDone (struct TDNSServerContext *context, uint16_t qtype)
+{
+  context->timer.done((DNSType)qtype);
+}
+
+uint8_t TDNSDumpTimings (struct TDNSServerContext *context, const char *fname)
+{
+  ofstream out(fname);
+  out << context->timings.dump();
+  out.close();
+  if(!out) {
+    TLOG(Warning, "Unable to write timings to ", fname);
+    return 0;
+  }
+  return 1;
+}
+
+void TDNSGetInflightStats (struct TDNSServerContext *context, struct TDNSInflightStats *stats)
+{
+  auto st = context->inflight.getStats();
+  stats->resolutions = st.resolutions;
+  stats->waiters = st.waiters;
+  stats->maxwaiters = st.maxwaiters;
+}
+
+uint8_t TDNSSaveSnapshot (struct TDNSServerContext *context, const char *fname)
+{
+  try {
+    SnapshotWriter sw;
+    context->infra.save(sw);
+    context->negcache.save(sw);
+    writeSnapshot(fname, sw);
+    return 1;
+  }
+  catch(std::exception& e) {
+    TLOG(Warning, "Unable to save snapshot: ", e.what());
+    return 0;
+  }
+}
+
+uint8_t TDNSLoadSnapshot (struct TDNSServerContext *context, const char *fname)
+{
+  try {
+    std::unique_ptr<SnapshotReader> sr;
+    if(!readSnapshot(fname, sr))
+      return 0;
+    auto servers = context->infra.load(*sr);
+    auto negatives = context->negcache.load(*sr);
+    TLOG(Info, "Loaded ", servers, " nameservers and ", negatives, " negative entries from ", fname);
+    return 1;
+  }
+  catch(std::exception& e) {
+    TLOG(Warning, "Unable to load snapshot ", fname, ": ", e.what());
+    return 0;
+  }
+}
+
 void putAddrQID(struct TDNSServerContext* context, uint16_t qid, struct sockaddr_in *addr)
 {
   context->qid_to_addr[qid].sin_addr = addr->sin_addr;
@@ -88,6 +88,10 @@ uint8_t TDNSParseMsg (const char *message, uint64_t size, struct TDNSParseResult
 /* the IP address to which it delegates the query */
 uint8_t TDNSFind (struct TDNSServerContext* context, struct TDNSParseResult *parsed, struct TDNSFindResult *result);
 
+/* Frees what TDNSParseMsg(), TDNSFind() and TDNSPickNS() allocated in `parsed`, and sets those fields to NULL */
+/* Set nsIP and nsDomain to NULL first if they were handed to putNSQID() or came from getNSbyQID() */
+void TDNSFreeParseResult (struct TDNSParseResult *parsed);
+
 /**************/
 /* for Part 2 */
 /**************/
@@ -103,6 +107,87 @@ ssize_t TDNSGetIterQuery(struct TDNSParseResult *parsed, char *serialized);
 /* to let a client know the trajectory. */
 uint64_t TDNSPutNStoMessage (char *message, uint64_t size, struct TDNSParseResult *parsed, const char* nsIP, const char* nsDomain);
 
+/* Negative caching (RFC 2308) */
+/* Stores an NXDOMAIN or NODATA response from a nameserver in the negative cache of `context` */
+/* Only responses that have a SOA record in the authority section can be cached */
+/* Returns 1 if the response was cached, 0 otherwise */
+uint8_t TDNSCacheNegative (struct TDNSServerContext *context, const char *message, uint64_t size);
+
+/* Looks up the query represented by `parsed` in the negative cache */
+/* Names below a cached NXDOMAIN do not exist either (RFC 8020) */
+/* Returns 1 and stores a response in `result` if the query can be answered from the cache */
+uint8_t TDNSFindNegative (struct TDNSServerContext *context, struct TDNSParseResult *parsed, struct TDNSFindResult *result);
+
+/* Retransmissions and timeouts for queries to nameservers */
+/* Starts tracking query `qid`, which was just sent to `upstream`. If no response arrives in time, */
+/* TDNSProcessTimeouts() resends it with exponential backoff. When all retransmissions fail */
+/* it sends a SERVFAIL to the client stored with putAddrQID() and deletes the per-query context */
+void TDNSTrackQuery (struct TDNSServerContext *context, uint16_t qid, const char *query, uint64_t size, struct sockaddr_in *upstream);
+
+/* Stops tracking query `qid`, call this when a response arrives */
+/* Returns 1 if the query was outstanding, 0 if we were not waiting for it (anymore) */
+uint8_t TDNSQueryAnswered (struct TDNSServerContext *context, uint16_t qid);
+
+/* Returns the number of milliseconds until TDNSProcessTimeouts() needs to be called */
+/* or -1 if there are no outstanding queries. This can be passed to poll() */
+int TDNSNextTimeout (struct TDNSServerContext *context);
+
+/* Performs all retransmissions and timeouts that are due, sending them over `sockfd` */
+void TDNSProcessTimeouts (struct TDNSServerContext *context, int sockfd);
+
+/* Nameserver selection */
+/* A referral usually lists several nameservers. TDNSParseMsg() just stores the last one in parsed->nsIP */
+/* This picks the one that answered fastest so far, based on the round trip times measured by */
+/* TDNSTrackQuery() and TDNSQueryAnswered(), so pass the context you use for those. */
+/* Servers that keep timing out are avoided, and now and then another server is tried to keep measurements fresh */
+/* Replaces parsed->nsIP and parsed->nsDomain, returns 0 if the message has no usable glue */
+uint8_t TDNSPickNS (struct TDNSServerContext *context, const char *message, uint64_t size, struct TDNSParseResult *parsed);
+
+/* Coalescing identical queries */
+/* When many clients ask the same question at once, only the first query needs to be sent to a nameserver */
+/* Returns 1 if a query for the same name and type is already being resolved. The client is then stored */
+/* as a waiter, and nothing needs to be sent. Returns 0 if this query should be resolved as usual */
+uint8_t TDNSCoalesceQuery (struct TDNSServerContext *context, struct TDNSParseResult *parsed, struct sockaddr_in *client);
+
+/* Sends the final response to query `qid` to all clients waiting for it, each with their own ID */
+/* Returns how many clients were answered. TDNSProcessTimeouts() does this for queries it gives up on */
+int TDNSAnswerWaiters (struct TDNSServerContext *context, int sockfd, uint16_t qid, const char *message, uint64_t size);
+
+/* Every query is either resolved, or waits for a resolution that was already in progress */
+struct TDNSInflightStats {
+  uint64_t resolutions; /* queries that were resolved */
+  uint64_t waiters; /* queries that were answered with the resolution of another query */
+  uint64_t maxwaiters; /* the most waiters a single resolution had */
+};
+void TDNSGetInflightStats (struct TDNSServerContext *context, struct TDNSInflightStats *stats);
+
+/* Latency per stage of handling a query */
+/* Call TDNSTimingStart() when a query came in, TDNSTimingMark() when a stage is done, and */
+/* TDNSTimingDone() after the response was sent. The time since the previous mark goes to that stage */
+/* TDNSFind() marks TDNS_STAGE_LOOKUP itself, once it found the node, so mark TDNS_STAGE_RENDER after it */
+/* Only 1 in 64 queries is timed, or 1 in TDNS_SAMPLE if that environment variable is set */
+enum TDNSStage
+{
+  TDNS_STAGE_PARSE, TDNS_STAGE_LOOKUP, TDNS_STAGE_RENDER, TDNS_STAGE_SEND
+};
+void TDNSTimingStart (struct TDNSServerContext *context);
+void TDNSTimingMark (struct TDNSServerContext *context, enum TDNSStage stage);
+void TDNSTimingDone (struct TDNSServerContext *context, uint16_t qtype);
+
+/* Writes percentiles of how long each stage took, per query type, to `fname` */
+/* Returns 1 on success, 0 if the file could not be written */
+uint8_t TDNSDumpTimings (struct TDNSServerContext *context, const char *fname);
+
+/* Snapshots, so a restarted server does not start with empty caches */
+/* Saves the negative cache and the nameserver round trip times of `context` to `fname` */
+/* The file is replaced in one go, a crash while saving leaves the previous snapshot intact */
+/* Returns 1 on success, 0 if the snapshot could not be written */
+uint8_t TDNSSaveSnapshot (struct TDNSServerContext *context, const char *fname);
+
+/* Loads a snapshot written by TDNSSaveSnapshot() into `context`, leaving out entries that expired since */
+/* Returns 1 if a snapshot was loaded, 0 if there was none or it could not be read */
+uint8_t TDNSLoadSnapshot (struct TDNSServerContext *context, const char *fname);
+
 /* For maintaining per-query contexts */
 void putAddrQID(struct TDNSServerContext* context, uint16_t qid, struct sockaddr_in *addr);
 void getAddrbyQID(struct TDNSServerContext* context, uint16_t qid, struct sockaddr_in *addr);
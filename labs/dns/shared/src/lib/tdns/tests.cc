@@ -1,10 +1,40 @@
 #define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
+#define CATCH_CONFIG_NO_POSIX_SIGNALS // SIGSTKSZ is no longer a constant in recent glibc
 #include "ext/catch/catch.hpp"
 #include "dnsmessages.hh"
 #include "dns-storage.hh"
+#include "negcache.hh"
+#include "reccache.hh"
+#include "timerwheel.hh"
+#include "infra.hh"
+#include "inflight.hh"
+#include "engine.hh"
+#include "udppool.hh"
+#include "tcppool.hh"
+#include "snapshot.hh"
+#include "rootmirror.hh"
+#include "log.hh"
+#include "metrics.hh"
+#include "histogram.hh"
+#include "querylog.hh"
+#include "heavyhitters.hh"
+#include "loadgen.hh"
+#include "replay.hh"
+#include "labsim.hh"
+#include "opcount.hh"
+#include "tdns-c.h"
+#include "tres.hh"
+#include "sclasses.hh"
+#include <thread>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <unistd.h>
 
 using namespace std;
 
+bool answerUDPQuestion(int sock, const ComboAddress& local, const DNSNode* zones, DNSName& qname, DNSType& qtype);
+
 TEST_CASE("DNSLabel equality", "[dnslabel]") {
   DNSLabel a("www"), b("WWW");
   REQUIRE(a==b);
@@ -53,6 +83,25 @@ TEST_CASE("DNSName operations", "[dnsname]") {
   REQUIRE(unrelated.isPartOf(Org));
 }
 
+TEST_CASE("EDNS options", "[dnsmessage]") {
+  DNSMessageWriter dmw(makeDNSName("www.example.com"), DNSType::A);
+  dmw.setEDNS(1500, false);
+  dmw.addEDNSOption(EDNSOption::TCPKeepalive, "");
+  dmw.addEDNSOption(EDNSOption::Padding, string(4, '\0'));
+  DNSMessageReader dmr(dmw.serialize());
+
+  uint16_t bufsize;
+  bool doBit;
+  REQUIRE(dmr.getEDNS(&bufsize, &doBit));
+  REQUIRE(bufsize == 1500);
+  string data("x");
+  REQUIRE(dmr.getEDNSOption(EDNSOption::TCPKeepalive, data));
+  REQUIRE(data.empty());
+  REQUIRE(dmr.getEDNSOption(EDNSOption::Padding, data));
+  REQUIRE(data.size() == 4);
+  REQUIRE(!dmr.getEDNSOption(EDNSOption::Cookie, data));
+}
+
 TEST_CASE("DNS Messages", "[dnsmessage]") {
   DNSName qname({"www", "powerdns", "com"}), rname;
   DNSType rtype;
@@ -64,3 +113,1423 @@ TEST_CASE("DNS Messages", "[dnsmessage]") {
   REQUIRE(rname == qname);
   REQUIRE(rtype == DNSType::SOA);
 }
+
+TEST_CASE("Negative cache", "[negcache]") {
+  NegativeCache nc;
+  NegativeCache::Entry ne;
+  SOAGen soa({"ns", "example", "com"}, {"hostmaster", "example", "com"}, 1, 10800, 3600, 604800, 300);
+  DNSName zone({"example", "com"}), nosuch({"nosuch", "example", "com"}), www({"www", "example", "com"});
+  time_t now = 1000;
+
+  nc.addNxdomain(nosuch, zone, soa, 3600, now);
+  REQUIRE(nc.get(nosuch, DNSType::A, ne, now));
+  REQUIRE(ne.kind == NegativeCache::Kind::Nxdomain);
+  REQUIRE(ne.ttl(now) == 300); // SOA minimum is lower than the SOA TTL
+
+  // RFC 8020: nothing exists below an NXDOMAIN
+  REQUIRE(nc.get(DNSName({"a", "b", "nosuch", "example", "com"}), DNSType::AAAA, ne, now));
+  REQUIRE(ne.name == nosuch);
+  REQUIRE(!nc.get(zone, DNSType::A, ne, now));
+
+  nc.addNodata(www, DNSType::AAAA, zone, soa, 60, now);
+  REQUIRE(nc.get(www, DNSType::AAAA, ne, now));
+  REQUIRE(ne.kind == NegativeCache::Kind::Nodata);
+  REQUIRE(ne.ttl(now) == 60);
+  REQUIRE(!nc.get(www, DNSType::A, ne, now));
+
+  REQUIRE(!nc.get(www, DNSType::AAAA, ne, now + 60));
+  REQUIRE(!nc.get(nosuch, DNSType::A, ne, now + 300));
+  nc.purge(now + 300);
+  REQUIRE(nc.size() == 0);
+}
+
+TEST_CASE("Record cache", "[reccache]") {
+  RecordCache rc(4);
+  RecordCache::RRset rrset;
+  time_t now = 1000;
+  DNSName zone({"example", "com"}), ns1({"ns1", "example", "com"}), www({"www", "example", "com"});
+
+  vector<std::unique_ptr<RRGen>> nsses, glue, answer, cname;
+  nsses.push_back(NSGen::make(ns1));
+  glue.push_back(AGen::make("192.0.2.1"));
+  cname.push_back(CNAMEGen::make(www));
+  DNSName cut;
+  multimap<DNSName, ComboAddress> servers;
+  rc.add(zone, DNSType::NS, nsses, 3600, RecordCache::Rank::Referral, now);
+  REQUIRE(!rc.getDelegation(www, cut, servers, now)); // no addresses yet
+  rc.add(ns1, DNSType::A, glue, 3600, RecordCache::Rank::Glue, now);
+
+  REQUIRE(rc.getDelegation(www, cut, servers, now));
+  REQUIRE(cut == zone);
+  REQUIRE(servers.size() == 1);
+  REQUIRE(servers.begin()->second == ComboAddress("192.0.2.1", 53));
+
+  // glue does not count as an answer, and does not replace one
+  REQUIRE(!rc.get(ns1, DNSType::A, rrset, RecordCache::Rank::AuthAnswer, now));
+  answer.push_back(AGen::make("192.0.2.2"));
+  rc.add(ns1, DNSType::A, answer, 60, RecordCache::Rank::AuthAnswer, now);
+  rc.add(ns1, DNSType::A, glue, 3600, RecordCache::Rank::Glue, now);
+  REQUIRE(rc.get(ns1, DNSType::A, rrset, RecordCache::Rank::AuthAnswer, now));
+  REQUIRE(rrset.rrs.size() == 1);
+  REQUIRE(rrset.rrs[0]->toString() == "192.0.2.2");
+  REQUIRE(rrset.ttl(now + 10) == 50);
+  // until the answer expires
+  REQUIRE(!rc.get(ns1, DNSType::A, rrset, RecordCache::Rank::Glue, now + 60));
+  rc.add(ns1, DNSType::A, glue, 3600, RecordCache::Rank::Glue, now + 60);
+  REQUIRE(rc.get(ns1, DNSType::A, rrset, RecordCache::Rank::Glue, now + 60));
+  REQUIRE(rrset.rank == RecordCache::Rank::Glue);
+
+  // names in rdata survive the trip through wire format, case does not matter
+  REQUIRE(rc.get(DNSName({"EXAMPLE", "com"}), DNSType::NS, rrset, RecordCache::Rank::Glue, now));
+  REQUIRE(dynamic_cast<NSGen*>(rrset.rrs[0].get())->d_name == ns1);
+  auto st = rc.getStats();
+  REQUIRE(st.hits + st.misses == 5);
+  REQUIRE(st.entries == 2);
+  REQUIRE(st.bytes > 0);
+
+  // expired RRsets can still be had for a while, if you ask for them
+  REQUIRE(!rc.get(zone, DNSType::NS, rrset, RecordCache::Rank::Glue, now + 3600));
+  REQUIRE(rc.getStale(zone, DNSType::NS, rrset, RecordCache::Rank::Glue, now + 3600));
+  REQUIRE(rrset.ttl(now + 3600) == 0);
+  REQUIRE(rc.getStats().stale == 1);
+  rc.purge(now + 3600);
+  REQUIRE(rc.size() == 2);
+  REQUIRE(!rc.getStale(zone, DNSType::NS, rrset, RecordCache::Rank::Glue, now + 3600 + rc.d_staleseconds));
+  rc.purge(now + 3600 + rc.d_staleseconds);
+  REQUIRE(rc.size() == 1); // the glue we added later
+
+  // popular RRsets are refreshed in the last 10% of their TTL, and only once
+  RecordCache pf(1);
+  pf.add(www, DNSType::A, answer, 100, RecordCache::Rank::AuthAnswer, now);
+  pf.add(ns1, DNSType::A, answer, 100, RecordCache::Rank::AuthAnswer, now);
+  for(int n = 0; n < 3; ++n) {
+    REQUIRE(pf.get(www, DNSType::A, rrset, RecordCache::Rank::AuthAnswer, now));
+    REQUIRE(!rrset.prefetch);
+  }
+  REQUIRE(pf.get(www, DNSType::A, rrset, RecordCache::Rank::AuthAnswer, now + 91));
+  REQUIRE(rrset.prefetch);
+  REQUIRE(pf.get(www, DNSType::A, rrset, RecordCache::Rank::AuthAnswer, now + 92));
+  REQUIRE(!rrset.prefetch);
+  REQUIRE(pf.get(ns1, DNSType::A, rrset, RecordCache::Rank::AuthAnswer, now + 91));
+  REQUIRE(!rrset.prefetch); // not popular enough
+  pf.add(www, DNSType::A, answer, 100, RecordCache::Rank::AuthAnswer, now + 92);
+  REQUIRE(pf.get(www, DNSType::A, rrset, RecordCache::Rank::AuthAnswer, now + 93));
+  REQUIRE(rrset.ttl(now + 93) == 99);
+  st = pf.getStats();
+  REQUIRE(st.prefetches == 1);
+  REQUIRE(st.prefetchHitRatio() == Approx(1.0));
+
+  // within budget, the RRsets that were looked up stay, and names that are only asked once make way
+  RecordCache small(1);
+  small.d_maxbytes = 16384;
+  small.add(www, DNSType::A, answer, 3600, RecordCache::Rank::AuthAnswer, now);
+  for(int n = 0; n < 100; ++n) {
+    REQUIRE(small.get(www, DNSType::A, rrset, RecordCache::Rank::AuthAnswer, now));
+    small.add(DNSName({"host"+to_string(n), "example", "com"}), DNSType::CNAME, cname, 60, RecordCache::Rank::AuthAnswer, now);
+    REQUIRE(small.getStats().bytes <= small.d_maxbytes);
+  }
+  vector<RecordCache::Stats> pershard;
+  st = small.getStats(&pershard);
+  REQUIRE(pershard.size() == 1);
+  REQUIRE(st.evictions > 0);
+  REQUIRE(st.entries + st.evictions == 101);
+  REQUIRE(st.hitRatio() == Approx(1.0));
+  small.purge(now + 3600 + small.d_staleseconds);
+  REQUIRE(small.size() == 0);
+  REQUIRE(small.getStats().bytes == 0);
+}
+
+TEST_CASE("Timer wheel", "[timerwheel]") {
+  uint64_t now = 100000;
+  TimerWheel tw(10, now);
+  vector<int> fired;
+
+  auto a = tw.add(now + 25, [&]() { fired.push_back(1); });
+  auto b = tw.add(now + 25, [&]() { fired.push_back(2); });
+  tw.add(now + 5000, [&]() { fired.push_back(3); });       // needs a cascade
+  tw.add(now + 3600000, [&]() { fired.push_back(4); });    // an hour, needs several
+
+  REQUIRE(tw.size() == 4);
+  REQUIRE(tw.nextTimeout(now) <= 30);
+  REQUIRE(tw.advance(now + 20) == 0);
+  REQUIRE(tw.cancel(b));
+  REQUIRE(!tw.cancel(b));
+  REQUIRE(tw.advance(now + 30) == 1);
+  REQUIRE(fired == vector<int>({1}));
+  REQUIRE(!tw.pending(a));
+  REQUIRE(!tw.cancel(a)); // already fired
+
+  // a timer that adds another timer, which reuses the slot of the one that fired
+  tw.add(now + 100, [&]() { tw.add(now + 200, [&]() { fired.push_back(5); }); });
+  REQUIRE(tw.advance(now + 4999) == 2);
+  REQUIRE(fired == vector<int>({1, 5}));
+  REQUIRE(tw.advance(now + 5000) == 1);
+  REQUIRE(tw.advance(now + 3599999) == 0);
+  REQUIRE(tw.advance(now + 3600000) == 1);
+  REQUIRE(fired == vector<int>({1, 5, 3, 4}));
+  REQUIRE(tw.size() == 0);
+  REQUIRE(tw.nextTimeout(now) == -1);
+}
+
+TEST_CASE("Infra table", "[infra]") {
+  uint64_t now = 100000;
+  InfraTable it;
+  it.d_explore = 0;
+  ComboAddress fast("192.0.2.1", 53), slow("192.0.2.2", 53), dead("192.0.2.3", 53), unknown("192.0.2.4", 53);
+
+  for(int n = 0; n < 10; ++n) {
+    it.reportRTT(fast, 10000, now);
+    it.reportRTT(slow, 200000, now);
+  }
+  InfraTable::Stats st;
+  REQUIRE(it.getStats(fast, st, now));
+  REQUIRE(st.srtt == Approx(10000));
+  REQUIRE(!it.getStats(unknown, st, now));
+
+  for(int n = 0; n < 4; ++n)
+    it.reportTimeout(dead, now);
+  REQUIRE(it.isThrottled(dead, now));
+  REQUIRE(!it.isThrottled(slow, now));
+
+  vector<ComboAddress> servers{dead, slow, fast, unknown};
+  it.sort(servers, [](const ComboAddress& ca) { return ca; }, now);
+  REQUIRE(servers == vector<ComboAddress>({unknown, fast, slow, dead}));
+
+  // timeouts are forgotten over time, two half-lives later it gets another chance
+  REQUIRE(!it.isThrottled(dead, now + 2 * it.d_halflife));
+  REQUIRE(it.score(dead, now + 10 * it.d_halflife) < it.score(slow, now + 10 * it.d_halflife));
+
+  it.d_explore = 1;
+  servers = {fast, slow};
+  it.sort(servers, [](const ComboAddress& ca) { return ca; }, now);
+  REQUIRE(servers.front() == slow);
+
+  it.purge(now + 10 * it.d_halflife + it.d_maxage + 1);
+  REQUIRE(it.size() == 0);
+}
+
+TEST_CASE("Snapshots", "[snapshot]") {
+  time_t now = 1000;
+  uint64_t msec = 100000;
+  string fname = "testrunner.snapshot";
+  DNSName zone({"example", "com"}), ns1({"ns1", "example", "com"}), www({"www", "example", "com"}), old({"old", "example", "com"});
+  ComboAddress v4("192.0.2.1", 53), v6("2001:db8::1", 5300);
+  SOAGen soa({"ns", "example", "com"}, {"hostmaster", "example", "com"}, 1, 10800, 3600, 604800, 300);
+
+  InfraTable it;
+  NegativeCache nc;
+  RecordCache rc(4);
+  vector<std::unique_ptr<RRGen>> nsses, glue;
+  nsses.push_back(NSGen::make(ns1));
+  glue.push_back(AGen::make("192.0.2.1"));
+  glue.push_back(AGen::make("192.0.2.2"));
+  it.reportRTT(v4, 10000, msec);
+  it.reportTimeout(v6, msec);
+  nc.addNxdomain(DNSName({"nosuch", "example", "com"}), zone, soa, 3600, now);
+  rc.add(zone, DNSType::NS, nsses, 3600, RecordCache::Rank::Referral, now);
+  rc.add(ns1, DNSType::A, glue, 3600, RecordCache::Rank::Glue, now);
+  rc.add(old, DNSType::A, glue, 10, RecordCache::Rank::AuthAnswer, now);
+
+  SnapshotWriter sw;
+  it.save(sw, msec + 1000);
+  nc.save(sw, now);
+  rc.save(sw, now);
+  unlink(fname.c_str());
+  std::unique_ptr<SnapshotReader> sr;
+  REQUIRE(!readSnapshot(fname, sr));
+  writeSnapshot(fname, sw);
+  REQUIRE(access((fname + ".tmp").c_str(), F_OK) < 0);
+
+  // a little later, 'old' has expired
+  InfraTable it2;
+  NegativeCache nc2;
+  RecordCache rc2(8);
+  REQUIRE(readSnapshot(fname, sr));
+  REQUIRE(sr->d_written > 0);
+  REQUIRE(it2.load(*sr, msec + 1000) == 2);
+  REQUIRE(nc2.load(*sr, now + 10) == 1);
+  REQUIRE(rc2.load(*sr, now + 10) == 2);
+  REQUIRE(sr->done());
+
+  InfraTable::Stats st;
+  REQUIRE(it2.getStats(v4, st, msec + 1000));
+  REQUIRE(st.srtt == Approx(10000));
+  REQUIRE(it2.getStats(v6, st, msec + 1000));
+  REQUIRE(st.timeouts == Approx(1.0).epsilon(0.05));
+  NegativeCache::Entry ne;
+  REQUIRE(nc2.get(DNSName({"a", "nosuch", "example", "com"}), DNSType::A, ne, now + 10));
+  REQUIRE(ne.soa->d_minimum == 300);
+  REQUIRE(ne.ttl(now + 10) == 290);
+  DNSName cut;
+  multimap<DNSName, ComboAddress> servers;
+  REQUIRE(rc2.getDelegation(www, cut, servers, now + 10));
+  REQUIRE(cut == zone);
+  REQUIRE(servers.size() == 2);
+  RecordCache::RRset rrset;
+  REQUIRE(rc2.get(ns1, DNSType::A, rrset, RecordCache::Rank::Glue, now + 10));
+  REQUIRE(rrset.rank == RecordCache::Rank::Glue);
+  REQUIRE(rrset.ttl(now + 10) == 3590);
+  REQUIRE(!rc2.get(old, DNSType::A, rrset, RecordCache::Rank::Glue, now + 10));
+
+  // anything else is refused, and leaves the caches alone
+  {
+    std::ofstream ofs(fname);
+    ofs << "this is not a snapshot";
+  }
+  REQUIRE_THROWS(readSnapshot(fname, sr));
+  SnapshotReader truncated(sw.str().substr(0, sw.str().size() - 1));
+  it2.load(truncated);
+  nc2.load(truncated);
+  REQUIRE_THROWS_AS(rc2.load(truncated), std::out_of_range);
+  unlink(fname.c_str());
+}
+
+TEST_CASE("Root mirror", "[rootmirror]") {
+  time_t now = 1000;
+  string fname = "testrunner.root.zone";
+  {
+    std::ofstream ofs(fname);
+    ofs << "; the root zone, or a little of it\n";
+    ofs << ".\t86400\tIN\tSOA\ta.root-servers.net. nstld.verisign-grs.com. 2024010100 1800 900 604800 86400\n";
+    ofs << ".\t518400\tIN\tNS\ta.root-servers.net.\n";
+    ofs << "a.root-servers.net.\t518400\tIN\tA\t198.41.0.4\n";
+    ofs << "com.\t172800\tIN\tNS\ta.gtld-servers.net.\n";
+    ofs << "com.\t172800\tIN\tNS\tb.gtld-servers.net.\n";
+    ofs << "com.\t86400\tIN\tDS\t19718 13 2 8ACBB0CD28F41250A80A491389424D341522D946B0DA0C0291F2D3D771D7805A\n";
+    ofs << "a.gtld-servers.net.\t172800\tIN\tA\t192.5.6.30\n";
+    ofs << "a.gtld-servers.net.\t172800\tIN\tAAAA\t2001:503:a83e::2:30\n";
+    ofs << "nl.\t172800\tIN\tNS\tns1.dns.nl.\n";
+  }
+  RootMirror rm;
+  RootMirror::Referral ref;
+  REQUIRE(rm.lookup(makeDNSName("www.example.com"), ref, now) == RootMirror::Result::Unavailable);
+  rm.setSource(fname);
+  REQUIRE(rm.refresh(now));
+  unlink(fname.c_str());
+
+  REQUIRE(rm.lookup(makeDNSName("www.EXAMPLE.com"), ref, now) == RootMirror::Result::Referral);
+  REQUIRE(ref.zone == makeDNSName("com"));
+  REQUIRE(ref.nsses.size() == 2);
+  REQUIRE(ref.servers.size() == 2); // only a.gtld-servers.net has glue
+  REQUIRE(ref.servers.begin()->second == ComboAddress("192.5.6.30", 53));
+  REQUIRE(ref.ttl == 172800);
+  REQUIRE(rm.lookup(makeDNSName("www.nosuch"), ref, now) == RootMirror::Result::Nxdomain);
+  REQUIRE(rm.lookup(DNSName(), ref, now) == RootMirror::Result::Unavailable);
+  std::unique_ptr<SOAGen> soa;
+  uint32_t soattl;
+  REQUIRE(rm.getSOA(soa, soattl, now));
+  REQUIRE(soa->d_serial == 2024010100);
+  multimap<DNSName, ComboAddress> roots;
+  REQUIRE(rm.getRootServers(roots, now));
+  REQUIRE(roots.size() == 1);
+  auto st = rm.getStats();
+  REQUIRE(st.delegations == 2);
+  REQUIRE(st.referrals == 1);
+  REQUIRE(st.nxdomains == 1);
+
+  // the file is gone, so refreshing fails, and after the SOA expire time we don't use the zone anymore
+  rm.maintain(now + 1800);
+  REQUIRE(rm.getStats().failures == 1);
+  REQUIRE(rm.lookup(makeDNSName("www.example.com"), ref, now + 604799) == RootMirror::Result::Referral);
+  REQUIRE(rm.lookup(makeDNSName("www.example.com"), ref, now + 604800) == RootMirror::Result::Unavailable);
+
+  // from a server, the serial is checked before transferring the zone again
+  Socket listener(AF_INET, SOCK_STREAM);
+  ComboAddress local("127.0.0.1", 0);
+  SBind(listener, local);
+  SListen(listener, 10);
+  SGetsockname(listener, local);
+  std::thread server([&listener]() {
+      auto reply = [](int fd) {
+        string len = SRead(fd, 2);
+        DNSMessageReader dmr(SRead(fd, (uint8_t)len[0] * 256 + (uint8_t)len[1]));
+        DNSName qname;
+        DNSType qtype;
+        dmr.getQuestion(qname, qtype);
+        bool axfr = qtype == DNSType::AXFR;
+        DNSMessageWriter dmw(qname, qtype);
+        dmw.dh.id = dmr.dh.id;
+        dmw.dh.qr = 1;
+        std::unique_ptr<RRGen> soa = SOAGen::make(makeDNSName("a.root-servers.net"), makeDNSName("nstld.verisign-grs.com"), 2024010200);
+        std::unique_ptr<RRGen> ns = NSGen::make(makeDNSName("ns1.dns.nl")), glue = AGen::make("194.0.28.53");
+        dmw.putRR(DNSSection::Answer, DNSName(), 86400, soa);
+        if(axfr) {
+          dmw.putRR(DNSSection::Answer, DNSName(), 518400, ns); // not quite, but good enough
+          dmw.putRR(DNSSection::Answer, makeDNSName("nl"), 172800, ns);
+          dmw.putRR(DNSSection::Answer, makeDNSName("ns1.dns.nl"), 172800, glue);
+          dmw.putRR(DNSSection::Answer, DNSName(), 86400, soa);
+        }
+        string resp = dmw.serialize();
+        SWriten(fd, string{(char)(resp.size() / 256), (char)(resp.size() % 256)} + resp);
+      };
+      ComboAddress client;
+      for(int n = 0; n < 3; ++n) { // serial, AXFR, serial
+        Socket conn(SAccept(listener, client));
+        reply(conn);
+      }
+    });
+  rm.setSource(local.toStringWithPort());
+  REQUIRE(rm.refresh(now));
+  REQUIRE(rm.getStats().serial == 2024010200);
+  REQUIRE(rm.lookup(makeDNSName("www.example.com"), ref, now) == RootMirror::Result::Nxdomain);
+  REQUIRE(rm.lookup(makeDNSName("www.sidn.nl"), ref, now) == RootMirror::Result::Referral);
+  REQUIRE(ref.servers.size() == 1);
+  rm.maintain(now + 3599); // the default refresh of SOAGen is 10800
+  REQUIRE(rm.getStats().checks == 0);
+  rm.maintain(now + 10800);
+  server.join();
+  st = rm.getStats();
+  REQUIRE(st.checks == 1);
+  REQUIRE(st.refreshes == 2);
+  REQUIRE(rm.lookup(makeDNSName("www.sidn.nl"), ref, now + 10800 + 604799) == RootMirror::Result::Referral);
+}
+
+TEST_CASE("Inflight coalescing", "[inflight]") {
+  InflightTable<pair<DNSName, DNSType>, int> it;
+  auto key = make_pair(makeDNSName("www.example.com"), DNSType::A);
+
+  REQUIRE(it.join(key, 1));
+  REQUIRE(!it.join(key, 2));
+  REQUIRE(!it.join(key, 3));
+  REQUIRE(it.join({makeDNSName("www.example.com"), DNSType::AAAA}, 4));
+  REQUIRE(it.size() == 2);
+
+  REQUIRE(it.finish(key) == vector<int>({2, 3}));
+  REQUIRE(it.finish(key).empty());
+  REQUIRE(it.join(key, 5)); // a new resolution
+  REQUIRE(it.finish(key).empty());
+
+  auto st = it.getStats();
+  REQUIRE(st.resolutions == 3);
+  REQUIRE(st.waiters == 2);
+  REQUIRE(st.maxwaiters == 2);
+  REQUIRE(st.ratio() == Approx(0.4));
+}
+
+TEST_CASE("Logging", "[log]") {
+  ostringstream out, err;
+  setLogStreams(out, err);
+  REQUIRE(setLogLevel("info"));
+  REQUIRE(!setLogLevel("loud"));
+
+  int evaluated = 0;
+  TLOG(Debug, "not shown ", ++evaluated);
+  REQUIRE(evaluated == 0); // a line that is not logged does not even evaluate its arguments
+  {
+    string temp("copied");
+    TLOG(Info, "Looking for ", makeDNSName("www.example.com"), "|", DNSType::A, " ", 42, " ", temp.c_str());
+  } // temp is gone before the line gets written
+  std::thread t([]() { TLOG(Error, "From another thread"); });
+  t.join();
+  flushLog();
+  REQUIRE(out.str() == "Looking for www.example.com.|A 42 copied\n");
+  REQUIRE(err.str() == "From another thread\n");
+  REQUIRE(getLogStats().dropped == 0);
+
+  setLogLevel("warning");
+  setLogStreams(cout, cerr);
+}
+
+TEST_CASE("Query log", "[querylog]") {
+  QueryLogRecord r;
+  r.usec = 1500000000123456;
+  r.latency = 1234;
+  r.client = ComboAddress("2001:db8::1", 5300);
+  r.qtype = (uint16_t)DNSType::AAAA;
+  r.rcode = (uint8_t)RCode::Nxdomain;
+  r.flags = QueryLogRecord::TCP;
+  r.size = 512;
+  r.setQName(makeDNSName("www.example.com"));
+  REQUIRE(r.qnamelen == 17);
+  REQUIRE(r.getQName() == makeDNSName("www.example.com"));
+
+  istringstream in(queryLogHeader() + serializeQueryLogRecord(r) + serializeQueryLogRecord(r).substr(0, 10));
+  QueryLogReader qlr(in);
+  QueryLogRecord got;
+  REQUIRE(qlr.get(got));
+  REQUIRE(got.usec == r.usec);
+  REQUIRE(got.latency == 1234);
+  REQUIRE(got.client.toStringWithPort() == "[2001:db8::1]:5300");
+  REQUIRE(got.qtype == r.qtype);
+  REQUIRE(got.rcode == r.rcode);
+  REQUIRE(got.flags == r.flags);
+  REQUIRE(got.size == 512);
+  REQUIRE(got.getQName() == makeDNSName("www.example.com"));
+  REQUIRE_THROWS(qlr.get(got)); // cut off
+  istringstream other("not a query log");
+  REQUIRE_THROWS(QueryLogReader(other));
+
+  // what servers do, a record per answer from all threads, here 6 of them fit in a file
+  string fname = "testrunner.querylog";
+  REQUIRE(!queryLogEnabled());
+  logQuery(r); // ignored, not started yet
+  startQueryLog(fname, 300, 1);
+  REQUIRE(queryLogEnabled());
+  auto answer = [](int n) {
+    logQuery(ComboAddress("192.0.2.1", 1000 + n), makeDNSName("www.example.com"), DNSType::A, usecNow(), RCode::Noerror, 0, 100);
+  };
+  std::thread t([&answer]() {
+      for(int n = 0; n < 10; ++n)
+        answer(n);
+    });
+  for(int n = 10; n < 20; ++n)
+    answer(n);
+  t.join();
+  flushQueryLog();
+  auto st = getQueryLogStats();
+  REQUIRE(st.records == 20);
+  REQUIRE(st.dropped == 0);
+  REQUIRE(st.files == 4);
+
+  set<uint16_t> ports;
+  for(const auto& f : {fname + ".1", fname}) {
+    ifstream file(f);
+    QueryLogReader qlr(file);
+    while(qlr.get(got)) {
+      REQUIRE(got.getQName() == makeDNSName("www.example.com"));
+      REQUIRE(got.size == 100);
+      ports.insert(ntohs(got.client.sin4.sin_port));
+    }
+  }
+  REQUIRE(ports.size() == 8); // the two oldest files are gone
+  REQUIRE_THROWS(startQueryLog(fname)); // it runs already
+
+  // so the tests after this one don't log
+  stopQueryLog();
+  REQUIRE(!queryLogEnabled());
+  REQUIRE(getQueryLogStats().files == 4);
+  unlink(fname.c_str());
+  unlink((fname + ".1").c_str());
+}
+
+TEST_CASE("Heavy hitters", "[heavyhitters]") {
+  HeavyHitters hh;
+  ComboAddress busy("192.0.2.1", 1000), nx("2001:db8::53", 1000);
+  // 20000 different names from a few clients, hiding 3 names that are asked a lot
+  auto feed = [&hh, &busy](int from, int to) {
+    for(int n = from; n < to; ++n) {
+      hh.query(makeDNSName("host" + std::to_string(n) + ".example.net"), ComboAddress("198.51.100." + std::to_string(n % 100), 53));
+      if(n % 10 == 0)
+        hh.query(makeDNSName("www.example.com"), busy);
+      if(n % 20 == 0)
+        hh.query(makeDNSName("WWW.Example.COM"), busy); // same name
+      if(n % 40 == 0)
+        hh.query(makeDNSName("mail.example.com"), busy);
+      if(n % 50 == 0)
+        hh.query(makeDNSName("ftp.example.org"), busy);
+    }
+  };
+  std::thread t(feed, 0, 10000);
+  feed(10000, 20000);
+  t.join();
+  for(int n = 0; n < 5; ++n)
+    hh.nxdomain(nx);
+  hh.nxdomain(busy);
+
+  auto qnames = hh.top(HeavyHitters::Kind::QName, 3);
+  REQUIRE(qnames.size() == 3);
+  REQUIRE(qnames[0].key == "www.example.com.");
+  REQUIRE(qnames[0].count >= 3000); // never too low
+  REQUIRE(qnames[0].count < 3000 + 20000 / 20);
+  REQUIRE(qnames[1].key == "mail.example.com.");
+  REQUIRE(qnames[2].key == "ftp.example.org.");
+
+  auto zones = hh.top(HeavyHitters::Kind::Zone, 4);
+  REQUIRE(zones.size() == 4);
+  REQUIRE(zones[0].key == "example.net."); // equal counts go alphabetically
+  REQUIRE(zones[1].key == "net.");
+  REQUIRE(zones[2].key == "com.");
+  REQUIRE(zones[3].key == "example.com.");
+  REQUIRE(zones[3].count >= 3500);
+
+  auto clients = hh.top(HeavyHitters::Kind::Client, 1);
+  REQUIRE(clients.size() == 1);
+  REQUIRE(clients[0].key == "192.0.2.1");
+
+  auto nxs = hh.top(HeavyHitters::Kind::Nxdomain);
+  REQUIRE(nxs.size() == 2);
+  REQUIRE(nxs[0].key == "2001:db8::53");
+  REQUIRE(nxs[0].count == 5);
+
+  string report = hh.report(2);
+  REQUIRE(report.find("Top 2 qnames\n        " + std::to_string(qnames[0].count) + "  www.example.com.\n") != string::npos);
+  REQUIRE(report.find("Top 2 nxdomain-clients\n") != string::npos);
+}
+
+TEST_CASE("Metrics", "[metrics]") {
+  static Metrics m("test"); // the HTTP thread outlives the test
+  m.query(Metrics::Transport::UDP, DNSType::A, true, true);
+  std::thread t([]() {
+      m.query(Metrics::Transport::TCP, DNSType::AAAA, false, false);
+      m.query(Metrics::Transport::UDP, (DNSType)65000, true, false);
+      m.response(RCode::Nxdomain, false);
+      m.drop();
+    });
+  t.join();
+  m.response(RCode::Noerror, true);
+  m.cache(true);
+  m.cache(false);
+  m.cache(false);
+  m.addGauge("answer", "Of life, the universe and everything", []() { return 42.0; });
+  m.addPage("/hello", []() { return string("world\n"); });
+
+  auto tot = m.getTotals();
+  REQUIRE(tot.queries[(int)Metrics::Transport::UDP] == 2);
+  REQUIRE(tot.queries[(int)Metrics::Transport::TCP] == 1);
+  REQUIRE(tot.qtypes[(int)DNSType::A] == 1);
+  REQUIRE(tot.qtypes[256] == 1);
+  REQUIRE(tot.responses == 2);
+  REQUIRE(tot.rcodes[(int)RCode::Nxdomain] == 1);
+  REQUIRE(tot.truncated == 1);
+  REQUIRE(tot.dropped == 1);
+  REQUIRE(tot.edns == 2);
+  REQUIRE(tot.dnssecok == 1);
+  REQUIRE(tot.cachehits == 1);
+  REQUIRE(tot.cachemisses == 2);
+
+  auto local = m.serve(ComboAddress("127.0.0.1", 0));
+  auto get = [&local](const string& path) {
+    Socket sock(local.sin4.sin_family, SOCK_STREAM);
+    SConnect(sock, local);
+    SWriten(sock, "GET "+path+" HTTP/1.0\r\nHost: localhost\r\n\r\n");
+    string ret, part;
+    while(!(part = SRead(sock, 4096)).empty())
+      ret += part;
+    return ret;
+  };
+  string text = get("/metrics");
+  REQUIRE(text.find("HTTP/1.0 200 OK\r\n") == 0);
+  REQUIRE(text.find("\ntest_queries_total{transport=\"udp\"} 2\n") != string::npos);
+  REQUIRE(text.find("\ntest_queries_by_type_total{qtype=\"AAAA\"} 1\n") != string::npos);
+  REQUIRE(text.find("\ntest_queries_by_type_total{qtype=\"other\"} 1\n") != string::npos);
+  REQUIRE(text.find("\ntest_responses_total{rcode=\"Nxdomain\"} 1\n") != string::npos);
+  REQUIRE(text.find("\n# TYPE test_answer gauge\ntest_answer 42\n") != string::npos);
+  REQUIRE(get("/elsewhere").find("HTTP/1.0 404") == 0);
+  text = get("/hello");
+  REQUIRE(text.find("HTTP/1.0 200 OK\r\n") == 0);
+  REQUIRE(text.substr(text.size() - 10) == "\r\n\r\nworld\n");
+}
+
+TEST_CASE("Latency histograms", "[histogram]") {
+  // every bucket starts where the previous one ended, and is at most 1/16th of its values wide
+  for(unsigned int n = 0; n < LatencyHistogram::c_buckets - 1; ++n) {
+    REQUIRE(LatencyHistogram::highest(n) + 1 == LatencyHistogram::lowest(n + 1));
+    REQUIRE(LatencyHistogram::bucket(LatencyHistogram::lowest(n)) == n);
+    REQUIRE(LatencyHistogram::bucket(LatencyHistogram::highest(n)) == n);
+    REQUIRE((LatencyHistogram::highest(n) - LatencyHistogram::lowest(n)) * 16 <= LatencyHistogram::lowest(n));
+  }
+  REQUIRE(LatencyHistogram::bucket(~0ULL) == LatencyHistogram::c_buckets - 1);
+
+  LatencyHistogram h;
+  for(uint64_t n = 1; n <= 1000; ++n)
+    h.record(n * 1000); // 1 to 1000 usec
+  LatencyHistogram::Snapshot snap;
+  h.snapshot(snap);
+  REQUIRE(snap.count() == 1000);
+  REQUIRE(snap.max == 1000000);
+  auto near = [](uint64_t got, uint64_t want) { return got >= want && got <= want + want / 16; };
+  REQUIRE(near(snap.percentile(0.5), 500000));
+  REQUIRE(near(snap.percentile(0.99), 990000));
+  REQUIRE(snap.percentile(1) == 1000000); // not the end of its bucket, the actual maximum
+  REQUIRE(LatencyHistogram::Snapshot().percentile(0.5) == 0);
+
+  PipelineTimings pt(1);
+  {
+    StageTimer st(pt);
+    REQUIRE(st.sampled());
+    st.mark(Stage::Parse);
+    usleep(2000);
+    st.mark(Stage::Lookup);
+    st.mark(Stage::Render);
+    usleep(1000);
+    st.mark(Stage::Lookup); // like after chasing a CNAME
+    st.done(DNSType::A);
+    st.done(DNSType::A); // only the first counts
+  }
+  StageTimer(pt).done(DNSType::AAAA);
+  REQUIRE(pt.get(Stage::Lookup).count() == 1);
+  REQUIRE(pt.get(Stage::Lookup).max >= 3000000);
+  REQUIRE(pt.get(Stage::Total, DNSType::A).count() == 1);
+  REQUIRE(pt.get(Stage::Total, DNSType::A).max >= pt.get(Stage::Lookup).max);
+  REQUIRE(pt.get(Stage::Total).count() == 2);
+  REQUIRE(pt.get(Stage::Resolve).count() == 0);
+
+  string dump = pt.dump();
+  REQUIRE(dump.find("lookup   A ") != string::npos);
+  REQUIRE(dump.find("total    all               2 ") != string::npos);
+  REQUIRE(dump.find("resolve") == string::npos);
+
+  PipelineTimings none(4);
+  unsigned int sampled = 0;
+  for(int n = 0; n < 100; ++n)
+    sampled += StageTimer(none).sampled();
+  REQUIRE(sampled == 25);
+  none.d_every = 0;
+  REQUIRE(!StageTimer(none).sampled());
+}
+
+TEST_CASE("Engine", "[engine]") {
+  std::atomic<int> reads{0}, timeouts{0}, intask{0};
+  int fds[4][2];
+  for(auto& p : fds)
+    REQUIRE(pipe(p) == 0);
+
+  {
+    Engine e(2);
+    for(auto& p : fds) {
+      int fd = p[0];
+      REQUIRE(e.submit([&, fd]() {
+            if(Engine::inTask())
+              ++intask;
+            double timeout = 0.1;
+            if(Engine::waitForRead(fd, &timeout))
+              ++reads;
+            else
+              ++timeouts;
+          }));
+    }
+    REQUIRE(write(fds[0][1], "x", 1) == 1);
+    REQUIRE(write(fds[2][1], "x", 1) == 1);
+  } // waits for all tasks
+  REQUIRE(intask == 4);
+  REQUIRE(reads == 2);
+  REQUIRE(timeouts == 2);
+
+  // outside of the engine, we simply block
+  REQUIRE(!Engine::inTask());
+  double timeout = 0.1;
+  REQUIRE(Engine::waitForRead(fds[0][0], &timeout) == 1);
+
+  { // one running, one queued, then we are full
+    Engine e(1, 1, 1);
+    REQUIRE(e.submit([&]() { double t = 0.2; Engine::waitForRead(fds[1][0], &t); }));
+    while(e.getStats().running != 1)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    REQUIRE(e.submit([]() {}));
+    REQUIRE(!e.submit([]() {}));
+    auto st = e.getStats();
+    REQUIRE(st.queued == 1);
+    REQUIRE(st.rejected == 1);
+  }
+
+  std::atomic<int> helped{0};
+  { // helpers run on the same worker, and wake up the task that started them
+    Engine e(1);
+    REQUIRE(e.submit([&]() {
+          auto self = Engine::currentTask();
+          int done = 0;
+          for(int n = 0; n < 3; ++n)
+            Engine::spawn([&done, self]() { ++done; Engine::wakeup(self); });
+          while(done < 3)
+            Engine::suspend(nullptr);
+          helped = done;
+        }));
+  }
+  REQUIRE(helped == 3);
+
+  for(auto& p : fds) {
+    close(p[0]);
+    close(p[1]);
+  }
+}
+
+TEST_CASE("UDP pool", "[udppool]") {
+  Socket server(AF_INET, SOCK_DGRAM);
+  ComboAddress local("127.0.0.1", 0);
+  SBind(server, local);
+  SGetsockname(server, local);
+
+  // answers a query, after first sending something with the wrong ID
+  auto answer = [&server]() {
+    double timeout = 1;
+    REQUIRE(waitForData(server, &timeout) == 1);
+    ComboAddress client;
+    string packet = SRecvfrom(server, 512, client);
+    packet[2] |= 0x80; // QR
+    string wrongid = packet;
+    wrongid[0] ^= 1;
+    SSendto(server, wrongid, client);
+    SSendto(server, packet, client);
+  };
+
+  DNSMessageWriter dmw(makeDNSName("www.example.com"), DNSType::A);
+  dmw.randomizeID();
+  auto& pool = UDPPool::get();
+  {
+    UDPPool::Query q(pool, local, dmw.serialize(), makeDNSName("www.example.com"), DNSType::A);
+    answer();
+    double timeout = 1;
+    REQUIRE(q.wait(&timeout) == 1);
+    DNSMessageReader dmr(q.response());
+    REQUIRE(dmr.dh.id == q.id());
+  }
+  auto st = pool.getStats();
+  REQUIRE(st.sent == 1);
+  REQUIRE(st.received == 2);
+  REQUIRE(st.unexpected == 1);
+
+  { // of two queries out at the same time, the one that gets answered wins
+    Socket silent(AF_INET, SOCK_DGRAM);
+    ComboAddress quiet("127.0.0.1", 0);
+    SBind(silent, quiet);
+    SGetsockname(silent, quiet);
+    UDPPool::Query q1(pool, quiet, dmw.serialize(), makeDNSName("www.example.com"), DNSType::A);
+    UDPPool::Query q2(pool, local, dmw.serialize(), makeDNSName("www.example.com"), DNSType::A);
+    answer();
+    double timeout = 1;
+    REQUIRE(pool.waitAny({&q1, &q2}, &timeout) == 1);
+    REQUIRE(!q1.done());
+    timeout = 0.05;
+    REQUIRE(pool.waitAny({&q1}, &timeout) == -1);
+  }
+
+  // and the same within the engine, where the worker loop reads the pool
+  std::atomic<int> answered{0};
+  {
+    Engine e(1);
+    REQUIRE(e.submit([&]() {
+          UDPPool::Query q(UDPPool::get(), local, dmw.serialize(), makeDNSName("www.example.com"), DNSType::A);
+          double timeout = 1;
+          if(q.wait(&timeout) == 1 && !q.response().empty())
+            ++answered;
+        }));
+    answer();
+  }
+  REQUIRE(answered == 1);
+}
+
+TEST_CASE("Load generator", "[loadgen]") {
+  istringstream list("# name type\nwww.example.com A\n\ndrop.example.com AAAA\n");
+  auto queries = readQueryList(list);
+  REQUIRE(queries.size() == 2);
+  REQUIRE(queries[1].name == makeDNSName("drop.example.com"));
+  REQUIRE(queries[1].type == DNSType::AAAA);
+  istringstream bad("www.example.com\n");
+  REQUIRE_THROWS(readQueryList(bad));
+
+  Socket server(AF_INET, SOCK_DGRAM);
+  ComboAddress local("127.0.0.1", 0);
+  SBind(server, local);
+  SGetsockname(server, local);
+
+  // answers everything with NXDOMAIN, except the queries for drop.example.com
+  std::atomic<bool> stop{false};
+  std::thread responder([&]() {
+      while(!stop) {
+        double timeout = 0.01;
+        if(waitForData(server, &timeout) != 1)
+          continue;
+        ComboAddress client;
+        string packet = SRecvfrom(server, 512, client);
+        DNSMessageReader dmr(packet);
+        DNSName qname;
+        DNSType qtype;
+        dmr.getQuestion(qname, qtype);
+        if(qname == makeDNSName("drop.example.com"))
+          continue;
+        packet[2] |= 0x80;
+        packet[3] = (packet[3] & 0xf0) | (int)RCode::Nxdomain;
+        SSendto(server, packet, client);
+      }
+    });
+
+  LoadOptions opts;
+  opts.server = local;
+  opts.queries = queries;
+  opts.inflight = 4;
+  opts.threads = 2;
+  opts.sockets = 2;
+  opts.duration = 0.3;
+  opts.timeout = 0.1;
+  auto report = runLoad(opts);
+  REQUIRE(report.sent > 0);
+  REQUIRE(report.sent == report.answered + report.lost);
+  REQUIRE(report.answered > 0);
+  REQUIRE(report.lost > 0);
+  REQUIRE(report.unexpected == 0);
+  REQUIRE(report.rcodes[(int)RCode::Nxdomain] == report.answered);
+  REQUIRE(report.latency.count() == report.answered);
+
+  // open loop, with random names, which all get answered
+  opts.queries.clear();
+  opts.randomzone = makeDNSName("example.com");
+  opts.qps = 1000;
+  report = runLoad(opts);
+  stop = true;
+  responder.join();
+  REQUIRE(report.answered == report.sent);
+  REQUIRE(report.sent > 200);
+  REQUIRE(report.sent <= 302);
+  REQUIRE(report.toString().find("Nxdomain") != string::npos);
+}
+
+TEST_CASE("Capture replay", "[replay]") {
+  // a pcap file with Ethernet frames, of which some carry DNS over UDP and IPv4
+  auto le32 = [](uint32_t v) { return string((const char*)&v, 4); };
+  auto be16 = [](uint16_t v) { return string(1, (char)(v >> 8)) + string(1, (char)(v & 0xff)); };
+  auto frame = [&](uint32_t usec, const char* src, uint16_t sport, const char* dst, uint16_t dport, const string& payload) {
+    string f(12, 0);  // MAC addresses
+    f += be16(0x0800);
+    string ip = "\x45" + string(1, 0) + be16(28 + payload.size()) + string(4, 0) + "\x40\x11" + string(2, 0);
+    ComboAddress s(src), d(dst);
+    ip.append((const char*)&s.sin4.sin_addr.s_addr, 4);
+    ip.append((const char*)&d.sin4.sin_addr.s_addr, 4);
+    f += ip + be16(sport) + be16(dport) + be16(8 + payload.size()) + string(2, 0) + payload;
+    return le32(1700000000) + le32(usec) + le32(f.size()) + le32(f.size()) + f;
+  };
+  auto message = [](const char* name, uint16_t id, bool response, RCode rcode, const char* address) {
+    DNSMessageWriter dmw(makeDNSName(name), DNSType::A);
+    dmw.dh.id = htons(id);
+    dmw.dh.qr = response;
+    dmw.dh.rcode = (int)rcode;
+    if(address)
+      dmw.putRR(DNSSection::Answer, makeDNSName(name), 3600, AGen::make(address));
+    return dmw.serialize();
+  };
+  // version 2.4, no time zone or accuracy, snaplen 65535, Ethernet
+  string pcap = le32(0xa1b2c3d4) + string("\x02\x00\x04\x00", 4) + string(8, 0) + le32(65535) + le32(1);
+  pcap += frame(0, "10.0.0.1", 1234, "10.0.0.53", 53, message("www.example.com", 1, false, RCode::Noerror, nullptr));
+  pcap += frame(100, "10.0.0.9", 5000, "10.0.0.10", 123, "not DNS");
+  pcap += frame(200, "10.0.0.53", 53, "10.0.0.1", 1234, message("www.example.com", 1, true, RCode::Noerror, "192.0.2.1"));
+  pcap += frame(300, "10.0.0.2", 5678, "10.0.0.53", 53, message("nx.example.com", 2, false, RCode::Noerror, nullptr));
+  pcap += frame(400, "10.0.0.53", 53, "10.0.0.2", 5678, message("nx.example.com", 2, true, RCode::Nxdomain, nullptr));
+  pcap += frame(500, "10.0.0.3", 999, "10.0.0.53", 53, message("late.example.com", 3, false, RCode::Noerror, nullptr));
+
+  istringstream in(pcap);
+  auto queries = readCapturedQueries(in);
+  REQUIRE(queries.size() == 3);
+  REQUIRE(queries[0].usec == 1700000000000000ULL);
+  REQUIRE(queries[1].client == ComboAddress("10.0.0.2:5678"));
+  REQUIRE(!queries[1].response.empty());
+  REQUIRE(queries[2].response.empty());
+  istringstream cut(pcap.substr(0, pcap.size() - 10));
+  REQUIRE_THROWS(readCapturedQueries(cut));
+  istringstream notpcap("something else entirely");
+  REQUIRE_THROWS(PcapReader(notpcap));
+
+  REQUIRE(compareResponses(queries[0].response, queries[0].response).empty());
+  REQUIRE(compareResponses(queries[0].response, message("www.example.com", 1, true, RCode::Noerror, "192.0.2.2")) == "1 answers instead of 1, missing www.example.com. A 192.0.2.1");
+
+  // a server that says everything exists, and has the address of www.example.com right
+  Socket server(AF_INET, SOCK_DGRAM);
+  ComboAddress local("127.0.0.1", 0);
+  SBind(server, local);
+  SGetsockname(server, local);
+  std::thread responder([&]() {
+      for(int n = 0; n < 3; ++n) {
+        double timeout = 1;
+        if(waitForData(server, &timeout) != 1)
+          break;
+        ComboAddress client;
+        string packet = SRecvfrom(server, 512, client);
+        DNSMessageReader dmr(packet);
+        DNSName qname;
+        DNSType qtype;
+        dmr.getQuestion(qname, qtype);
+        string response = message(qname.toString().c_str(), ntohs(dmr.dh.id), true, RCode::Noerror, qname == makeDNSName("www.example.com") ? "192.0.2.1" : nullptr);
+        SSendto(server, response, client);
+      }
+    });
+
+  ReplayOptions opts;
+  opts.server = local;
+  opts.speed = 0;
+  opts.sockets = 2;
+  ostringstream details;
+  opts.details = &details;
+  auto report = replay(queries, opts);
+  responder.join();
+  REQUIRE(report.sent == 3);
+  REQUIRE(report.answered == 3);
+  REQUIRE(report.compared == 2);
+  REQUIRE(report.mismatched == 1);
+  REQUIRE(report.examples.size() == 1);
+  REQUIRE(report.examples[0] == "nx.example.com. A: rcode Noerror instead of Nxdomain");
+  REQUIRE(report.latency.count() == 3);
+  string lines = details.str();
+  REQUIRE(std::count(lines.begin(), lines.end(), '\n') == 3);
+
+  // captures can be out of order, what is earlier than the first query goes out right away
+  pcap = le32(0xa1b2c3d4) + string("\x02\x00\x04\x00", 4) + string(8, 0) + le32(65535) + le32(1);
+  pcap += frame(200000, "10.0.0.1", 1234, "10.0.0.53", 53, message("www.example.com", 4, false, RCode::Noerror, nullptr));
+  pcap += frame(100000, "10.0.0.2", 5678, "10.0.0.53", 53, message("early.example.com", 5, false, RCode::Noerror, nullptr));
+  istringstream unordered(pcap);
+  queries = readCapturedQueries(unordered);
+  REQUIRE(queries.size() == 2);
+  REQUIRE(queries[1].usec < queries[0].usec);
+  opts.speed = 1;
+  opts.timeout = 0.1;
+  opts.details = nullptr;
+  report = replay(queries, opts);  // nobody answers anymore
+  REQUIRE(report.sent == 2);
+  REQUIRE(report.lost == 2);
+  REQUIRE(report.elapsed < 1);
+}
+
+TEST_CASE("Lab simulator", "[labsim]") {
+  REQUIRE(LabNetwork::labAddress("40.0.0.20") == "127.40.0.20");
+
+  LinkProfile link;
+  link.latency = 5;
+  LabNetwork net(5397);
+  buildLab(net, link, {}, true);
+  net.start();
+
+  // local-dns.c has edu itself, so this goes to utexas.edu and then cs.utexas.edu, 10 msec round trip each
+  Socket sock(AF_INET, SOCK_DGRAM);
+  SConnect(sock, ComboAddress(c_labResolver, 5397));
+  DNSMessageWriter dmw(makeDNSName("aquila.cs.utexas.edu"), DNSType::A);
+  auto start = nsecNow();
+  SWrite(sock, dmw.serialize());
+  double timeout = 2;
+  REQUIRE(waitForData(sock, &timeout) == 1);
+  REQUIRE(nsecNow() - start >= 20000000);
+  ComboAddress from;
+  DNSMessageReader dmr(SRecvfrom(sock, 512, from));
+  REQUIRE(dmr.dh.rcode == (int)RCode::Noerror);
+  REQUIRE(ntohs(dmr.dh.ancount) == 1);
+
+  auto stats = net.getStats();
+  REQUIRE(stats.size() == 5);
+  REQUIRE(stats[2].name == "utexas.edu");
+  REQUIRE(stats[2].queries == 1);
+  REQUIRE(stats[3].name == "cs.utexas.edu");
+  REQUIRE(stats[3].queries == 1);
+  REQUIRE(stats[0].queries == 0);
+  net.stop();
+
+  // a link that loses half the packets, both ways
+  LabNetwork lossy(5398);
+  link.latency = 0;
+  link.loss = 0.5;
+  lossy.addServer("cs.utexas.edu", "127.50.0.30", [](struct TDNSServerContext* ctx) {
+      TDNSCreateZone(ctx, "cs.utexas.edu");
+      TDNSAddRecord(ctx, "cs.utexas.edu", "aquila", "172.0.0.1", NULL);
+    }, link);
+  lossy.start();
+  Socket client(AF_INET, SOCK_DGRAM);
+  SConnect(client, ComboAddress("127.50.0.30", 5398));
+  DNSMessageWriter aquila(makeDNSName("aquila.cs.utexas.edu"), DNSType::A);
+  for(int n = 0; n < 100; ++n)
+    SWrite(client, aquila.serialize());
+  int answers = 0;
+  for(;;) {
+    timeout = 0.2;
+    if(waitForData(client, &timeout) != 1)
+      break;
+    SRecvfrom(client, 512, from);
+    ++answers;
+  }
+  stats = lossy.getStats();
+  REQUIRE(stats[0].queries == 100);
+  REQUIRE(stats[0].answered == answers);
+  REQUIRE(answers > 10);
+  REQUIRE(answers < 50);
+}
+
+TEST_CASE("TDNS-C with malformed responses", "[tdns-c]") {
+  struct TDNSServerContext* ctx = TDNSInit();
+  TDNSCreateZone(ctx, "tdns.powerdns.org");
+
+  SECTION("TDNSCacheNegative") {
+    DNSMessageWriter dmw(makeDNSName("nx.tdns.powerdns.org"), DNSType::A);
+    dmw.dh.qr = 1;
+    dmw.dh.rcode = (int)RCode::Nxdomain;
+    dmw.putRR(DNSSection::Authority, makeDNSName("tdns.powerdns.org"), 300, SOAGen::make(makeDNSName("ns.tdns.powerdns.org"), makeDNSName("admin.tdns.powerdns.org"), 1));
+    string packet = dmw.serialize();
+    // the SOA is cut short, which the C code can't catch
+    REQUIRE(TDNSCacheNegative(ctx, packet.c_str(), packet.size() - 10) == 0);
+    REQUIRE(TDNSCacheNegative(ctx, packet.c_str(), packet.size()) == 1);
+  }
+
+  SECTION("TDNSPickNS") {
+    DNSMessageWriter dmw(makeDNSName("www.tdns.powerdns.org"), DNSType::A);
+    dmw.dh.qr = 1;
+    dmw.putRR(DNSSection::Authority, makeDNSName("tdns.powerdns.org"), 300, NSGen::make(makeDNSName("ns.tdns.powerdns.org")));
+    dmw.putRR(DNSSection::Additional, makeDNSName("ns.tdns.powerdns.org"), 300, AGen::make("192.0.2.53"));
+    string packet = dmw.serialize();
+    struct TDNSParseResult parsed;
+    memset(&parsed, 0, sizeof(parsed));
+    // the glue is cut short
+    REQUIRE(TDNSPickNS(ctx, packet.c_str(), packet.size() - 2, &parsed) == 0);
+    REQUIRE(parsed.nsIP == nullptr);
+    REQUIRE(TDNSPickNS(ctx, packet.c_str(), packet.size(), &parsed) == 1);
+    REQUIRE(string(parsed.nsIP) == "192.0.2.53");
+    REQUIRE(string(parsed.nsDomain) == "ns.tdns.powerdns.org.");
+    free((char*)parsed.nsIP);
+    free((char*)parsed.nsDomain);
+  }
+}
+
+//! Lets tres answer a query from a client on our side of a socket pair, like its main loop does
+static DNSMessageReader askTres(const std::string& name, DNSType type)
+{
+  Socket server(AF_INET, SOCK_DGRAM);
+  SBind(server, ComboAddress("127.0.0.1", 0));
+  Socket client(AF_INET, SOCK_DGRAM);
+  ComboAddress remote("127.0.0.1", 0);
+  SBind(client, remote);
+  SGetsockname(client, remote);
+
+  DNSMessageWriter dmw(makeDNSName(name), type);
+  dmw.dh.rd = 1;
+  processQuery(server, remote, DNSMessageReader(dmw.serialize()), usecNow(), StageTimer(g_timings));
+  double timeout = 0;
+  if(waitForData(client, &timeout) != 1)
+    throw std::runtime_error("tres did not answer");
+  ComboAddress from;
+  return DNSMessageReader(SRecvfrom(client, 512, from));
+}
+
+TEST_CASE("Serve stale", "[tres]") {
+  // a root server that never answers
+  LinkProfile link;
+  link.loss = 1;
+  LabNetwork net(5396);
+  net.addServer("root", "127.60.0.1", [](struct TDNSServerContext* ctx) {
+      TDNSCreateZone(ctx, "tres.test");
+    }, link);
+  net.start();
+  auto root = g_root;
+  g_root = {{makeDNSName("root.invalid"), ComboAddress("127.60.0.1", 5396)}};
+  g_nsport = 5396;
+
+  // expired a minute ago
+  std::vector<std::unique_ptr<RRGen>> rrs;
+  rrs.push_back(AGen::make("192.0.2.1"));
+  g_reccache.add(makeDNSName("stale.tres.test"), DNSType::A, rrs, 60, RecordCache::Rank::AuthAnswer, time(nullptr) - 120);
+
+  // every try times out, which is what serving stale is for
+  auto dmr = askTres("stale.tres.test", DNSType::A);
+  REQUIRE(dmr.dh.rcode == (int)RCode::Noerror);
+  DNSSection section;
+  DNSName name;
+  DNSType type;
+  uint32_t ttl;
+  std::unique_ptr<RRGen> rr;
+  REQUIRE(dmr.getRR(section, name, type, ttl, rr));
+  REQUIRE(name == makeDNSName("stale.tres.test"));
+  REQUIRE(type == DNSType::A);
+  REQUIRE(ttl == 30);
+  REQUIRE(rr->toString() == "192.0.2.1");
+  REQUIRE(net.getStats()[0].queries > 0);
+
+  // without anything stale, the client gets a SERVFAIL, not an empty answer
+  dmr = askTres("fresh.tres.test", DNSType::A);
+  REQUIRE(dmr.dh.rcode == (int)RCode::Servfail);
+
+  // answered clients leave no timers behind, neither their deadline nor that for a stale answer
+  {
+    std::lock_guard<std::mutex> l(g_deadlines.lock);
+    REQUIRE(g_deadlines.wheel.size() == 0);
+  }
+  REQUIRE(fireDeadlines() == -1);
+
+  g_root = root;
+  g_nsport = 53;
+}
+
+TEST_CASE("NXDOMAIN for the target of a CNAME", "[tres]") {
+  Socket server(AF_INET, SOCK_DGRAM);
+  ComboAddress local("127.0.0.1", 0);
+  SBind(server, local);
+  SGetsockname(server, local);
+
+  // alias.tres.test exists, it is where it points to that does not
+  std::thread responder([&]() {
+      double timeout = 2;
+      if(waitForData(server, &timeout) != 1)
+        return;
+      ComboAddress client;
+      DNSMessageReader dmr(SRecvfrom(server, 512, client));
+      DNSName qname;
+      DNSType qtype;
+      dmr.getQuestion(qname, qtype);
+      DNSMessageWriter dmw(qname, qtype);
+      dmw.dh.id = dmr.dh.id;
+      dmw.dh.qr = 1;
+      dmw.dh.aa = 1;
+      dmw.dh.rcode = (int)RCode::Nxdomain;
+      dmw.putRR(DNSSection::Answer, qname, 300, CNAMEGen::make(makeDNSName("gone.tres.test")));
+      dmw.putRR(DNSSection::Authority, makeDNSName("tres.test"), 300, SOAGen::make(makeDNSName("ns.tres.test"), makeDNSName("admin.tres.test"), 1));
+      SSendto(server, dmw.serialize(), client);
+    });
+
+  auto root = g_root;
+  g_root = {{makeDNSName("root.invalid"), local}};
+  g_nsport = ntohs(local.sin4.sin_port);
+  auto dmr = askTres("alias.tres.test", DNSType::A);
+  responder.join();
+  REQUIRE(dmr.dh.rcode == (int)RCode::Nxdomain);
+  NegativeCache::Entry ne;
+  REQUIRE(!g_negcache.get(makeDNSName("alias.tres.test"), DNSType::A, ne));
+  REQUIRE(!g_negcache.get(makeDNSName("alias.tres.test"), DNSType::AAAA, ne));
+
+  g_root = root;
+  g_nsport = 53;
+}
+
+TEST_CASE("Client deadlines", "[tres]") {
+  // nobody waits for this resolver
+  TDNSResolver tdr(g_root);
+  tdr.setDeadline(msecNow() - 1);
+  REQUIRE_THROWS_AS(tdr.resolveAt(makeDNSName("deadline.tres.test"), DNSType::A), DeadlineException);
+
+  LinkProfile dead;
+  dead.loss = 1;
+  LabNetwork net(5399);
+  net.addServer("dead", "127.60.0.2", [](struct TDNSServerContext* ctx) {
+      TDNSCreateZone(ctx, "tres.test");
+    }, dead);
+  net.addServer("slow", "127.60.0.3", [](struct TDNSServerContext* ctx) {
+      TDNSCreateZone(ctx, "tres.test");
+    });
+  net.start();
+  auto root = g_root;
+  g_nsport = 5399;
+  uint64_t resolutions = g_budget.resolutions, overruns = g_budget.overruns;
+
+  SECTION("a server that never answers costs the client no more than its deadline") {
+    g_root = {{makeDNSName("root.invalid"), ComboAddress("127.60.0.2", 5399)}};
+    g_deadlines.timeoutmsec = 300;
+    uint64_t start = msecNow();
+    auto dmr = askTres("dead.tres.test", DNSType::A);
+    uint64_t took = msecNow() - start;
+    REQUIRE(dmr.dh.rcode == (int)RCode::Servfail);
+    REQUIRE(took >= 300);
+    REQUIRE(took < 1000); // waiting for the retransmit would take 1050
+    REQUIRE(net.getStats()[0].queries > 0);
+  }
+
+  SECTION("a server that would answer after the deadline is not asked") {
+    g_root = {{makeDNSName("root.invalid"), ComboAddress("127.60.0.3", 5399)}};
+    // 2 seconds, give or take a second, so 6 seconds at worst, and the client waits 5
+    g_infra.reportRTT(ComboAddress("127.60.0.3", 5399), 2000000);
+    auto dmr = askTres("slow.tres.test", DNSType::A);
+    REQUIRE(dmr.dh.rcode == (int)RCode::Servfail);
+    REQUIRE(net.getStats()[1].queries == 0);
+  }
+
+  REQUIRE(g_budget.resolutions == resolutions + 1);
+  REQUIRE(g_budget.overruns == overruns + 1);
+
+  g_deadlines.timeoutmsec = 5000;
+  g_root = root;
+  g_nsport = 53;
+}
+
+/* What the hot paths may cost per query. If one of these fails because a change made a path
+   cheaper, lower the budget. If it got more expensive, that had better be worth it */
+TEST_CASE("Allocation and syscall budgets", "[budget]") {
+  if(!opCountsSupported())
+    return;
+
+  OpCounts before = opCounts();
+  void* ptr = malloc(10);
+  free(ptr);
+  auto str = std::make_unique<std::string>(100, 'x');
+  str.reset();
+  OpCounts used = opCounts() - before;
+  REQUIRE(used.allocs == 2);
+  REQUIRE(used.frees == 2);
+  REQUIRE(used.syscalls == 0);
+
+  DNSMessageWriter query(makeDNSName("server1.tdns.powerdns.org"), DNSType::A);
+  query.dh.rd = 1;
+  string packet = query.serialize();
+
+  // every path runs twice, and the second run counts, so one-time setup does not
+  auto measure = [&used](std::function<void()> work) {
+    for(int n = 0; n < 2; ++n) {
+      OpCounts before = opCounts();
+      work();
+      used = opCounts() - before;
+    }
+  };
+
+  SECTION("tauth answers over UDP") {
+    DNSNode zones;
+    auto zone = zones.add({"tdns", "powerdns", "org"});
+    auto newzone = std::make_unique<DNSNode>();
+    newzone->addRRs(SOAGen::make({"ns1", "tdns", "powerdns", "org"}, {"admin", "powerdns", "org"}, 1),
+                    NSGen::make({"ns1", "tdns", "powerdns", "org"}));
+    newzone->add({"server1"})->addRRs(AGen::make("213.244.168.210"));
+    zone->zone = std::move(newzone);
+
+    Socket server(AF_INET, SOCK_DGRAM);
+    ComboAddress local("127.0.0.1", 0);
+    SBind(server, local);
+    SGetsockname(server, local);
+    Socket client(AF_INET, SOCK_DGRAM);
+    SConnect(client, local);
+
+    DNSName qname;
+    DNSType qtype;
+    for(int n = 0; n < 2; ++n) {  // like measure(), but without what the client does
+      SWrite(client, packet);
+      before = opCounts();
+      bool answered = answerUDPQuestion(server, local, &zones, qname, qtype);
+      used = opCounts() - before;
+      REQUIRE(answered);
+      ComboAddress from;
+      REQUIRE(ntohs(DNSMessageReader(SRecvfrom(client, 512, from)).dh.ancount) == 1);
+    }
+    REQUIRE(used.syscalls == 2);  // recvfrom and sendto
+    REQUIRE(used.allocs <= 80);
+    REQUIRE(used.frees == used.allocs);
+  }
+
+  SECTION("tres answers from its record cache") {
+    std::vector<std::unique_ptr<RRGen>> rrs;
+    rrs.push_back(AGen::make("213.244.168.210"));
+    g_reccache.add(makeDNSName("server1.tdns.powerdns.org"), DNSType::A, rrs, 3600, RecordCache::Rank::AuthAnswer);
+
+    Socket server(AF_INET, SOCK_DGRAM);
+    ComboAddress local("127.0.0.1", 0);
+    SBind(server, local);
+    Socket client(AF_INET, SOCK_DGRAM);
+    ComboAddress remote("127.0.0.1", 0);
+    SBind(client, remote);
+    SGetsockname(client, remote);
+
+    DNSMessageReader dmr(packet);
+    for(int n = 0; n < 2; ++n) {
+      before = opCounts();
+      processQuery(server, remote, dmr, usecNow(), StageTimer(g_timings));
+      used = opCounts() - before;
+      ComboAddress from;
+      DNSMessageReader response(SRecvfrom(client, 512, from));
+      REQUIRE(response.dh.rcode == (int)RCode::Noerror);
+      REQUIRE(ntohs(response.dh.ancount) == 1);
+    }
+    REQUIRE(used.syscalls == 1);  // sendto, the main loop of tres does the recvfrom
+    REQUIRE(used.allocs <= 130);
+  }
+
+  SECTION("TDNS-C parses and looks up a query") {
+    struct TDNSServerContext* ctx = TDNSInit();
+    TDNSCreateZone(ctx, "tdns.powerdns.org");
+    TDNSAddRecord(ctx, "tdns.powerdns.org", "server1", "213.244.168.210", NULL);
+
+    struct TDNSFindResult found;
+    measure([&]() {
+        struct TDNSParseResult parsed;
+        memset(&parsed, 0, sizeof(parsed));
+        found.len = 0;
+        if(TDNSParseMsg(packet.c_str(), packet.size(), &parsed) == TDNS_QUERY)
+          TDNSFind(ctx, &parsed, &found);
+        delete parsed.dh;
+        free((char*)parsed.qname);
+        free((char*)parsed.nsIP);
+        free((char*)parsed.nsDomain);
+      });
+    REQUIRE(found.len > 0);
+    REQUIRE(used.syscalls == 0);
+    REQUIRE(used.allocs <= 88);
+    REQUIRE(used.frees == used.allocs);
+  }
+
+  SECTION("makeDNSName") {
+    measure([]() { makeDNSName("server1.tdns.powerdns.org"); });
+    REQUIRE(used.allocs <= 3);
+  }
+}
+
+TEST_CASE("TCP pool", "[tcppool]") {
+  Socket listener(AF_INET, SOCK_STREAM);
+  ComboAddress local("127.0.0.1", 0);
+  SBind(listener, local);
+  SListen(listener, 10);
+  SGetsockname(listener, local);
+
+  auto readn = [](int fd, size_t len) {
+    string ret;
+    while(ret.size() < len) {
+      double timeout = 1;
+      REQUIRE(waitForData(fd, &timeout) == 1);
+      string part = SRead(fd, len - ret.size());
+      REQUIRE(!part.empty());
+      ret += part;
+    }
+    return ret;
+  };
+  auto readQuery = [&readn](int fd) {
+    string len = readn(fd, 2);
+    return readn(fd, (uint8_t)len[0] * 256 + (uint8_t)len[1]);
+  };
+  // answers with an idle timeout of keepalive * 100 msec
+  auto answer = [](int fd, const string& query, uint16_t keepalive) {
+    DNSMessageReader dmr(query);
+    DNSName qname;
+    DNSType qtype;
+    dmr.getQuestion(qname, qtype);
+    DNSMessageWriter dmw(qname, qtype);
+    dmw.dh.id = dmr.dh.id;
+    dmw.dh.qr = 1;
+    dmw.setEDNS(1500, false);
+    dmw.addEDNSOption(EDNSOption::TCPKeepalive, string{(char)(keepalive / 256), (char)(keepalive % 256)});
+    string resp = dmw.serialize();
+    SWriten(fd, string{(char)(resp.size() / 256), (char)(resp.size() % 256)} + resp);
+  };
+
+  auto& pool = TCPPool::get();
+  auto before = pool.getStats();
+  DNSMessageWriter dmw1(makeDNSName("www.example.com"), DNSType::A);
+  DNSMessageWriter dmw2(makeDNSName("www.example.net"), DNSType::AAAA);
+  {
+    double timeout = 1;
+    TCPPool::Query q1(pool, local, dmw1.serialize(), makeDNSName("www.example.com"), DNSType::A, &timeout);
+    TCPPool::Query q2(pool, local, dmw2.serialize(), makeDNSName("www.example.net"), DNSType::AAAA, &timeout);
+    REQUIRE(q1.id() != q2.id()); // both writers start out with ID 0
+
+    ComboAddress client;
+    Socket conn(SAccept(listener, client));
+    string query1 = readQuery(conn), query2 = readQuery(conn);
+    answer(conn, query2, 50); // out of order
+    answer(conn, query1, 50);
+
+    REQUIRE(q1.wait(&timeout) == 1);
+    REQUIRE(q2.wait(&timeout) == 1);
+    DNSName qname;
+    DNSType qtype;
+    DNSMessageReader(q1.response()).getQuestion(qname, qtype);
+    REQUIRE(qname == makeDNSName("www.example.com"));
+    DNSMessageReader(q2.response()).getQuestion(qname, qtype);
+    REQUIRE(qname == makeDNSName("www.example.net"));
+
+    // the connection stays open, and the server now says it wants it closed when idle
+    TCPPool::Query q3(pool, local, dmw1.serialize(), makeDNSName("www.example.com"), DNSType::A, &timeout);
+    answer(conn, readQuery(conn), 0);
+    REQUIRE(q3.wait(&timeout) == 1);
+  }
+  auto st = pool.getStats();
+  REQUIRE(st.connects - before.connects == 1);
+  REQUIRE(st.reused - before.reused == 2);
+  REQUIRE(st.pipelined - before.pipelined == 2); // q1 and q2 were still attached when q3 went out
+  REQUIRE(st.received - before.received == 3);
+  REQUIRE(st.unexpected == before.unexpected);
+  REQUIRE(st.connections == 0);
+
+  // within the engine, the worker loop closes an idle connection without another query coming along
+  std::atomic<int> answered{0};
+  TCPPool::Stats est;
+  {
+    Engine e(1);
+    REQUIRE(e.submit([&]() {
+          double timeout = 1;
+          TCPPool::Query q(TCPPool::get(), local, dmw1.serialize(), makeDNSName("www.example.com"), DNSType::A, &timeout);
+          if(q.wait(&timeout) == 1)
+            ++answered;
+        }));
+    ComboAddress client;
+    Socket conn(SAccept(listener, client));
+    answer(conn, readQuery(conn), 1);
+    double timeout = 2;
+    REQUIRE(waitForData(conn, &timeout) == 1);
+    REQUIRE(SRead(conn, 1).empty()); // we closed it
+    REQUIRE(e.submit([&]() { est = TCPPool::get().getStats(); }));
+  }
+  REQUIRE(answered == 1);
+  REQUIRE(est.closed == 1);
+  REQUIRE(est.connections == 0);
+}
@@ -0,0 +1,149 @@
+#include "timerwheel.hh"
+#include <algorithm>
+using namespace std;
+
+/*!
+   @file
+   @brief Implements the hierarchical timer wheel
+*/
+
+constexpr uint32_t TimerWheel::Nil;
+
+TimerWheel::TimerWheel(unsigned int tickmsec, uint64_t now) : d_curtick(now / tickmsec), d_tickmsec(tickmsec)
+{
+  std::fill(begin(d_heads), end(d_heads), Nil);
+}
+
+//! Puts a timer in the slot that matches its expiry, in the lowest wheel that reaches that far
+void TimerWheel::link(uint32_t idx)
+{
+  auto& t = d_timers[idx];
+  uint64_t expire = max(t.expire, d_curtick);
+  uint64_t delta = expire - d_curtick;
+  if(delta >= (1ULL << (Bits * Levels))) // beyond the last wheel, will get cascaded again
+    expire = d_curtick + (1ULL << (Bits * Levels)) - 1;
+
+  int level = 0;
+  while(level < Levels - 1 && delta >= (1ULL << (Bits * (level + 1))))
+    ++level;
+
+  t.slot = level * Slots + ((expire >> (Bits * level)) & (Slots - 1));
+  t.prev = Nil;
+  t.next = d_heads[t.slot];
+  if(t.next != Nil)
+    d_timers[t.next].prev = idx;
+  d_heads[t.slot] = idx;
+}
+
+void TimerWheel::unlink(uint32_t idx)
+{
+  auto& t = d_timers[idx];
+  if(t.prev != Nil)
+    d_timers[t.prev].next = t.next;
+  else
+    d_heads[t.slot] = t.next;
+  if(t.next != Nil)
+    d_timers[t.next].prev = t.prev;
+  t.prev = t.next = Nil;
+}
+
+void TimerWheel::release(uint32_t idx)
+{
+  auto& t = d_timers[idx];
+  t.active = false;
+  t.cb = nullptr;
+  if(!++t.generation) // TimerID 0 must never be valid
+    t.generation = 1;
+  d_free.push_back(idx);
+  --d_count;
+}
+
+TimerWheel::TimerID TimerWheel::add(uint64_t deadline, Callback cb)
+{
+  uint32_t idx;
+  if(!d_free.empty()) {
+    idx = d_free.back();
+    d_free.pop_back();
+  }
+  else {
+    idx = d_timers.size();
+    d_timers.emplace_back();
+  }
+  auto& t = d_timers[idx];
+  // round up, we never fire early. And the current tick has already been processed
+  t.expire = max((deadline + d_tickmsec - 1) / d_tickmsec, d_curtick + 1);
+  t.cb = std::move(cb);
+  t.active = true;
+  link(idx);
+  ++d_count;
+  return ((uint64_t)t.generation << 32) | idx;
+}
+
+bool TimerWheel::pending(TimerID id) const
+{
+  uint32_t idx = id & 0xffffffff;
+  return idx < d_timers.size() && d_timers[idx].active && d_timers[idx].generation == (id >> 32);
+}
+
+bool TimerWheel::cancel(TimerID id)
+{
+  if(!pending(id))
+    return false;
+  uint32_t idx = id & 0xffffffff;
+  unlink(idx);
+  release(idx);
+  return true;
+}
+
+//! Redistributes the timers of the current slot of wheel 'level' over the lower wheels
+void TimerWheel::cascade(int level)
+{
+  uint32_t slot = level * Slots + ((d_curtick >> (Bits * level)) & (Slots - 1));
+  uint32_t idx = d_heads[slot];
+  d_heads[slot] = Nil;
+  while(idx != Nil) {
+    uint32_t next = d_timers[idx].next;
+    link(idx);
+    idx = next;
+  }
+}
+
+size_t TimerWheel::advance(uint64_t now)
+{
+  uint64_t target = now / d_tickmsec;
+  size_t fired = 0;
+  while(d_curtick < target) {
+    if(!d_count) { // nothing to do, so we can skip ahead
+      d_curtick = target;
+      break;
+    }
+    ++d_curtick;
+    for(int level = Levels - 1; level > 0; --level)
+      if(!(d_curtick & ((1ULL << (Bits * level)) - 1)))
+        cascade(level);
+
+    // callbacks can add and cancel timers, so we take them out one by one
+    uint32_t& head = d_heads[d_curtick & (Slots - 1)];
+    while(head != Nil) {
+      uint32_t idx = head;
+      unlink(idx);
+      Callback cb = std::move(d_timers[idx].cb);
+      release(idx);
+      ++fired;
+      cb();
+    }
+  }
+  return fired;
+}
+
+int64_t TimerWheel::nextTimeout(uint64_t now) const
+{
+  if(!d_count)
+    return -1;
+  // we stop at the first tick with timers, or where a cascade could bring in new ones
+  uint64_t tick = d_curtick + 1;
+  while(d_heads[tick & (Slots - 1)] == Nil && (tick & (Slots - 1)))
+    ++tick;
+  uint64_t when = tick * d_tickmsec;
+  return when > now ? when - now : 0;
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include <cstdint>
+#include <chrono>
+#include <functional>
+#include <vector>
+
+/*!
+   @file
+   @brief Defines TimerWheel, which keeps track of deadlines for outstanding queries
+*/
+
+//! Milliseconds on a clock that never jumps, which is what deadlines should be measured on
+inline uint64_t msecNow()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//! Microseconds on the same clock as msecNow(), for measuring round trip times
+inline uint64_t usecNow()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//! Nanoseconds on the same clock, for timing the stages of handling a query
+inline uint64_t nsecNow()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*! \brief A hierarchical timer wheel
+
+   A resolver has a deadline for every query it sent out, and almost all of
+   these deadlines get cancelled because an answer arrived. A timer wheel makes
+   both adding and cancelling a timer O(1), no matter how many there are.
+
+   Time is divided in ticks. The first wheel has a slot for each of the next 64
+   ticks. The second wheel has 64 slots that each cover 64 ticks, and so on, for
+   four wheels. When the first wheel has gone round, the timers in the next slot
+   of the second wheel are redistributed over the first wheel ('cascading').
+   With the default tick of 10 milliseconds, this covers 46 hours.
+
+   Timers are stored in a vector that is reused, so there are no allocations once
+   the wheel has warmed up. A TimerID contains a generation number, so cancelling a
+   timer that already fired is harmless.
+
+   This class does no locking. */
+class TimerWheel
+{
+public:
+  typedef uint64_t TimerID; //!< 0 is never a valid TimerID
+  typedef std::function<void()> Callback;
+
+  explicit TimerWheel(unsigned int tickmsec=10, uint64_t now=msecNow());
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  //! Calls cb from advance() once 'deadline' (in msec on the msecNow() clock) has passed
+  TimerID add(uint64_t deadline, Callback cb);
+  //! Returns false if the timer was not pending (anymore)
+  bool cancel(TimerID id);
+  //! Is this timer still pending?
+  bool pending(TimerID id) const;
+
+  //! Fires all timers that expired up to now, returns how many did. Callbacks may add & cancel timers.
+  size_t advance(uint64_t now=msecNow());
+  //! Milliseconds until advance() should next be called, -1 if there are no timers
+  int64_t nextTimeout(uint64_t now=msecNow()) const;
+
+  size_t size() const { return d_count; }
+
+private:
+  enum { Bits = 6, Slots = 1 << Bits, Levels = 4 };
+  static constexpr uint32_t Nil = UINT32_MAX;
+
+  struct Timer
+  {
+    uint64_t expire;     //!< in ticks
+    Callback cb;
+    uint32_t prev{Nil}, next{Nil};
+    uint32_t generation{0};
+    uint16_t slot{0};
+    bool active{false};
+  };
+
+  void link(uint32_t idx);
+  void unlink(uint32_t idx);
+  void release(uint32_t idx);
+  void cascade(int level);
+
+  std::vector<Timer> d_timers;
+  std::vector<uint32_t> d_free;
+  uint32_t d_heads[Levels * Slots];
+  uint64_t d_curtick;
+  unsigned int d_tickmsec;
+  size_t d_count{0};
+};
@@ -0,0 +1,247 @@
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "sclasses.hh"
+#include "dnsmessages.hh"
+#include "labsim.hh"
+#include "loadgen.hh"
+
+/*!
+   @file
+   @brief Benchmarks local-dns.c and tres against a simulation of the DNS lab, without containers
+*/
+
+using namespace std;
+
+static void usage()
+{
+  cerr<<"Syntax: tlab [options]"<<endl;
+  cerr<<"Runs the root, edu, utexas.edu and cs.utexas.edu servers of the DNS lab in this"<<endl;
+  cerr<<"process, on 127.x.y.z addresses, and sends load to the iterative server of"<<endl;
+  cerr<<"local-dns.c and to tres, which resolve through them. Reports their latency, and"<<endl;
+  cerr<<"how many queries each lab server got."<<endl;
+  cerr<<endl;
+  cerr<<"  --port n              of all lab servers, default 5300"<<endl;
+  cerr<<"  --latency msec        of every link, one way, default 5"<<endl;
+  cerr<<"  --jitter msec         random extra latency, up to this, default 0"<<endl;
+  cerr<<"  --loss fraction       of packets lost on every link, default 0"<<endl;
+  cerr<<"  --bandwidth kbit/s    of every link, default unlimited"<<endl;
+  cerr<<"  --link name=msec[,loss[,kbit/s]]  for the link of one server: root, edu,"<<endl;
+  cerr<<"                        utexas.edu or cs.utexas.edu"<<endl;
+  cerr<<"  --seed n              for loss and jitter, default 1"<<endl;
+  cerr<<"  --resolver which      local, tres or both (the default)"<<endl;
+  cerr<<"  --tres path           default ./tres"<<endl;
+  cerr<<endl;
+  cerr<<"The load is like that of tdig --load, by default the names of the lab in turn:"<<endl;
+  cerr<<"  --queries file, --random zone, --qps n, --inflight n (default 20), --duration secs"<<endl;
+  cerr<<"  (default 5), --timeout secs (default 4), --threads n"<<endl;
+}
+
+//! What the lab has, and a name it does not have
+static std::vector<LoadQuery> labQueries()
+{
+  std::vector<LoadQuery> ret;
+  for(const char* name : {"www.utexas.edu", "cs.utexas.edu", "aquila.cs.utexas.edu", "nonexistent.cs.utexas.edu"})
+    ret.push_back({makeDNSName(name), DNSType::A});
+  return ret;
+}
+
+//! Waits until server answers anything, up to 5 seconds
+static bool waitForServer(const ComboAddress& server)
+{
+  Socket sock(server.sin4.sin_family, SOCK_DGRAM);
+  SConnect(sock, server);
+  DNSMessageWriter dmw(makeDNSName("tlab.invalid"), DNSType::A);
+  for(int n = 0; n < 25; ++n) {
+    dmw.randomizeID();
+    try {
+      SWrite(sock, dmw.serialize());
+      double timeout = 0.2;
+      if(waitForData(sock, &timeout) == 1)
+        return true;
+    }
+    catch(std::exception& e) {  // refused, it is not listening yet
+      usleep(200000);
+    }
+  }
+  return false;
+}
+
+//! Starts tres as a server on address, with the lab as the DNS
+static pid_t startTres(const std::string& path, const ComboAddress& address, uint16_t port)
+{
+  pid_t pid = fork();
+  if(pid < 0)
+    throw std::runtime_error("Could not fork for tres: "+string(strerror(errno)));
+  if(!pid) {
+    setenv("TRES_ROOTS", c_labRoot, 1);
+    setenv("TRES_NS_PORT", to_string(port).c_str(), 1);
+    setenv("TDNS_LOG", "error", 0);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    execl(path.c_str(), path.c_str(), address.toStringWithPort().c_str(), (char*)nullptr);
+    cerr<<"Could not run "<<path<<": "<<strerror(errno)<<endl;
+    _exit(EXIT_FAILURE);
+  }
+  return pid;
+}
+
+static void report(const std::string& name, const LoadReport& lr, const std::vector<LabNetwork::ServerStats>& before, const std::vector<LabNetwork::ServerStats>& after)
+{
+  cout<<"== "<<name<<endl;
+  cout<<lr.toString();
+  cout<<"Upstream queries, per answered query:"<<endl;
+  for(unsigned int n = 0; n < after.size(); ++n) {
+    if(after[n].name == "local-dns")
+      continue;
+    uint64_t queries = after[n].queries - before[n].queries;
+    uint64_t dropped = after[n].dropped - before[n].dropped;
+    char line[200];
+    snprintf(line, sizeof(line), "  %-14s %10llu  %6.3f  (%llu lost on the link)\n", after[n].name.c_str(),
+             (unsigned long long)queries, lr.answered ? (double)queries / lr.answered : 0.0, (unsigned long long)dropped);
+    cout<<line;
+  }
+  cout<<endl;
+}
+
+static LinkProfile parseLink(const std::string& spec, LinkProfile link)
+{
+  istringstream in(spec);
+  string part;
+  if(getline(in, part, ','))
+    link.latency = atof(part.c_str());
+  if(getline(in, part, ','))
+    link.loss = atof(part.c_str());
+  if(getline(in, part, ','))
+    link.bandwidth = atof(part.c_str()) * 1000;
+  return link;
+}
+
+int main(int argc, char** argv)
+try
+{
+  signal(SIGPIPE, SIG_IGN);
+  uint16_t port = 5300;
+  uint64_t seed = 1;
+  LinkProfile link;
+  link.latency = 5;
+  std::vector<std::pair<std::string, std::string>> linkspecs;
+  string resolver = "both", tres = "./tres";
+  LoadOptions opts;
+  opts.inflight = 20;
+  opts.duration = 5;
+  opts.timeout = 4;  // local-dns.c retransmits after 0.5, 1 and 2 seconds
+  bool haveZone = false;
+
+  for(int n = 1; n < argc; n += 2) {
+    string opt(argv[n]);
+    if(n + 1 == argc || opt == "--help") {
+      usage();
+      return EXIT_FAILURE;
+    }
+    string val(argv[n + 1]);
+    if(opt == "--port")
+      port = atoi(val.c_str());
+    else if(opt == "--latency")
+      link.latency = atof(val.c_str());
+    else if(opt == "--jitter")
+      link.jitter = atof(val.c_str());
+    else if(opt == "--loss")
+      link.loss = atof(val.c_str());
+    else if(opt == "--bandwidth")
+      link.bandwidth = atof(val.c_str()) * 1000;
+    else if(opt == "--link") {
+      auto pos = val.find('=');
+      if(pos == string::npos)
+        throw std::runtime_error("--link needs name=msec[,loss[,kbit/s]], not "+val);
+      linkspecs.push_back({val.substr(0, pos), val.substr(pos + 1)});
+    }
+    else if(opt == "--seed")
+      seed = atoll(val.c_str());
+    else if(opt == "--resolver")
+      resolver = val;
+    else if(opt == "--tres")
+      tres = val;
+    else if(opt == "--queries") {
+      ifstream in(val);
+      if(!in)
+        throw std::runtime_error("Unable to open query list "+val);
+      opts.queries = readQueryList(in);
+    }
+    else if(opt == "--random") {
+      opts.randomzone = makeDNSName(val);
+      haveZone = true;
+    }
+    else if(opt == "--qps")
+      opts.qps = atof(val.c_str());
+    else if(opt == "--inflight")
+      opts.inflight = atoi(val.c_str());
+    else if(opt == "--duration")
+      opts.duration = atof(val.c_str());
+    else if(opt == "--timeout")
+      opts.timeout = atof(val.c_str());
+    else if(opt == "--threads")
+      opts.threads = atoi(val.c_str());
+    else {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+  if(resolver != "local" && resolver != "tres" && resolver != "both") {
+    usage();
+    return EXIT_FAILURE;
+  }
+  if(opts.queries.empty() && !haveZone)
+    opts.queries = labQueries();
+
+  // the links of the servers that were not named get the link all servers get
+  std::map<std::string, LinkProfile> links;
+  for(const auto& ls : linkspecs)
+    links[ls.first] = parseLink(ls.second, link);
+
+  LabNetwork net(port, seed);
+  buildLab(net, link, links, resolver != "tres");
+  net.start();
+  cout<<"Lab servers on port "<<port<<", links with "<<link.latency<<" msec latency, "<<link.jitter<<" msec jitter, "
+      <<link.loss * 100<<"% loss, ";
+  if(link.bandwidth)
+    cout<<link.bandwidth / 1000<<" kbit/s"<<endl;
+  else
+    cout<<"unlimited bandwidth"<<endl;
+  for(const auto& l : links)
+    cout<<"The link of "<<l.first<<" has "<<l.second.latency<<" msec latency, "<<l.second.loss * 100<<"% loss"<<endl;
+  cout<<endl;
+
+  if(resolver != "tres") {
+    opts.server = ComboAddress(c_labResolver, port);
+    auto before = net.getStats();
+    auto lr = runLoad(opts);
+    report("local-dns.c on "+opts.server.toStringWithPort(), lr, before, net.getStats());
+  }
+
+  if(resolver != "local") {
+    opts.server = ComboAddress("127.0.0.2", port);
+    pid_t pid = startTres(tres, opts.server, port);
+    if(!waitForServer(opts.server)) {
+      kill(pid, SIGKILL);
+      waitpid(pid, nullptr, 0);
+      throw std::runtime_error("tres did not start, is "+tres+" there?");
+    }
+    auto before = net.getStats();
+    auto lr = runLoad(opts);
+    auto after = net.getStats();
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+    report("tres on "+opts.server.toStringWithPort(), lr, before, after);
+  }
+}
+catch(std::exception& e)
+{
+  cerr<<"Fatal error: "<<e.what()<<endl;
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,90 @@
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include "querylog.hh"
+#include "nlohmann/json.hpp"
+
+/*!
+   @file
+   @brief Prints query logs written by tauth and tres as JSON, one query per line
+*/
+
+using namespace std;
+
+//! The name of a type or rcode if it has one, otherwise its number like in RFC 3597
+template<typename T>
+static std::string label(T val, const char* unknown)
+{
+  std::string ret = toString(val);
+  if(ret == "?")
+    ret = unknown + std::to_string((unsigned int)val);
+  return ret;
+}
+
+static nlohmann::json recordToJSON(const QueryLogRecord& r)
+{
+  nlohmann::json ret;
+  time_t secs = r.usec / 1000000;
+  struct tm tm;
+  gmtime_r(&secs, &tm);
+  char when[40];
+  size_t len = strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(when + len, sizeof(when) - len, ".%06uZ", (unsigned int)(r.usec % 1000000));
+  ret["time"] = when;
+  ret["client"] = r.client.toStringWithPort();
+  ret["transport"] = (r.flags & QueryLogRecord::TCP) ? "tcp" : "udp";
+  ret["qname"] = r.getQName().toString();
+  ret["qtype"] = label((DNSType)r.qtype, "TYPE");
+  if(r.flags & QueryLogRecord::Dropped)
+    ret["dropped"] = true;
+  else {
+    ret["rcode"] = label((RCode)r.rcode, "RCODE");
+    ret["truncated"] = (bool)(r.flags & QueryLogRecord::Truncated);
+    ret["size"] = r.size;
+  }
+  ret["latency_usec"] = r.latency;
+  return ret;
+}
+
+static void print(std::istream& in, const std::string& name)
+{
+  QueryLogReader qlr(in);
+  QueryLogRecord r;
+  try {
+    while(qlr.get(r))
+      cout << recordToJSON(r).dump() << '\n';
+  }
+  catch(std::exception& e) {
+    cerr << name << ": " << e.what() << endl;
+  }
+}
+
+int main(int argc, char** argv)
+try
+{
+  if(argc < 2) {
+    cerr<<"Syntax: tqlog file [file...]"<<endl;
+    cerr<<"Prints the query log files written by tauth or tres with TDNS_QUERYLOG as JSON,"<<endl;
+    cerr<<"a line per query. With - as file, reads standard input, for example from"<<endl;
+    cerr<<"socat UNIX-LISTEN:/tmp/querylog.sock - | tqlog -"<<endl;
+    return EXIT_FAILURE;
+  }
+  ios::sync_with_stdio(false);
+  for(int n = 1; n < argc; ++n) {
+    string name(argv[n]);
+    if(name == "-")
+      print(cin, "stdin");
+    else {
+      ifstream in(name, std::ios::binary);
+      if(!in)
+        throw std::runtime_error("Unable to open "+name);
+      print(in, name);
+    }
+  }
+}
+catch(std::exception& e)
+{
+  cerr<<"Fatal error: "<<e.what()<<endl;
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,100 @@
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <signal.h>
+#include "replay.hh"
+
+/*!
+   @file
+   @brief Replays the DNS queries in a pcap capture against a server, and compares the answers
+*/
+
+using namespace std;
+
+static void usage()
+{
+  cerr<<"Syntax: treplay capture.pcap ip[:port] [options]"<<endl;
+  cerr<<"Sends the DNS queries over UDP in a capture to a server, and reports latency, loss"<<endl;
+  cerr<<"and how many answers differ from the responses in the capture. Capture with"<<endl;
+  cerr<<"tcpdump -w capture.pcap port 53"<<endl;
+  cerr<<endl;
+  cerr<<"  --speed x         replay x times as fast as captured, default 1"<<endl;
+  cerr<<"  --fast            replay as fast as possible, with --inflight unanswered at most"<<endl;
+  cerr<<"  --inflight n      default 1000"<<endl;
+  cerr<<"  --sockets n       spread the captured clients over n source ports, default 1"<<endl;
+  cerr<<"  --timeout secs    after which a query counts as lost, default 2"<<endl;
+  cerr<<"  --details file    write a line per query with its latency and result"<<endl;
+}
+
+int main(int argc, char** argv)
+try
+{
+  if(argc < 3) {
+    usage();
+    return EXIT_FAILURE;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  ReplayOptions opts;
+  opts.server = ComboAddress(argv[2], 53);
+  ofstream details;
+  for(int n = 3; n < argc; ++n) {
+    string opt(argv[n]);
+    if(opt == "--fast") {
+      opts.speed = 0;
+      continue;
+    }
+    if(n + 1 == argc) {
+      usage();
+      return EXIT_FAILURE;
+    }
+    string val(argv[++n]);
+    if(opt == "--speed")
+      opts.speed = atof(val.c_str());
+    else if(opt == "--inflight")
+      opts.inflight = atoi(val.c_str());
+    else if(opt == "--sockets")
+      opts.sockets = atoi(val.c_str());
+    else if(opt == "--timeout")
+      opts.timeout = atof(val.c_str());
+    else if(opt == "--details") {
+      details.open(val);
+      if(!details)
+        throw std::runtime_error("Unable to write details to "+val);
+      opts.details = &details;
+    }
+    else {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+  if(opts.speed < 0) {
+    cerr<<"--speed must be positive, use --fast for as fast as possible"<<endl;
+    return EXIT_FAILURE;
+  }
+
+  ifstream in(argv[1], std::ios::binary);
+  if(!in)
+    throw std::runtime_error("Unable to open "+string(argv[1]));
+  auto queries = readCapturedQueries(in);
+  unsigned int withResponse = 0;
+  for(const auto& q : queries)
+    withResponse += !q.response.empty();
+  cout<<"Read "<<queries.size()<<" queries from "<<argv[1]<<", "<<withResponse<<" with their response"<<endl;
+  if(queries.empty())
+    return EXIT_SUCCESS;
+  double span = (queries.back().usec - queries.front().usec) / 1000000.0;
+  cout<<"Replaying to "<<opts.server.toStringWithPort()<<", ";
+  if(opts.speed > 0)
+    cout<<"in "<<span / opts.speed<<" s";
+  else
+    cout<<"as fast as possible";
+  cout<<", over "<<opts.sockets<<" sockets"<<endl;
+
+  cout<<replay(queries, opts).toString();
+}
+catch(std::exception& e)
+{
+  cerr<<"Fatal error: "<<e.what()<<endl;
+  return EXIT_FAILURE;
+}
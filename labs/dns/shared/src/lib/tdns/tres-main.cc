@@ -0,0 +1,382 @@
+#include "tres.hh"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <signal.h>
+#include "sclasses.hh"
+#include "snapshot.hh"
+#include "querylog.hh"
+#include "nlohmann/json.hpp"
+
+/*!
+   @file
+   @brief The main() of tres, which is a server or looks up a single name
+*/
+
+using namespace std;
+
+//! What the server did, see TDNS_METRICS
+Metrics g_metrics("tres");
+//! How long the stages of answering take, served on /latency next to the metrics
+PipelineTimings g_timings;
+//! Which names and clients most queries are about, served on /heavyhitters
+HeavyHitters g_hitters;
+
+//! Runs in server mode, fires the client deadlines. Once a minute, it also cleans up the record cache
+static void deadlineThread()
+{
+  uint64_t lastpurge = msecNow();
+  for(;;) {
+    if(msecNow() - lastpurge >= 60000) {
+      lastpurge = msecNow();
+      g_reccache.purge();
+      auto st = g_reccache.getStats();
+      if(uint64_t n = g_budget.resolutions)
+        cout<<"Resolutions took "<<g_budget.msec / n<<" of "<<g_deadlines.timeoutmsec<<" msec and "<<g_budget.queries / n<<" queries on average, "<<g_budget.overruns<<" of "<<n<<" ran out of time"<<endl;
+      cout<<"Record cache has "<<st.entries<<" RRsets in "<<st.bytes<<" of "<<g_reccache.d_maxbytes<<" bytes, hit ratio "<<100.0*st.hitRatio()<<"%, "<<st.evictions<<" evictions, "<<st.prefetches<<" prefetches of which "<<100.0*st.prefetchHitRatio()<<"% were used, "<<st.stale<<" stale answers"<<endl;
+    }
+    int64_t wait = fireDeadlines();
+    // new deadlines are never shorter than this, so we don't need to be woken up for them
+    if(wait < 0 || wait > 100)
+      wait = 100;
+    std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+  }
+}
+
+//! Saves all caches to g_snapshot, in its own thread since this can take a while with a full cache
+static void snapshotThread()
+{
+  for(;;) {
+    std::this_thread::sleep_for(std::chrono::seconds(60));
+    try {
+      auto start = msecNow();
+      SnapshotWriter sw;
+      g_infra.save(sw);
+      g_negcache.save(sw);
+      g_reccache.save(sw);
+      writeSnapshot(g_snapshot, sw);
+      cout<<"Saved "<<sw.str().size()<<" bytes of snapshot in "<<msecNow() - start<<" msec"<<endl;
+    }
+    catch(std::exception& e) {
+      cerr<<"Unable to save snapshot: "<<e.what()<<endl;
+    }
+  }
+}
+
+//! Keeps the root zone mirror up to date, in its own thread since a transfer can take a while
+static void rootMirrorThread()
+{
+  for(;;) {
+    std::this_thread::sleep_for(std::chrono::seconds(10));
+    g_rootmirror.maintain();
+  }
+}
+
+//! Fills the caches from g_snapshot, if there is one. Expired records are left out
+static void loadSnapshot()
+{
+  try {
+    auto start = msecNow();
+    std::unique_ptr<SnapshotReader> sr;
+    if(!readSnapshot(g_snapshot, sr)) {
+      cout<<"No snapshot in '"<<g_snapshot<<"', starting with empty caches"<<endl;
+      return;
+    }
+    auto servers = g_infra.load(*sr);
+    auto negatives = g_negcache.load(*sr);
+    auto rrsets = g_reccache.load(*sr);
+    cout<<"Loaded "<<servers<<" nameservers, "<<negatives<<" negative entries and "<<rrsets<<" RRsets from snapshot in "<<msecNow() - start<<" msec"<<endl;
+  }
+  catch(std::exception& e) {
+    cerr<<"Unable to load snapshot '"<<g_snapshot<<"': "<<e.what()<<endl;
+  }
+}
+
+static nlohmann::json rrToJSON(const TDNSResolver::ResolveRR& r)
+{
+  nlohmann::json record;
+  record["name"]=r.name.toString();
+  record["ttl"]=r.ttl;
+  record["type"]=toString(r.rr->getType());
+  record["content"]=r.rr->toString();
+  return record;
+}
+
+
+int main(int argc, char** argv)
+try
+{
+  if(argc != 2 && argc != 3) {
+    cerr<<"Syntax: tres name type\n";
+    cerr<<"Syntax: tres ip:port\n";
+    cerr<<"\n";
+    cerr<<"When name and type are specified, tres looks up a DNS record.\n";
+    cerr<<"types: A, NS, CNAME, SOA, PTR, MX, TXT, AAAA, ...\n";
+    cerr<<"       see https://en.wikipedia.org/wiki/List_of_DNS_record_types\n";
+    cerr<<"\n";
+    cerr<<"When ip:port is specified, tres acts as a DNS server.\n";
+    cerr<<"\n";
+    cerr<<"If a nameserver does not answer within TRES_STAGGER milliseconds (default 200),\n";
+    cerr<<"tres asks the next one too. With TRES_STAGGER=0, it asks them one at a time.\n";
+    cerr<<"The record cache uses at most TRES_CACHE_MB megabytes (default 128).\n";
+    cerr<<"Expired records are kept for TRES_STALE seconds (default 86400), and used when\n";
+    cerr<<"resolving fails or takes over 1.8 seconds. With TRES_STALE=0, they are not.\n";
+    cerr<<"With TRES_ROOT_MIRROR, tres keeps a copy of the root zone and does not query the\n";
+    cerr<<"root servers. It is an IP address to AXFR the zone from, or a file like root.zone.\n";
+    cerr<<"TRES_ROOTS=ip,ip,... makes those the root servers, instead of the ones the hints\n";
+    cerr<<"list. With TRES_NS_PORT, nameservers are asked on that port instead of 53. Both\n";
+    cerr<<"are for simulated networks, like that of tlab.\n";
+    cerr<<"If TRES_SNAPSHOT is set, the server saves its caches to that file once a minute,\n";
+    cerr<<"and loads them from there when it starts.\n";
+    cerr<<"TDNS_LOG sets what the server logs: debug, info, warning (the default), error\n";
+    cerr<<"or none. With debug, it shows how every query is resolved.\n";
+    cerr<<"With TDNS_METRICS=ip:port (default port 9153), the server serves counters of\n";
+    cerr<<"what it does on http://ip:port/metrics, in the Prometheus text format, and how\n";
+    cerr<<"long the stages of answering take on /latency. TDNS_SAMPLE=N times 1 in N\n";
+    cerr<<"queries for that (default 64), 0 times none. /heavyhitters has the names, zones\n";
+    cerr<<"and clients that most queries are about or come from.\n";
+    cerr<<"With TDNS_QUERYLOG=file, every query and its answer are logged to file, which is\n";
+    cerr<<"rotated at 64MB, or to a Unix socket with TDNS_QUERYLOG=unix:/path. Read it with\n";
+    cerr<<"tqlog, which prints JSON.\n";
+    return(EXIT_FAILURE);
+  }
+  signal(SIGPIPE, SIG_IGN); // TCP, so we need this
+  if(const char* stagger = getenv("TRES_STAGGER"))
+    g_staggermsec = atoi(stagger);
+  if(const char* cachemb = getenv("TRES_CACHE_MB"))
+    g_reccache.d_maxbytes = atoll(cachemb) * 1024 * 1024;
+  if(const char* stale = getenv("TRES_STALE"))
+    g_reccache.d_staleseconds = atoi(stale);
+  if(const char* snapshot = getenv("TRES_SNAPSHOT"))
+    g_snapshot = snapshot;
+  if(const char* nsport = getenv("TRES_NS_PORT"))
+    g_nsport = atoi(nsport);
+  // before anything else, so we already know the nameservers when we ask for the root
+  if(argc == 2 && !g_snapshot.empty())
+    loadSnapshot();
+  // configure some hints
+  multimap<DNSName, ComboAddress> hints = {{makeDNSName("a.root-servers.net"), ComboAddress("198.41.0.4", 53)},
+                                           {makeDNSName("f.root-servers.net"), ComboAddress("192.5.5.241", 53)},
+                                           {makeDNSName("k.root-servers.net"), ComboAddress("193.0.14.129", 53)},
+  };
+
+  if(const char* roots = getenv("TRES_ROOTS")) {
+    g_root.clear();
+    istringstream in(roots);
+    string ip;
+    for(unsigned int n = 1; getline(in, ip, ','); ++n)
+      g_root.insert({makeDNSName("root"+to_string(n)+".invalid"), ComboAddress(ip, g_nsport)});
+    cout<<"Using "<<g_root.size()<<" root servers from TRES_ROOTS"<<endl;
+  }
+
+  const char* mirror = getenv("TRES_ROOT_MIRROR");
+  if(mirror) {
+    g_rootmirror.setSource(mirror);
+    if(g_rootmirror.refresh() && g_rootmirror.getRootServers(g_root)) {
+      auto st = g_rootmirror.getStats();
+      cout<<"Loaded root zone with serial "<<st.serial<<" and "<<st.delegations<<" delegations from "<<mirror<<endl;
+    }
+  }
+
+  // retrieve the actual live root NSSET from the hints, unless the mirror already told us
+  for(const auto& h : hints) {
+    if(!g_root.empty())
+      break;
+    try {
+      TDNSResolver tdr;
+      DNSMessageReader dmr = tdr.getResponse(h.second, makeDNSName("."), DNSType::NS);
+      DNSSection rrsection;
+      DNSName rrdn;
+      DNSType rrdt;
+      uint32_t ttl;
+      std::unique_ptr<RRGen> rr;
+
+      // XXX should check if response name and type match query
+      // this assumes the root will only send us relevant NS records
+      // we could check with the NS records if we wanted
+      // but if a root wants to mess with us, it can
+      while(dmr.getRR(rrsection, rrdn, rrdt, ttl, rr)) {
+        if(rrdt == DNSType::A || rrdt == DNSType::AAAA)
+          g_root.insert({rrdn, getIP(rr)});
+      }
+      break;
+    }
+    catch(...){}
+  }
+
+  cout<<"Retrieved . NSSET from hints, have "<<g_root.size()<<" addresses"<<endl;
+
+  if(argc == 2) { // be a server
+    ComboAddress local(argv[1], 53);
+    Socket sock(local.sin4.sin_family, SOCK_DGRAM);
+    SBind(sock, local);
+    string packet;
+    ComboAddress client;
+
+    std::thread deadlines(deadlineThread);
+    deadlines.detach();
+    if(!g_snapshot.empty())
+      std::thread(snapshotThread).detach();
+    if(mirror)
+      std::thread(rootMirrorThread).detach();
+
+    // a few threads run all the resolutions, and we stop taking on more if they can't keep up
+    Engine engine(std::max(std::thread::hardware_concurrency(), 2U));
+    g_engine = &engine;
+
+    if(const char* querylog = getenv("TDNS_QUERYLOG")) {
+      startQueryLog(querylog);
+      cout<<"Writing query log to "<<querylog<<endl;
+    }
+    if(const char* metrics = getenv("TDNS_METRICS")) {
+      g_metrics.addGauge("record_cache_bytes", "Bytes used by the record cache", []() { return (double)g_reccache.getStats().bytes; });
+      g_metrics.addGauge("record_cache_entries", "RRsets in the record cache", []() { return (double)g_reccache.getStats().entries; });
+      g_metrics.addGauge("resolutions_running", "Resolutions the engine is working on", [&engine]() { return (double)engine.getStats().running; });
+      g_metrics.addGauge("resolutions_queued", "Resolutions waiting for the engine", [&engine]() { return (double)engine.getStats().queued; });
+      g_metrics.addPage("/latency", []() { return g_timings.dump(); });
+      g_metrics.addPage("/heavyhitters", []() { return g_hitters.report(); });
+      cout<<"Serving metrics on http://"<<g_metrics.serve(ComboAddress(metrics, 9153)).toStringWithPort()<<"/metrics, /latency and /heavyhitters"<<endl;
+    }
+    
+    for(;;) {
+      try {
+        packet = SRecvfrom(sock, 1500, client);
+        TLOG(Info, "Received packet from ", client.toStringWithPort());
+        uint64_t received = usecNow();
+        StageTimer st(g_timings);
+        DNSMessageReader dmr(packet);
+        if(dmr.dh.qr) {
+          TLOG(Warning, "Packet from ", client.toStringWithPort(), " was not a query");
+          g_metrics.drop();
+          continue;
+        }
+        DNSName qname;
+        DNSType qtype;
+        dmr.getQuestion(qname, qtype);
+        uint16_t bufsize;
+        bool doBit = false;
+        bool edns = dmr.getEDNS(&bufsize, &doBit);
+        g_metrics.query(Metrics::Transport::UDP, qtype, edns, doBit);
+        g_hitters.query(qname, client);
+        st.mark(Stage::Parse);
+
+        int fd = sock;
+        if(!engine.submit([fd, client, dmr, received, st]() { processQuery(fd, client, dmr, received, st); })) {
+          auto st = engine.getStats();
+          TLOG(Warning, "Dropping query from ", client.toStringWithPort(), ", ", st.running, " resolutions running and ", st.queued, " queued, ", st.rejected, " dropped so far");
+          g_metrics.drop();
+          logQuery(client, qname, qtype, received, RCode::Noerror, QueryLogRecord::Dropped, 0);
+        }
+      }
+      catch(exception& e) {
+        TLOG(Warning, "Processing packet from ", client.toStringWithPort(), ": ", e.what());
+        g_metrics.drop();
+      }
+    }
+  }
+  
+  // single shot operation
+  DNSName dn = makeDNSName(argv[1]);
+  DNSType dt = makeDNSType(argv[2]);
+
+  
+  TDNSResolver tdr(g_root);
+  tdr.setStagger(g_staggermsec);
+  ostringstream logstream;
+  ostringstream dotstream;
+  tdr.setLog(logstream);
+  tdr.setPlot(dotstream);
+  
+  auto start = chrono::high_resolution_clock::now();
+
+  int rc = EXIT_SUCCESS;
+
+  nlohmann::json jres;
+  jres["name"]=dn.toString();
+  jres["type"]=toString(dt);
+  jres["intermediate"]= nlohmann::json::array();
+  jres["answer"]= nlohmann::json::array();  
+  try {
+
+    auto res = tdr.resolveAt(dn, dt);
+    
+    jres["numqueries"]=tdr.d_numqueries;
+    cout<<"Result of query for "<< dn <<"|"<<toString(dt)<< " ("<<res.intermediate.size()<<" intermediate, "<<res.res.size()<<" actual)\n";
+    for(const auto& r : res.intermediate) {
+      jres["intermediate"].push_back(rrToJSON(r));
+      cout<<r.name <<" "<<r.ttl<<" "<<r.rr->getType()<<" " << r.rr->toString()<<endl;
+    }
+    
+    for(const auto& r : res.res) {
+      jres["answer"].push_back(rrToJSON(r));
+      cout<<r.name <<" "<<r.ttl<<" "<<r.rr->getType()<<" "<<r.rr->toString()<<endl;
+    }
+    cout<<"Used "<<tdr.d_numqueries << " queries"<<endl;
+    jres["rcode"]=0;
+  }
+  catch(NxdomainException& e)
+  {
+    cout<<argv[1]<<": name does not exist"<<endl;
+    cout<<"Used "<<tdr.d_numqueries << " queries"<<endl;
+    rc=EXIT_FAILURE;
+    jres["rcode"]=3;
+  }
+  catch(NodataException& e)
+  {
+    cout<<argv[1]<< ": name does not have datatype requested"<<endl;
+    cout<<"Used "<<tdr.d_numqueries << " queries"<<endl;
+    rc=EXIT_FAILURE;
+    jres["rcode"]=0;
+  }
+  catch(TooManyQueriesException& e)
+  {
+    cout<<argv[1]<< ": exceeded maximum number of queries (" << tdr.d_numqueries<<")"<<endl;
+    rc= EXIT_FAILURE;
+
+    jres["rcode"]=2;
+  }
+  jres["numqueries"]=tdr.d_numqueries;
+  jres["numtimeouts"]=tdr.d_numtimeouts;
+  jres["numformerrs"]=tdr.d_numformerrs;
+  jres["trace"]=logstream.str();
+  auto finish = chrono::high_resolution_clock::now();
+  auto msecs = chrono::duration_cast<chrono::milliseconds>(finish-start);
+  
+  jres["msec"]= msecs.count();
+  {
+    tdr.endPlot();
+
+    ofstream tmpstr(dn.toString()+"dot");
+    tmpstr << dotstream.str();
+    tmpstr.flush();
+  }
+
+  FILE* dotfp = popen(string("dot -Tsvg < "+dn.toString()+"dot").c_str(), "r");
+  if(!dotfp) {
+    cerr << "popen failed: " << strerror(errno) <<endl;
+  }
+  else {
+    char buffer[100000];
+    int siz = fread(buffer, 1, sizeof(buffer), dotfp);
+    //    unlink(string(dn.toString()+"dot").c_str());
+    jres["dot"]=std::string(buffer, siz);
+    pclose(dotfp);
+  }
+  cout << jres << endl;
+
+  ofstream logfile(dn.toString()+"txt");
+  logfile << logstream.str();
+  
+  std::vector<std::uint8_t> v_cbor = nlohmann::json::to_cbor(jres);
+  FILE* out = fopen("cbor", "w");
+  fwrite(&v_cbor[0], 1, v_cbor.size(), out);
+  fclose(out);
+  return rc;
+}
+catch(std::exception& e)
+{
+  cerr<<argv[1]<<": fatal error: "<<e.what()<<endl;
+  return EXIT_FAILURE;
+}
@@ -1,107 +1,56 @@
+#include "tres.hh"
 #include <fstream>
 #include <vector>
 #include <map>
+#include <deque>
+#include <sstream>
 #include <stdexcept>
 #include "sclasses.hh"
 #include <signal.h>
 #include <random>
 #include "record-types.hh"
+#include "negcache.hh"
+#include "reccache.hh"
+#include "timerwheel.hh"
+#include "infra.hh"
+#include "inflight.hh"
+#include "engine.hh"
+#include "udppool.hh"
+#include "tcppool.hh"
+#include "snapshot.hh"
+#include "rootmirror.hh"
+#include "log.hh"
+#include "metrics.hh"
+#include "histogram.hh"
+#include "querylog.hh"
+#include "heavyhitters.hh"
 #include <thread>
+#include <mutex>
 #include <chrono>
-#include "nlohmann/json.hpp"
 /*! 
    @file
-   @brief Teachable resolver
+   @brief Teachable resolver, the main() of tres is in tres-main.cc
 */
 
 using namespace std;
 
-//! Thrown if too many queries have been sent.
-struct TooManyQueriesException{};
-//! this is a different kind of error: we KNOW your name does not exist
-struct NxdomainException{};
-//! Or if your type does not exist
-struct NodataException{};
+/*! Like TLOG(), for the trace of a resolution. Goes to the log stream of the resolver if it
+    has one, otherwise it is a Debug line. The arguments are only evaluated if it goes anywhere */
+#define RLOG(tdr, ...) do { if((tdr).logging()) (tdr).log(__VA_ARGS__); } while(0)
 
 multimap<DNSName, ComboAddress> g_root;
-class TDNSResolver
-{
-public:
-
-  TDNSResolver(multimap<DNSName, ComboAddress>& root) : d_root(root)
-  {}
-  TDNSResolver()
-  {}
-
-  //! This describes a single resource record returned
-  struct ResolveRR
-  {
-    DNSName name;
-    uint32_t ttl;
-    std::unique_ptr<RRGen> rr;
-  };
-  
-  //! This is the end result of our resolving work
-  struct ResolveResult
-  {
-    vector<ResolveRR> res; //!< what you asked for
-    vector<ResolveRR> intermediate; //!< a CNAME chain that gets you there
-    void clear()
-    {
-      res.clear();
-      intermediate.clear();
-    }
-  };
-
-  ResolveResult resolveAt(const DNSName& dn, const DNSType& dt, int depth=0, const DNSName& auth={}, const multimap<DNSName, ComboAddress>& mservers=g_root);
-
-  void setPlot(ostream& fs)
-  {
-    d_dot = &fs;
-    (*d_dot) << "digraph { "<<endl;
-  }
-
-  void endPlot()
-  {
-    if(d_dot)
-      (*d_dot) << "}\n";
-  }
-  
-  void setLog(ostream& fs)
-  {
-    d_log = &fs;
-  }
-  
-  ~TDNSResolver()
-  {
-  }
-  DNSMessageReader getResponse(const ComboAddress& server, const DNSName& dn, const DNSType& dt, int depth=0);
-private:
-  void dotQuery(const DNSName& auth, const DNSName& server);
-  void dotAnswer(const DNSName& dn, const DNSType& rrdt, const DNSName& server);
-  void dotCNAME(const DNSName& target, const DNSName& server, const DNSName& dn);
-  void dotDelegation(const DNSName& rrdn, const DNSName& server);
-  multimap<DNSName, ComboAddress> d_root;
-  unsigned int d_maxqueries{100};
-
-  bool d_skipIPv6{false};
-  ostream* d_dot{nullptr};
-  ostream* d_log{nullptr};
-  ostream& lstream()
-  {
-    return d_log ? *d_log : cout;
-  }
-
-public:
-  unsigned int d_numqueries{0};
-  unsigned int d_numtimeouts{0};
-  unsigned int d_numformerrs{0};
-  
-};
-
-/** Helper function that extracts a useable IP address from an
-    A or AAAA resource record. Returns sin_family == 0 if it didn't work */
-static ComboAddress getIP(const std::unique_ptr<RRGen>& rr)
+NegativeCache g_negcache;
+RecordCache g_reccache;
+InfraTable g_infra;
+RootMirror g_rootmirror;
+unsigned int g_staggermsec{200};
+Engine* g_engine{nullptr};
+string g_snapshot;
+uint16_t g_nsport{53};
+ClientDeadlines g_deadlines;
+BudgetStats g_budget;
+
+ComboAddress getIP(const std::unique_ptr<RRGen>& rr)
 {
   ComboAddress ret;
   ret.sin4.sin_family = 0;
@@ -110,7 +59,7 @@ static ComboAddress getIP(const std::unique_ptr<RRGen>& rr)
   else if(auto ptr = dynamic_cast<AAAAGen*>(rr.get()))
     ret=ptr->getIP();
 
-  ret.sin4.sin_port = htons(53);
+  ret.sin4.sin_port = htons(g_nsport);
   return ret;
 }
 
@@ -125,14 +74,12 @@ static ComboAddress getIP(const std::unique_ptr<RRGen>& rr)
 */
 DNSMessageReader TDNSResolver::getResponse(const ComboAddress& server, const DNSName& dn, const DNSType& dt, int depth)
 {
-  // quick hack to prevent us from hammering dead servers 
-  static thread_local map<std::tuple<ComboAddress, DNSName, DNSType>, int> skips;
   std::string prefix(depth, ' ');
   prefix += dn.toString() + "|"+toString(dt)+" ";
 
-  auto skipiter = skips.find(std::tie(server,dn,dt));
-  if(skipiter != skips.end() && skipiter->second > 3) {
-    throw std::runtime_error("Skipping query to "+server.toString()+": failed before");
+  // don't hammer dead servers
+  if(g_infra.isThrottled(server)) {
+    throw std::runtime_error("Skipping query to "+server.toString()+": timed out too often recently");
   }
   
   bool doEDNS=true, doTCP=false;
@@ -140,6 +87,7 @@ DNSMessageReader TDNSResolver::getResponse(const ComboAddress& server, const DNS
   for(int tries = 0; tries < 4 ; ++tries) {
     if(++d_numqueries > d_maxqueries) // there is the possibility our algorithm will loop
       throw TooManyQueriesException(); // and send out thousands of queries, so let's not
+    timeLeft(0);
 
     DNSMessageWriter dmw(dn, dt);
     dmw.dh.rd = false;
@@ -147,71 +95,83 @@ DNSMessageReader TDNSResolver::getResponse(const ComboAddress& server, const DNS
     if(doEDNS) 
       dmw.setEDNS(1500, false);  // no DNSSEC for now, 1500 byte buffer size
     string resp;
-    double timeout=1.0;
+    double timeout = timeLeft(1.0);
+    uint64_t start = 0; // usec
+    uint16_t id = dmw.dh.id;
+    bool retransmitted = false;
     if(doTCP) {
-      Socket sock(server.sin4.sin_family, SOCK_STREAM);
-      SConnect(sock, server);
-      string ser = dmw.serialize();
-      uint16_t len = htons(ser.length());
-      string tmp((char*)&len, 2);
-      SWrite(sock, tmp);
-      SWrite(sock, ser);
+      if(doEDNS) // ask the server how long we may keep the connection open
+        dmw.addEDNSOption(EDNSOption::TCPKeepalive, "");
+      // reuses a connection to this server if we have one, and does not wait for other queries on it
+      TCPPool::Query query(TCPPool::get(), server, dmw.serialize(), dn, dt, &timeout);
+      id = query.id();
+      start = usecNow();
 
-      int err = waitForData(sock, &timeout);
+      int err = query.wait(&timeout);
 
       if( err <= 0) {
-        if(!err) d_numtimeouts++;
-        throw std::runtime_error("Error waiting for data from "+server.toStringWithPort()+": "+ (err ? string(strerror(errno)): string("Timeout")));
-      }
-
-      tmp=SRead(sock, 2);
-      len = ntohs(*((uint16_t*)tmp.c_str()));
-
-      // so yes, you need to check for a timeout here again!
-      err = waitForData(sock, &timeout);
-
-      if( err <= 0) {
-        if(!err) d_numtimeouts++;
-        throw std::runtime_error("Error waiting for data from "+server.toStringWithPort()+": "+ (err ? string(strerror(errno)): string("Timeout")));
+        if(!err) {
+          timeLeft(0); // if it was us who ran out of time, that is not the fault of the server
+          d_numtimeouts++;
+          g_infra.reportTimeout(server);
+        }
+        throw std::runtime_error("Error waiting for data from "+server.toStringWithPort()+": "+ (err ? string("Connection closed"): string("Timeout")));
       }
-      // and even this is not good enough, an authoritative server could be trickling us bytes
-      resp = SRead(sock, len);
+      resp = query.response();
     }
     else {
-      Socket sock(server.sin4.sin_family, SOCK_DGRAM);
-      SConnect(sock, server);
-      SWrite(sock, dmw.serialize());
-
-      int err = waitForData(sock, &timeout);
+      // goes out over one of the sockets in the pool of this thread, no need to make a new one
+      start = usecNow();
+      UDPPool::Query query(UDPPool::get(), server, dmw.serialize(), dn, dt);
+      id = query.id(); // the pool might have had to pick another one
+
+      // packets get lost, so we resend with exponential backoff. All waits add up to a bit over a second
+      int err = 0;
+      double wait = 0.35;
+      for(int transmits = 0; transmits < 2; ++transmits, wait *= 2) {
+        if(transmits) {
+          RLOG(*this, prefix, "No response from ", server.toString(), " in time, retransmitting");
+          retransmitted = true;
+          query.resend();
+        }
+        timeout = timeLeft(wait);
+        err = query.wait(&timeout); // in the engine, other queries run while we wait
+        if(err)
+          break;
+      }
 
       // so one could simply retry on a timeout, but here we don't
       if( err <= 0) {
-        skips[std::tie(server,dn,dt)]++;
-        if(!err) d_numtimeouts++;
-        
+        if(!err) {
+          timeLeft(0); // if it was us who ran out of time, that is not the fault of the server
+          d_numtimeouts++;
+          g_infra.reportTimeout(server);
+        }
+
         throw std::runtime_error("Error waiting for data from "+server.toStringWithPort()+": "+ (err ? string(strerror(errno)): string("Timeout")));
       }
-      ComboAddress ign=server;
-      resp = SRecvfrom(sock, 65535, ign); 
+      resp = query.response();
     }
-    skips.erase(std::tie(server,dn,dt));
+    // Karn's algorithm: after a retransmit, we can't know which query this answers
+    if(!retransmitted)
+      g_infra.reportRTT(server, usecNow() - start);
     DNSMessageReader dmr(resp);
-    if(dmr.dh.id != dmw.dh.id) {
-      lstream() << prefix << "ID mismatch on answer" << endl;
+    if(dmr.dh.id != id) {
+      RLOG(*this, prefix, "ID mismatch on answer");
       continue;
     }
     if(!dmr.dh.qr) { // for security reasons, you really need this
-      lstream() << prefix << "What we received was not a response, ignoring"<<endl;
+      RLOG(*this, prefix, "What we received was not a response, ignoring");
       continue;
     }
     if((RCode)dmr.dh.rcode == RCode::Formerr) { // XXX this should check that there is no OPT in the response
-      lstream() << prefix <<"Got a Formerr, resending without EDNS"<<endl;
+      RLOG(*this, prefix, "Got a Formerr, resending without EDNS");
       doEDNS=false;
       d_numformerrs++;
       continue;
     }
     if(dmr.dh.tc) {
-      lstream() << prefix <<"Got a truncated answer, retrying over TCP"<<endl;
+      RLOG(*this, prefix, "Got a truncated answer, retrying over TCP");
       doTCP=true;
       continue;
     }
@@ -223,22 +183,212 @@ DNSMessageReader TDNSResolver::getResponse(const ComboAddress& server, const DNS
 
 
 
-/** This takes a list of servers (in a specific order) and shuffles them to a vector.
-    This is to spread the load across nameservers
+/** This takes a list of servers (in a specific order) and puts them in a vector, 
+    the ones we expect to answer fastest first. Servers with equal scores are shuffled,
+    to spread the load across nameservers
 */
     
-static auto randomizeServers(const multimap<DNSName, ComboAddress>& mservers)
+static auto orderServers(const multimap<DNSName, ComboAddress>& mservers)
 {
   vector<pair<DNSName, ComboAddress> > servers;
-  for(auto& sp : mservers) 
+  for(auto& sp : mservers) {
     servers.push_back(sp);
+    servers.back().second.sin4.sin_port = htons(g_nsport); // just to be sure
+  }
 
-  std::random_device rd;
-  std::mt19937 g(rd());
-  std::shuffle(servers.begin(), servers.end(), g);
+  g_infra.sort(servers, [](const pair<DNSName, ComboAddress>& sp) { return sp.second; });
   return servers;
 }
 
+/** Asks a list of nameservers the same question, the best one first. Like Happy Eyeballs
+    (RFC 8305) does for connections: if no usable answer came in after d_staggermsec, the
+    next server is asked too, without giving up on the ones before it. So a dead or slow
+    server costs us the stagger, and not a full timeout.
+
+    Responses are handed out in the order they arrive. Servers that answer with an error
+    are skipped, and a truncated answer or a Formerr is sorted out by getResponse().
+*/
+class TDNSResolver::Race
+{
+public:
+  Race(TDNSResolver& tdr, const vector<pair<DNSName, ComboAddress>>& servers, const DNSName& dn, const DNSType& dt, int depth, const DNSName& auth) :
+    d_tdr(tdr), d_servers(servers), d_dn(dn), d_auth(auth), d_dt(dt), d_depth(depth), d_prefix(depth, ' ')
+  {
+    if(tdr.logging())
+      d_prefix += dn.toString() + "|"+toString(dt)+" ";
+  }
+
+  /*! Returns the next usable response, which came from servers[idx]. False once all servers answered or timed out.
+      Throws a DeadlineException at the deadline, or if the only servers left would answer after it */
+  bool next(size_t& idx, std::unique_ptr<DNSMessageReader>& dmr);
+
+private:
+  struct Attempt
+  {
+    size_t idx;
+    std::unique_ptr<UDPPool::Query> query;
+    uint64_t start;       //!< usec, for the round trip time
+    uint64_t deadline;    //!< msec, when we retransmit or give up
+    bool retransmitted{false};
+  };
+  bool launch();
+  bool collect(Attempt& a, std::unique_ptr<DNSMessageReader>& dmr);
+
+  TDNSResolver& d_tdr;
+  const vector<pair<DNSName, ComboAddress>>& d_servers;
+  DNSName d_dn, d_auth;
+  DNSType d_dt;
+  int d_depth;
+  std::string d_prefix;
+  size_t d_next{0};           //!< the next server to ask
+  uint64_t d_nextlaunch{0};   //!< msec, when we ask it
+  vector<Attempt> d_attempts; //!< still waiting for these
+  bool d_overbudget{false};   //!< we did not ask a server because it would answer after the deadline
+};
+
+//! Sends the question to the next server we can ask, returns false if there is none left
+bool TDNSResolver::Race::launch()
+{
+  while(d_next < d_servers.size()) {
+    size_t idx = d_next++;
+    const auto& sp = d_servers[idx];
+    const ComboAddress& server = sp.second;
+    if(d_tdr.d_skipIPv6 && server.sin4.sin_family == AF_INET6)
+      continue;
+    // don't hammer dead servers
+    if(g_infra.isThrottled(server)) {
+      RLOG(d_tdr, d_prefix, "Skipping query to ", server.toString(), ": timed out too often recently");
+      continue;
+    }
+    // a server that we expect to answer after the deadline is of no use
+    uint64_t expected = g_infra.score(server) / 1000;
+    if(d_tdr.d_deadline && msecNow() + expected >= d_tdr.d_deadline) {
+      RLOG(d_tdr, d_prefix, "Skipping query to ", server.toString(), ": would not answer before the deadline");
+      d_overbudget = true;
+      continue;
+    }
+    if(++d_tdr.d_numqueries > d_tdr.d_maxqueries) // there is the possibility our algorithm will loop
+      throw TooManyQueriesException();
+
+    d_tdr.dotQuery(d_auth, sp.first);
+    RLOG(d_tdr, d_prefix, "Sending to server ", sp.first, " on ", server.toString());
+    DNSMessageWriter dmw(d_dn, d_dt);
+    dmw.dh.rd = false;
+    dmw.randomizeID();
+    dmw.setEDNS(1500, false);  // no DNSSEC for now, 1500 byte buffer size
+
+    Attempt a;
+    a.idx = idx;
+    a.start = usecNow();
+    try {
+      a.query = std::make_unique<UDPPool::Query>(UDPPool::get(), server, dmw.serialize(), d_dn, d_dt);
+    }
+    catch(std::exception& e) {
+      RLOG(d_tdr, d_prefix, "Error resolving: ", e.what());
+      continue;
+    }
+    a.deadline = msecNow() + 350;
+    d_attempts.push_back(std::move(a));
+    d_nextlaunch = msecNow() + d_tdr.d_staggermsec;
+    return true;
+  }
+  return false;
+}
+
+//! Called once the response for a is in, returns true if it is one we can use
+bool TDNSResolver::Race::collect(Attempt& a, std::unique_ptr<DNSMessageReader>& dmr)
+{
+  const ComboAddress& server = d_servers[a.idx].second;
+  // Karn's algorithm: after a retransmit, we can't know which query this answers
+  if(!a.retransmitted)
+    g_infra.reportRTT(server, usecNow() - a.start);
+  try {
+    dmr = std::make_unique<DNSMessageReader>(a.query->response());
+    if((RCode)dmr->dh.rcode == RCode::Formerr || dmr->dh.tc) {
+      RLOG(d_tdr, d_prefix, (dmr->dh.tc ? "Got a truncated answer" : "Got a Formerr"), " from ", server.toString(), ", asking again");
+      dmr = std::make_unique<DNSMessageReader>(d_tdr.getResponse(server, d_dn, d_dt, d_depth)); // knows about TCP, and servers without EDNS
+    }
+    auto rcode = (RCode)dmr->dh.rcode;
+    if(rcode != RCode::Noerror && rcode != RCode::Nxdomain) {
+      RLOG(d_tdr, d_prefix, server.toString(), " answered with ", rcode, ", trying other servers");
+      return false;
+    }
+    return true;
+  }
+  catch(std::exception& e) {
+    RLOG(d_tdr, d_prefix, "Error resolving: ", e.what());
+    return false;
+  }
+}
+
+bool TDNSResolver::Race::next(size_t& idx, std::unique_ptr<DNSMessageReader>& dmr)
+{
+  for(;;) {
+    auto iter = std::find_if(d_attempts.begin(), d_attempts.end(), [](const Attempt& a) { return a.query->done(); });
+    if(iter != d_attempts.end()) {
+      Attempt a = std::move(*iter);
+      d_attempts.erase(iter);
+      if(collect(a, dmr)) {
+        idx = a.idx;
+        return true;
+      }
+      d_nextlaunch = 0; // that one was no good, so ask the next one right away
+      continue;
+    }
+
+    d_tdr.timeLeft(0); // we give up on all of them when the client does
+
+    // packets get lost, so we resend once. All waits add up to a bit over a second
+    uint64_t now = msecNow();
+    for(auto iter = d_attempts.begin(); iter != d_attempts.end(); ) {
+      if(now < iter->deadline) {
+        ++iter;
+        continue;
+      }
+      const ComboAddress& server = d_servers[iter->idx].second;
+      if(!iter->retransmitted) {
+        RLOG(d_tdr, d_prefix, "No response from ", server.toString(), " in time, retransmitting");
+        try {
+          iter->query->resend();
+        }
+        catch(std::exception& e) {} // then it times out
+        iter->retransmitted = true;
+        iter->deadline = now + 700;
+        ++iter;
+      }
+      else {
+        RLOG(d_tdr, d_prefix, "Timeout waiting for ", server.toString());
+        d_tdr.d_numtimeouts++;
+        g_infra.reportTimeout(server);
+        iter = d_attempts.erase(iter);
+        d_nextlaunch = 0;
+      }
+    }
+
+    // ask another server if the stagger passed, or if there is nobody to wait for anymore
+    if((d_attempts.empty() || (d_tdr.d_staggermsec && now >= d_nextlaunch)) && launch())
+      continue;
+    if(d_attempts.empty()) {
+      if(d_overbudget) // the servers we did not ask might have known, but the client can't wait for them
+        throw DeadlineException();
+      return false;
+    }
+
+    uint64_t wake = d_attempts.front().deadline;
+    vector<UDPPool::Query*> queries;
+    for(const auto& a : d_attempts) {
+      wake = min(wake, a.deadline);
+      queries.push_back(a.query.get());
+    }
+    if(d_tdr.d_staggermsec && d_next < d_servers.size())
+      wake = min(wake, d_nextlaunch);
+    if(d_tdr.d_deadline)
+      wake = min(wake, d_tdr.d_deadline);
+    double timeout = wake > now ? (wake - now) / 1000.0 : 0;
+    UDPPool::get().waitAny(queries, &timeout); // in the engine, other queries run while we wait
+  }
+}
+
 void TDNSResolver::dotQuery(const DNSName& auth, const DNSName& server)
 {
   if(!d_dot) return;
@@ -267,6 +417,43 @@ void TDNSResolver::dotDelegation(const DNSName& rrdn, const DNSName& server)
   (*d_dot) << '"' << server << "\" -> \"" << rrdn << "\"" <<endl;
 }
 
+/** Stores the records in a response in the record cache, as long as they are within the
+    authority of the server that sent them. How much we believe them depends on whether the
+    response was authoritative, and on the section they were in */
+static void cacheResponse(const DNSMessageReader& response, const DNSName& auth)
+{
+  DNSMessageReader dmr(response); // getRR() moves through the message, and the caller still needs to
+  map<tuple<DNSSection, DNSName, DNSType>, pair<vector<std::unique_ptr<RRGen>>, uint32_t>> rrsets;
+  DNSSection rrsection;
+  DNSName rrdn;
+  DNSType rrdt;
+  uint32_t ttl;
+  std::unique_ptr<RRGen> rr;
+  while(dmr.getRR(rrsection, rrdn, rrdt, ttl, rr)) {
+    if(!rrdn.isPartOf(auth) || rrdt == DNSType::OPT || rrdt == DNSType::RRSIG)
+      continue;
+    auto& rrset = rrsets[make_tuple(rrsection, rrdn, rrdt)];
+    if(rrset.first.empty() || ttl < rrset.second) // an RRset has one TTL, the lowest one is safest
+      rrset.second = ttl;
+    rrset.first.push_back(std::move(rr));
+  }
+
+  for(const auto& rrset : rrsets) {
+    RecordCache::Rank rank;
+    switch(get<0>(rrset.first)) {
+    case DNSSection::Answer:
+      rank = dmr.dh.aa ? RecordCache::Rank::AuthAnswer : RecordCache::Rank::NonAuthAnswer;
+      break;
+    case DNSSection::Authority:
+      rank = dmr.dh.aa ? RecordCache::Rank::AuthAuthority : RecordCache::Rank::Referral;
+      break;
+    default:
+      rank = RecordCache::Rank::Glue;
+    }
+    g_reccache.add(get<1>(rrset.first), get<2>(rrset.first), rrset.second.first, rrset.second.second, rank);
+  }
+}
+
 /** This attempts to look up the name dn with type dt. The depth parameter is for 
     trace output.
     the 'auth' field describes the authority of the servers we will be talking to. Defaults to root ('believe everything')
@@ -274,31 +461,115 @@ void TDNSResolver::dotDelegation(const DNSName& rrdn, const DNSName& server)
     root-servers.
 */
 
+/* Resolves dn|dt in the background, because the record cache told us it is popular and
+   about to expire. Once this is done, the next client gets a fresh answer from the cache */
+static void prefetch(const DNSName& dn, DNSType dt)
+{
+  if(!g_engine)
+    return;
+  bool queued = g_engine->submit([dn, dt]() {
+      TDNSResolver tdr(g_root);
+      tdr.setStagger(g_staggermsec);
+      tdr.setRefresh(dn);
+      tdr.setDeadline(msecNow() + g_deadlines.timeoutmsec);
+      try {
+        tdr.resolveAt(dn, dt);
+        TLOG(Info, "Prefetched ", dn, "|", toString(dt), " in ", tdr.d_numqueries, " queries");
+      }
+      catch(...) {
+        TLOG(Info, "Prefetching ", dn, "|", toString(dt), " failed, it will expire");
+      }
+    });
+  if(!queued)
+    TLOG(Info, "Too busy to prefetch ", dn, "|", toString(dt));
+}
+
 TDNSResolver::ResolveResult TDNSResolver::resolveAt(const DNSName& dn, const DNSType& dt, int depth, const DNSName& auth, const multimap<DNSName, ComboAddress>& mservers)
 {
   std::string prefix(depth, ' ');
   prefix += dn.toString() + "|"+toString(dt)+" ";
-  lstream() << prefix << "Starting query at authority = "<<auth<< ", have "<<mservers.size() << " addresses to try"<<endl;
+  RLOG(*this, prefix, "Starting query at authority = ", auth, ", have ", mservers.size(), " addresses to try");
+  timeLeft(0);
+
+  NegativeCache::Entry ne;
+  if(g_negcache.get(dn, dt, ne)) {
+    RLOG(*this, prefix, "Negative cache says ", ne.name, (ne.kind == NegativeCache::Kind::Nxdomain ? " does not exist" : " has no such type"), ", ", ne.ttl(time(nullptr)), " seconds left");
+    if(ne.kind == NegativeCache::Kind::Nxdomain)
+      throw NxdomainException();
+    throw NodataException();
+  }
 
   ResolveResult ret;
-  // it is good form to sort the servers in order of response time
-  // for tres, this is not done (since we have no memory), but we do randomize:
+  time_t now = time(nullptr);
+  RecordCache::RRset cached;
+  bool refresh = d_refreshing && dn == d_refresh;
+  if(!refresh && g_reccache.get(dn, dt, cached, RecordCache::Rank::AuthAnswer)) {
+    RLOG(*this, prefix, "Record cache has ", cached.rrs.size(), " records, ", cached.ttl(now), " seconds left");
+    if(cached.prefetch)
+      prefetch(dn, dt);
+    for(auto& rr : cached.rrs)
+      ret.res.push_back({dn, cached.ttl(now), std::move(rr)});
+    return ret;
+  }
+  if(!refresh && dt != DNSType::CNAME && g_reccache.get(dn, DNSType::CNAME, cached, RecordCache::Rank::AuthAnswer) && !cached.rrs.empty()) {
+    if(cached.prefetch)
+      prefetch(dn, dt);
+    // following a cached CNAME counts as a query, so a loop in the cache ends too
+    if(++d_numqueries > d_maxqueries)
+      throw TooManyQueriesException();
+    DNSName target = dynamic_cast<CNAMEGen*>(cached.rrs.front().get())->d_name;
+    RLOG(*this, prefix, "Record cache has a CNAME to ", target, ", chasing");
+    ret.intermediate.push_back({dn, cached.ttl(now), std::move(cached.rrs.front())});
+    auto chaseres=resolveAt(target, dt, depth + 1);
+    ret.res = std::move(chaseres.res);
+    for(auto& rr : chaseres.intermediate)   // add up their intermediates to ours
+      ret.intermediate.push_back(std::move(rr));
+    return ret;
+  }
 
-  auto servers = randomizeServers(mservers);
+  // start at the deepest zone cut we know servers for, if that is below what we were told
+  DNSName zone;
+  multimap<DNSName, ComboAddress> cut;
+  if(g_reccache.getDelegation(dn, zone, cut) && zone != auth && zone.isPartOf(auth)) {
+    RLOG(*this, prefix, "Record cache has a delegation to ", zone, ", starting there with ", cut.size(), " addresses");
+    auto res2 = resolveAt(dn, dt, depth+1, zone, cut);
+    if(!res2.res.empty())
+      return res2;
+    RLOG(*this, prefix, "The cached delegation did not provide a good answer");
+  }
 
-  for(auto& sp : servers) {      
-    dotQuery(auth, sp.first);
+  // with a copy of the root zone, the root servers don't have to tell us where to go (RFC 8806)
+  RootMirror::Referral ref;
+  auto mirrored = auth.empty() ? g_rootmirror.lookup(dn, ref) : RootMirror::Result::Unavailable;
+  if(mirrored == RootMirror::Result::Nxdomain) {
+    DNSName tld;
+    tld.push_back(dn.back());
+    std::unique_ptr<SOAGen> soa;
+    uint32_t soattl;
+    if(g_rootmirror.getSOA(soa, soattl))
+      g_negcache.addNxdomain(tld, DNSName(), *soa, soattl);
+    RLOG(*this, prefix, "Root zone mirror says ", tld, " does not exist");
+    throw NxdomainException();
+  }
+  if(mirrored == RootMirror::Result::Referral) {
+    RLOG(*this, prefix, "Root zone mirror delegates to ", ref.zone, ", ", ref.servers.size(), " addresses");
+    if(!ref.servers.empty())
+      return resolveAt(dn, dt, depth+1, ref.zone, ref.servers);
+    return resolveViaNames(dn, dt, depth, ref.zone, set<DNSName>(ref.nsses.begin(), ref.nsses.end()));
+  }
 
+  // it is good form to sort the servers in order of response time
+  auto servers = orderServers(mservers);
+
+  // the best one gets asked first, the others too if it takes a while
+  Race race(*this, servers, dn, dt, depth, auth);
+  size_t idx;
+  std::unique_ptr<DNSMessageReader> dmrp;
+  while(race.next(idx, dmrp)) {
+    const auto& sp = servers[idx];
     ret.clear();
-    ComboAddress server=sp.second;
-    server.sin4.sin_port = htons(53); // just to be sure
-    
-    if(d_skipIPv6 && server.sin4.sin_family == AF_INET6)
-      continue;
     try {
-      lstream() << prefix<<"Sending to server "<<sp.first<<" on "<<server.toString()<<endl;
-
-      DNSMessageReader dmr = getResponse(server, dn, dt, depth); // takes care of EDNS and TCP for us
+      DNSMessageReader& dmr = *dmrp;
 
       DNSSection rrsection;
       uint32_t ttl;
@@ -307,47 +578,59 @@ TDNSResolver::ResolveResult TDNSResolver::resolveAt(const DNSName& dn, const DNS
       
       dmr.getQuestion(rrdn, rrdt); // parse into rrdn and rrdt
       
-      lstream() << prefix<<"Received a "<< dmr.size() << " byte response with RCode "<<(RCode)dmr.dh.rcode<<", qname " <<dn<<", qtype "<<dt<<", aa: "<<dmr.dh.aa << endl;
+      RLOG(*this, prefix, "Received a ", dmr.size(), " byte response with RCode ", (RCode)dmr.dh.rcode, ", qname ", dn, ", qtype ", dt, ", aa: ", (int)dmr.dh.aa);
       if(rrdn != dn || dt != rrdt) {
-        lstream() << prefix << "Got a response to a different question or different type than we asked for!"<<endl;
+        RLOG(*this, prefix, "Got a response to a different question or different type than we asked for!");
         continue; // see if another server wants to work with us
       }
+      cacheResponse(dmr, auth);
 
       // in a real resolver, you must ignore NXDOMAIN in case of a CNAME. Because that is how the internet rolls.
       if((RCode)dmr.dh.rcode == RCode::Nxdomain) {
-        lstream() << prefix<<"Got an Nxdomain, it does not exist"<<endl;
+        RLOG(*this, prefix, "Got an Nxdomain, it does not exist");
+        // the SOA record in the authority section tells us how long we may remember this. Unless there
+        // are answers: then dn is a CNAME, and it is its target that does not exist
+        std::unique_ptr<RRGen> rr;
+        while(!dmr.dh.ancount && dmr.getRR(rrsection, rrdn, rrdt, ttl, rr)) {
+          if(rrsection == DNSSection::Authority && rrdt == DNSType::SOA && dn.isPartOf(rrdn) && rrdn.isPartOf(auth)) {
+            g_negcache.addNxdomain(dn, rrdn, *dynamic_cast<SOAGen*>(rr.get()), ttl);
+            break;
+          }
+        }
         throw NxdomainException();
       }
       else if((RCode)dmr.dh.rcode != RCode::Noerror) {
         throw std::runtime_error(string("Answer from authoritative server had an error: ") + toString((RCode)dmr.dh.rcode));
       }
       if(dmr.dh.aa) {
-        lstream() << prefix<<"Answer says it is authoritative!"<<endl;
+        RLOG(*this, prefix, "Answer says it is authoritative!");
       }
       
-      std::unique_ptr<RRGen> rr;
+      std::unique_ptr<RRGen> rr, soa;
       set<DNSName> nsses;
       multimap<DNSName, ComboAddress> addresses;
+      DNSName soaname;
+      uint32_t soattl=0;
 
       /* here we loop over records. Perhaps the answer is there, perhaps
          there is a CNAME we should follow, perhaps we get a delegation.
          And if we do get a delegation, there might even be useful glue */
       
       while(dmr.getRR(rrsection, rrdn, rrdt, ttl, rr)) {
-        lstream() << prefix << rrsection<<" "<<rrdn<< " IN " << rrdt << " " << ttl << " " <<rr->toString()<<endl;
+        RLOG(*this, prefix, rrsection, " ", rrdn, " IN ", rrdt, " ", ttl, " ", rr->toString());
         if(dmr.dh.aa==1) { // authoritative answer. We trust this.
           if(rrsection == DNSSection::Answer && dn == rrdn && dt == rrdt) {
-            lstream() << prefix<<"We got an answer to our question!"<<endl;
+            RLOG(*this, prefix, "We got an answer to our question!");
             dotAnswer(dn, rrdt, sp.first);
             ret.res.push_back({dn, ttl, std::move(rr)});
           }
           else if(dn == rrdn && rrdt == DNSType::CNAME) {
             DNSName target = dynamic_cast<CNAMEGen*>(rr.get())->d_name;
             ret.intermediate.push_back({dn, ttl, std::move(rr)}); // rr is DEAD now!
-            lstream() << prefix<<"We got a CNAME to " << target <<", chasing"<<endl;
+            RLOG(*this, prefix, "We got a CNAME to ", target, ", chasing");
             dotCNAME(target, sp.first, dn);
             if(target.isPartOf(auth)) { // this points to something we consider this server auth for
-              lstream() << prefix << "target " << target << " is within " << auth<<", harvesting from packet"<<endl;
+              RLOG(*this, prefix, "target ", target, " is within ", auth, ", harvesting from packet");
               bool hadMatch=false;      // perhaps the answer is in this DNS message
               while(dmr.getRR(rrsection, rrdn, rrdt, ttl, rr)) {
                 if(rrsection==DNSSection::Answer && rrdn == target && rrdt == dt) {
@@ -356,11 +639,11 @@ TDNSResolver::ResolveResult TDNSResolver::resolveAt(const DNSName& dn, const DNS
                 }
               }
               if(hadMatch) {            // if it worked, great, otherwise actual chase
-                lstream() << prefix << "in-message chase worked, we're done"<<endl;
+                RLOG(*this, prefix, "in-message chase worked, we're done");
                 return ret;
               }
               else
-                lstream() <<prefix<<"in-message chase not successful, will do new query for "<<target<<endl;
+                RLOG(*this, prefix, "in-message chase not successful, will do new query for ", target);
             }
                         
             auto chaseres=resolveAt(target, dt, depth + 1);
@@ -369,6 +652,11 @@ TDNSResolver::ResolveResult TDNSResolver::resolveAt(const DNSName& dn, const DNS
               ret.intermediate.push_back(std::move(rr)); 
             return ret;
           }
+          else if(rrsection == DNSSection::Authority && rrdt == DNSType::SOA && dn.isPartOf(rrdn) && rrdn.isPartOf(auth)) {
+            soaname = rrdn;  // in case this turns out to be a NODATA answer
+            soattl = ttl;
+            soa = std::move(rr);
+          }
         }
         else {
           // this picks up nameserver records. We check if glue records are within the authority
@@ -384,7 +672,7 @@ TDNSResolver::ResolveResult TDNSResolver::resolveAt(const DNSName& dn, const DNS
               newAuth = rrdn;
             }
             else
-              lstream()<< prefix << "Authoritative server gave us NS record to which this query does not belong" <<endl;
+              RLOG(*this, prefix, "Authoritative server gave us NS record to which this query does not belong");
           }
           else if(rrsection == DNSSection::Additional && nsses.count(rrdn) && (rrdt == DNSType::A || rrdt == DNSType::AAAA)) {
             // this only picks up addresses for NS records we've seen already
@@ -392,329 +680,450 @@ TDNSResolver::ResolveResult TDNSResolver::resolveAt(const DNSName& dn, const DNS
             if(rrdn.isPartOf(auth)) 
               addresses.insert({rrdn, getIP(rr)}); 
             else
-              lstream() << prefix << "Not accepting IP address of " << rrdn <<": out of authority of this server"<<endl;
+              RLOG(*this, prefix, "Not accepting IP address of ", rrdn, ": out of authority of this server");
           }
         }
       }
       if(!ret.res.empty()) {
         // the answer is in!
-        lstream() << prefix<<"Done, returning "<<ret.res.size()<<" results, "<<ret.intermediate.size()<<" intermediate\n";
+        RLOG(*this, prefix, "Done, returning ", ret.res.size(), " results, ", ret.intermediate.size(), " intermediate");
         return ret;
       }
       else if(dmr.dh.aa) {
-        lstream() << prefix <<"No data response"<<endl;
+        RLOG(*this, prefix, "No data response");
+        if(soa)
+          g_negcache.addNodata(dn, dt, soaname, *dynamic_cast<SOAGen*>(soa.get()), soattl);
         throw NodataException();
       }
       // we got a delegation
-      lstream() << prefix << "We got delegated to " << nsses.size() << " " << newAuth << " nameserver names " << endl;
+      RLOG(*this, prefix, "We got delegated to ", nsses.size(), " ", newAuth, " nameserver names ");
       if(!addresses.empty()) {
         // in addresses are nameservers for which we have IP or IPv6 addresses
-        lstream() << prefix<<"Have "<<addresses.size()<<" IP addresses to iterate to: ";
-        for(const auto& p : addresses)
-          lstream() << p.first <<"="<<p.second.toString()<<" ";
-        lstream() <<endl;
+        if(logging()) {
+          ostringstream servers;
+          for(const auto& p : addresses)
+            servers << p.first <<"="<<p.second.toString()<<" ";
+          RLOG(*this, prefix, "Have ", addresses.size(), " IP addresses to iterate to: ", servers.str());
+        }
         auto res2=resolveAt(dn, dt, depth+1, newAuth, addresses);
         if(!res2.res.empty())
           return res2;
-        lstream() << prefix<<"The IP addresses we had did not provide a good answer"<<endl;
+        RLOG(*this, prefix, "The IP addresses we had did not provide a good answer");
       }
 
       // well we could not make it work using the servers we had addresses for. Let's try
       // to get addresses for the rest
-      lstream() << prefix<<"Don't have a resolved nameserver to ask anymore, trying to resolve "<<nsses.size()<<" names"<<endl;
-      vector<DNSName> rnsses;
-      for(const auto& name: nsses) 
-        rnsses.push_back(name);
-      std::random_device rd;
-      std::mt19937 g(rd());
-      std::shuffle(rnsses.begin(), rnsses.end(), g);
-
-      for(const auto& name: rnsses) {
-        for(const DNSType& qtype : {DNSType::A, DNSType::AAAA}) {
-          multimap<DNSName, ComboAddress> newns;
-          lstream() << prefix<<"Attempting to resolve NS " <<name<< "|"<<qtype<<endl;
-
-          try {
-            auto result = resolveAt(name, qtype, depth+1);
-            lstream() << prefix<<"Got "<<result.res.size()<<" nameserver " << qtype <<" addresses, adding to list"<<endl;
-            for(const auto& res : result.res)
-              newns.insert({name, getIP(res.rr)});
-            lstream() << prefix<<"We now have "<<newns.size()<<" resolved " << qtype<<" addresses to try"<<endl;
-            if(newns.empty())
-              continue;
-          }
-          catch(std::exception& e)
-          {
-            lstream() << prefix <<"Failed to resolve name for "<<name<<"|"<<qtype<<": "<<e.what()<<endl;
-            continue;
-          }
-
-          catch(...)
-          {
-            lstream() << prefix <<"Failed to resolve name for "<<name<<"|"<<qtype<<endl;
-            continue;
-          }
-          // we have a new (set) of addresses to try
-          auto res2 = resolveAt(dn, dt, depth+1, newAuth, newns);
-          if(!res2.res.empty()) // it worked!
-            return res2;
-          // this could throw an NodataException or a NxdomainException, and we should let that fall through
-          // it didn't, let's move on to the next server
-            
-        }
-      }
+      RLOG(*this, prefix, "Don't have a resolved nameserver to ask anymore, trying to resolve ", nsses.size(), " names");
+      auto res2 = resolveViaNames(dn, dt, depth, newAuth, nsses);
+      if(!res2.res.empty()) // it worked!
+        return res2;
+      // this could throw an NodataException or a NxdomainException, and we should let that fall through
+      // it didn't, let's move on to the next server
     }
     catch(std::exception& e) {
-      lstream() << prefix <<"Error resolving: " << e.what() << endl;
+      RLOG(*this, prefix, "Error resolving: ", e.what());
     }
   }
   // if we get here, we have no results for you.
   return ret;
 }
 
-//! This is a thread that will create an answer to the query in `dmr`
-void processQuery(int sock, ComboAddress client, DNSMessageReader dmr)
-try
+//! Lookups of nameserver names for resolveViaNames(), which can outlive it
+struct NSLookups
 {
-  DNSName dn;
-  DNSType dt;
-  dmr.getQuestion(dn, dt);
+  struct Result
+  {
+    DNSName name;
+    DNSType qtype;
+    multimap<DNSName, ComboAddress> addresses;
+    unsigned int numqueries;
+  };
+  Engine::TaskHandle parent{nullptr}; //!< gets woken up for every result, until it is not interested anymore
+  std::deque<Result> results;
+  ostringstream log;
+};
 
-  DNSMessageWriter dmw(dn, dt);
-  dmw.dh.rd = dmr.dh.rd;
-  dmw.dh.ra = true;
-  dmw.dh.qr = true;
-  dmw.dh.id = dmr.dh.id;
+/** We were delegated to nameservers without (usable) glue, so we need to look up their
+    addresses ourselves, and then ask them. In the engine, all names are looked up at the
+    same time, in tasks of their own, and we ask the addresses that come in first. Outside
+    of it, the names are looked up one by one.
+*/
+TDNSResolver::ResolveResult TDNSResolver::resolveViaNames(const DNSName& dn, const DNSType& dt, int depth, const DNSName& auth, const set<DNSName>& nsses)
+{
+  std::string prefix(depth, ' ');
+  prefix += dn.toString() + "|"+toString(dt)+" ";
 
-  TDNSResolver::ResolveResult res;
-  TDNSResolver tdr(g_root);
-  try {
+  vector<pair<DNSName, DNSType>> todo;
+  for(const auto& name : nsses)
+    for(const DNSType& qtype : {DNSType::A, DNSType::AAAA})
+      if(qtype == DNSType::A || !d_skipIPv6)
+        todo.push_back({name, qtype});
+  std::random_device rd;
+  std::mt19937 g(rd());
+  std::shuffle(todo.begin(), todo.end(), g);
 
-    res = tdr.resolveAt(dn, dt);
-    
-    cout<<"Result of query for "<< dn <<"|"<<toString(dt)<<endl;
-    for(const auto& r : res.intermediate) {
-      cout<<r.name <<" "<<r.ttl<<" "<<r.rr->getType()<<" " << r.rr->toString()<<endl;
+  auto state = std::make_shared<NSLookups>();
+  state->parent = Engine::currentTask();
+  struct Detach // the lookups might finish after we are gone
+  {
+    NSLookups& s;
+    ~Detach() { s.parent = nullptr; }
+  } detach{*state};
+
+  // they share what is left of our query budget
+  unsigned int budget = std::max<size_t>(1, (d_maxqueries - min(d_numqueries, d_maxqueries)) / max<size_t>(todo.size(), 1));
+  auto lookup = [state, budget, depth, root = d_root, skip = d_skipIPv6, stagger = d_staggermsec, deadline = d_deadline, logging = (bool)d_log](const pair<DNSName, DNSType>& what) {
+    NSLookups::Result r{what.first, what.second, {}, 0};
+    TDNSResolver tdr(root);
+    tdr.d_maxqueries = budget;
+    tdr.d_deadline = deadline; // and our time
+    tdr.d_skipIPv6 = skip;
+    tdr.d_staggermsec = stagger;
+    if(logging)
+      tdr.setLog(state->log);
+    RLOG(tdr, string(depth, ' '), "Attempting to resolve NS ", r.name, "|", r.qtype);
+    try {
+      auto result = tdr.resolveAt(r.name, r.qtype, depth+1);
+      for(const auto& res : result.res)
+        r.addresses.insert({r.name, getIP(res.rr)});
     }
-    
-    for(const auto& r : res.res) {
-      cout<<r.name <<" "<<r.ttl<<" "<<r.rr->getType()<<" "<<r.rr->toString()<<endl;
+    catch(std::exception& e) {
+      RLOG(tdr, string(depth, ' '), "Failed to resolve name for ", r.name, "|", r.qtype, ": ", e.what());
+    }
+    catch(...) {
+      RLOG(tdr, string(depth, ' '), "Failed to resolve name for ", r.name, "|", r.qtype);
     }
-    cout<<"Result for "<< dn <<"|"<<toString(dt)<<" took "<<tdr.d_numqueries <<" queries"<<endl;
+    r.numqueries = tdr.d_numqueries;
+    state->results.push_back(std::move(r));
+    if(state->parent)
+      Engine::wakeup(state->parent);
+  };
+
+  size_t started = 0, collected = 0;
+  if(state->parent) {
+    for(const auto& what : todo)
+      Engine::spawn([lookup, what]() { lookup(what); });
+    started = todo.size();
   }
-  catch(NodataException& nd)
-  {
-    cout<<"No Data for "<< dn <<"|"<<toString(dt)<<" took "<<tdr.d_numqueries <<" queries"<<endl;
-    SSendto(sock, dmw.serialize(), client);
-    return;
+  while(collected < todo.size()) {
+    if(state->results.empty()) {
+      double timeout = timeLeft(3600);
+      if(state->parent)
+        Engine::suspend(d_deadline ? &timeout : nullptr); // the lookups wake us up, but so might responses to queries we no longer wait for
+      else
+        lookup(todo[started++]);
+      continue;
+    }
+    auto r = std::move(state->results.front());
+    state->results.pop_front();
+    ++collected;
+    if(d_log) {
+      *d_log << state->log.str();
+      state->log.str("");
+    }
+    d_numqueries += r.numqueries;
+    if(d_numqueries > d_maxqueries)
+      throw TooManyQueriesException();
+    RLOG(*this, prefix, "Got ", r.addresses.size(), " nameserver ", r.qtype, " addresses for ", r.name);
+    if(r.addresses.empty())
+      continue;
+    // we have a new (set) of addresses to try
+    auto res2 = resolveAt(dn, dt, depth+1, auth, r.addresses);
+    if(!res2.res.empty())
+      return res2;
   }
-  catch(NxdomainException& nx)
-  {
-    cout<<"NXDOMAIN for "<< dn <<"|"<<toString(dt)<<" took "<<tdr.d_numqueries <<" queries"<<endl;
-    dmw.dh.rcode = (int)RCode::Nxdomain;
-    SSendto(sock, dmw.serialize(), client);
-    return;
+  return ResolveResult();
+}
+
+/** Adds the SOA record that proves a negative answer to the authority section, 
+    with the TTL we have left, so downstream caches can do RFC 2308 as well */
+static void putNegativeSOA(DNSMessageWriter& dmw, const DNSName& dn, const DNSType& dt)
+{
+  NegativeCache::Entry ne;
+  if(g_negcache.get(dn, dt, ne)) {
+    std::unique_ptr<RRGen> soa = std::make_unique<SOAGen>(*ne.soa);
+    dmw.putRR(DNSSection::Authority, ne.zone, ne.ttl(time(nullptr)), soa);
   }
-  // Put in the CNAME chain
+}
+
+//! RFC 8767 recommends this TTL for stale answers, so clients come back soon for a fresh one
+static const uint32_t g_stalettl = 30;
+
+/* Finds an expired answer for dn|dt in the record cache, following CNAMEs. Only authoritative
+   answers are used, like resolveAt() does for fresh ones */
+static bool getStale(const DNSName& dn, const DNSType& dt, TDNSResolver::ResolveResult& res)
+{
+  res.clear();
+  DNSName name(dn);
+  RecordCache::RRset cached;
+  // what has not expired yet keeps its TTL
+  auto ttl = [&cached]() { return cached.ttl(time(nullptr)) ? cached.ttl(time(nullptr)) : g_stalettl; };
+  for(int n = 0; n < 10; ++n) {
+    if(g_reccache.getStale(name, dt, cached, RecordCache::Rank::AuthAnswer)) {
+      for(auto& rr : cached.rrs)
+        res.res.push_back({name, ttl(), std::move(rr)});
+      return !res.res.empty();
+    }
+    if(dt == DNSType::CNAME || !g_reccache.getStale(name, DNSType::CNAME, cached, RecordCache::Rank::AuthAnswer) || cached.rrs.empty())
+      return false;
+    DNSName target = dynamic_cast<CNAMEGen*>(cached.rrs.front().get())->d_name;
+    res.intermediate.push_back({name, ttl(), std::move(cached.rrs.front())});
+    name = target;
+  }
+  return false;
+}
+
+//! Puts a resolution result in the answer section, the CNAME chain first
+static void putResult(DNSMessageWriter& dmw, const TDNSResolver::ResolveResult& res)
+{
   for(const auto& rr : res.intermediate)
     dmw.putRR(DNSSection::Answer, rr.name, rr.ttl, rr.rr);
-  for(const auto& rr : res.res) // and the actual answer
+  for(const auto& rr : res.res)
     dmw.putRR(DNSSection::Answer, rr.name, rr.ttl, rr.rr);
-  string resp = dmw.serialize();
-  SSendto(sock, resp, client); // and send it!
 }
-catch(TooManyQueriesException& e)
+
+//! A client that is waiting for an answer
+struct ClientQuery
 {
-  cerr << "Thread died after too many queries" << endl;
+  int sock;
+  ComboAddress client;
+  uint16_t id;
+  bool rd;
+  TimerWheel::TimerID deadline;
+  TimerWheel::TimerID stale; //!< 0 if there is no timer for a stale answer
+  uint64_t received; //!< on the usecNow() clock
+};
+
+/*! Sends our response, unless the deadline passed and the client already got a SERVFAIL or a stale answer.
+    cq.received is when the query came in, for the query log */
+static void sendResponse(const ClientQuery& cq, DNSMessageWriter& dmw, StageTimer* st)
+{
+  {
+    std::lock_guard<std::mutex> l(g_deadlines.lock);
+    g_deadlines.wheel.cancel(cq.stale);
+    if(!g_deadlines.wheel.cancel(cq.deadline)) {
+      TLOG(Info, "Response for ", dmw.d_qname, "|", dmw.d_qtype, " is too late, client already got a SERVFAIL or a stale answer");
+      return;
+    }
+  }
+  string packet = dmw.serialize();
+  if(st)
+    st->mark(Stage::Render);
+  SSendto(cq.sock, packet, cq.client);
+  if(st)
+    st->mark(Stage::Send);
+  g_metrics.response((RCode)dmw.dh.rcode, dmw.dh.tc);
+  logQuery(cq.client, dmw.d_qname, dmw.d_qtype, cq.received, (RCode)dmw.dh.rcode, dmw.dh.tc ? QueryLogRecord::Truncated : 0, packet.size());
 }
 
-catch(exception& e)
+int64_t fireDeadlines()
 {
-  cerr << "Thread died: " << e.what() << endl;
+  std::vector<TimerWheel::Callback> due;
+  int64_t ret;
+  {
+    std::lock_guard<std::mutex> l(g_deadlines.lock);
+    g_deadlines.wheel.advance();
+    due.swap(g_deadlines.due);
+    ret = g_deadlines.wheel.nextTimeout();
+  }
+  // these look in the cache and send packets, which should not hold up clients that get answered meanwhile
+  for(auto& cb : due)
+    cb();
+  return ret;
 }
 
-static nlohmann::json rrToJSON(const TDNSResolver::ResolveRR& r)
+/* Arms the deadline for client query cq, after which it will get a SERVFAIL. Before that, after
+   stalemsec, it gets a stale answer if there is one. Either way, the resolution continues and
+   refreshes the cache, but its answer is no longer sent. Whoever takes the deadline timer off
+   the wheel answers the client: the wheel itself once it passed, the stale timer and
+   sendResponse() by cancelling it. sendResponse() cancels the stale timer too */
+static void setDeadline(ClientQuery& cq, const DNSMessageReader& dmr)
 {
-  nlohmann::json record;
-  record["name"]=r.name.toString();
-  record["ttl"]=r.ttl;
-  record["type"]=toString(r.rr->getType());
-  record["content"]=r.rr->toString();
-  return record;
+  auto respond = [sock = cq.sock, client = cq.client, dmr, received = cq.received](bool stale, TimerWheel::TimerID deadline) {
+    try {
+      DNSName dn;
+      DNSType dt;
+      dmr.getQuestion(dn, dt);
+      DNSMessageWriter dmw(dn, dt);
+      dmw.dh.rd = dmr.dh.rd;
+      dmw.dh.ra = dmw.dh.qr = true;
+      dmw.dh.id = dmr.dh.id;
+      if(stale) {
+        TDNSResolver::ResolveResult res;
+        if(!getStale(dn, dt, res))
+          return;
+        putResult(dmw, res);
+        std::lock_guard<std::mutex> l(g_deadlines.lock);
+        if(!g_deadlines.wheel.cancel(deadline)) // answered while we looked
+          return;
+        TLOG(Info, "Resolving ", dn, "|", dt, " for ", client.toStringWithPort(), " takes long, sending stale answer");
+      }
+      else {
+        dmw.dh.rcode = (int)RCode::Servfail;
+        TLOG(Info, "Deadline for ", dn, "|", dt, " from ", client.toStringWithPort(), " passed, sending SERVFAIL");
+      }
+      string packet = dmw.serialize();
+      SSendto(sock, packet, client);
+      g_metrics.response((RCode)dmw.dh.rcode, dmw.dh.tc);
+      logQuery(client, dn, dt, received, (RCode)dmw.dh.rcode, dmw.dh.tc ? QueryLogRecord::Truncated : 0, packet.size());
+    }
+    catch(std::exception& e) {
+      TLOG(Warning, "Unable to send ", (stale ? "stale answer" : "SERVFAIL"), " to ", client.toStringWithPort(), ": ", e.what());
+    }
+  };
+
+  std::lock_guard<std::mutex> l(g_deadlines.lock);
+  auto now = msecNow();
+  // these fire with the lock held, so they leave the work to fireDeadlines()
+  cq.deadline = g_deadlines.wheel.add(now + g_deadlines.timeoutmsec, [respond]() {
+      g_deadlines.due.push_back([respond]() { respond(false, 0); });
+    });
+  cq.stale = 0;
+  if(g_reccache.d_staleseconds && g_deadlines.stalemsec < g_deadlines.timeoutmsec) {
+    cq.stale = g_deadlines.wheel.add(now + g_deadlines.stalemsec, [respond, deadline = cq.deadline]() {
+        g_deadlines.due.push_back([respond, deadline]() { respond(true, deadline); });
+      });
+  }
 }
 
+//! Identical queries that come in while one is being resolved wait for that resolution
+InflightTable<pair<DNSName, DNSType>, ClientQuery> g_inflight;
 
-int main(int argc, char** argv)
+/** Sends the outcome of a resolution to a client. If res is nullptr and the rcode
+    is Noerror, the type does not exist. If st is set, rendering and sending are timed */
+static void answerClient(const ClientQuery& cq, const DNSName& dn, const DNSType& dt, RCode rcode, const TDNSResolver::ResolveResult* res, StageTimer* st=nullptr)
 try
 {
-  if(argc != 2 && argc != 3) {
-    cerr<<"Syntax: tres name type\n";
-    cerr<<"Syntax: tres ip:port\n";
-    cerr<<"\n";
-    cerr<<"When name and type are specified, tres looks up a DNS record.\n";
-    cerr<<"types: A, NS, CNAME, SOA, PTR, MX, TXT, AAAA, ...\n";
-    cerr<<"       see https://en.wikipedia.org/wiki/List_of_DNS_record_types\n";
-    cerr<<"\n";
-    cerr<<"When ip:port is specified, tres acts as a DNS server.\n";
-    return(EXIT_FAILURE);
-  }
-  signal(SIGPIPE, SIG_IGN); // TCP, so we need this
-  // configure some hints
-  multimap<DNSName, ComboAddress> hints = {{makeDNSName("a.root-servers.net"), ComboAddress("198.41.0.4", 53)},
-                                           {makeDNSName("f.root-servers.net"), ComboAddress("192.5.5.241", 53)},
-                                           {makeDNSName("k.root-servers.net"), ComboAddress("193.0.14.129", 53)},
-  };
+  DNSMessageWriter dmw(dn, dt);
+  dmw.dh.rd = cq.rd;
+  dmw.dh.ra = true;
+  dmw.dh.qr = true;
+  dmw.dh.id = cq.id;
+  dmw.dh.rcode = (int)rcode;
+  if(res)
+    putResult(dmw, *res);
+  else if(rcode == RCode::Noerror || rcode == RCode::Nxdomain)
+    putNegativeSOA(dmw, dn, dt);
+  sendResponse(cq, dmw, st); // and send it!
+  if(rcode == RCode::Nxdomain)
+    g_hitters.nxdomain(cq.client);
+}
+catch(std::exception& e)
+{
+  TLOG(Warning, "Unable to send answer to ", cq.client.toStringWithPort(), ": ", e.what());
+}
 
-  // retrieve the actual live root NSSET from the hints
-  for(const auto& h : hints) {
-    try {
-      TDNSResolver tdr;
-      DNSMessageReader dmr = tdr.getResponse(h.second, makeDNSName("."), DNSType::NS);
-      DNSSection rrsection;
-      DNSName rrdn;
-      DNSType rrdt;
-      uint32_t ttl;
-      std::unique_ptr<RRGen> rr;
+/*! st was started when the query came in, at received. Queries that wait for another
+    resolution are not timed */
+void processQuery(int sock, ComboAddress client, DNSMessageReader dmr, uint64_t received, StageTimer st)
+try
+{
+  st.mark(Stage::Queue);
+  DNSName dn;
+  DNSType dt;
+  dmr.getQuestion(dn, dt);
 
-      // XXX should check if response name and type match query
-      // this assumes the root will only send us relevant NS records
-      // we could check with the NS records if we wanted
-      // but if a root wants to mess with us, it can
-      while(dmr.getRR(rrsection, rrdn, rrdt, ttl, rr)) {
-        if(rrdt == DNSType::A || rrdt == DNSType::AAAA)
-          g_root.insert({rrdn, getIP(rr)});
-      }
-      break;
-    }
-    catch(...){}
+  ClientQuery cq{sock, client, dmr.dh.id, (bool)dmr.dh.rd, 0, 0, received};
+  setDeadline(cq, dmr);
+  auto key = make_pair(dn, dt);
+  if(!g_inflight.join(key, ClientQuery(cq))) {
+    TLOG(Info, "Already resolving ", dn, "|", toString(dt), ", ", client.toStringWithPort(), " will get that answer");
+    return;
   }
 
-  cout<<"Retrieved . NSSET from hints, have "<<g_root.size()<<" addresses"<<endl;
+  // answers us and everyone that joined while we were resolving
+  auto answerAll = [&](RCode rcode, const TDNSResolver::ResolveResult* res) {
+    auto waiters = g_inflight.finish(key);
+    st.mark(Stage::Resolve);
+    answerClient(cq, dn, dt, rcode, res, &st);
+    st.done(dt);
+    for(const auto& w : waiters)
+      answerClient(w, dn, dt, rcode, res);
+    if(!waiters.empty()) {
+      auto st = g_inflight.getStats();
+      TLOG(Info, "Answered ", waiters.size(), " waiting clients for ", dn, "|", toString(dt), " too. ",
+           st.waiters, " of ", st.waiters + st.resolutions, " queries coalesced (", 100.0*st.ratio(), "%), at most ", st.maxwaiters, " waiters");
+    }
+  };
 
-  if(argc == 2) { // be a server
-    ComboAddress local(argv[1], 53);
-    Socket sock(local.sin4.sin_family, SOCK_DGRAM);
-    SBind(sock, local);
-    string packet;
-    ComboAddress client;
-    
-    for(;;) {
-      try {
-        packet = SRecvfrom(sock, 1500, client);
-        cout<<"Received packet from "<< client.toStringWithPort() << endl;
-        DNSMessageReader dmr(packet);
-        if(dmr.dh.qr) {
-          cout << "Packet from " << client.toStringWithPort()<< " was not a query"<<endl;
-          continue;
-        }
-        std::thread t(processQuery, (int)sock, client, dmr);
-        t.detach();
-      }
-      catch(exception& e) {
-        cout << "Processing packet from " << client.toStringWithPort() <<": "<<e.what() << endl;
-      }
+  TDNSResolver::ResolveResult res;
+  // there won't be a fresh answer, so no need to make the clients wait for their deadline
+  auto answerFailure = [&]() {
+    if(getStale(dn, dt, res)) {
+      TLOG(Info, "Resolving ", dn, "|", toString(dt), " failed, answering from what expired in the record cache");
+      answerAll(RCode::Noerror, &res);
     }
-  }
-  
-  // single shot operation
-  DNSName dn = makeDNSName(argv[1]);
-  DNSType dt = makeDNSType(argv[2]);
+    else
+      answerAll(RCode::Servfail, nullptr);
+  };
 
-  
   TDNSResolver tdr(g_root);
-  ostringstream logstream;
-  ostringstream dotstream;
-  tdr.setLog(logstream);
-  tdr.setPlot(dotstream);
-  
-  auto start = chrono::high_resolution_clock::now();
-
-  int rc = EXIT_SUCCESS;
-
-  nlohmann::json jres;
-  jres["name"]=dn.toString();
-  jres["type"]=toString(dt);
-  jres["intermediate"]= nlohmann::json::array();
-  jres["answer"]= nlohmann::json::array();  
+  tdr.setStagger(g_staggermsec);
+  // once the client got its SERVFAIL, there is no use in going on
+  uint64_t start = msecNow();
+  tdr.setDeadline(start + g_deadlines.timeoutmsec);
+  struct Account
+  {
+    const TDNSResolver& tdr;
+    uint64_t start;
+    ~Account()
+    {
+      g_budget.resolutions++;
+      g_budget.msec += msecNow() - start;
+      g_budget.queries += tdr.d_numqueries;
+      g_metrics.cache(!tdr.d_numqueries);
+    }
+  } account{tdr, start};
   try {
 
-    auto res = tdr.resolveAt(dn, dt);
+    res = tdr.resolveAt(dn, dt);
     
-    jres["numqueries"]=tdr.d_numqueries;
-    cout<<"Result of query for "<< dn <<"|"<<toString(dt)<< " ("<<res.intermediate.size()<<" intermediate, "<<res.res.size()<<" actual)\n";
+    TLOG(Info, "Result of query for ", dn, "|", toString(dt));
     for(const auto& r : res.intermediate) {
-      jres["intermediate"].push_back(rrToJSON(r));
-      cout<<r.name <<" "<<r.ttl<<" "<<r.rr->getType()<<" " << r.rr->toString()<<endl;
+      TLOG(Info, r.name, " ", r.ttl, " ", r.rr->getType(), " ", r.rr->toString());
     }
     
     for(const auto& r : res.res) {
-      jres["answer"].push_back(rrToJSON(r));
-      cout<<r.name <<" "<<r.ttl<<" "<<r.rr->getType()<<" "<<r.rr->toString()<<endl;
+      TLOG(Info, r.name, " ", r.ttl, " ", r.rr->getType(), " ", r.rr->toString());
     }
-    cout<<"Used "<<tdr.d_numqueries << " queries"<<endl;
-    jres["rcode"]=0;
+    TLOG(Info, "Result for ", dn, "|", toString(dt), " took ", tdr.d_numqueries, " queries in ", msecNow() - start, " msec");
   }
-  catch(NxdomainException& e)
-  {
-    cout<<argv[1]<<": name does not exist"<<endl;
-    cout<<"Used "<<tdr.d_numqueries << " queries"<<endl;
-    rc=EXIT_FAILURE;
-    jres["rcode"]=3;
-  }
-  catch(NodataException& e)
+  catch(NodataException& nd)
   {
-    cout<<argv[1]<< ": name does not have datatype requested"<<endl;
-    cout<<"Used "<<tdr.d_numqueries << " queries"<<endl;
-    rc=EXIT_FAILURE;
-    jres["rcode"]=0;
+    TLOG(Info, "No Data for ", dn, "|", toString(dt), " took ", tdr.d_numqueries, " queries");
+    answerAll(RCode::Noerror, nullptr);
+    return;
   }
-  catch(TooManyQueriesException& e)
+  catch(NxdomainException& nx)
   {
-    cout<<argv[1]<< ": exceeded maximum number of queries (" << tdr.d_numqueries<<")"<<endl;
-    rc= EXIT_FAILURE;
-
-    jres["rcode"]=2;
+    TLOG(Info, "NXDOMAIN for ", dn, "|", toString(dt), " took ", tdr.d_numqueries, " queries");
+    answerAll(RCode::Nxdomain, nullptr);
+    return;
   }
-  jres["numqueries"]=tdr.d_numqueries;
-  jres["numtimeouts"]=tdr.d_numtimeouts;
-  jres["numformerrs"]=tdr.d_numformerrs;
-  jres["trace"]=logstream.str();
-  auto finish = chrono::high_resolution_clock::now();
-  auto msecs = chrono::duration_cast<chrono::milliseconds>(finish-start);
-  
-  jres["msec"]= msecs.count();
+  catch(...)
   {
-    tdr.endPlot();
-
-    ofstream tmpstr(dn.toString()+"dot");
-    tmpstr << dotstream.str();
-    tmpstr.flush();
+    answerFailure();
+    throw;
   }
-
-  FILE* dotfp = popen(string("dot -Tsvg < "+dn.toString()+"dot").c_str(), "r");
-  if(!dotfp) {
-    cerr << "popen failed: " << strerror(errno) <<endl;
-  }
-  else {
-    char buffer[100000];
-    int siz = fread(buffer, 1, sizeof(buffer), dotfp);
-    //    unlink(string(dn.toString()+"dot").c_str());
-    jres["dot"]=std::string(buffer, siz);
-    pclose(dotfp);
+  // all servers timed out, or none of them had a usable answer
+  if(res.res.empty() && res.intermediate.empty()) {
+    TLOG(Info, "No server had an answer for ", dn, "|", toString(dt), " after ", tdr.d_numqueries, " queries");
+    answerFailure();
+    return;
   }
-  cout << jres << endl;
-
-  ofstream logfile(dn.toString()+"txt");
-  logfile << logstream.str();
-  
-  std::vector<std::uint8_t> v_cbor = nlohmann::json::to_cbor(jres);
-  FILE* out = fopen("cbor", "w");
-  fwrite(&v_cbor[0], 1, v_cbor.size(), out);
-  fclose(out);
-  return rc;
+  answerAll(RCode::Noerror, &res);
 }
-catch(std::exception& e)
+catch(TooManyQueriesException& e)
+{
+  TLOG(Warning, "Thread died after too many queries");
+}
+catch(DeadlineException& e)
+{
+  g_budget.overruns++;
+  TLOG(Warning, "Resolution abandoned, the client stopped waiting");
+}
+
+catch(exception& e)
 {
-  cerr<<argv[1]<<": fatal error: "<<e.what()<<endl;
-  return EXIT_FAILURE;
+  TLOG(Error, "Thread died: ", e.what());
 }
@@ -0,0 +1,224 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+#include "dns-storage.hh"
+#include "dnsmessages.hh"
+#include "record-types.hh"
+#include "negcache.hh"
+#include "reccache.hh"
+#include "infra.hh"
+#include "rootmirror.hh"
+#include "timerwheel.hh"
+#include "engine.hh"
+#include "log.hh"
+#include "metrics.hh"
+#include "histogram.hh"
+#include "heavyhitters.hh"
+
+/*!
+   @file
+   @brief Defines the resolver of tres, and the state its resolutions share
+*/
+
+//! Thrown if too many queries have been sent.
+struct TooManyQueriesException{};
+//! Or if the client would not be waiting for the answer anymore
+struct DeadlineException{};
+//! this is a different kind of error: we KNOW your name does not exist
+struct NxdomainException{};
+//! Or if your type does not exist
+struct NodataException{};
+
+extern std::multimap<DNSName, ComboAddress> g_root;
+//! Shared by all resolver threads, so we remember what does not exist
+extern NegativeCache g_negcache;
+//! And what does exist, so we don't have to start at the root every time
+extern RecordCache g_reccache;
+//! Also shared, round trip times and timeouts of the nameservers we talked to
+extern InfraTable g_infra;
+//! If TRES_ROOT_MIRROR is set, we make the referrals of the root ourselves
+extern RootMirror g_rootmirror;
+//! How long we wait for a nameserver before we ask the next one too, 0 for one at a time. From TRES_STAGGER
+extern unsigned int g_staggermsec;
+//! In server mode, this runs all resolutions, including those that refresh the record cache
+extern Engine* g_engine;
+//! In server mode, the caches are saved here once a minute and loaded on startup. From TRES_SNAPSHOT
+extern std::string g_snapshot;
+//! The port we ask nameservers on. Only something else than 53 in simulations like tlab, from TRES_NS_PORT
+extern uint16_t g_nsport;
+
+/** In server mode, every client query gets a deadline. If resolving takes longer than that,
+    the client gets a SERVFAIL, no matter what the resolving thread is still doing */
+struct ClientDeadlines
+{
+  std::mutex lock;
+  TimerWheel wheel;
+  unsigned int timeoutmsec{5000};
+  //! if resolving takes longer than this, the client gets a stale answer if we have one (RFC 8767, section 5)
+  unsigned int stalemsec{1800};
+  //! what the timers that fired want to do, which fireDeadlines() runs once it let go of lock
+  std::vector<TimerWheel::Callback> due;
+};
+extern ClientDeadlines g_deadlines;
+
+//! Fires the client deadlines that passed. Returns msec until the next one, -1 if there is none
+int64_t fireDeadlines();
+
+//! How much of their budget of time and queries client resolutions used, printed once a minute
+struct BudgetStats
+{
+  std::atomic<uint64_t> resolutions{0};
+  std::atomic<uint64_t> overruns{0};  //!< abandoned at the deadline
+  std::atomic<uint64_t> msec{0};      //!< all resolutions together
+  std::atomic<uint64_t> queries{0};
+};
+extern BudgetStats g_budget;
+
+/* These belong to the program that links the resolver, so tauth and tres can be
+   linked into one test program. tres-main.cc has those of tres */
+//! What the server did, see TDNS_METRICS
+extern Metrics g_metrics;
+//! How long the stages of answering take, served on /latency next to the metrics
+extern PipelineTimings g_timings;
+//! Which names and clients most queries are about, served on /heavyhitters
+extern HeavyHitters g_hitters;
+
+class TDNSResolver
+{
+public:
+
+  TDNSResolver(const std::multimap<DNSName, ComboAddress>& root) : d_root(root)
+  {}
+  TDNSResolver()
+  {}
+
+  //! This describes a single resource record returned
+  struct ResolveRR
+  {
+    DNSName name;
+    uint32_t ttl;
+    std::unique_ptr<RRGen> rr;
+  };
+  
+  //! This is the end result of our resolving work
+  struct ResolveResult
+  {
+    std::vector<ResolveRR> res; //!< what you asked for
+    std::vector<ResolveRR> intermediate; //!< a CNAME chain that gets you there
+    void clear()
+    {
+      res.clear();
+      intermediate.clear();
+    }
+  };
+
+  ResolveResult resolveAt(const DNSName& dn, const DNSType& dt, int depth=0, const DNSName& auth={}, const std::multimap<DNSName, ComboAddress>& mservers=g_root);
+
+  void setPlot(std::ostream& fs)
+  {
+    d_dot = &fs;
+    (*d_dot) << "digraph { "<<std::endl;
+  }
+
+  void endPlot()
+  {
+    if(d_dot)
+      (*d_dot) << "}\n";
+  }
+  
+  void setLog(std::ostream& fs)
+  {
+    d_log = &fs;
+  }
+
+  //! If a nameserver did not answer within this many milliseconds, we ask the next one too. With 0, we wait for each in turn
+  void setStagger(unsigned int msec)
+  {
+    d_staggermsec = msec;
+  }
+
+  /*! Gives up with a DeadlineException once msecNow() passes this, 0 for never. Every wait for a
+      nameserver is cut short to fit, and servers that won't answer in time are not asked */
+  void setDeadline(uint64_t msec)
+  {
+    d_deadline = msec;
+  }
+
+  //! Resolve dn again instead of answering it from the record cache, which is how prefetches refresh it
+  void setRefresh(const DNSName& dn)
+  {
+    d_refresh = dn;
+    d_refreshing = true;
+  }
+  
+  ~TDNSResolver()
+  {
+  }
+  DNSMessageReader getResponse(const ComboAddress& server, const DNSName& dn, const DNSType& dt, int depth=0);
+private:
+  class Race;
+  ResolveResult resolveViaNames(const DNSName& dn, const DNSType& dt, int depth, const DNSName& auth, const std::set<DNSName>& nsses);
+  void dotQuery(const DNSName& auth, const DNSName& server);
+  void dotAnswer(const DNSName& dn, const DNSType& rrdt, const DNSName& server);
+  void dotCNAME(const DNSName& target, const DNSName& server, const DNSName& dn);
+  void dotDelegation(const DNSName& rrdn, const DNSName& server);
+  std::multimap<DNSName, ComboAddress> d_root;
+  unsigned int d_maxqueries{100};
+  unsigned int d_staggermsec{200}; //!< see setStagger()
+  DNSName d_refresh;               //!< see setRefresh()
+  bool d_refreshing{false};
+  uint64_t d_deadline{0};          //!< see setDeadline()
+
+  //! Seconds until the deadline, throws if it passed
+  double timeLeft(double wanted)
+  {
+    if(!d_deadline)
+      return wanted;
+    uint64_t now = msecNow();
+    if(now >= d_deadline)
+      throw DeadlineException();
+    return std::min(wanted, (d_deadline - now) / 1000.0);
+  }
+
+  bool d_skipIPv6{false};
+  std::ostream* d_dot{nullptr};
+  std::ostream* d_log{nullptr};
+
+  //! If this is false, RLOG() skips its arguments
+  bool logging() const
+  {
+    return d_log || logEnabled(LogLevel::Debug);
+  }
+  //! A line of the trace of this resolution, to the stream from setLog() if there is one, and to TLOG() at Debug otherwise
+  template<typename... Args>
+  void log(Args&&... args)
+  {
+    if(d_log) {
+      (void)std::initializer_list<int>{(*d_log << args, 0)...};
+      *d_log << '\n';
+    }
+    else
+      logLine(LogLevel::Debug, std::forward<Args>(args)...);
+  }
+
+public:
+  unsigned int d_numqueries{0};
+  unsigned int d_numtimeouts{0};
+  unsigned int d_numformerrs{0};
+  
+};
+
+/** Helper function that extracts a useable IP address from an
+    A or AAAA resource record. Returns sin_family == 0 if it didn't work */
+ComboAddress getIP(const std::unique_ptr<RRGen>& rr);
+
+/*! Answers the client query in dmr, which came in on sock at received (usecNow()), from the
+    cache or by resolving it. Runs as a task in g_engine in server mode, but works outside of one too */
+void processQuery(int sock, ComboAddress client, DNSMessageReader dmr, uint64_t received, StageTimer st);
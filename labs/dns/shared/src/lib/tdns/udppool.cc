@@ -0,0 +1,252 @@
+#include "udppool.hh"
+#include <algorithm>
+#include <random>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include "dnsmessages.hh"
+#include "sclasses.hh"
+#include "timerwheel.hh"
+using namespace std;
+
+/*!
+   @file
+   @brief Implements the pool of UDP sockets for outgoing queries
+*/
+
+struct UDPPool::PoolSocket
+{
+  int fd;
+  int family;
+  uint64_t created;       //!< msec
+  uint64_t uses{0};
+  unsigned int outstanding{0};
+  bool retiring{false};   //!< no new queries, closed once outstanding is 0
+};
+
+struct UDPPool::Pending
+{
+  PoolSocket* sock{nullptr};
+  Engine::TaskHandle task{nullptr};
+  std::string response;
+  bool done{false};
+};
+
+static std::mt19937& getRandom()
+{
+  thread_local std::mt19937 gen{std::random_device{}()};
+  return gen;
+}
+
+UDPPool& UDPPool::get()
+{
+  thread_local UDPPool pool;
+  return pool;
+}
+
+UDPPool::UDPPool() : d_buffer(65535, 0), d_inengine(Engine::inTask())
+{
+}
+
+UDPPool::~UDPPool()
+{
+  for(auto& s : d_socks) {
+    if(d_inengine)
+      Engine::unwatch(s->fd);
+    close(s->fd);
+  }
+}
+
+UDPPool::PoolSocket* UDPPool::makeSocket(int family)
+{
+  int fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd < 0)
+    throw std::runtime_error("Creating UDP socket for pool: "+string(strerror(errno)));
+
+  // the kernel would pick a port for us, but not a random one
+  ComboAddress local(family == AF_INET ? "0.0.0.0" : "::", 0);
+  int tries;
+  for(tries = 0; tries < 10; ++tries) {
+    local.sin4.sin_port = htons(std::uniform_int_distribution<int>(1025, 65535)(getRandom()));
+    if(::bind(fd, (struct sockaddr*)&local, local.getSocklen()) == 0)
+      break;
+  }
+  if(tries == 10) { // all in use, we'll take what we can get
+    local.sin4.sin_port = 0;
+    if(::bind(fd, (struct sockaddr*)&local, local.getSocklen()) < 0) {
+      close(fd);
+      throw std::runtime_error("Binding UDP socket for pool: "+string(strerror(errno)));
+    }
+  }
+
+  auto s = std::make_unique<PoolSocket>();
+  s->fd = fd;
+  s->family = family;
+  s->created = msecNow();
+  auto ret = s.get();
+  if(d_inengine)
+    Engine::watch(fd, [this, ret]() { readSocket(ret); });
+  d_socks.push_back(std::move(s));
+  return ret;
+}
+
+void UDPPool::retire(PoolSocket* s)
+{
+  s->retiring = true;
+  if(s->outstanding)
+    return;
+  if(d_inengine)
+    Engine::unwatch(s->fd);
+  close(s->fd);
+  d_socks.erase(std::find_if(d_socks.begin(), d_socks.end(), [s](const std::unique_ptr<PoolSocket>& p) { return p.get() == s; }));
+}
+
+UDPPool::PoolSocket* UDPPool::pick(int family)
+{
+  vector<PoolSocket*> usable;
+  for(auto& s : d_socks)
+    if(s->family == family && !s->retiring)
+      usable.push_back(s.get());
+  if(usable.size() < d_sockets)
+    return makeSocket(family);
+
+  auto s = usable[std::uniform_int_distribution<size_t>(0, usable.size() - 1)(getRandom())];
+  if(s->uses >= d_maxuses || msecNow() - s->created >= d_maxage) {
+    d_stats.rotated++;
+    retire(s);
+    return makeSocket(family);
+  }
+  return s;
+}
+
+void UDPPool::send(PoolSocket* s, const std::string& packet, const ComboAddress& server)
+{
+  if(sendto(s->fd, packet.c_str(), packet.size(), 0, (struct sockaddr*)&server, server.getSocklen()) < 0)
+    throw std::runtime_error("Sending query to "+server.toStringWithPort()+": "+string(strerror(errno)));
+  d_stats.sent++;
+}
+
+void UDPPool::readSocket(PoolSocket* s)
+{
+  for(;;) {
+    ComboAddress from;
+    socklen_t fromlen = sizeof(from);
+    int res = recvfrom(s->fd, &d_buffer.at(0), d_buffer.size(), 0, (struct sockaddr*)&from, &fromlen);
+    if(res < 0)
+      return; // EAGAIN, or an ICMP error we can't attribute to a query
+    d_stats.received++;
+    try {
+      DNSMessageReader dmr(d_buffer.c_str(), res);
+      DNSName qname;
+      DNSType qtype;
+      dmr.getQuestion(qname, qtype);
+      auto iter = d_pending.find(std::make_tuple(from, dmr.dh.id, qname, qtype));
+      if(!dmr.dh.qr || iter == d_pending.end() || iter->second->sock != s || iter->second->done) {
+        d_stats.unexpected++;
+        continue;
+      }
+      auto p = iter->second;
+      p->response.assign(d_buffer.c_str(), res);
+      p->done = true;
+      if(p->task)
+        Engine::wakeup(p->task);
+    }
+    catch(std::exception& e) { // could not even parse it
+      d_stats.unexpected++;
+    }
+  }
+}
+
+UDPPool::Stats UDPPool::getStats() const
+{
+  Stats ret = d_stats;
+  ret.sockets = d_socks.size();
+  return ret;
+}
+
+UDPPool::Query::Query(UDPPool& pool, const ComboAddress& server, std::string packet, const DNSName& qname, DNSType qtype) :
+  d_pool(pool), d_packet(std::move(packet)), d_pending(std::make_unique<Pending>())
+{
+  if(d_packet.size() < 12)
+    throw std::runtime_error("Query packet is too short");
+  uint16_t id;
+  memcpy(&id, &d_packet.at(0), 2);
+  d_key = std::make_tuple(server, id, qname, qtype);
+  while(d_pool.d_pending.count(d_key)) { // someone is asking the same thing with the same ID
+    id = getRandom()();
+    memcpy(&d_packet.at(0), &id, 2);
+    std::get<1>(d_key) = id;
+  }
+
+  d_pending->sock = d_pool.pick(server.sin4.sin_family);
+  d_pending->task = Engine::currentTask();
+  d_pool.send(d_pending->sock, d_packet, server);
+  d_pending->sock->uses++;
+  d_pending->sock->outstanding++;
+  d_pool.d_pending[d_key] = d_pending.get();
+}
+
+UDPPool::Query::~Query()
+{
+  d_pool.d_pending.erase(d_key);
+  auto s = d_pending->sock;
+  if(!--s->outstanding && s->retiring)
+    d_pool.retire(s);
+}
+
+void UDPPool::Query::resend()
+{
+  d_pool.send(d_pending->sock, d_packet, std::get<0>(d_key));
+}
+
+const std::string& UDPPool::Query::response() const
+{
+  return d_pending->response;
+}
+
+bool UDPPool::Query::done() const
+{
+  return d_pending->done;
+}
+
+int UDPPool::Query::wait(double* timeout)
+{
+  return d_pool.waitAny({this}, timeout) == 0;
+}
+
+int UDPPool::waitAny(const std::vector<Query*>& queries, double* timeout)
+{
+  uint64_t deadline = timeout ? msecNow() + *timeout * 1000 : 0;
+  for(;;) {
+    for(size_t n = 0; n < queries.size(); ++n)
+      if(queries[n]->d_pending->done)
+        return n;
+    double left = 0;
+    if(timeout) {
+      uint64_t now = msecNow();
+      if(now >= deadline)
+        return -1;
+      left = (deadline - now) / 1000.0;
+    }
+    if(d_inengine) {
+      // we might get woken up for another query of this task, so we check again
+      Engine::suspend(timeout ? &left : nullptr);
+      continue;
+    }
+
+    // nobody else is reading our sockets, so we do it ourselves
+    vector<pollfd> pfds;
+    for(auto q : queries) {
+      pollfd pfd;
+      pfd.fd = q->d_pending->sock->fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      pfds.push_back(pfd);
+    }
+    if(pfds.empty() || poll(&pfds[0], pfds.size(), timeout ? left * 1000 + 1 : -1) < 0)
+      return -1;
+    for(size_t n = 0; n < pfds.size(); ++n)
+      if(pfds[n].revents)
+        readSocket(queries[n]->d_pending->sock);
+  }
+}
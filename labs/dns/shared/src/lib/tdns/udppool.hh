@@ -0,0 +1,102 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "comboaddress.hh"
+#include "dns-storage.hh"
+#include "engine.hh"
+
+/*!
+   @file
+   @brief Defines UDPPool, a set of UDP sockets shared by all outgoing queries of a thread
+*/
+
+/*! \brief Sends UDP queries over a few shared sockets, and hands every response to the query it belongs to
+
+   Creating, binding and connecting a socket for every query costs more than the
+   query itself when the nameserver is close by. So every thread gets a pool of
+   sockets, each bound to a random source port. A query picks one at random.
+
+   A response is only accepted if it arrives on the socket its query went out on,
+   from the address the query was sent to, with the same ID and the same question.
+   Everything else is counted as unexpected and dropped.
+
+   Every d_maxuses queries, or after d_maxage milliseconds, a socket is replaced
+   by one on a new random port, so an attacker can't learn our ports and keep
+   using them. The old one is closed once no queries are waiting on it anymore.
+
+   Within an Engine task, the sockets are watched by the worker loop, which
+   wakes up the task a response is for. Outside of the engine, Query::wait()
+   reads the socket itself. waitAny() waits for the first of several queries,
+   so a task can have queries out to a few servers at once.
+
+   There is one pool per thread, get() returns it. It does no locking. */
+class UDPPool
+{
+  struct PoolSocket;
+  struct Pending;
+public:
+  //! The pool of this thread
+  static UDPPool& get();
+  ~UDPPool();
+
+  //! A query that is waiting for its response. Sends the packet on construction
+  class Query
+  {
+  public:
+    Query(UDPPool& pool, const ComboAddress& server, std::string packet, const DNSName& qname, DNSType qtype);
+    ~Query();
+    Query(const Query&) = delete;
+    Query& operator=(const Query&) = delete;
+
+    //! Returns 1 once the response arrived, 0 if it did not within timeout seconds
+    int wait(double* timeout);
+    //! Did the response arrive?
+    bool done() const;
+    //! Sends the same packet again, on the same socket
+    void resend();
+    //! The ID the query went out with, which differs from that in packet if that was in use already
+    uint16_t id() const { return std::get<1>(d_key); }
+    const std::string& response() const;
+
+  private:
+    UDPPool& d_pool;
+    std::tuple<ComboAddress, uint16_t, DNSName, DNSType> d_key;
+    std::string d_packet;
+    std::unique_ptr<Pending> d_pending;
+    friend class UDPPool;
+  };
+
+  //! Waits until one of queries has its response, or timeout seconds passed. Returns its index, or -1 on timeout
+  int waitAny(const std::vector<Query*>& queries, double* timeout);
+
+  struct Stats
+  {
+    uint64_t sent{0};
+    uint64_t received{0};
+    uint64_t unexpected{0}; //!< late, for nobody, or possibly spoofed
+    uint64_t rotated{0};    //!< sockets replaced by one on a new port
+    uint64_t sockets{0};    //!< open right now
+  };
+  Stats getStats() const;
+
+  unsigned int d_sockets{8};  //!< per address family
+  uint64_t d_maxuses{2000};
+  uint64_t d_maxage{60000};   //!< msec
+
+private:
+  UDPPool();
+  PoolSocket* pick(int family);
+  PoolSocket* makeSocket(int family);
+  void retire(PoolSocket* s);
+  void readSocket(PoolSocket* s);
+  void send(PoolSocket* s, const std::string& packet, const ComboAddress& server);
+
+  std::vector<std::unique_ptr<PoolSocket>> d_socks;
+  std::map<std::tuple<ComboAddress, uint16_t, DNSName, DNSType>, Pending*> d_pending;
+  std::string d_buffer;
+  Stats d_stats;
+  bool d_inengine;
+};
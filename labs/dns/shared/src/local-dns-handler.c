@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "local-dns-handler.h"
+
+/* DNS header structure */
+struct dnsheader {
+        uint16_t        id;         /* query identification number */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                        /* fields in third byte */
+        unsigned        qr: 1;          /* response flag */
+        unsigned        opcode: 4;      /* purpose of message */
+        unsigned        aa: 1;          /* authoritative answer */
+        unsigned        tc: 1;          /* truncated message */
+        unsigned        rd: 1;          /* recursion desired */
+                        /* fields in fourth byte */
+        unsigned        ra: 1;          /* recursion available */
+        unsigned        unused :1;      /* unused bits (MBZ as of 4.9.3a3) */
+        unsigned        ad: 1;          /* authentic data from named */
+        unsigned        cd: 1;          /* checking disabled by resolver */
+        unsigned        rcode :4;       /* response code */
+#elif __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ 
+                        /* fields in third byte */
+        unsigned        rd :1;          /* recursion desired */
+        unsigned        tc :1;          /* truncated message */
+        unsigned        aa :1;          /* authoritative answer */
+        unsigned        opcode :4;      /* purpose of message */
+        unsigned        qr :1;          /* response flag */
+                        /* fields in fourth byte */
+        unsigned        rcode :4;       /* response code */
+        unsigned        cd: 1;          /* checking disabled by resolver */
+        unsigned        ad: 1;          /* authentic data from named */
+        unsigned        unused :1;      /* unused bits (MBZ as of 4.9.3a3) */
+        unsigned        ra :1;          /* recursion available */
+#endif
+                        /* remaining bytes */
+        uint16_t        qdcount;    /* number of question records */
+        uint16_t        ancount;    /* number of answer records */
+        uint16_t        nscount;    /* number of authority records */
+        uint16_t        arcount;    /* number of resource records */
+};
+
+void LocalDNSHandle (struct LocalDNS *srv, char *buffer, uint64_t size, struct sockaddr_in *from) {
+    int sockfd = srv->sockfd;
+    struct TDNSServerContext *ctx = srv->ctx;
+    struct TDNSServerContext *per_query_ctx = srv->per_query_ctx;
+    struct TDNSParseResult *parsed = srv->parsed;
+    struct TDNSFindResult *ret = srv->ret;
+    struct sockaddr_in client_addr, iter_query_addr;
+    socklen_t client_len = sizeof(client_addr);
+
+    /* Queries we answer ourselves are timed, from here until they are sent */
+    TDNSTimingStart(ctx);
+    uint8_t res = TDNSParseMsg(buffer, size, parsed);
+    if (res == 0) {
+        srv->queries++;
+        client_addr = *from;
+        TDNSTimingMark(ctx, TDNS_STAGE_PARSE);
+        /* 6. If it is a query for A, AAAA, NS DNS record, find the queried record using TDNSFind() */
+        /* You can ignore the other types of queries */
+        if (TDNSFind(ctx, parsed, ret) == 1) { // found a record
+            TDNSTimingMark(ctx, TDNS_STAGE_RENDER);
+            if (parsed->nsIP != NULL && parsed->nsDomain != NULL && TDNSFindNegative(ctx, parsed, ret)) {
+                /* We already know this name or type does not exist, answer from the negative cache */
+                sendto(sockfd, ret->serialized, ret->len, 0, (struct sockaddr*)&client_addr, client_len);
+                srv->answered++;
+                TDNSTimingMark(ctx, TDNS_STAGE_SEND);
+                TDNSTimingDone(ctx, parsed->qtype);
+            } else if (parsed->nsIP != NULL && parsed->nsDomain != NULL && TDNSCoalesceQuery(per_query_ctx, parsed, &client_addr)) {
+                /* Someone else asked the same question and we are still resolving it, this client gets that answer too */
+            } else if (parsed->nsIP != NULL && parsed->nsDomain != NULL) {
+                /* a. If the record is found and the record indicates delegation, */
+                /* send an iterative query to the corresponding nameserver */
+                /* You should store a per-query context using putAddrQID() and putNSQID() */
+                /* for future response handling */
+                memset(&iter_query_addr, 0, sizeof(iter_query_addr));
+                iter_query_addr.sin_family = AF_INET;
+                inet_pton(AF_INET, parsed->nsIP, &iter_query_addr.sin_addr.s_addr);
+                iter_query_addr.sin_port = htons(srv->ns_port);
+                putAddrQID(per_query_ctx, parsed->dh->id, &client_addr);
+                putNSQID(per_query_ctx, parsed->dh->id, parsed->nsIP, parsed->nsDomain);
+                /* per_query_ctx owns those now */
+                parsed->nsIP = parsed->nsDomain = NULL;
+                // send iterative query, and keep track of it in case it gets lost
+                sendto(sockfd, buffer, size, 0, (struct sockaddr *)&iter_query_addr, sizeof(iter_query_addr));
+                TDNSTrackQuery(per_query_ctx, parsed->dh->id, buffer, size, &iter_query_addr);
+            } else {
+                /* b. If the record is found and the record doesn't indicate delegation, */
+                /* send a response back */
+                sendto(sockfd, ret->serialized, ret->len, 0, (struct sockaddr*)&client_addr, client_len);
+                srv->answered++;
+                TDNSTimingMark(ctx, TDNS_STAGE_SEND);
+                TDNSTimingDone(ctx, parsed->qtype);
+            }
+        } else {
+            /* c. If the record is not found, send a response back */
+            TDNSTimingMark(ctx, TDNS_STAGE_RENDER);
+            sendto(sockfd, ret->serialized, ret->len, 0, (struct sockaddr*)&client_addr, client_len);
+            srv->answered++;
+            TDNSTimingMark(ctx, TDNS_STAGE_SEND);
+            TDNSTimingDone(ctx, parsed->qtype);
+        }
+    } else if (TDNSQueryAnswered(per_query_ctx, parsed->dh->id)) {
+        // parsed message is a response to a query we are waiting for
+        if (parsed->nsIP == NULL && parsed->nsDomain == NULL) {
+            /* 7. If the message is an authoritative response (i.e., it contains an answer), */
+            /* add the NS information to the response and send it to the original client */
+            /* You can retrieve the NS and client address information for the response using */
+            /* getNSbyQID() and getAddrbyQID() */
+            /* You can add the NS information to the response using TDNSPutNStoMessage() */
+            /* Delete a per-query context using delAddrQID() and putNSQID() */
+            getNSbyQID(per_query_ctx, parsed->dh->id, &(parsed->nsIP), &(parsed->nsDomain));
+            getAddrbyQID(per_query_ctx, parsed->dh->id, &client_addr);
+            /* Remember NXDOMAIN and NODATA answers, before we add our NS information */
+            TDNSCacheNegative(ctx, buffer, size);
+            uint16_t newLen = TDNSPutNStoMessage(buffer, size, parsed, parsed->nsIP, parsed->nsDomain);
+            // send response to original client
+            sendto(sockfd, buffer, newLen, 0, (struct sockaddr*)&client_addr, sizeof(client_addr));
+            /* and to everyone that asked the same question in the meantime */
+            srv->answered += 1 + TDNSAnswerWaiters(per_query_ctx, sockfd, parsed->dh->id, buffer, newLen);
+            /* those belong to per_query_ctx, delNSQID() frees them */
+            parsed->nsIP = parsed->nsDomain = NULL;
+            delAddrQID(per_query_ctx, parsed->dh->id);
+            delNSQID(per_query_ctx, parsed->dh->id);
+        } else {
+            /* 7-1. If the message is a non-authoritative response */
+            /* (i.e., it contains referral to another nameserver) */
+            /* send an iterative query to the corresponding nameserver */
+            /* You can extract the query from the response using TDNSGetIterQuery() */
+            /* You should update a per-query context using putNSQID() */
+            ssize_t querySize = TDNSGetIterQuery(parsed, ret->serialized);
+            ret->len = querySize;
+            /* Of all nameservers in the referral, pick the one that has been answering fastest */
+            TDNSPickNS(per_query_ctx, buffer, size, parsed);
+            if (parsed->nsIP != NULL && parsed->nsDomain != NULL) {
+                // set the address to send the iterative query to
+                memset(&iter_query_addr, 0, sizeof(iter_query_addr));
+                iter_query_addr.sin_family = AF_INET;
+                inet_pton(AF_INET, parsed->nsIP, &iter_query_addr.sin_addr.s_addr);
+                iter_query_addr.sin_port = htons(srv->ns_port);
+                putNSQID(per_query_ctx, parsed->dh->id, parsed->nsIP, parsed->nsDomain);
+                parsed->nsIP = parsed->nsDomain = NULL;
+                // send iterative query, and keep track of it in case it gets lost
+                sendto(sockfd, ret->serialized, ret->len, 0, (struct sockaddr*)&iter_query_addr, sizeof(iter_query_addr));
+                TDNSTrackQuery(per_query_ctx, parsed->dh->id, ret->serialized, ret->len, &iter_query_addr);
+            } else {
+                /* A referral without glue, which we can't follow */
+                delAddrQID(per_query_ctx, parsed->dh->id);
+                delNSQID(per_query_ctx, parsed->dh->id);
+            }
+        }
+    } /* Otherwise it is a response we did not ask for, or gave up on already */
+    TDNSFreeParseResult(parsed);
+}
@@ -0,0 +1,34 @@
+#ifndef LOCAL_DNS_HANDLER_H
+#define LOCAL_DNS_HANDLER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "lib/tdns/tdns-c.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* What the local iterative DNS server keeps between messages */
+/* local-dns.c fills this in once, the simulated lab of tlab does too */
+struct LocalDNS {
+    int sockfd; /* clients and nameservers are all talked to over this socket */
+    uint16_t ns_port; /* nameservers are asked on this port, DNS_PORT in the lab */
+    struct TDNSServerContext *ctx; /* our zones, the negative cache and the timings */
+    struct TDNSServerContext *per_query_ctx; /* queries to nameservers, waiting clients and round trip times */
+    struct TDNSParseResult *parsed; /* zeroed before the first message */
+    struct TDNSFindResult *ret;
+    uint64_t queries; /* that came in from clients */
+    uint64_t answered; /* responses we sent to clients, not counting the SERVFAILs of TDNSProcessTimeouts() */
+};
+
+/* Handles one message that came in on srv->sockfd from `from`: a query from a client, or a response from a nameserver */
+/* `buffer` holds `size` bytes, and must have room for MAX_RESPONSE, since answers get our NS information added */
+void LocalDNSHandle (struct LocalDNS *srv, char *buffer, uint64_t size, struct sockaddr_in *from);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif